@@ -27,6 +27,13 @@ static char *api_extensions[] = {
 	"cpuview_daemon",
 	"loadavg_daemon",
 	"pidfds",
+	"cache_budget",
+	"thread_placement",
+	"policy",
+	"sessions",
+	"prewarm",
+	"bpf_cpuacct",
+	"slow_request_watchdog",
 };
 
 static size_t nr_api_extensions = sizeof(api_extensions) / sizeof(*api_extensions);
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#if HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include <fuse.h>
+#endif
+
+#include "async_log.h"
+
+#include "bindings.h"
+#include "memory_utils.h"
+#include "utils.h"
+
+/* Must be a power of two. */
+#define ASYNC_LOG_SLOTS 256
+#define ASYNC_LOG_MSG_MAX 512
+
+/*
+ * Bounded multi-producer queue: a slot is free for position pos when its
+ * sequence is pos and holds a message for the writer when it is pos + 1.
+ */
+struct async_log_slot {
+	uint64_t seq;
+	char msg[ASYNC_LOG_MSG_MAX];
+};
+
+static struct async_log_slot ring[ASYNC_LOG_SLOTS];
+static uint64_t ring_tail;
+static uint64_t ring_head;
+static unsigned int ring_dropped;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static bool writing;
+static pthread_t writer;
+static bool stopping;
+/*
+ * Set by the writer before it sleeps on wake_fd. Only the producer that clears
+ * it pays for the eventfd write, everyone else just fills the ring.
+ */
+static bool sleeping;
+static int wake_fd = -EBADF;
+
+static int64_t monotonic_secs(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts))
+		return 0;
+
+	return ts.tv_sec;
+}
+
+bool async_log_ratelimit(struct async_log_ratelimit *rl, unsigned int *missed)
+{
+	int64_t now = monotonic_secs();
+	int64_t begin;
+
+	begin = __atomic_load_n(&rl->begin, __ATOMIC_RELAXED);
+	if (!begin || now - begin >= ASYNC_LOG_INTERVAL) {
+		/* Only the thread that starts the new window reports. */
+		if (__atomic_compare_exchange_n(&rl->begin, &begin, now, false,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&rl->printed, 0, __ATOMIC_RELAXED);
+			*missed = __atomic_exchange_n(&rl->missed, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (__atomic_add_fetch(&rl->printed, 1, __ATOMIC_RELAXED) <= ASYNC_LOG_BURST)
+		return true;
+
+	__atomic_add_fetch(&rl->missed, 1, __ATOMIC_RELAXED);
+	return false;
+}
+
+static void ring_drain(void)
+{
+	unsigned int dropped;
+
+	for (;;) {
+		struct async_log_slot *slot = &ring[ring_head & (ASYNC_LOG_SLOTS - 1)];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_head + 1)
+			break;
+
+		fputs(slot->msg, stderr);
+		__atomic_store_n(&slot->seq, ring_head + ASYNC_LOG_SLOTS, __ATOMIC_RELEASE);
+		ring_head++;
+	}
+
+	dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		fprintf(stderr, "Dropped %u log messages\n", dropped);
+}
+
+static bool ring_pending(void)
+{
+	struct async_log_slot *slot = &ring[ring_head & (ASYNC_LOG_SLOTS - 1)];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == ring_head + 1;
+}
+
+static void ring_wake(void)
+{
+	uint64_t val = 1;
+
+	if (!__atomic_exchange_n(&sleeping, false, __ATOMIC_SEQ_CST))
+		return;
+
+	/* Can only fail when the counter is full, the writer is awake then. */
+	if (write(wake_fd, &val, sizeof(val)) != sizeof(val))
+		return;
+}
+
+static void *async_log_thread(void *arg)
+{
+	lxcfs_background_thread_setup(arg);
+
+	for (;;) {
+		struct pollfd fd = { .fd = wake_fd, .events = POLLIN };
+		uint64_t val;
+		int ret;
+
+		ring_drain();
+		if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+			break;
+
+		/* Pairs with the publish and ring_wake() in async_log(). */
+		__atomic_store_n(&sleeping, true, __ATOMIC_SEQ_CST);
+		if (ring_pending()) {
+			__atomic_store_n(&sleeping, false, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		ret = poll(&fd, 1, -1);
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		if (ret > 0 && read(wake_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+			break;
+		__atomic_store_n(&sleeping, false, __ATOMIC_RELAXED);
+	}
+
+	ring_drain();
+	return NULL;
+}
+
+static void async_log_init(void)
+{
+	__do_close int efd = -EBADF;
+	struct fuse_context *fc = fuse_get_context();
+	int ret;
+
+	for (uint64_t i = 0; i < ASYNC_LOG_SLOTS; i++)
+		ring[i].seq = i;
+
+	efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (efd < 0) {
+		lxcfs_error("%s - Failed to create eventfd, logging synchronously", strerror(errno));
+		return;
+	}
+
+	wake_fd = move_fd(efd);
+	ret = pthread_create(&writer, NULL, async_log_thread, fc ? fc->private_data : NULL);
+	if (ret) {
+		close_prot_errno_disarm(wake_fd);
+		lxcfs_error("%s - Failed to create log writer thread, logging synchronously", strerror(ret));
+		return;
+	}
+
+	__atomic_store_n(&writing, true, __ATOMIC_RELEASE);
+}
+
+static struct async_log_slot *ring_reserve(uint64_t *pos)
+{
+	uint64_t tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		struct async_log_slot *slot = &ring[tail & (ASYNC_LOG_SLOTS - 1)];
+		int64_t diff;
+
+		diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - tail);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring_tail, &tail, tail + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*pos = tail;
+				return slot;
+			}
+		} else if (diff < 0) {
+			/* The writer hasn't caught up. */
+			return NULL;
+		} else {
+			tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void async_log(const char *file, int line, const char *func,
+	       unsigned int missed, const char *format, ...)
+{
+	struct async_log_slot *slot;
+	char buf[ASYNC_LOG_MSG_MAX];
+	char *msg = buf;
+	size_t size = sizeof(buf), len;
+	uint64_t pos = 0;
+	va_list args;
+	int ret;
+
+	pthread_once(&ring_once, async_log_init);
+
+	slot = NULL;
+	if (__atomic_load_n(&writing, __ATOMIC_ACQUIRE)) {
+		slot = ring_reserve(&pos);
+		if (!slot) {
+			__atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		msg = slot->msg;
+		size = sizeof(slot->msg);
+	}
+
+	ret = snprintf(msg, size, "%s: %d: %s: ", file, line, func);
+	len = ret < 0 ? 0 : (size_t)ret;
+	if (len >= size)
+		len = size - 1;
+
+	va_start(args, format);
+	ret = vsnprintf(msg + len, size - len, format, args);
+	va_end(args);
+	if (ret > 0)
+		len += ret;
+	if (len >= size)
+		len = size - 1;
+
+	if (missed)
+		ret = snprintf(msg + len, size - len, " (%u similar messages suppressed)\n", missed);
+	else
+		ret = snprintf(msg + len, size - len, "\n");
+	/* Keep the line terminated even when the message was truncated. */
+	if (ret < 0 || (size_t)ret >= size - len)
+		msg[size - 2] = '\n';
+
+	if (slot) {
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+		ring_wake();
+	} else {
+		fputs(msg, stderr);
+	}
+}
+
+void async_log_exit(void)
+{
+	uint64_t val = 1;
+
+	if (!__atomic_load_n(&writing, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	if (write(wake_fd, &val, sizeof(val)) != sizeof(val))
+		lxcfs_error("%s - Failed to stop log writer thread", strerror(errno));
+	else
+		pthread_join(writer, NULL);
+
+	close_prot_errno_disarm(wake_fd);
+	__atomic_store_n(&writing, false, __ATOMIC_RELEASE);
+}
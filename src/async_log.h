@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_ASYNC_LOG_H
+#define __LXCFS_ASYNC_LOG_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "macro.h"
+
+/*
+ * Logging for call sites that can fire on every request. Messages are
+ * formatted into a fixed ring buffer without taking locks and written to
+ * stderr by a background thread. Each call site prints at most
+ * ASYNC_LOG_BURST messages every ASYNC_LOG_INTERVAL seconds and reports how
+ * many it suppressed with the next message it prints. Messages are dropped
+ * when the ring is full rather than making the caller wait.
+ */
+#define ASYNC_LOG_INTERVAL 5
+#define ASYNC_LOG_BURST 10
+
+struct async_log_ratelimit {
+	int64_t begin;
+	unsigned int printed;
+	unsigned int missed;
+};
+
+/* Whether the call site may print now. @missed is set when a window ends. */
+extern bool async_log_ratelimit(struct async_log_ratelimit *rl, unsigned int *missed);
+
+extern void async_log(const char *file, int line, const char *func,
+		      unsigned int missed, const char *format, ...)
+	__attribute__((format(printf, 5, 6)));
+
+/* Write out whatever is still buffered and stop the writer thread. */
+extern void async_log_exit(void);
+
+#define lxcfs_error_ratelimit(format, ...)                                     \
+	do {                                                                   \
+		static struct async_log_ratelimit __rl__;                      \
+		unsigned int __missed__ = 0;                                   \
+		if (async_log_ratelimit(&__rl__, &__missed__))                 \
+			async_log(__FILE__, __LINE__, __func__, __missed__,    \
+				  format, ##__VA_ARGS__);                      \
+	} while (false)
+
+/* Like log_error() for call sites on the request path. */
+#define log_error_ratelimit(__ret__, format, ...)                  \
+	({                                                         \
+		lxcfs_error_ratelimit(format, ##__VA_ARGS__);      \
+		__ret__;                                           \
+	})
+
+#endif /* __LXCFS_ASYNC_LOG_H */
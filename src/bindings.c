@@ -36,17 +36,28 @@
 #include "bindings.h"
 
 #include "api_extensions.h"
+#include "async_log.h"
+#include "bpf_cpuacct.h"
+#include "cache_budget.h"
 #include "cgroup_fuse.h"
+#include "cgroup_watch.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "cpu_topology.h"
+#include "file_info_pool.h"
 #include "memory_utils.h"
+#include "policy.h"
+#include "prewarm.h"
 #include "proc_cpuview.h"
+#include "render_stream.h"
 #include "syscall_numbers.h"
 #include "utils.h"
+#include "watchdog.h"
 
 static bool can_use_pidfd;
 static bool can_use_swap;
 static bool can_use_sys_cpu;
+static bool can_use_passthrough;
 static bool has_versioned_opts;
 
 static volatile sig_atomic_t reload_successful;
@@ -66,6 +77,11 @@ bool liblxcfs_can_use_sys_cpu(void)
 	return can_use_sys_cpu;
 }
 
+bool liblxcfs_passthrough(void)
+{
+	return can_use_passthrough;
+}
+
 bool liblxcfs_has_versioned_opts(void)
 {
 	return has_versioned_opts;
@@ -100,6 +116,7 @@ struct pidns_init_store {
 	pid_t initpid; /* the pid of nit in that ns */
 	int init_pidfd;
 	int64_t ctime; /* the time at which /proc/$initpid was created */
+	uint64_t starttime; /* start time of init in clock ticks after boot */
 	struct pidns_init_store *next;
 	int64_t lastcheck;
 };
@@ -133,6 +150,7 @@ static void mutex_unlock(pthread_mutex_t *l)
 
 static inline void store_lock(void)
 {
+	request_stage(REQUEST_STAGE_LOCK);
 	mutex_lock(&pidns_store_mutex);
 }
 
@@ -141,6 +159,23 @@ static inline void store_unlock(void)
 	mutex_unlock(&pidns_store_mutex);
 }
 
+static int64_t initpid_cache_oldest(void);
+static void initpid_cache_evict(int64_t cutoff, uint64_t bytes);
+
+static struct lxcfs_cache initpid_cache = {
+	.name	= "initpid",
+	.oldest	= initpid_cache_oldest,
+	.evict	= initpid_cache_evict,
+};
+
+/* Must be called under store_lock */
+static void free_initpid(struct pidns_init_store *entry, bool evicted)
+{
+	close_prot_errno_disarm(entry->init_pidfd);
+	free_disarm(entry);
+	cache_account_del(&initpid_cache, sizeof(*entry), evicted);
+}
+
 /* /proc/       =    6
  *                +
  * <pid-as-str> =   INTTYPE_TO_STRLEN(pid_t)
@@ -204,8 +239,7 @@ static void remove_initpid(struct pidns_init_store *entry)
 	ino_hash = HASH(entry->ino);
 	if (pidns_hash_table[ino_hash] == entry) {
 		pidns_hash_table[ino_hash] = entry->next;
-		close_prot_errno_disarm(entry->init_pidfd);
-		free_disarm(entry);
+		free_initpid(entry, false);
 		return;
 	}
 
@@ -213,8 +247,7 @@ static void remove_initpid(struct pidns_init_store *entry)
 	while (it) {
 		if (it->next == entry) {
 			it->next = entry->next;
-			close_prot_errno_disarm(entry->init_pidfd);
-			free_disarm(entry);
+			free_initpid(entry, false);
 			return;
 		}
 		it = it->next;
@@ -254,8 +287,7 @@ static void prune_initpid_store(void)
 				else
 					pidns_hash_table[i] = entry->next;
 				entry = entry->next;
-				close_prot_errno_disarm(cur->init_pidfd);
-				free_disarm(cur);
+				free_initpid(cur, false);
 			} else {
 				prev = entry;
 				entry = entry->next;
@@ -275,15 +307,107 @@ static void clear_initpid_store(void)
 
 			pidns_hash_table[i] = entry->next;
 			entry = entry->next;
-			close_prot_errno_disarm(cur->init_pidfd);
-			free_disarm(cur);
+			free_initpid(cur, false);
+		}
+	}
+	store_unlock();
+}
+
+static int64_t initpid_cache_oldest(void)
+{
+	int64_t oldest = -1;
+
+	store_lock();
+	for (int i = 0; i < PIDNS_HASH_SIZE; i++) {
+		for (struct pidns_init_store *entry = pidns_hash_table[i]; entry; entry = entry->next) {
+			if (oldest < 0 || entry->lastcheck < oldest)
+				oldest = entry->lastcheck;
 		}
 	}
 	store_unlock();
+
+	return oldest;
+}
+
+static void initpid_cache_evict(int64_t cutoff, uint64_t bytes)
+{
+	uint64_t freed = 0;
+
+	store_lock();
+	for (int i = 0; i < PIDNS_HASH_SIZE && freed < bytes; i++) {
+		for (struct pidns_init_store *entry = pidns_hash_table[i], *prev = NULL; entry;) {
+			if (entry->lastcheck <= cutoff && freed < bytes) {
+				struct pidns_init_store *cur = entry;
+
+				if (prev)
+					prev->next = entry->next;
+				else
+					pidns_hash_table[i] = entry->next;
+				entry = entry->next;
+				free_initpid(cur, true);
+				freed += sizeof(*cur);
+			} else {
+				prev = entry;
+				entry = entry->next;
+			}
+		}
+	}
+	store_unlock();
+}
+
+/* Field 22 of /proc/<pid>/stat. */
+static int read_pid_starttime(pid_t pid, uint64_t *starttime)
+{
+	__do_free void *fopen_cache = NULL;
+	__do_fclose FILE *f = NULL;
+	char path[STRLITERALLEN("/proc/") + LXCFS_NUMSTRLEN64 +
+		  STRLITERALLEN("/stat") + 1];
+	int ret;
+
+	ret = snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return ret_errno(EINVAL);
+
+	f = fopen_cached(path, "re", &fopen_cache);
+	if (!f)
+		return ret_errno(EINVAL);
+
+	/* Note that the *scanf() argument supression requires that length
+	 * modifiers such as "l" are omitted. Otherwise some compilers will yell
+	 * at us. It's like telling someone you're not married and then asking
+	 * if you can bring your wife to the party.
+	 */
+	ret = fscanf(f, "%*d "      /* (1)  pid         %d   */
+			"%*s "      /* (2)  comm        %s   */
+			"%*c "      /* (3)  state       %c   */
+			"%*d "      /* (4)  ppid        %d   */
+			"%*d "      /* (5)  pgrp        %d   */
+			"%*d "      /* (6)  session     %d   */
+			"%*d "      /* (7)  tty_nr      %d   */
+			"%*d "      /* (8)  tpgid       %d   */
+			"%*u "      /* (9)  flags       %u   */
+			"%*u "      /* (10) minflt      %lu  */
+			"%*u "      /* (11) cminflt     %lu  */
+			"%*u "      /* (12) majflt      %lu  */
+			"%*u "      /* (13) cmajflt     %lu  */
+			"%*u "      /* (14) utime       %lu  */
+			"%*u "      /* (15) stime       %lu  */
+			"%*d "      /* (16) cutime      %ld  */
+			"%*d "      /* (17) cstime      %ld  */
+			"%*d "      /* (18) priority    %ld  */
+			"%*d "      /* (19) nice        %ld  */
+			"%*d "      /* (20) num_threads %ld  */
+			"%*d "      /* (21) itrealvalue %ld  */
+			"%" SCNu64, /* (22) starttime   %llu */
+		     starttime);
+	if (ret != 1)
+		return ret_errno(EINVAL);
+
+	return 0;
 }
 
 /* Must be called under store_lock */
-static void save_initpid(ino_t pidns_inode, pid_t pid)
+static void save_initpid(ino_t pidns_inode, pid_t pid, uint64_t starttime)
 {
 	__do_free struct pidns_init_store *entry = NULL;
 	__do_close int pidfd = -EBADF;
@@ -311,11 +435,13 @@ static void save_initpid(ino_t pidns_inode, pid_t pid)
 		.ino		= pidns_inode,
 		.initpid	= pid,
 		.ctime		= st.st_ctime,
+		.starttime	= starttime,
 		.next		= pidns_hash_table[ino_hash],
 		.lastcheck	= time(NULL),
 		.init_pidfd	= move_fd(pidfd),
 	};
 	pidns_hash_table[ino_hash] = move_ptr(entry);
+	cache_account_add(&initpid_cache, sizeof(struct pidns_init_store));
 
 	lxcfs_debug("Added cache entry %d for pid %d to init pid cache", ino_hash, pid);
 }
@@ -327,7 +453,7 @@ static void save_initpid(ino_t pidns_inode, pid_t pid)
  * otherwise.
  * Must be called under store_lock
  */
-static pid_t lookup_verify_initpid(ino_t pidns_inode)
+static pid_t lookup_verify_initpid(ino_t pidns_inode, uint64_t *starttime)
 {
 	struct pidns_init_store *entry = pidns_hash_table[HASH(pidns_inode)];
 
@@ -335,6 +461,13 @@ static pid_t lookup_verify_initpid(ino_t pidns_inode)
 		if (entry->ino == pidns_inode) {
 			if (initpid_still_valid(entry)) {
 				entry->lastcheck = time(NULL);
+				if (starttime) {
+					/* 0 means it couldn't be read so far, retry. */
+					if (!entry->starttime &&
+					    read_pid_starttime(entry->initpid, &entry->starttime))
+						entry->starttime = 0;
+					*starttime = entry->starttime;
+				}
 				return entry->initpid;
 			}
 
@@ -356,7 +489,7 @@ static bool send_creds_ok(int sock_fd)
 	    .pid = 1,
 	};
 
-	return send_creds(sock_fd, &cred, v, true) == SEND_CREDS_OK;
+	return send_creds(sock_fd, &cred, v) == SEND_CREDS_OK;
 }
 
 __returns_twice pid_t lxcfs_raw_clone(unsigned long flags, int *pidfd)
@@ -428,10 +561,6 @@ __returns_twice pid_t lxcfs_raw_clone(unsigned long flags, int *pidfd)
 #endif
 }
 
-#define LXCFS_PROC_PID_NS_LEN                                    \
-	(STRLITERALLEN("/proc/") + INTTYPE_TO_STRLEN(uint64_t) + \
-	 STRLITERALLEN("/ns/pid") + 1)
-
 /*
  * clone a task which switches to @task's namespace and writes '1'.
  * over a unix sock so we can read the task's reaper's pid in our
@@ -488,6 +617,11 @@ static pid_t scm_init_pid(pid_t task)
 	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0)
 		return -1;
 
+	/* The child sends right away instead of waiting for us to be ready. */
+	pid = -1;
+	if (!enable_passcred(sock[1]))
+		goto out;
+
 	pid = fork();
 	if (pid < 0)
 		goto out;
@@ -512,29 +646,65 @@ out:
 	return pid_ret;
 }
 
-pid_t lookup_initpid_in_store(pid_t pid)
+/*
+ * A per-container session only serves the container it was created for so
+ * its callers' init is known without looking at their pid namespace.
+ */
+static pid_t lookup_session_initpid(pid_t pid, uint64_t *starttime)
+{
+	struct fuse_context *fc = fuse_get_context();
+	struct lxcfs_opts *opts = fc ? fc->private_data : NULL;
+	uint64_t init_starttime;
+
+	if (!lxcfs_session_pid(opts) || pid != fc->pid)
+		return 0;
+
+	if (starttime) {
+		init_starttime = __atomic_load_n(&opts->session_starttime, __ATOMIC_RELAXED);
+		if (!init_starttime && !read_pid_starttime(opts->session_pid, &init_starttime))
+			__atomic_store_n(&opts->session_starttime, init_starttime, __ATOMIC_RELAXED);
+		*starttime = init_starttime;
+	}
+
+	return opts->session_pid;
+}
+
+pid_t lookup_initpid_starttime(pid_t pid, uint64_t *starttime)
 {
 	pid_t hashed_pid = 0;
 	char path[LXCFS_PROC_PID_NS_LEN];
 	struct stat st;
 
+	request_stage(REQUEST_STAGE_INITPID);
+
+	hashed_pid = lookup_session_initpid(pid, starttime);
+	if (hashed_pid > 0)
+		return hashed_pid;
+
 	snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
 	if (stat(path, &st))
 		return ret_errno(ESRCH);
 
 	store_lock();
 
-	hashed_pid = lookup_verify_initpid(st.st_ino);
+	hashed_pid = lookup_verify_initpid(st.st_ino, starttime);
 	if (hashed_pid < 0) {
-		/* release the mutex as the following call is expensive */
+		uint64_t init_starttime = 0;
+
+		/* release the mutex as the following calls are expensive */
 		store_unlock();
 
 		hashed_pid = scm_init_pid(pid);
+		/* The start time of init never changes so read it only once. */
+		if (hashed_pid > 0 && read_pid_starttime(hashed_pid, &init_starttime))
+			init_starttime = 0;
 
 		store_lock();
 
 		if (hashed_pid > 0)
-			save_initpid(st.st_ino, hashed_pid);
+			save_initpid(st.st_ino, hashed_pid, init_starttime);
+		if (starttime)
+			*starttime = init_starttime;
 	}
 
 	/*
@@ -544,9 +714,16 @@ pid_t lookup_initpid_in_store(pid_t pid)
 	prune_initpid_store();
 	store_unlock();
 
+	cache_budget_enforce();
+
 	return hashed_pid;
 }
 
+pid_t lookup_initpid_in_store(pid_t pid)
+{
+	return lookup_initpid_starttime(pid, NULL);
+}
+
 /*
  * Functions needed to setup cgroups in the __constructor__.
  */
@@ -803,6 +980,81 @@ static bool cgfs_setup_controllers(void)
 	return true;
 }
 
+/*
+ * The private mount namespace and the hierarchy fds outlive a reload. The
+ * outgoing liblxcfs leaves them in the binary's handoff struct and the
+ * incoming one adopts them instead of mounting everything again while FUSE
+ * requests are held up.
+ */
+static void cgfs_handover(void)
+{
+	struct lxcfs_handoff *handoff = lxcfs_get_handoff();
+	int nr = 0;
+
+	if (!handoff || !cgroup_ops || cgroup_ops->mntns_fd < 0 ||
+	    handoff->mntns_fd >= 0 || handoff->nr_hierarchies)
+		return;
+
+	for (struct hierarchy **h = cgroup_ops->hierarchies; h && *h; h++, nr++)
+		if ((*h)->fd < 0 || nr >= LXCFS_HANDOFF_HIERARCHIES)
+			return;
+
+	for (int i = 0; i < nr; i++) {
+		handoff->hierarchies[i].mountpoint = strdup(cgroup_ops->hierarchies[i]->mountpoint);
+		if (!handoff->hierarchies[i].mountpoint) {
+			while (i--)
+				free_disarm(handoff->hierarchies[i].mountpoint);
+			return;
+		}
+	}
+
+	/* Keep them open for the next liblxcfs. */
+	for (int i = 0; i < nr; i++)
+		handoff->hierarchies[i].fd = move_fd(cgroup_ops->hierarchies[i]->fd);
+	handoff->nr_hierarchies = nr;
+	handoff->mntns_fd = move_fd(cgroup_ops->mntns_fd);
+}
+
+/* What isn't adopted here is closed by the binary after the reload. */
+static bool cgfs_adopt_controllers(void)
+{
+	struct lxcfs_handoff *handoff = lxcfs_get_handoff();
+	int match[LXCFS_HANDOFF_HIERARCHIES];
+	int nr = 0;
+
+	if (!handoff || handoff->mntns_fd < 0 || !handoff->nr_hierarchies)
+		return false;
+
+	for (struct hierarchy **h = cgroup_ops->hierarchies; h && *h; h++)
+		nr++;
+
+	/* The hierarchies changed since the last load. */
+	if (nr != handoff->nr_hierarchies)
+		goto out;
+
+	for (int i = 0; i < nr; i++) {
+		int j;
+
+		for (j = 0; j < nr; j++)
+			if (strcmp(cgroup_ops->hierarchies[i]->mountpoint,
+				   handoff->hierarchies[j].mountpoint) == 0)
+				break;
+
+		if (j == nr || !is_cgroup_fd(handoff->hierarchies[j].fd))
+			goto out;
+		match[i] = j;
+	}
+
+	for (int i = 0; i < nr; i++)
+		cgroup_ops->hierarchies[i]->fd = move_fd(handoff->hierarchies[match[i]].fd);
+	cgroup_ops->mntns_fd = move_fd(handoff->mntns_fd);
+	return true;
+
+out:
+	lxcfs_info("Can't reuse private cgroup mounts, setting them up again");
+	return false;
+}
+
 static void sigusr2_toggle_virtualization(int signo, siginfo_t *info, void *extra)
 {
 	int ret;
@@ -850,8 +1102,13 @@ static void __attribute__((constructor)) lxcfs_init(void)
 		goto broken_upgrade;
 	}
 
-	/* Preserve initial namespace. */
 	pid = getpid();
+	if (cgfs_adopt_controllers()) {
+		lxcfs_info("Reusing private cgroup mounts");
+		goto adopted;
+	}
+
+	/* Preserve initial namespace. */
 	init_ns = preserve_ns(pid, "mnt");
 	if (init_ns < 0) {
 		lxcfs_info("Failed to preserve initial mount namespace");
@@ -870,11 +1127,15 @@ static void __attribute__((constructor)) lxcfs_init(void)
 		goto broken_upgrade;
 	}
 
+adopted:
 	if (!init_cpuview()) {
 		log_exit("Failed to init CPU view");
 		goto broken_upgrade;
 	}
 
+	cache_register(&initpid_cache);
+	render_stream_init();
+
 	lxcfs_info("mount namespace: %d", cgroup_ops->mntns_fd);
 	lxcfs_info("hierarchies:");
 
@@ -898,6 +1159,8 @@ static void __attribute__((constructor)) lxcfs_init(void)
 	else
 		lxcfs_info("Kernel does not support swap accounting");
 
+	cgroup_ops->probe_files(cgroup_ops);
+
 	lxcfs_info("api_extensions:");
 	for (size_t nr = 0; nr < nr_api_extensions; nr++)
 		lxcfs_info("- %s", api_extensions[nr]);
@@ -925,9 +1188,22 @@ static void __attribute__((destructor)) lxcfs_exit(void)
 {
 	lxcfs_info("Running destructor %s", __func__);
 
+	watchdog_exit();
+	prewarm_exit();
+	bpf_cpuacct_exit();
+	cpu_topology_exit();
+	cgroup_watch_exit();
 	clear_initpid_store();
+	cache_unregister(&initpid_cache);
 	free_cpuview();
+	render_stream_exit();
+	file_info_pool_exit();
+	cg_attr_cache_exit();
+	cg_dir_cache_exit();
+	policy_exit();
+	cgfs_handover();
 	cgroup_exit(cgroup_ops);
+	async_log_exit();
 }
 
 void *lxcfs_fuse_init(struct fuse_conn_info *conn, void *data)
@@ -935,5 +1211,18 @@ void *lxcfs_fuse_init(struct fuse_conn_info *conn, void *data)
 	struct fuse_context *fc = fuse_get_context();
 	can_use_sys_cpu = true;
 	has_versioned_opts = true;
+#if HAVE_FUSE_PASSTHROUGH
+	if (conn && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		/* Backing files are on procfs and sysfs which don't stack. */
+		conn->max_backing_stack_depth = 1;
+		can_use_passthrough = true;
+	}
+#endif
 	return fc->private_data;
 }
+
+void lxcfs_fuse_destroy(void *data)
+{
+	passthrough_destroy();
+}
@@ -6,8 +6,10 @@
 #include "config.h"
 
 #include <linux/types.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -34,6 +36,10 @@
 /* Maximum number for 64 bit integer is a string with 21 digits: 2^64 - 1 = 21 */
 #define LXCFS_NUMSTRLEN64 21
 
+#define LXCFS_PROC_PID_NS_LEN                                    \
+	(STRLITERALLEN("/proc/") + INTTYPE_TO_STRLEN(uint64_t) + \
+	 STRLITERALLEN("/ns/pid") + 1)
+
 enum lxcfs_virt_t {
 	LXC_TYPE_CGDIR,
 	LXC_TYPE_CGFILE,
@@ -62,6 +68,9 @@ enum lxcfs_virt_t {
 	LXC_TYPE_PROC_SLABINFO,
 #define LXC_TYPE_PROC_SLABINFO_PATH "/proc/slabinfo"
 
+	LXC_TYPE_PROC_LXCFS_STATS,
+#define LXC_TYPE_PROC_LXCFS_STATS_PATH "/proc/.lxcfs_stats"
+
 	LXC_TYPE_SYS,
 	LXC_TYPE_SYS_DEVICES,
 	LXC_TYPE_SYS_DEVICES_SYSTEM,
@@ -71,6 +80,8 @@ enum lxcfs_virt_t {
 
 	LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE,
 #define LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE_PATH "/sys/devices/system/cpu/online"
+
+	LXC_TYPE_MAX,
 };
 
 struct file_info {
@@ -82,6 +93,10 @@ struct file_info {
 	int buflen;
 	int size; /*actual data size */
 	int cached;
+	int numa_node; /* node the render buffer was pooled on */
+	int backing_id; /* FUSE passthrough backing file, 0 if none */
+	struct render_snapshot *snapshot; /* contents of streamed files */
+	struct cg_dir_snapshot *dir; /* listing of cgroup directories */
 };
 
 struct lxcfs_opts {
@@ -93,8 +108,70 @@ struct lxcfs_opts {
 	 * and the use of bool instead of explicited __u32 and __u64 we can't.
 	 */
 	__u32 version;
+	/* Added in version 2. */
+	__u64 cache_budget;
+	/* Added in version 3. */
+	bool pin_background;
+	cpu_set_t background_cpus;
+	int background_policy;
+	int background_nice;
+	/* Added in version 4. */
+	const char *policy_file;
+	/*
+	 * Added in version 5. Init of the container a per-container session
+	 * serves, 0 for the shared mount. The start time is filled in by
+	 * liblxcfs on first use.
+	 */
+	pid_t session_pid;
+	uint64_t session_starttime;
+	/*
+	 * Added in version 6. Comma separated parent cgroups whose new children
+	 * are pre-warmed and the directory lxcfs is mounted on.
+	 */
+	const char *prewarm;
+	const char *mountpoint;
+	/* Added in version 7. */
+	bool bpf_cpuacct;
+	/* Added in version 8. Requests slower than this are logged, 0 is off. */
+	unsigned int slow_request_ms;
+};
+
+/*
+ * File descriptors that outlive a reload of liblxcfs. The struct is owned by
+ * the lxcfs binary: the outgoing library stores what it wants to pass on from
+ * its destructor, the incoming one takes what it can use and resets the
+ * fields to -EBADF. Whatever is left once the new library is running is
+ * closed by the binary. Only touched while no FUSE request is in liblxcfs.
+ */
+#define LXCFS_HANDOFF_HIERARCHIES 64
+
+struct lxcfs_handoff {
+	__u32 version;
+	/* BPF cpu accounting usage map and tracepoint link. */
+	int bpf_map_fd;
+	int bpf_link_fd;
+	/* Private mount namespace and the cgroup hierarchies mounted in it. */
+	int mntns_fd;
+	int nr_hierarchies;
+	struct {
+		int fd;
+		char *mountpoint;
+	} hierarchies[LXCFS_HANDOFF_HIERARCHIES];
 };
 
+/* Weak so that liblxcfs still loads from binaries that don't have it. */
+extern struct lxcfs_handoff lxcfs_handoff __attribute__((weak));
+
+static inline struct lxcfs_handoff *lxcfs_get_handoff(void)
+{
+	struct lxcfs_handoff *handoff = &lxcfs_handoff;
+
+	if (!handoff || handoff->version < 1)
+		return NULL;
+
+	return handoff;
+}
+
 typedef enum lxcfs_opt_t {
 	LXCFS_SWAP_ON	= 0,
 	LXCFS_PIDFD_ON	= 1,
@@ -104,11 +181,17 @@ typedef enum lxcfs_opt_t {
 
 
 extern pid_t lookup_initpid_in_store(pid_t qpid);
+/*
+ * Same as lookup_initpid_in_store() but also return the start time of init
+ * in clock ticks after boot or 0 if it is unknown.
+ */
+extern pid_t lookup_initpid_starttime(pid_t qpid, uint64_t *starttime);
 extern void prune_init_slice(char *cg);
 extern bool supports_pidfd(void);
 extern bool liblxcfs_functional(void);
 extern bool liblxcfs_can_use_swap(void);
 extern bool liblxcfs_can_use_sys_cpu(void);
+extern bool liblxcfs_passthrough(void);
 extern bool liblxcfs_has_versioned_opts(void);
 
 static inline bool lxcfs_has_opt(struct lxcfs_opts *opts, lxcfs_opt_t opt)
@@ -133,6 +216,62 @@ static inline bool lxcfs_has_opt(struct lxcfs_opts *opts, lxcfs_opt_t opt)
 	return false;
 }
 
+static inline __u64 lxcfs_cache_budget(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 2)
+		return 0;
+
+	return opts->cache_budget;
+}
+
+static inline const char *lxcfs_policy_file(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 4)
+		return NULL;
+
+	return opts->policy_file;
+}
+
+static inline pid_t lxcfs_session_pid(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 5)
+		return 0;
+
+	return opts->session_pid;
+}
+
+static inline const char *lxcfs_prewarm(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 6)
+		return NULL;
+
+	return opts->prewarm;
+}
+
+static inline const char *lxcfs_mountpoint(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 6)
+		return NULL;
+
+	return opts->mountpoint;
+}
+
+static inline bool lxcfs_bpf_cpuacct(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 7)
+		return false;
+
+	return opts->bpf_cpuacct;
+}
+
+static inline unsigned int lxcfs_slow_request_ms(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 8)
+		return 0;
+
+	return opts->slow_request_ms;
+}
+
 static inline int install_signal_handler(int signo,
 					 void (*handler)(int, siginfo_t *, void *))
 {
@@ -161,5 +300,6 @@ static inline pid_t lxcfs_clone(int (*fn)(void *), void *arg, int flags)
 }
 
 __visible extern void *lxcfs_fuse_init(struct fuse_conn_info *conn, void *data);
+__visible extern void lxcfs_fuse_destroy(void *data);
 
 #endif /* __LXCFS_BINDINGS_H */
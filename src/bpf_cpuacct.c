@@ -0,0 +1,670 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if HAVE_BPF_CPUACCT
+#include <linux/bpf.h>
+#endif
+
+#include "bpf_cpuacct.h"
+
+#include "bindings.h"
+#include "cgroups/cgroup.h"
+#include "cgroups/cgroup_utils.h"
+#include "cpu_topology.h"
+#include "memory_utils.h"
+#include "syscall_numbers.h"
+#include "utils.h"
+
+/* How old the counters may get before they are read again. */
+#define BPF_CPUACCT_TICK_MS 100
+/* Least recently charged cgroups are forgotten beyond this. */
+#define BPF_CPUACCT_MAX_CGROUPS 16384
+#define BPF_CPUACCT_BATCH 256
+#define BPF_CPUACCT_MAX_DEPTH 32
+#define BPF_CPUACCT_SUM_CACHE 64
+
+static bool enabled;
+
+#if HAVE_BPF_CPUACCT
+
+/* Runtime of one cgroup on each possible cpu, in the order of cpu_ids. */
+struct cpuacct_counter {
+	uint64_t id;
+	const uint64_t *runtime;
+};
+
+static int usage_fd = -EBADF;
+static int link_fd = -EBADF;
+/* Per-cpu map values come one per possible cpu, cpu numbers may have holes. */
+static int nr_possible;
+static int *cpu_ids;
+
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int64_t snapshot_taken;
+static uint64_t snapshot_generation;
+static size_t nr_counters;
+static size_t snapshot_cap;
+static uint64_t *snapshot_ids;
+static uint64_t *snapshot_values;
+static struct cpuacct_counter *counters;
+
+/* Subtree sums of recently read cgroups, valid for one snapshot. */
+struct cpuacct_sum {
+	char *cgroup;
+	uint64_t generation;
+	uint64_t *usage_ns;
+};
+
+static struct cpuacct_sum sums[BPF_CPUACCT_SUM_CACHE];
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return (int)syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define BPF_ALU64_REG(OP, DST, SRC)                                \
+	((struct bpf_insn){.code = BPF_ALU64 | BPF_OP(OP) | BPF_X, \
+			   .dst_reg = DST,                         \
+			   .src_reg = SRC,                         \
+			   .off = 0,                               \
+			   .imm = 0})
+
+#define BPF_ALU64_IMM(OP, DST, IMM)                                \
+	((struct bpf_insn){.code = BPF_ALU64 | BPF_OP(OP) | BPF_K, \
+			   .dst_reg = DST,                         \
+			   .src_reg = 0,                           \
+			   .off = 0,                               \
+			   .imm = IMM})
+
+#define BPF_MOV64_REG(DST, SRC)                                 \
+	((struct bpf_insn){.code = BPF_ALU64 | BPF_MOV | BPF_X, \
+			   .dst_reg = DST,                      \
+			   .src_reg = SRC,                      \
+			   .off = 0,                            \
+			   .imm = 0})
+
+#define BPF_MOV64_IMM(DST, IMM)                                 \
+	((struct bpf_insn){.code = BPF_ALU64 | BPF_MOV | BPF_K, \
+			   .dst_reg = DST,                      \
+			   .src_reg = 0,                        \
+			   .off = 0,                            \
+			   .imm = IMM})
+
+/* Memory load, dst_reg = *(size *) (src_reg + off16) */
+#define BPF_LDX_MEM(SIZE, DST, SRC, OFF)                               \
+	((struct bpf_insn){.code = BPF_LDX | BPF_SIZE(SIZE) | BPF_MEM, \
+			   .dst_reg = DST,                             \
+			   .src_reg = SRC,                             \
+			   .off = OFF,                                 \
+			   .imm = 0})
+
+/* Memory store, *(size *) (dst_reg + off16) = src_reg */
+#define BPF_STX_MEM(SIZE, DST, SRC, OFF)                               \
+	((struct bpf_insn){.code = BPF_STX | BPF_SIZE(SIZE) | BPF_MEM, \
+			   .dst_reg = DST,                             \
+			   .src_reg = SRC,                             \
+			   .off = OFF,                                 \
+			   .imm = 0})
+
+/* Memory store, *(size *) (dst_reg + off16) = imm32 */
+#define BPF_ST_MEM(SIZE, DST, OFF, IMM)                               \
+	((struct bpf_insn){.code = BPF_ST | BPF_SIZE(SIZE) | BPF_MEM, \
+			   .dst_reg = DST,                            \
+			   .src_reg = 0,                              \
+			   .off = OFF,                                \
+			   .imm = IMM})
+
+/* dst_reg = map, takes two instructions */
+#define BPF_LD_MAP_FD(DST, FD)                                        \
+	((struct bpf_insn){.code = BPF_LD | BPF_DW | BPF_IMM,         \
+			   .dst_reg = DST,                            \
+			   .src_reg = BPF_PSEUDO_MAP_FD,              \
+			   .off = 0,                                  \
+			   .imm = FD}),                               \
+	((struct bpf_insn){.code = 0,                                 \
+			   .dst_reg = 0,                              \
+			   .src_reg = 0,                              \
+			   .off = 0,                                  \
+			   .imm = 0})
+
+/* Conditional jumps against immediates, if (dst_reg 'op' imm32) goto pc + off16 */
+#define BPF_JMP_IMM(OP, DST, IMM, OFF)                           \
+	((struct bpf_insn){.code = BPF_JMP | BPF_OP(OP) | BPF_K, \
+			   .dst_reg = DST,                       \
+			   .src_reg = 0,                         \
+			   .off = OFF,                           \
+			   .imm = IMM})
+
+/* Unconditional jump, goto pc + off16 */
+#define BPF_JMP_A(OFF)                               \
+	((struct bpf_insn){.code = BPF_JMP | BPF_JA, \
+			   .dst_reg = 0,             \
+			   .src_reg = 0,             \
+			   .off = OFF,               \
+			   .imm = 0})
+
+/* Helper call, r0 = func(r1, ..., r5) */
+#define BPF_EMIT_CALL(FUNC)                            \
+	((struct bpf_insn){.code = BPF_JMP | BPF_CALL, \
+			   .dst_reg = 0,               \
+			   .src_reg = 0,               \
+			   .off = 0,                   \
+			   .imm = FUNC})
+
+/* Program exit */
+#define BPF_EXIT_INSN()                                \
+	((struct bpf_insn){.code = BPF_JMP | BPF_EXIT, \
+			   .dst_reg = 0,               \
+			   .src_reg = 0,               \
+			   .off = 0,                   \
+			   .imm = 0})
+
+static int map_create(uint32_t type, uint32_t key_size, uint32_t max_entries)
+{
+	union bpf_attr attr = {
+		.map_type	= type,
+		.key_size	= key_size,
+		.value_size	= sizeof(uint64_t),
+		.max_entries	= max_entries,
+	};
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/*
+ * On every context switch the time since the previous one on this cpu is
+ * charged to the cgroup of the task switched out:
+ *
+ *	now = ktime_get_ns();
+ *	prev = last[0]; last[0] = now;
+ *	if (prev)
+ *		usage[get_current_cgroup_id()] += now - prev;
+ */
+static int prog_load(int last_fd, int map_fd)
+{
+	struct bpf_insn insns[] = {
+		BPF_EMIT_CALL(BPF_FUNC_ktime_get_ns),
+		BPF_MOV64_REG(BPF_REG_7, BPF_REG_0),
+		BPF_ST_MEM(BPF_W, BPF_REG_10, -4, 0),
+		BPF_LD_MAP_FD(BPF_REG_1, last_fd),
+		BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+		BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -4),
+		BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),
+		BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 25),
+		BPF_LDX_MEM(BPF_DW, BPF_REG_8, BPF_REG_0, 0),
+		BPF_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_7, 0),
+		BPF_JMP_IMM(BPF_JEQ, BPF_REG_8, 0, 22),
+		BPF_ALU64_REG(BPF_SUB, BPF_REG_7, BPF_REG_8),
+		BPF_EMIT_CALL(BPF_FUNC_get_current_cgroup_id),
+		BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_0, -16),
+		BPF_LD_MAP_FD(BPF_REG_1, map_fd),
+		BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+		BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -16),
+		BPF_EMIT_CALL(BPF_FUNC_map_lookup_elem),
+		BPF_JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 4),
+		BPF_LDX_MEM(BPF_DW, BPF_REG_1, BPF_REG_0, 0),
+		BPF_ALU64_REG(BPF_ADD, BPF_REG_1, BPF_REG_7),
+		BPF_STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_1, 0),
+		BPF_JMP_A(9),
+		/* First time this cgroup ran since it was (re)added. */
+		BPF_STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_7, -24),
+		BPF_LD_MAP_FD(BPF_REG_1, map_fd),
+		BPF_MOV64_REG(BPF_REG_2, BPF_REG_10),
+		BPF_ALU64_IMM(BPF_ADD, BPF_REG_2, -16),
+		BPF_MOV64_REG(BPF_REG_3, BPF_REG_10),
+		BPF_ALU64_IMM(BPF_ADD, BPF_REG_3, -24),
+		BPF_MOV64_IMM(BPF_REG_4, BPF_NOEXIST),
+		BPF_EMIT_CALL(BPF_FUNC_map_update_elem),
+		BPF_MOV64_IMM(BPF_REG_0, 0),
+		BPF_EXIT_INSN(),
+	};
+	union bpf_attr attr = {
+		.prog_type	= BPF_PROG_TYPE_RAW_TRACEPOINT,
+		.insns		= PTR_TO_UINT64(insns),
+		.insn_cnt	= ARRAY_SIZE(insns),
+		.license	= PTR_TO_UINT64("GPL"),
+	};
+
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int bpf_cpuacct_load(void)
+{
+	__do_close int last_fd = -EBADF, map_fd = -EBADF, prog_fd = -EBADF;
+	union bpf_attr attr;
+	int fd;
+
+	last_fd = map_create(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(uint32_t), 1);
+	if (last_fd < 0)
+		return log_error(-errno, "%s - Failed to create BPF cpu accounting map", strerror(errno));
+
+	map_fd = map_create(BPF_MAP_TYPE_LRU_PERCPU_HASH, sizeof(uint64_t), BPF_CPUACCT_MAX_CGROUPS);
+	if (map_fd < 0)
+		return log_error(-errno, "%s - Failed to create BPF cpu accounting map", strerror(errno));
+
+	prog_fd = prog_load(last_fd, map_fd);
+	if (prog_fd < 0)
+		return log_error(-errno, "%s - Failed to load BPF cpu accounting program", strerror(errno));
+
+	attr = (union bpf_attr){
+		.raw_tracepoint.name	= PTR_TO_UINT64("sched_switch"),
+		.raw_tracepoint.prog_fd	= prog_fd,
+	};
+	fd = sys_bpf(BPF_RAW_TRACEPOINT_OPEN, &attr);
+	if (fd < 0)
+		return log_error(-errno, "%s - Failed to attach BPF cpu accounting program", strerror(errno));
+
+	/* The tracepoint keeps the program and its maps alive. */
+	link_fd = fd;
+	usage_fd = move_fd(map_fd);
+	return 0;
+}
+
+static bool is_usage_map(int fd)
+{
+	struct bpf_map_info info = {};
+	union bpf_attr attr = {
+		.info.bpf_fd	= fd,
+		.info.info_len	= sizeof(info),
+		.info.info	= PTR_TO_UINT64(&info),
+	};
+
+	if (sys_bpf(BPF_OBJ_GET_INFO_BY_FD, &attr))
+		return false;
+
+	return info.type == BPF_MAP_TYPE_LRU_PERCPU_HASH &&
+	       info.key_size == sizeof(uint64_t) &&
+	       info.value_size == sizeof(uint64_t);
+}
+
+/*
+ * The map and the tracepoint survive a reload of liblxcfs so the counters
+ * keep running. Anything not taken here is closed by the binary.
+ */
+static bool bpf_cpuacct_adopt(void)
+{
+	struct lxcfs_handoff *handoff = lxcfs_get_handoff();
+
+	if (!handoff || handoff->bpf_map_fd < 0 || handoff->bpf_link_fd < 0)
+		return false;
+
+	if (!is_usage_map(handoff->bpf_map_fd))
+		return false;
+
+	usage_fd = move_fd(handoff->bpf_map_fd);
+	link_fd = move_fd(handoff->bpf_link_fd);
+	return true;
+}
+
+static bool snapshot_grow(size_t *cap, size_t want)
+{
+	uint64_t *ids, *values;
+	size_t new_cap;
+
+	if (want <= *cap)
+		return true;
+
+	new_cap = want + BPF_CPUACCT_BATCH;
+	ids = realloc(snapshot_ids, new_cap * sizeof(*ids));
+	if (!ids)
+		return false;
+	snapshot_ids = ids;
+
+	values = realloc(snapshot_values, new_cap * nr_possible * sizeof(*values));
+	if (!values)
+		return false;
+	snapshot_values = values;
+
+	*cap = new_cap;
+	return true;
+}
+
+/* Kernels without BPF_MAP_LOOKUP_BATCH, one key at a time. */
+static int snapshot_read_keys(size_t *cap)
+{
+	uint64_t key = 0, next_key;
+	bool first = true;
+	size_t nr = 0;
+
+	while (nr < BPF_CPUACCT_MAX_CGROUPS) {
+		union bpf_attr attr = {
+			.map_fd		= usage_fd,
+			.key		= first ? 0 : PTR_TO_UINT64(&key),
+			.next_key	= PTR_TO_UINT64(&next_key),
+		};
+
+		if (sys_bpf(BPF_MAP_GET_NEXT_KEY, &attr))
+			break;
+
+		if (!snapshot_grow(cap, nr + 1))
+			return -ENOMEM;
+
+		attr = (union bpf_attr){
+			.map_fd	= usage_fd,
+			.key	= PTR_TO_UINT64(&next_key),
+			.value	= PTR_TO_UINT64(snapshot_values + nr * nr_possible),
+		};
+		if (sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0)
+			snapshot_ids[nr++] = next_key;
+
+		key = next_key;
+		first = false;
+	}
+
+	return nr;
+}
+
+static int snapshot_read_batch(size_t *cap)
+{
+	uint64_t in_batch = 0, out_batch = 0;
+	bool first = true;
+	size_t nr = 0;
+
+	for (;;) {
+		union bpf_attr attr;
+		int ret;
+
+		if (!snapshot_grow(cap, nr + BPF_CPUACCT_BATCH))
+			return -ENOMEM;
+
+		attr = (union bpf_attr){
+			.batch.in_batch		= first ? 0 : PTR_TO_UINT64(&in_batch),
+			.batch.out_batch	= PTR_TO_UINT64(&out_batch),
+			.batch.keys		= PTR_TO_UINT64(snapshot_ids + nr),
+			.batch.values		= PTR_TO_UINT64(snapshot_values + nr * nr_possible),
+			.batch.count		= BPF_CPUACCT_BATCH,
+			.batch.map_fd		= usage_fd,
+		};
+		ret = sys_bpf(BPF_MAP_LOOKUP_BATCH, &attr);
+		if (ret && errno != ENOENT)
+			return -errno;
+
+		/* The last batch ends with ENOENT and may still hold entries. */
+		nr += attr.batch.count;
+		if (ret || nr >= BPF_CPUACCT_MAX_CGROUPS)
+			break;
+
+		in_batch = out_batch;
+		first = false;
+	}
+
+	return nr;
+}
+
+static int cmp_counter(const void *a, const void *b)
+{
+	const struct cpuacct_counter *ca = a, *cb = b;
+
+	return (ca->id > cb->id) - (ca->id < cb->id);
+}
+
+/* Must be called with snapshot_mutex held. */
+static int snapshot_refresh(void)
+{
+	struct cpuacct_counter *new;
+	int64_t now = monotonic_ms();
+	int nr;
+
+	if (snapshot_taken && now - snapshot_taken < BPF_CPUACCT_TICK_MS)
+		return 0;
+
+	nr = snapshot_read_batch(&snapshot_cap);
+	if (nr < 0 && nr != -ENOMEM)
+		nr = snapshot_read_keys(&snapshot_cap);
+	if (nr < 0)
+		return nr;
+
+	new = realloc(counters, (nr ? nr : 1) * sizeof(*new));
+	if (!new)
+		return -ENOMEM;
+	counters = new;
+
+	for (int i = 0; i < nr; i++) {
+		counters[i].id = snapshot_ids[i];
+		counters[i].runtime = snapshot_values + i * nr_possible;
+	}
+	qsort(counters, nr, sizeof(*counters), cmp_counter);
+
+	nr_counters = nr;
+	snapshot_taken = now;
+	snapshot_generation++;
+	return 0;
+}
+
+static void collect_subtree(int cfd, const char *cgroup, uint64_t **ids,
+			    size_t *nr_ids, int depth)
+{
+	__do_free char *path = NULL;
+	__do_closedir DIR *dir = NULL;
+	struct dirent *dirent;
+	uint64_t id;
+	int fd;
+
+	id = cgroup_id_at(cfd, cgroup);
+	if (id) {
+		if (*nr_ids % BATCH_SIZE == 0)
+			*ids = must_realloc(*ids, (*nr_ids + BATCH_SIZE) * sizeof(**ids));
+		(*ids)[(*nr_ids)++] = id;
+	}
+
+	if (depth >= BPF_CPUACCT_MAX_DEPTH)
+		return;
+
+	path = must_make_path_relative(cgroup, NULL);
+	fd = openat(cfd, path, O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+
+	while ((dirent = readdir(dir))) {
+		__do_free char *child = NULL;
+
+		if (dirent->d_type != DT_DIR || strcmp(dirent->d_name, ".") == 0 ||
+		    strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		child = must_make_path(cgroup, dirent->d_name, NULL);
+		collect_subtree(cfd, child, ids, nr_ids, depth + 1);
+	}
+}
+
+/* Must be called with snapshot_mutex held. */
+static struct cpuacct_sum *sum_lookup(const char *cg)
+{
+	struct cpuacct_sum *sum = &sums[calc_hash(cg) % BPF_CPUACCT_SUM_CACHE];
+
+	if (sum->cgroup && sum->generation == snapshot_generation &&
+	    strcmp(sum->cgroup, cg) == 0)
+		return sum;
+
+	return NULL;
+}
+
+/* Must be called with snapshot_mutex held. */
+static struct cpuacct_sum *sum_store(const char *cg, const uint64_t *ids,
+				     size_t nr_ids)
+{
+	struct cpuacct_sum *sum = &sums[calc_hash(cg) % BPF_CPUACCT_SUM_CACHE];
+	struct cpuacct_counter key;
+
+	if (!sum->usage_ns) {
+		sum->usage_ns = malloc(nr_possible * sizeof(*sum->usage_ns));
+		if (!sum->usage_ns)
+			return NULL;
+	}
+
+	if (!sum->cgroup || strcmp(sum->cgroup, cg) != 0) {
+		free_disarm(sum->cgroup);
+		sum->cgroup = strdup(cg);
+		if (!sum->cgroup)
+			return NULL;
+	}
+
+	memset(sum->usage_ns, 0, nr_possible * sizeof(*sum->usage_ns));
+	for (size_t i = 0; i < nr_ids; i++) {
+		const struct cpuacct_counter *counter;
+
+		key.id = ids[i];
+		counter = bsearch(&key, counters, nr_counters, sizeof(*counters), cmp_counter);
+		if (!counter)
+			continue;
+
+		for (int cpu = 0; cpu < nr_possible; cpu++)
+			sum->usage_ns[cpu] += counter->runtime[cpu];
+	}
+	sum->generation = snapshot_generation;
+
+	return sum;
+}
+
+static void sum_add(const struct cpuacct_sum *sum, uint64_t *usage_ns, int nr_cpus)
+{
+	for (int i = 0; i < nr_possible; i++)
+		if (cpu_ids[i] < nr_cpus)
+			usage_ns[cpu_ids[i]] += sum->usage_ns[i];
+}
+
+int bpf_cpuacct_read(const char *cg, uint64_t *usage_ns, int nr_cpus)
+{
+	__do_free uint64_t *ids = NULL;
+	struct cpuacct_sum *sum;
+	size_t nr_ids = 0;
+	int ret;
+
+	if (usage_fd < 0 || !cgroup_ops->unified)
+		return -EOPNOTSUPP;
+
+	/* Every reader of a container within one tick shares its sum. */
+	pthread_mutex_lock(&snapshot_mutex);
+	ret = snapshot_refresh();
+	sum = ret ? NULL : sum_lookup(cg);
+	if (sum)
+		sum_add(sum, usage_ns, nr_cpus);
+	pthread_mutex_unlock(&snapshot_mutex);
+	if (ret || sum)
+		return ret;
+
+	/* The subtree is walked without holding up other containers. */
+	collect_subtree(cgroup_ops->unified->fd, cg, &ids, &nr_ids, 0);
+
+	pthread_mutex_lock(&snapshot_mutex);
+	sum = sum_store(cg, ids, nr_ids);
+	if (sum)
+		sum_add(sum, usage_ns, nr_cpus);
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	return sum ? 0 : -ENOMEM;
+}
+
+int bpf_cpuacct_start(const struct lxcfs_opts *opts)
+{
+	if (!lxcfs_bpf_cpuacct(opts))
+		return 0;
+
+	enabled = true;
+	if (usage_fd >= 0)
+		return 0;
+
+	if (!cgroup_ops || !pure_unified_layout(cgroup_ops)) {
+		lxcfs_info("BPF cpu accounting is only used on a pure cgroup2 layout");
+		return 0;
+	}
+
+	nr_possible = host_cpus_nr_possible();
+	if (nr_possible <= 0)
+		return 0;
+
+	cpu_ids = malloc(nr_possible * sizeof(*cpu_ids));
+	if (!cpu_ids)
+		return -ENOMEM;
+	/* Cpus that can't be numbered are never added to anyone. */
+	for (int i = host_cpus_possible_ids(cpu_ids, nr_possible); i < nr_possible; i++)
+		cpu_ids[i] = INT_MAX;
+
+	if (bpf_cpuacct_adopt())
+		return 0;
+
+	if (bpf_cpuacct_load())
+		lxcfs_info("Estimating per-cpu usage from cpu.stat");
+
+	return 0;
+}
+
+void bpf_cpuacct_exit(void)
+{
+	struct lxcfs_handoff *handoff = lxcfs_get_handoff();
+
+	/* Keep them open for the next liblxcfs. */
+	if (handoff && usage_fd >= 0 && link_fd >= 0 &&
+	    handoff->bpf_map_fd < 0 && handoff->bpf_link_fd < 0) {
+		handoff->bpf_map_fd = move_fd(usage_fd);
+		handoff->bpf_link_fd = move_fd(link_fd);
+	}
+
+	close_prot_errno_disarm(usage_fd);
+	close_prot_errno_disarm(link_fd);
+	free_disarm(snapshot_ids);
+	free_disarm(snapshot_values);
+	free_disarm(counters);
+	free_disarm(cpu_ids);
+	for (int i = 0; i < BPF_CPUACCT_SUM_CACHE; i++) {
+		free_disarm(sums[i].cgroup);
+		free_disarm(sums[i].usage_ns);
+	}
+	snapshot_cap = 0;
+	nr_counters = 0;
+	snapshot_taken = 0;
+	enabled = false;
+}
+
+#else /* !HAVE_BPF_CPUACCT */
+
+int bpf_cpuacct_read(const char *cg, uint64_t *usage_ns, int nr_cpus)
+{
+	return -EOPNOTSUPP;
+}
+
+int bpf_cpuacct_start(const struct lxcfs_opts *opts)
+{
+	if (!lxcfs_bpf_cpuacct(opts))
+		return 0;
+
+	enabled = true;
+	lxcfs_info("Built without BPF cpu accounting, estimating per-cpu usage from cpu.stat");
+	return 0;
+}
+
+void bpf_cpuacct_exit(void)
+{
+	enabled = false;
+}
+
+#endif /* HAVE_BPF_CPUACCT */
+
+bool bpf_cpuacct_enabled(void)
+{
+	return enabled;
+}
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_BPF_CPUACCT_H
+#define __LXCFS_BPF_CPUACCT_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "macro.h"
+
+struct lxcfs_opts;
+
+/*
+ * Per-CPU usage for cgroup2, which only reports a total in cpu.stat. A small
+ * BPF program on the sched_switch tracepoint charges the time each task ran
+ * to its cgroup on the CPU it ran on. The counters of all cgroups are read in
+ * one batch lookup at most every BPF_CPUACCT_TICK_MS and summed over the
+ * subtree of the container asking, once per batch. When BPF isn't permitted cpu.stat is
+ * spread evenly over the CPUs in the container's cpuset instead.
+ *
+ * Returns 0 when accounting isn't enabled or was started, even if only the
+ * fallback is available. @opts must stay valid until liblxcfs is unloaded.
+ */
+__visible extern int bpf_cpuacct_start(const struct lxcfs_opts *opts);
+
+extern void bpf_cpuacct_exit(void);
+
+/* Whether per-CPU usage should be derived from cpu.stat on cgroup2. */
+extern bool bpf_cpuacct_enabled(void);
+
+/*
+ * Add the runtime in nanoseconds @cg and its descendants spent on each CPU
+ * to @usage_ns. Returns -EOPNOTSUPP when the BPF program isn't loaded.
+ */
+extern int bpf_cpuacct_read(const char *cg, uint64_t *usage_ns, int nr_cpus);
+
+#endif /* __LXCFS_BPF_CPUACCT_H */
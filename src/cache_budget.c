@@ -0,0 +1,278 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#define __STDC_FORMAT_MACROS
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache_budget.h"
+
+#include "bindings.h"
+#include "memory_utils.h"
+#include "utils.h"
+
+#define CACHE_MAX 16
+/* Upper bound on eviction passes per request so a reader never stalls. */
+#define CACHE_EVICT_ROUNDS 64
+/* Evict down to this fraction of the budget below it, as a shift. */
+#define CACHE_BUDGET_MARGIN_SHIFT 3
+
+static struct lxcfs_cache *caches[CACHE_MAX];
+static int64_t cache_registered[CACHE_MAX];
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t enforce_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Bytes counting against the budget, written under cache_lock. */
+static uint64_t charged_bytes;
+
+static inline void cache_lock(void)
+{
+	pthread_mutex_lock(&cache_mutex);
+}
+
+static inline void cache_unlock(void)
+{
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/* Must be called under cache_lock */
+static inline void cache_charge(int64_t bytes)
+{
+	__atomic_store_n(&charged_bytes, charged_bytes + bytes, __ATOMIC_RELAXED);
+}
+
+void cache_register(struct lxcfs_cache *cache)
+{
+	cache_lock();
+	for (int i = 0; i < CACHE_MAX; i++) {
+		if (caches[i] == cache)
+			break;
+
+		if (!caches[i]) {
+			caches[i] = cache;
+			cache_registered[i] = time(NULL);
+			break;
+		}
+	}
+	cache_unlock();
+}
+
+void cache_unregister(struct lxcfs_cache *cache)
+{
+	cache_lock();
+	for (int i = 0; i < CACHE_MAX; i++) {
+		if (caches[i] == cache) {
+			caches[i] = NULL;
+			cache_charge(-(int64_t)(cache->bytes - cache->releasing));
+			break;
+		}
+	}
+	cache->bytes = 0;
+	cache->releasing = 0;
+	cache->entries = 0;
+	cache_unlock();
+}
+
+void cache_account_add(struct lxcfs_cache *cache, size_t bytes)
+{
+	cache_lock();
+	cache->bytes += bytes;
+	cache->entries++;
+	cache_charge(bytes);
+	cache_unlock();
+}
+
+void cache_account_resize(struct lxcfs_cache *cache, size_t old_bytes,
+			  size_t new_bytes)
+{
+	cache_lock();
+	cache->bytes -= old_bytes;
+	cache->bytes += new_bytes;
+	cache_charge((int64_t)new_bytes - (int64_t)old_bytes);
+	cache_unlock();
+}
+
+void cache_account_del(struct lxcfs_cache *cache, size_t bytes, bool evicted)
+{
+	cache_lock();
+	cache->bytes -= bytes;
+	cache->entries--;
+	if (evicted)
+		cache->evictions++;
+	cache_charge(-(int64_t)bytes);
+	cache_unlock();
+}
+
+void cache_account_evicting(struct lxcfs_cache *cache, size_t bytes)
+{
+	cache_lock();
+	cache->releasing += bytes;
+	cache->evictions++;
+	cache_charge(-(int64_t)bytes);
+	cache_unlock();
+}
+
+void cache_account_release(struct lxcfs_cache *cache, size_t bytes)
+{
+	cache_lock();
+	cache->bytes -= bytes;
+	cache->releasing -= bytes;
+	cache->entries--;
+	cache_unlock();
+}
+
+/* Must be called under cache_lock */
+static uint64_t cache_total_bytes(void)
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < CACHE_MAX; i++)
+		if (caches[i])
+			total += caches[i]->bytes;
+
+	return total;
+}
+
+void cache_budget_enforce(void)
+{
+	struct fuse_context *fc = fuse_get_context();
+	struct lxcfs_cache *snapshot[CACHE_MAX];
+	uint64_t budget, target;
+
+	budget = lxcfs_cache_budget(fc ? fc->private_data : NULL);
+	if (!budget || __atomic_load_n(&charged_bytes, __ATOMIC_RELAXED) <= budget)
+		return;
+
+	/* One thread evicting on behalf of everyone is enough. */
+	if (pthread_mutex_trylock(&enforce_mutex))
+		return;
+
+	target = budget - (budget >> CACHE_BUDGET_MARGIN_SHIFT);
+	for (int round = 0; round < CACHE_EVICT_ROUNDS; round++) {
+		struct lxcfs_cache *victim = NULL;
+		int64_t cutoff = -1;
+		uint64_t total;
+
+		cache_lock();
+		total = charged_bytes;
+		memcpy(snapshot, caches, sizeof(snapshot));
+		cache_unlock();
+
+		if (total <= target)
+			break;
+
+		/*
+		 * The ->oldest() callbacks take the cache's own lock which is
+		 * held when accounting, so never call them under cache_lock.
+		 */
+		for (int i = 0; i < CACHE_MAX; i++) {
+			int64_t oldest;
+
+			if (!snapshot[i])
+				continue;
+
+			oldest = snapshot[i]->oldest();
+			if (oldest < 0)
+				continue;
+
+			if (!victim || oldest < cutoff) {
+				victim = snapshot[i];
+				cutoff = oldest;
+			}
+		}
+		if (!victim)
+			break;
+
+		lxcfs_debug("Evicting from %s cache (%" PRIu64 " > %" PRIu64 ")",
+			    victim->name, total, target);
+		victim->evict(cutoff, total - target);
+	}
+
+	pthread_mutex_unlock(&enforce_mutex);
+}
+
+static uint64_t self_rss(void)
+{
+	__do_fclose FILE *f = NULL;
+	unsigned long size, resident;
+	long page_size;
+
+	f = fopen("/proc/self/statm", "re");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%lu %lu", &size, &resident) != 2)
+		return 0;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		return 0;
+
+	return (uint64_t)resident * page_size;
+}
+
+int cache_budget_stats(char *buf, size_t len)
+{
+	struct fuse_context *fc = fuse_get_context();
+	int64_t now = time(NULL);
+	size_t total_len = 0;
+	int ret;
+
+	ret = snprintf(buf, len, "rss_bytes %" PRIu64 "\nbudget_bytes %" PRIu64 "\n",
+		       self_rss(),
+		       (uint64_t)lxcfs_cache_budget(fc ? fc->private_data : NULL));
+	if (ret < 0 || (size_t)ret >= len)
+		return -EIO;
+	total_len += ret;
+
+	cache_lock();
+	ret = snprintf(buf + total_len, len - total_len,
+		       "cache_bytes %" PRIu64 "\n", cache_total_bytes());
+	if (ret < 0 || (size_t)ret >= len - total_len) {
+		cache_unlock();
+		return -EIO;
+	}
+	total_len += ret;
+
+	for (int i = 0; i < CACHE_MAX; i++) {
+		struct lxcfs_cache *c = caches[i];
+		int64_t elapsed;
+
+		if (!c)
+			continue;
+
+		elapsed = now - cache_registered[i];
+		if (elapsed <= 0)
+			elapsed = 1;
+
+		ret = snprintf(buf + total_len, len - total_len,
+			       "%s.entries %" PRIu64 "\n"
+			       "%s.bytes %" PRIu64 "\n"
+			       "%s.evictions %" PRIu64 "\n"
+			       "%s.evictions_per_min %" PRIu64 "\n",
+			       c->name, c->entries,
+			       c->name, c->bytes,
+			       c->name, c->evictions,
+			       c->name, c->evictions * 60 / elapsed);
+		if (ret < 0 || (size_t)ret >= len - total_len) {
+			cache_unlock();
+			return -EIO;
+		}
+		total_len += ret;
+	}
+	cache_unlock();
+
+	return total_len;
+}
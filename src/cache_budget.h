@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_CACHE_BUDGET_H
+#define __LXCFS_CACHE_BUDGET_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "macro.h"
+
+/*
+ * A cache that keeps per-container state across requests. All caches share
+ * a single memory budget (--cache-budget). When the budget is exceeded the
+ * cache holding the least recently used entry is asked to evict it, until
+ * usage is an eighth of the budget below it so the next few requests don't
+ * have to evict again.
+ */
+struct lxcfs_cache {
+	const char *name;
+
+	/*
+	 * Return the last-use time (as returned by time()) of the least
+	 * recently used entry or -1 if the cache is empty.
+	 */
+	int64_t (*oldest)(void);
+
+	/*
+	 * Evict entries last used at or before @cutoff until at least @bytes
+	 * have been released. Entries that are currently in use are skipped.
+	 */
+	void (*evict)(int64_t cutoff, uint64_t bytes);
+
+	/* Accounting, protected by the cache_budget lock. */
+	uint64_t bytes;
+	/* Evicted but not freed yet, part of @bytes. */
+	uint64_t releasing;
+	uint64_t entries;
+	uint64_t evictions;
+};
+
+extern void cache_register(struct lxcfs_cache *cache);
+extern void cache_unregister(struct lxcfs_cache *cache);
+
+extern void cache_account_add(struct lxcfs_cache *cache, size_t bytes);
+extern void cache_account_resize(struct lxcfs_cache *cache, size_t old_bytes,
+				 size_t new_bytes);
+extern void cache_account_del(struct lxcfs_cache *cache, size_t bytes,
+			      bool evicted);
+
+/*
+ * For caches that can't free an entry from ->evict(). Marking it no longer
+ * counts against the budget, its bytes are released when it is freed.
+ */
+extern void cache_account_evicting(struct lxcfs_cache *cache, size_t bytes);
+extern void cache_account_release(struct lxcfs_cache *cache, size_t bytes);
+
+/*
+ * Evict least recently used entries across all caches once the budget is
+ * exceeded. Only reads a counter while it isn't. Must be called from a FUSE
+ * request without holding any cache lock.
+ */
+extern void cache_budget_enforce(void);
+
+extern int cache_budget_stats(char *buf, size_t len);
+
+#endif /* __LXCFS_CACHE_BUDGET_H */
@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdarg.h>
@@ -36,12 +37,16 @@
 
 #include "cgroup_fuse.h"
 
+#include "async_log.h"
 #include "bindings.h"
+#include "cgroup_watch.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
 #include "lxcfs_fuse_compat.h"
 #include "memory_utils.h"
+#include "proc_loadavg.h"
 #include "utils.h"
+#include "watchdog.h"
 
 struct cgfs_files {
 	char *name;
@@ -239,7 +244,7 @@ static char *get_next_cgroup_dir(const char *taskcg, const char *querycg)
 	char *start, *end;
 
 	if (strlen(taskcg) <= strlen(querycg)) {
-		lxcfs_error("%s\n", "I was fed bad input.");
+		lxcfs_error_ratelimit("%s\n", "I was fed bad input.");
 		return NULL;
 	}
 
@@ -364,7 +369,7 @@ static int convert_id_to_ns(FILE *idfile, unsigned int in_id)
 			 * uids wrapped around - unexpected as this is a procfile,
 			 * so just bail.
 			 */
-			lxcfs_error("pid wrapparound at entry %u %u %u in %s\n",
+			lxcfs_error_ratelimit("pid wrapparound at entry %u %u %u in %s\n",
 				nsuid, hostuid, count, line);
 			return -1;
 		}
@@ -508,8 +513,339 @@ out:
 	return ret;
 }
 
+/*
+ * cg_getattr() results per caller and path. Walking the tree stats every
+ * entry and each stat re-reads the caller's cgroups and uid map, so keep the
+ * answers for a short while. Changes made through lxcfs invalidate them right
+ * away. Cgroups created, removed or re-owned on the host bump the watched
+ * generation of their parent, which is part of the key. Whatever the kernel
+ * doesn't notify is picked up once the entry expires.
+ */
+#define CG_ATTR_CACHE_SIZE 1024
+#define CG_ATTR_CACHE_LOCKS 64
+#define CG_ATTR_TTL_MS 1000
+
+struct cg_attr {
+	char *path;
+	/* Callers in the same container with the same ids share entries. */
+	pid_t initpid;
+	uint64_t starttime;
+	uid_t uid;
+	gid_t gid;
+	uint64_t generation;
+	/* cgroup_generation() of the directory holding the entry. */
+	uint64_t cg_generation;
+	int64_t expires;
+	int ret;
+	mode_t mode;
+	nlink_t nlink;
+	uid_t st_uid;
+	gid_t st_gid;
+	off_t size;
+};
+
+static struct cg_attr cg_attr_cache[CG_ATTR_CACHE_SIZE];
+static pthread_mutex_t cg_attr_locks[CG_ATTR_CACHE_LOCKS] = {
+	[0 ... CG_ATTR_CACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+static uint64_t cg_attr_generation = 1;
+
+static inline int64_t cg_attr_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts))
+		return 0;
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Called after anything that changes the tree, ownership or membership. */
+static inline void cg_attr_invalidate(void)
+{
+	__atomic_add_fetch(&cg_attr_generation, 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t cg_watch_generation(const char *controller,
+					   const char *cgroup)
+{
+	if (strcmp(controller, "systemd") == 0)
+		return cgroup_generation("name=systemd", cgroup);
+
+	return cgroup_generation(controller, cgroup);
+}
+
+static inline int cg_attr_slot(const char *path, pid_t initpid, uid_t uid, gid_t gid)
+{
+	unsigned int hash = calc_hash(path);
+
+	hash ^= (unsigned int)initpid * 31 ^ (unsigned int)uid * 17 ^ (unsigned int)gid;
+	return hash % CG_ATTR_CACHE_SIZE;
+}
+
+static bool cg_attr_lookup(const char *path, pid_t initpid, uint64_t starttime,
+			   const struct fuse_context *fc, uint64_t cg_generation,
+			   struct stat *sb, int *ret)
+{
+	int slot = cg_attr_slot(path, initpid, fc->uid, fc->gid);
+	pthread_mutex_t *lock = &cg_attr_locks[slot % CG_ATTR_CACHE_LOCKS];
+	struct cg_attr *a = &cg_attr_cache[slot];
+	bool hit = false;
+
+	/* The directory can't be watched, nothing about it is cached. */
+	if (!cg_generation)
+		return false;
+
+	pthread_mutex_lock(lock);
+	if (a->path && a->initpid == initpid && a->starttime == starttime &&
+	    a->uid == fc->uid && a->gid == fc->gid &&
+	    a->cg_generation == cg_generation &&
+	    a->generation == __atomic_load_n(&cg_attr_generation, __ATOMIC_ACQUIRE) &&
+	    a->expires > cg_attr_now() && strcmp(a->path, path) == 0) {
+		sb->st_mode = a->mode;
+		sb->st_nlink = a->nlink;
+		sb->st_uid = a->st_uid;
+		sb->st_gid = a->st_gid;
+		sb->st_size = a->size;
+		*ret = a->ret;
+		hit = true;
+	}
+	pthread_mutex_unlock(lock);
+
+	return hit;
+}
+
+static void cg_attr_store(const char *path, pid_t initpid, uint64_t starttime,
+			  const struct fuse_context *fc, uint64_t generation,
+			  uint64_t cg_generation, const struct stat *sb, int ret)
+{
+	int slot = cg_attr_slot(path, initpid, fc->uid, fc->gid);
+	pthread_mutex_t *lock = &cg_attr_locks[slot % CG_ATTR_CACHE_LOCKS];
+	struct cg_attr *a = &cg_attr_cache[slot];
+	char *copy;
+
+	if (!cg_generation)
+		return;
+
+	copy = strdup(path);
+	if (!copy)
+		return;
+
+	pthread_mutex_lock(lock);
+	free(a->path);
+	a->path = copy;
+	a->initpid = initpid;
+	a->starttime = starttime;
+	a->uid = fc->uid;
+	a->gid = fc->gid;
+	/* Taken before computing the result so a concurrent change wins. */
+	a->generation = generation;
+	a->cg_generation = cg_generation;
+	a->expires = cg_attr_now() + CG_ATTR_TTL_MS;
+	a->ret = ret;
+	a->mode = sb->st_mode;
+	a->nlink = sb->st_nlink;
+	a->st_uid = sb->st_uid;
+	a->st_gid = sb->st_gid;
+	a->size = sb->st_size;
+	pthread_mutex_unlock(lock);
+}
+
+void cg_attr_cache_exit(void)
+{
+	for (int i = 0; i < CG_ATTR_CACHE_SIZE; i++)
+		free_disarm(cg_attr_cache[i].path);
+}
+
+/*
+ * Listings of cgroup directories shared by cg_readdir() calls. A listing is
+ * built with a single pass over the directory and reused by every reader
+ * until it expires, the tree is changed through lxcfs, which bumps the same
+ * generation as the cg_getattr() cache, or the directory's watched generation
+ * changes because a child was created or removed on the host. An open
+ * directory keeps the listing it started with so the offsets handed out as
+ * cookies stay valid until it is rewound.
+ */
+#define CG_DIR_CACHE_SIZE 256
+#define CG_DIR_TTL_MS 1000
+
+struct cg_dir_snapshot {
+	int refcount;
+	char *controller;
+	char *cgroup;
+	uint64_t generation;
+	uint64_t cg_generation;
+	int64_t expires;
+	/* Keys first, then child cgroups. */
+	size_t nr_names;
+	char **names;
+};
+
+static struct cg_dir_snapshot *cg_dir_cache[CG_DIR_CACHE_SIZE];
+static pthread_mutex_t cg_dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cg_dir_put(struct cg_dir_snapshot *dir)
+{
+	if (!dir || __atomic_sub_fetch(&dir->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (size_t i = 0; i < dir->nr_names; i++)
+		free(dir->names[i]);
+	free(dir->names);
+	free(dir->controller);
+	free(dir->cgroup);
+	free(dir);
+}
+
+static void cg_dir_add(char ***names, size_t *len, char *name)
+{
+	if (*len % BATCH_SIZE == 0)
+		*names = must_realloc(*names, (*len + BATCH_SIZE) * sizeof(char *));
+	(*names)[(*len)++] = name;
+}
+
+static bool cg_dir_is(int cfd, const char *path, const struct dirent *dirent,
+		      bool directory)
+{
+	char pathname[MAXPATHLEN];
+	struct stat mystat;
+	int ret;
+
+	if (dirent->d_type == DT_DIR)
+		return directory;
+	if (dirent->d_type == DT_REG)
+		return !directory;
+	if (dirent->d_type != DT_UNKNOWN)
+		return false;
+
+	ret = snprintf(pathname, sizeof(pathname), "%s/%s", path, dirent->d_name);
+	if (ret < 0 || (size_t)ret >= sizeof(pathname)) {
+		lxcfs_error_ratelimit("Pathname too long under %s\n", path);
+		return false;
+	}
+
+	if (fstatat(cfd, pathname, &mystat, AT_SYMLINK_NOFOLLOW)) {
+		lxcfs_error_ratelimit("Failed to stat %s: %s\n", pathname, strerror(errno));
+		return false;
+	}
+
+	return directory ? S_ISDIR(mystat.st_mode) : S_ISREG(mystat.st_mode);
+}
+
+static struct cg_dir_snapshot *cg_dir_new(const char *controller,
+					  const char *cgroup,
+					  uint64_t generation,
+					  uint64_t cg_generation)
+{
+	__do_close int fd = -EBADF;
+	__do_free char *path = NULL;
+	__do_closedir DIR *dir = NULL;
+	char **children = NULL;
+	size_t nr_children = 0;
+	struct cg_dir_snapshot *snap;
+	struct dirent *dirent;
+	int cfd;
+
+	cfd = get_cgroup_fd_handle_named(controller);
+	if (cfd < 0)
+		return NULL;
+
+	path = must_make_path_relative(cgroup, NULL);
+	fd = openat(cfd, path, O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	dir = fdopendir(fd);
+	if (!dir)
+		return NULL;
+	/* Transfer ownership of fd to fdopendir(). */
+	move_fd(fd);
+
+	snap = zalloc(sizeof(*snap));
+	if (!snap)
+		return NULL;
+
+	while ((dirent = readdir(dir))) {
+		if (strcmp(dirent->d_name, ".") == 0)
+			continue;
+
+		if (strcmp(dirent->d_name, "..") == 0)
+			continue;
+
+		if (cg_dir_is(cfd, path, dirent, false))
+			cg_dir_add(&snap->names, &snap->nr_names,
+				   must_copy_string(dirent->d_name));
+		else if (cg_dir_is(cfd, path, dirent, true))
+			cg_dir_add(&children, &nr_children,
+				   must_copy_string(dirent->d_name));
+	}
+
+	for (size_t i = 0; i < nr_children; i++)
+		cg_dir_add(&snap->names, &snap->nr_names, children[i]);
+	free(children);
+
+	snap->refcount = 1;
+	snap->controller = must_copy_string(controller);
+	snap->cgroup = must_copy_string(cgroup);
+	snap->generation = generation;
+	snap->cg_generation = cg_generation;
+	snap->expires = cg_attr_now() + CG_DIR_TTL_MS;
+
+	return snap;
+}
+
+static struct cg_dir_snapshot *cg_dir_get(const char *controller,
+					  const char *cgroup)
+{
+	int slot = (calc_hash(controller) ^ calc_hash(cgroup)) % CG_DIR_CACHE_SIZE;
+	struct cg_dir_snapshot *dir, *old;
+	uint64_t cg_generation, generation;
+
+	generation = __atomic_load_n(&cg_attr_generation, __ATOMIC_ACQUIRE);
+	cg_generation = cg_watch_generation(controller, cgroup);
+
+	/* Unwatched directories are listed afresh and not shared. */
+	if (!cg_generation)
+		return cg_dir_new(controller, cgroup, generation, 0);
+
+	pthread_mutex_lock(&cg_dir_lock);
+	dir = cg_dir_cache[slot];
+	if (dir && dir->generation == generation &&
+	    dir->cg_generation == cg_generation && dir->expires > cg_attr_now() &&
+	    strcmp(dir->controller, controller) == 0 &&
+	    strcmp(dir->cgroup, cgroup) == 0) {
+		__atomic_add_fetch(&dir->refcount, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&cg_dir_lock);
+		return dir;
+	}
+	pthread_mutex_unlock(&cg_dir_lock);
+
+	dir = cg_dir_new(controller, cgroup, generation, cg_generation);
+	if (!dir)
+		return NULL;
+
+	/* One reference for the cache, one for the caller. */
+	__atomic_add_fetch(&dir->refcount, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&cg_dir_lock);
+	old = cg_dir_cache[slot];
+	cg_dir_cache[slot] = dir;
+	pthread_mutex_unlock(&cg_dir_lock);
+	cg_dir_put(old);
+
+	return dir;
+}
+
+void cg_dir_cache_exit(void)
+{
+	pthread_mutex_lock(&cg_dir_lock);
+	for (int i = 0; i < CG_DIR_CACHE_SIZE; i++)
+		cg_dir_put(move_ptr(cg_dir_cache[i]));
+	pthread_mutex_unlock(&cg_dir_lock);
+}
+
 __lxcfs_fuse_ops int cg_getattr(const char *path, struct stat *sb)
 {
+	watch_request("getattr", path);
 	struct timespec now;
 	struct fuse_context *fc = fuse_get_context();
 	char * cgdir = NULL;
@@ -517,6 +853,8 @@ __lxcfs_fuse_ops int cg_getattr(const char *path, struct stat *sb)
 	struct cgfs_files *k = NULL;
 	const char *cgroup;
 	const char *controller = NULL;
+	uint64_t cg_generation, generation, starttime = 0;
+	pid_t initpid;
 	int ret = -ENOENT;
 
 	if (!liblxcfs_functional())
@@ -551,6 +889,12 @@ __lxcfs_fuse_ops int cg_getattr(const char *path, struct stat *sb)
 		return 0;
 	}
 
+	initpid = lookup_initpid_starttime(fc->pid, &starttime);
+	if (initpid <= 1 || is_shared_pidns(initpid)) {
+		initpid = fc->pid;
+		starttime = 0;
+	}
+
 	get_cgdir_and_path(cgroup, &cgdir, &last);
 
 	if (!last) {
@@ -561,9 +905,14 @@ __lxcfs_fuse_ops int cg_getattr(const char *path, struct stat *sb)
 		path2 = last;
 	}
 
-	pid_t initpid = lookup_initpid_in_store(fc->pid);
-	if (initpid <= 1 || is_shared_pidns(initpid))
-		initpid = fc->pid;
+	/* Both taken before computing the result so a concurrent change wins. */
+	generation = __atomic_load_n(&cg_attr_generation, __ATOMIC_ACQUIRE);
+	cg_generation = cg_watch_generation(controller, path1);
+	if (cg_attr_lookup(path, initpid, starttime, fc, cg_generation, sb, &ret)) {
+		free(cgdir);
+		return ret;
+	}
+
 	/* check that cgcopy is either a child cgroup of cgdir, or listed in its keys.
 	 * Then check that caller's cgroup is under path if last is a child
 	 * cgroup, or cgdir if last is a file */
@@ -616,6 +965,7 @@ __lxcfs_fuse_ops int cg_getattr(const char *path, struct stat *sb)
 	}
 
 out:
+	cg_attr_store(path, initpid, starttime, fc, generation, cg_generation, sb, ret);
 	free(cgdir);
 	return ret;
 }
@@ -634,7 +984,7 @@ static void chown_all_cgroup_files(const char *dirname, uid_t uid, gid_t gid, in
 
 	len = strlen(dirname);
 	if (len >= MAXPATHLEN) {
-		lxcfs_error("Pathname too long: %s\n", dirname);
+		lxcfs_error_ratelimit("Pathname too long: %s\n", dirname);
 		return;
 	}
 
@@ -644,7 +994,7 @@ static void chown_all_cgroup_files(const char *dirname, uid_t uid, gid_t gid, in
 
 	d = fdopendir(fd1);
 	if (!d) {
-		lxcfs_error("Failed to open %s\n", dirname);
+		lxcfs_error_ratelimit("Failed to open %s\n", dirname);
 		return;
 	}
 
@@ -653,11 +1003,11 @@ static void chown_all_cgroup_files(const char *dirname, uid_t uid, gid_t gid, in
 			continue;
 		ret = snprintf(path, MAXPATHLEN, "%s/%s", dirname, direntp->d_name);
 		if (ret < 0 || ret >= MAXPATHLEN) {
-			lxcfs_error("Pathname too long under %s\n", dirname);
+			lxcfs_error_ratelimit("Pathname too long under %s\n", dirname);
 			continue;
 		}
 		if (fchownat(fd, path, uid, gid, 0) < 0)
-			lxcfs_error("Failed to chown file %s to %u:%u", path, uid, gid);
+			lxcfs_error_ratelimit("Failed to chown file %s to %u:%u", path, uid, gid);
 	}
 	closedir(d);
 }
@@ -688,6 +1038,7 @@ static int cgfs_create(const char *controller, const char *cg, uid_t uid, gid_t
 
 __lxcfs_fuse_ops int cg_mkdir(const char *path, mode_t mode)
 {
+	watch_request("mkdir", path);
 	struct fuse_context *fc = fuse_get_context();
 	char *last = NULL, *path1, *cgdir = NULL, *controller, *next = NULL;
 	const char *cgroup;
@@ -736,6 +1087,7 @@ __lxcfs_fuse_ops int cg_mkdir(const char *path, mode_t mode)
 	}
 
 	ret = cgfs_create(controller, cgroup, fc->uid, fc->gid);
+	cg_attr_invalidate();
 
 out:
 	free(cgdir);
@@ -772,7 +1124,7 @@ static bool recursive_rmdir(const char *dirname, int fd, const int cfd)
 
 		rc = snprintf(pathname, MAXPATHLEN, "%s/%s", dirname, direntp->d_name);
 		if (rc < 0 || rc >= MAXPATHLEN) {
-			lxcfs_error("%s\n", "Pathname too long.");
+			lxcfs_error_ratelimit("%s\n", "Pathname too long.");
 			continue;
 		}
 
@@ -816,6 +1168,7 @@ static bool cgfs_remove(const char *controller, const char *cgroup)
 
 __lxcfs_fuse_ops int cg_rmdir(const char *path)
 {
+	watch_request("rmdir", path);
 	struct fuse_context *fc = fuse_get_context();
 	char *last = NULL, *cgdir = NULL, *controller, *next = NULL;
 	const char *cgroup;
@@ -869,6 +1222,7 @@ __lxcfs_fuse_ops int cg_rmdir(const char *path)
 		ret = -EINVAL;
 		goto out;
 	}
+	cg_attr_invalidate();
 
 	ret = 0;
 
@@ -896,6 +1250,7 @@ static bool cgfs_chmod_file(const char *controller, const char *file, mode_t mod
 
 __lxcfs_fuse_ops int cg_chmod(const char *path, mode_t mode)
 {
+	watch_request("chmod", path);
 	struct fuse_context *fc = fuse_get_context();
 	char * cgdir = NULL, *last = NULL, *path1, *path2, *controller;
 	struct cgfs_files *k = NULL;
@@ -958,6 +1313,7 @@ __lxcfs_fuse_ops int cg_chmod(const char *path, mode_t mode)
 		ret = -EINVAL;
 		goto out;
 	}
+	cg_attr_invalidate();
 
 	ret = 0;
 out:
@@ -1009,6 +1365,7 @@ static int cgfs_chown_file(const char *controller, const char *file, uid_t uid,
 
 __lxcfs_fuse_ops int cg_chown(const char *path, uid_t uid, gid_t gid)
 {
+	watch_request("chown", path);
 	struct fuse_context *fc = fuse_get_context();
 	char *cgdir = NULL, *last = NULL, *path1, *path2, *controller;
 	struct cgfs_files *k = NULL;
@@ -1068,6 +1425,7 @@ __lxcfs_fuse_ops int cg_chown(const char *path, uid_t uid, gid_t gid)
 	}
 
 	ret = cgfs_chown_file(controller, cgroup, uid, gid);
+	cg_attr_invalidate();
 
 out:
 	free_key(k);
@@ -1078,6 +1436,7 @@ out:
 
 __lxcfs_fuse_ops int cg_open(const char *path, struct fuse_file_info *fi)
 {
+	watch_request("open", path);
 	const char *cgroup;
 	char *last = NULL, *path1, *path2, * cgdir = NULL, *controller;
 	struct cgfs_files *k = NULL;
@@ -1127,7 +1486,7 @@ __lxcfs_fuse_ops int cg_open(const char *path, struct fuse_file_info *fi)
 	}
 
 	/* we'll free this at cg_release */
-	file_info = malloc(sizeof(*file_info));
+	file_info = zalloc(sizeof(*file_info));
 	if (!file_info) {
 		ret = -ENOMEM;
 		goto out;
@@ -1147,31 +1506,173 @@ out:
 	return ret;
 }
 
-#define POLLIN_SET ( EPOLLIN | EPOLLHUP | EPOLLRDHUP )
+/*
+ * Pids are exchanged with the helpers below as one datagram each. Both ends
+ * keep up to SCM_BATCH of them in flight instead of waiting for every answer
+ * before sending the next pid.
+ */
+static int send_pids(int sock, const pid_t *pids, size_t n)
+{
+	struct mmsghdr msgs[SCM_BATCH] = {};
+	struct iovec iov[SCM_BATCH];
+	int ret;
+
+	n = MIN(n, SCM_BATCH);
+	for (size_t i = 0; i < n; i++) {
+		iov[i].iov_base = (pid_t *)&pids[i];
+		iov[i].iov_len = sizeof(pid_t);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = sendmmsg(sock, msgs, n, MSG_DONTWAIT);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+static int recv_pids(int sock, pid_t *pids, size_t n)
+{
+	struct mmsghdr msgs[SCM_BATCH] = {};
+	struct iovec iov[SCM_BATCH];
+	int ret;
+
+	n = MIN(n, SCM_BATCH);
+	for (size_t i = 0; i < n; i++) {
+		iov[i].iov_base = &pids[i];
+		iov[i].iov_len = sizeof(pid_t);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	ret = recvmmsg(sock, msgs, n, MSG_DONTWAIT, NULL);
+	if (ret < 0)
+		return -errno;
+
+	for (int i = 0; i < ret; i++)
+		if (msgs[i].msg_len != sizeof(pid_t))
+			return -EBADMSG;
+
+	return ret;
+}
+
+/* Send all of @pids, waiting at most SCM_TIMEOUT_MS for room each time. */
+static bool send_pids_all(struct pollfd *pfd, const pid_t *pids, size_t n)
+{
+	for (size_t done = 0; done < n;) {
+		int ret;
+
+		ret = send_pids(pfd->fd, pids + done, n - done);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+
+		if (ret != -EAGAIN)
+			return false;
+
+		pfd->events = POLLOUT;
+		if (wait_for_events(pfd, 1, monotonic_ms() + SCM_TIMEOUT_MS) <= 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Send all of @creds. A task that went away in the meantime is answered
+ * with our own pid tagged '1' so the receiver can keep count.
+ */
+static bool send_creds_all(struct pollfd *pfd, struct ucred *creds, char *v,
+			   size_t n)
+{
+	for (size_t done = 0; done < n;) {
+		int ret;
+
+		ret = send_creds_batch(pfd->fd, creds + done, v + done,
+				       n - done, MSG_DONTWAIT);
+		if (ret > 0) {
+			done += ret;
+			continue;
+		}
+
+		if (ret == -ESRCH) {
+			creds[done].pid = getpid();
+			v[done] = '1';
+			continue;
+		}
+
+		if (ret != -EAGAIN)
+			return false;
+
+		pfd->events = POLLOUT;
+		if (wait_for_events(pfd, 1, monotonic_ms() + SCM_TIMEOUT_MS) <= 0)
+			return false;
+	}
+
+	return true;
+}
+
+/* The pids listed one per line in @data. */
+static pid_t *parse_pids(const char *data, size_t *n)
+{
+	pid_t *pids = NULL;
+	size_t len = 0;
+	pid_t pid;
+
+	for (const char *ptr = data; ptr && sscanf(ptr, "%d", &pid) == 1;) {
+		if (len % SCM_BATCH == 0)
+			pids = must_realloc(pids, (len + SCM_BATCH) * sizeof(pid_t));
+		pids[len++] = pid;
+
+		ptr = strchr(ptr, '\n');
+		if (ptr)
+			ptr++;
+	}
+
+	*n = len;
+	return pids;
+}
 
 /*
  * pid_to_ns - reads pids from a ucred over a socket, then writes the
  * int value back over the socket.  This shifts the pid from the
- * sender's pidns into tpid's pidns.
+ * sender's pidns into tpid's pidns. A ucred tagged '1' ends the exchange.
  */
 static int pid_to_ns(int sock, pid_t tpid)
 {
-	char v = '0';
-	struct ucred cred = {
-		.pid = -1,
-		.uid = -1,
-		.gid = -1,
-	};
+	struct pollfd pfd = { .fd = sock };
+	struct ucred creds[SCM_BATCH];
+	pid_t pids[SCM_BATCH];
+	char v[SCM_BATCH];
 
-	while (recv_creds(sock, &cred, &v)) {
-		if (v == '1')
-			return 0;
+	for (;;) {
+		int n = 0, ret;
 
-		if (write_nointr(sock, &cred.pid, sizeof(pid_t)) != sizeof(pid_t))
+		pfd.events = POLLIN;
+		if (wait_for_events(&pfd, 1, monotonic_ms() + SCM_TIMEOUT_MS) <= 0) {
+			lxcfs_error("%s\n", "Timeout reading from parent.");
 			return 1;
-	}
+		}
 
-	return 0;
+		ret = recv_creds_batch(sock, creds, v, SCM_BATCH);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret < 0)
+			return 1;
+
+		while (n < ret && v[n] != '1') {
+			pids[n] = creds[n].pid;
+			n++;
+		}
+
+		if (!send_pids_all(&pfd, pids, n))
+			return 1;
+
+		if (n < ret)
+			return 0;
+	}
 }
 
 /*
@@ -1233,7 +1734,7 @@ static void pid_to_ns_wrapper(int sock, pid_t tpid)
 		_exit(1);
 
 	/* Give the child 1 second to be done forking and write its ack. */
-	if (!wait_for_sock(cpipe[0], 1))
+	if (!wait_for_sock(cpipe[0], 1000))
 		_exit(1);
 	ret = read(cpipe[0], &v, 1);
 	if (ret != sizeof(char) || v != '1')
@@ -1264,30 +1765,35 @@ static void must_strcat_pid(char **src, size_t *sz, size_t *asz, pid_t pid)
 static bool do_read_pids(pid_t tpid, const char *contrl, const char *cg,
 			 const char *file, char **d)
 {
+	__do_free char *tmpdata = NULL;
+	__do_free pid_t *pids = NULL;
 	int sock[2] = {-1, -1};
-	char *tmpdata = NULL;
-	int ret;
-	pid_t qpid, cpid = -1;
+	pid_t cpid = -1;
 	bool answer = false;
-	char v = '0';
-	struct ucred cred;
-	size_t sz = 0, asz = 0;
+	struct ucred creds[SCM_BATCH] = {};
+	char v[SCM_BATCH];
+	struct pollfd pfd;
+	size_t npids, next = 0, sent = 0, received = 0, sz = 0, asz = 0;
+	int64_t deadline;
 
 	if (!get_cgroup_handle_named(cgroup_ops, contrl, cg, file, &tmpdata))
 		return false;
 
 	/*
-	 * Now we read the pids from returned data one by one, pass
-	 * them into a child in the target namespace, read back the
-	 * translated pids, and put them into our to-return data
+	 * Now we pass the pids from returned data into a child in the target
+	 * namespace, read back the translated pids in the same order, and put
+	 * them into our to-return data.
 	 */
+	pids = parse_pids(tmpdata, &npids);
 
 	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sock) < 0) {
 		perror("socketpair");
-		free(tmpdata);
 		return false;
 	}
 
+	if (!enable_passcred(sock[1]))
+		goto out;
+
 	cpid = fork();
 	if (cpid == -1)
 		goto out;
@@ -1295,59 +1801,86 @@ static bool do_read_pids(pid_t tpid, const char *contrl, const char *cg,
 	if (!cpid) // child - exits when done
 		pid_to_ns_wrapper(sock[1], tpid);
 
-	char *ptr = tmpdata;
-	cred.uid = 0;
-	cred.gid = 0;
-	while (sscanf(ptr, "%d\n", &qpid) == 1) {
-		cred.pid = qpid;
-		ret = send_creds(sock[0], &cred, v, true);
+	memset(v, '0', sizeof(v));
+	pfd.fd = sock[0];
+	deadline = monotonic_ms() + SCM_TIMEOUT_MS;
+	while (next < npids || received < sent) {
+		pid_t qpids[SCM_BATCH];
+		int ret;
 
-		if (ret == SEND_CREDS_NOTSK)
-			goto next;
-		if (ret == SEND_CREDS_FAIL)
-			goto out;
+		pfd.events = POLLIN;
+		if (next < npids && sent - received < SCM_BATCH)
+			pfd.events |= POLLOUT;
 
-		// read converted results
-		if (!wait_for_sock(sock[0], 2)) {
-			lxcfs_error("Timed out waiting for pid from child: %s.\n", strerror(errno));
+		ret = wait_for_events(&pfd, 1, deadline);
+		if (ret <= 0) {
+			lxcfs_error_ratelimit("Failed waiting for pid from child: %s.\n", ret ? strerror(-ret) : "timed out");
 			goto out;
 		}
-		if (read(sock[0], &qpid, sizeof(qpid)) != sizeof(qpid)) {
-			lxcfs_error("Error reading pid from child: %s.\n", strerror(errno));
-			goto out;
+
+		if (pfd.revents & POLLOUT) {
+			size_t n = MIN(npids - next, SCM_BATCH - (sent - received));
+
+			for (size_t i = 0; i < n; i++) {
+				creds[i].pid = pids[next + i];
+				creds[i].uid = 0;
+				creds[i].gid = 0;
+			}
+
+			ret = send_creds_batch(sock[0], creds, v, n, MSG_DONTWAIT);
+			if (ret == -ESRCH) {
+				/* Exited since the cgroup was read. */
+				next++;
+			} else if (ret > 0) {
+				next += ret;
+				sent += ret;
+			} else if (ret != -EAGAIN) {
+				lxcfs_error_ratelimit("Error writing pid to child: %s.\n", strerror(-ret));
+				goto out;
+			}
+		}
+
+		if (pfd.revents & ~POLLOUT) {
+			ret = recv_pids(sock[0], qpids, SCM_BATCH);
+			if (ret < 0 && ret != -EAGAIN) {
+				lxcfs_error_ratelimit("Error reading pid from child: %s.\n", strerror(-ret));
+				goto out;
+			}
+
+			for (int i = 0; i < ret; i++)
+				must_strcat_pid(d, &sz, &asz, qpids[i]);
+
+			if (ret > 0) {
+				received += ret;
+				deadline = monotonic_ms() + SCM_TIMEOUT_MS;
+			}
 		}
-		must_strcat_pid(d, &sz, &asz, qpid);
-next:
-		ptr = strchr(ptr, '\n');
-		if (!ptr)
-			break;
-		ptr++;
 	}
 
-	cred.pid = getpid();
-	v = '1';
-	if (send_creds(sock[0], &cred, v, true) != SEND_CREDS_OK) {
+	creds[0].pid = getpid();
+	creds[0].uid = 0;
+	creds[0].gid = 0;
+	v[0] = '1';
+	if (!send_creds_all(&pfd, creds, v, 1)) {
 		// failed to ask child to exit
-		lxcfs_error("Failed to ask child to exit: %s.\n", strerror(errno));
+		lxcfs_error_ratelimit("Failed to ask child to exit: %s.\n", strerror(errno));
 		goto out;
 	}
 
 	answer = true;
 
 out:
-	free(tmpdata);
 	if (cpid != -1)
 		wait_for_pid(cpid);
-	if (sock[0] != -1) {
-		close(sock[0]);
-		close(sock[1]);
-	}
+	close(sock[0]);
+	close(sock[1]);
 	return answer;
 }
 
 __lxcfs_fuse_ops int cg_read(const char *path, char *buf, size_t size,
 			     off_t offset, struct fuse_file_info *fi)
 {
+	watch_request("read", path);
 	struct fuse_context *fc = fuse_get_context();
 	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
 	struct cgfs_files *k = NULL;
@@ -1363,7 +1896,7 @@ __lxcfs_fuse_ops int cg_read(const char *path, char *buf, size_t size,
 		return -EIO;
 
 	if (f->type != LXC_TYPE_CGFILE) {
-		lxcfs_error("%s\n", "Internal error: directory cache info used in cg_read.");
+		lxcfs_error_ratelimit("%s\n", "Internal error: directory cache info used in cg_read.");
 		return -EIO;
 	}
 
@@ -1405,7 +1938,7 @@ __lxcfs_fuse_ops int cg_read(const char *path, char *buf, size_t size,
 	s = strlen(data);
 	if (s > size)
 		s = size;
-	memcpy(buf, data, s);
+	copy_out(buf, data, s);
 	if ((s > 0) && (s < size) && (data[s - 1] != '\n'))
 		buf[s++] = '\n';
 
@@ -1418,6 +1951,7 @@ out:
 
 __lxcfs_fuse_ops int cg_opendir(const char *path, struct fuse_file_info *fi)
 {
+	watch_request("opendir", path);
 	struct fuse_context *fc = fuse_get_context();
 	const char *cgroup;
 	struct file_info *dir_info;
@@ -1456,7 +1990,7 @@ __lxcfs_fuse_ops int cg_opendir(const char *path, struct fuse_file_info *fi)
 	}
 
 	/* we'll free this at cg_releasedir */
-	dir_info = malloc(sizeof(*dir_info));
+	dir_info = zalloc(sizeof(*dir_info));
 	if (!dir_info)
 		return -ENOMEM;
 	dir_info->controller = must_copy_string(controller);
@@ -1478,65 +2012,89 @@ __lxcfs_fuse_ops int cg_release(const char *path, struct fuse_file_info *fi)
 
 __lxcfs_fuse_ops int cg_releasedir(const char *path, struct fuse_file_info *fi)
 {
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+
+	if (d)
+		cg_dir_put(move_ptr(d->dir));
 	do_release_file_info(fi);
 	return 0;
 }
 
-static FILE *open_pids_file(const char *controller, const char *cgroup)
+static int open_pids_file(const char *controller, const char *cgroup)
 {
-	__do_close int fd = -EBADF;
 	__do_free char *path = NULL;
 	int cfd;
-	FILE *f;
 
 	cfd = get_cgroup_fd_handle_named(controller);
 	if (cfd < 0)
-		return false;
+		return -EBADF;
 
 	path = must_make_path_relative(cgroup, "cgroup.procs", NULL);
-	fd = openat(cfd, path, O_WRONLY | O_CLOEXEC);
-	if (fd < 0)
-		return NULL;
+	return openat(cfd, path, O_WRONLY | O_CLOEXEC);
+}
 
-	f = fdopen(fd, "we");
-	if (!f)
-		return NULL;
-	/* Transfer ownership of fd to fdopen(). */
-	move_fd(fd);
+/*
+ * cgroup.procs takes a single pid per write. A task that exited since it was
+ * translated is skipped like one that was already gone before.
+ */
+static bool write_pid(int fd, pid_t pid)
+{
+	char buf[INTTYPE_TO_STRLEN(pid_t)];
+	int len;
 
-	return f;
+	len = snprintf(buf, sizeof(buf), "%d", (int)pid);
+	if (len < 0 || (size_t)len >= sizeof(buf))
+		return false;
+
+	if (write_nointr(fd, buf, len) == len)
+		return true;
+
+	return errno == ESRCH;
 }
 
+/*
+ * pid_from_ns - the inverse of pid_to_ns(). Reads pids in tpid's pidns and
+ * sends them back as ucreds tagged '0', or tagged '1' for pids that don't
+ * exist. A pid of -1 ends the exchange.
+ */
 static int pid_from_ns(int sock, pid_t tpid)
 {
-	pid_t vpid;
-	struct ucred cred;
-	char v;
-	int ret;
+	struct pollfd pfd = { .fd = sock };
+	struct ucred creds[SCM_BATCH];
+	pid_t vpids[SCM_BATCH];
+	char v[SCM_BATCH];
+
+	for (;;) {
+		int n = 0, ret;
 
-	cred.uid = 0;
-	cred.gid = 0;
-	while (1) {
-		if (!wait_for_sock(sock, 2)) {
+		pfd.events = POLLIN;
+		if (wait_for_events(&pfd, 1, monotonic_ms() + SCM_TIMEOUT_MS) <= 0) {
 			lxcfs_error("%s\n", "Timeout reading from parent.");
 			return 1;
 		}
-		if ((ret = read(sock, &vpid, sizeof(pid_t))) != sizeof(pid_t)) {
-			lxcfs_error("Bad read from parent: %s.\n", strerror(errno));
+
+		ret = recv_pids(sock, vpids, SCM_BATCH);
+		if (ret == -EAGAIN)
+			continue;
+		if (ret < 0) {
+			lxcfs_error("Bad read from parent: %s.\n", strerror(-ret));
 			return 1;
 		}
-		if (vpid == -1) // done
-			break;
-		v = '0';
-		cred.pid = vpid;
-		if (send_creds(sock, &cred, v, true) != SEND_CREDS_OK) {
-			v = '1';
-			cred.pid = getpid();
-			if (send_creds(sock, &cred, v, false) != SEND_CREDS_OK)
-				return 1;
+
+		while (n < ret && vpids[n] != -1) {
+			creds[n].pid = vpids[n];
+			creds[n].uid = 0;
+			creds[n].gid = 0;
+			v[n] = '0';
+			n++;
 		}
+
+		if (!send_creds_all(&pfd, creds, v, n))
+			return 1;
+
+		if (n < ret)
+			return 0;
 	}
-	return 0;
 }
 
 static void pid_from_ns_wrapper(int sock, pid_t tpid)
@@ -1572,7 +2130,7 @@ static void pid_from_ns_wrapper(int sock, pid_t tpid)
 
 	// give the child 1 second to be done forking and
 	// write its ack
-	if (!wait_for_sock(cpipe[0], 1))
+	if (!wait_for_sock(cpipe[0], 1000))
 		_exit(1);
 	ret = read(cpipe[0], &v, 1);
 	if (ret != sizeof(char) || v != '1')
@@ -1599,20 +2157,20 @@ static void get_pid_creds(pid_t pid, uid_t *uid, gid_t *gid)
 	*gid = -1;
 	sprintf(line, "/proc/%d/status", pid);
 	if ((f = fopen(line, "re")) == NULL) {
-		lxcfs_error("Error opening %s: %s\n", line, strerror(errno));
+		lxcfs_error_ratelimit("Error opening %s: %s\n", line, strerror(errno));
 		return;
 	}
 	while (fgets(line, 400, f)) {
 		if (strncmp(line, "Uid:", 4) == 0) {
 			if (sscanf(line+4, "%u", &u) != 1) {
-				lxcfs_error("bad uid line for pid %u\n", pid);
+				lxcfs_error_ratelimit("bad uid line for pid %u\n", pid);
 				fclose(f);
 				return;
 			}
 			*uid = u;
 		} else if (strncmp(line, "Gid:", 4) == 0) {
 			if (sscanf(line+4, "%u", &g) != 1) {
-				lxcfs_error("bad gid line for pid %u\n", pid);
+				lxcfs_error_ratelimit("bad gid line for pid %u\n", pid);
 				fclose(f);
 				return;
 			}
@@ -1673,15 +2231,21 @@ static bool may_move_pid(pid_t r, uid_t r_uid, pid_t v)
 static bool do_write_pids(pid_t tpid, uid_t tuid, const char *contrl,
 			  const char *cg, const char *file, const char *buf)
 {
+	__do_free pid_t *pids = NULL;
 	int sock[2] = {-1, -1};
-	pid_t qpid, cpid = -1;
-	FILE *pids_file = NULL;
+	__do_close int pids_fd = -EBADF;
+	pid_t cpid = -1, done = -1;
 	bool answer = false, fail = false;
+	struct pollfd pfd;
+	size_t npids, sent = 0, received = 0;
+	int64_t deadline;
 
-	pids_file = open_pids_file(contrl, cg);
-	if (!pids_file)
+	pids_fd = open_pids_file(contrl, cg);
+	if (pids_fd < 0)
 		return false;
 
+	pids = parse_pids(buf, &npids);
+
 	/*
 	 * write the pids to a socket, have helper in writer's pidns
 	 * call movepid for us
@@ -1691,46 +2255,74 @@ static bool do_write_pids(pid_t tpid, uid_t tuid, const char *contrl,
 		goto out;
 	}
 
+	if (!enable_passcred(sock[0]))
+		goto out;
+
 	cpid = fork();
 	if (cpid == -1)
 		goto out;
 
 	if (!cpid) { // child
-		fclose(pids_file);
+		close(pids_fd);
 		pid_from_ns_wrapper(sock[1], tpid);
 	}
 
-	const char *ptr = buf;
-	while (sscanf(ptr, "%d", &qpid) == 1) {
-		struct ucred cred;
-		char v;
+	pfd.fd = sock[0];
+	deadline = monotonic_ms() + SCM_TIMEOUT_MS;
+	while (sent < npids || received < sent) {
+		struct ucred creds[SCM_BATCH];
+		char v[SCM_BATCH];
+		int ret;
+
+		pfd.events = POLLIN;
+		if (sent < npids && sent - received < SCM_BATCH)
+			pfd.events |= POLLOUT;
 
-		if (write(sock[0], &qpid, sizeof(qpid)) != sizeof(qpid)) {
-			lxcfs_error("Error writing pid to child: %s.\n", strerror(errno));
+		ret = wait_for_events(&pfd, 1, deadline);
+		if (ret <= 0) {
+			lxcfs_error_ratelimit("Failed waiting for child: %s.\n", ret ? strerror(-ret) : "timed out");
 			goto out;
 		}
 
-		if (recv_creds(sock[0], &cred, &v)) {
-			if (v == '0') {
-				if (!may_move_pid(tpid, tuid, cred.pid)) {
+		if (pfd.revents & POLLOUT) {
+			ret = send_pids(sock[0], pids + sent,
+					MIN(npids - sent, SCM_BATCH - (sent - received)));
+			if (ret > 0) {
+				sent += ret;
+			} else if (ret != -EAGAIN) {
+				lxcfs_error_ratelimit("Error writing pid to child: %s.\n", strerror(-ret));
+				goto out;
+			}
+		}
+
+		if (pfd.revents & ~POLLOUT) {
+			ret = recv_creds_batch(sock[0], creds, v, SCM_BATCH);
+			if (ret < 0 && ret != -EAGAIN) {
+				lxcfs_error_ratelimit("Error reading from child: %s.\n", strerror(-ret));
+				goto out;
+			}
+
+			/* Keep draining after a failure so the child can finish. */
+			for (int i = 0; i < ret && !fail; i++) {
+				if (v[i] != '0')
+					continue;
+
+				if (!may_move_pid(tpid, tuid, creds[i].pid))
 					fail = true;
-					break;
-				}
-				if (fprintf(pids_file, "%d", (int) cred.pid) < 0)
+				else if (!write_pid(pids_fd, creds[i].pid))
 					fail = true;
 			}
-		}
 
-		ptr = strchr(ptr, '\n');
-		if (!ptr)
-			break;
-		ptr++;
+			if (ret > 0) {
+				received += ret;
+				deadline = monotonic_ms() + SCM_TIMEOUT_MS;
+			}
+		}
 	}
 
 	/* All good, write the value */
-	qpid = -1;
-	if (write(sock[0], &qpid ,sizeof(qpid)) != sizeof(qpid))
-		lxcfs_error("%s\n", "Warning: failed to ask child to exit.");
+	if (!send_pids_all(&pfd, &done, 1))
+		lxcfs_error_ratelimit("%s\n", "Warning: failed to ask child to exit.");
 
 	if (!fail)
 		answer = true;
@@ -1742,10 +2334,6 @@ out:
 		close(sock[0]);
 		close(sock[1]);
 	}
-	if (pids_file) {
-		if (fclose(pids_file) != 0)
-			answer = false;
-	}
 	return answer;
 }
 
@@ -1779,6 +2367,7 @@ static bool cgfs_set_value(const char *controller, const char *cgroup,
 __lxcfs_fuse_ops int cg_write(const char *path, const char *buf, size_t size,
 			      off_t offset, struct fuse_file_info *fi)
 {
+	watch_request("write", path);
 	struct fuse_context *fc = fuse_get_context();
 	char *localbuf = NULL;
 	struct cgfs_files *k = NULL;
@@ -1792,7 +2381,7 @@ __lxcfs_fuse_ops int cg_write(const char *path, const char *buf, size_t size,
 		return -EIO;
 
 	if (f->type != LXC_TYPE_CGFILE) {
-		lxcfs_error("%s\n", "Internal error: directory cache info used in cg_write.");
+		lxcfs_error_ratelimit("%s\n", "Internal error: directory cache info used in cg_write.");
 		return -EIO;
 	}
 
@@ -1816,10 +2405,12 @@ __lxcfs_fuse_ops int cg_write(const char *path, const char *buf, size_t size,
 	if (strcmp(f->file, "tasks") == 0 ||
 			strcmp(f->file, "/tasks") == 0 ||
 			strcmp(f->file, "/cgroup.procs") == 0 ||
-			strcmp(f->file, "cgroup.procs") == 0)
+			strcmp(f->file, "cgroup.procs") == 0) {
 		// special case - we have to translate the pids
 		r = do_write_pids(fc->pid, fc->uid, f->controller, f->cgroup, f->file, localbuf);
-	else
+		/* Moving tasks changes what their container may see. */
+		cg_attr_invalidate();
+	} else
 		r = cgfs_set_value(f->controller, f->cgroup, f->file, localbuf);
 
 	if (!r)
@@ -1830,127 +2421,28 @@ out:
 	return size;
 }
 
-static bool cgfs_iterate_cgroup(const char *controller, const char *cgroup,
-				bool directories, void ***list, size_t typesize,
-				void *(*iterator)(const char *, const char *, const char *))
-{
-	__do_close int fd = -EBADF;
-	__do_free char *path = NULL;
-	__do_closedir DIR *dir = NULL;
-	size_t sz = 0, asz = 0;
-	int cfd;
-	struct dirent *dirent;
-
-	cfd = get_cgroup_fd_handle_named(controller);
-	*list = NULL;
-	if (cfd < 0)
-		return false;
-
-	path = must_make_path_relative(cgroup, NULL);
-	fd = openat(cfd, path, O_DIRECTORY | O_CLOEXEC);
-	if (fd < 0)
-		return false;
-
-	dir = fdopendir(fd);
-	if (!dir)
-		return false;
-	/* Transfer ownership of fd to fdopendir(). */
-	move_fd(fd);
-
-	while ((dirent = readdir(dir))) {
-		int ret;
-		char pathname[MAXPATHLEN];
-		struct stat mystat;
-
-		if (strcmp(dirent->d_name, ".") == 0)
-			continue;
-
-		if (strcmp(dirent->d_name, "..") == 0)
-			continue;
-
-		ret = snprintf(pathname, sizeof(pathname), "%s/%s", path, dirent->d_name);
-		if (ret < 0 || (size_t)ret >= sizeof(pathname)) {
-			lxcfs_error("Pathname too long under %s\n", path);
-			continue;
-		}
-
-		ret = fstatat(cfd, pathname, &mystat, AT_SYMLINK_NOFOLLOW);
-		if (ret) {
-			lxcfs_error("Failed to stat %s: %s\n", pathname, strerror(errno));
-			continue;
-		}
-
-		if (!directories && !S_ISREG(mystat.st_mode))
-			continue;
-
-		if (directories && !S_ISDIR(mystat.st_mode))
-			continue;
-
-		if (sz + 2 >= asz) {
-			asz += BATCH_SIZE;
-			*list = must_realloc(*list, asz * typesize);
-		}
-		(*list)[sz] = (*iterator)(controller, path, dirent->d_name);
-		(*list)[sz + 1] = NULL;
-		sz++;
-	}
-
-	return true;
-}
-
-static void *make_key_list_entry(const char *controller, const char *cgroup,
-				 const char *dir_entry)
-{
-	struct cgfs_files *entry;
-
-	entry = cgfs_get_key(controller, cgroup, dir_entry);
-	if (!entry)
-		lxcfs_error("Failed to retrieve files under %s:%s\n",
-			    controller, cgroup);
-	return entry;
-}
-
-static bool cgfs_list_keys(const char *controller, const char *cgroup,
-			   struct cgfs_files ***keys)
-{
-	return cgfs_iterate_cgroup(controller, cgroup, false, (void ***)keys,
-				   sizeof(*keys), &make_key_list_entry);
-}
-
-static void *make_children_list_entry(const char *controller,
-				      const char *cgroup, const char *dir_entry)
-{
-	return strdup(dir_entry);
-}
-
-static bool cgfs_list_children(const char *controller, const char *cgroup,
-			       char ***list)
-{
-	return cgfs_iterate_cgroup(controller, cgroup, true, (void ***)list,
-				   sizeof(*list), &make_children_list_entry);
-}
-
-static void free_keys(struct cgfs_files **keys)
+/*
+ * Offsets are cookies: the n-th entry of the listing is passed to the filler
+ * with offset n + 1 and a later call resumes after the offset it was given.
+ * Returns true once the filler's buffer is full.
+ */
+static inline bool cg_dir_fill(fuse_fill_dir_t filler, void *buf,
+			       const char *name, off_t cookie)
 {
-	if (!keys)
-		return;
-
-	for (int i = 0; keys[i]; i++)
-		free_key(keys[i]);
-
-	free_disarm(keys);
+	return DIR_FILLER(filler, buf, name, NULL, cookie) != 0;
 }
 
 __lxcfs_fuse_ops int cg_readdir(const char *path, void *buf,
 				fuse_fill_dir_t filler, off_t offset,
 				struct fuse_file_info *fi)
 {
+	watch_request("readdir", path);
+	__do_free char *nextcg = NULL;
 	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
-	struct cgfs_files **list = NULL;
-	int i, ret;
-	char *nextcg = NULL;
 	struct fuse_context *fc = fuse_get_context();
-	char **clist = NULL;
+	struct cg_dir_snapshot *dir;
+	off_t cookie = 2;
+	pid_t initpid;
 
 	if (!liblxcfs_functional())
 		return -EIO;
@@ -1958,86 +2450,66 @@ __lxcfs_fuse_ops int cg_readdir(const char *path, void *buf,
 	if (!fc || !cgroup_ops || pure_unified_layout(cgroup_ops))
 		return -EIO;
 
-	if (DIR_FILLER(filler, buf, ".", NULL, 0) != 0 || DIR_FILLER(filler, buf, "..", NULL, 0) != 0)
-		return -EIO;
-
 	if (d->type != LXC_TYPE_CGDIR) {
-		lxcfs_error("%s\n", "Internal error: file cache info used in readdir.");
+		lxcfs_error_ratelimit("%s\n", "Internal error: file cache info used in readdir.");
 		return -EIO;
 	}
+
+	if (offset < 1 && cg_dir_fill(filler, buf, ".", 1))
+		return 0;
+
+	if (offset < 2 && cg_dir_fill(filler, buf, "..", 2))
+		return 0;
+
 	if (!d->cgroup && !d->controller) {
 		/*
 		 * ls /var/lib/lxcfs/cgroup - just show list of controllers.
 		 * This only works with the legacy hierarchy.
 		 */
 		for (struct hierarchy **h = cgroup_ops->hierarchies; h && *h; h++) {
-			if (is_unified_hierarchy(*h))
+			cookie++;
+			if (cookie <= offset || is_unified_hierarchy(*h) || !(*h)->__controllers)
 				continue;
 
-			if ((*h)->__controllers && DIR_FILLER(filler, buf, (*h)->__controllers, NULL, 0))
-				return -EIO;
+			if (cg_dir_fill(filler, buf, (*h)->__controllers, cookie))
+				break;
 		}
 
 		return 0;
 	}
 
-	if (!cgfs_list_keys(d->controller, d->cgroup, &list)) {
-		// not a valid cgroup
-		ret = -EINVAL;
-		goto out;
+	/* A new pass over the directory picks up changes. */
+	if (offset == 0 || !d->dir) {
+		dir = cg_dir_get(d->controller, d->cgroup);
+		if (!dir) {
+			// not a valid cgroup
+			return -EINVAL;
+		}
+
+		cg_dir_put(d->dir);
+		d->dir = dir;
 	}
+	dir = d->dir;
 
-	pid_t initpid = lookup_initpid_in_store(fc->pid);
+	initpid = lookup_initpid_in_store(fc->pid);
 	if (initpid <= 1 || is_shared_pidns(initpid))
 		initpid = fc->pid;
 	if (!caller_is_in_ancestor(initpid, d->controller, d->cgroup, &nextcg)) {
-		if (nextcg) {
-			ret = DIR_FILLER(filler, buf, nextcg,  NULL, 0);
-			free(nextcg);
-			if (ret != 0) {
-				ret = -EIO;
-				goto out;
-			}
-		}
-		ret = 0;
-		goto out;
-	}
-
-	for (i = 0; list && list[i]; i++) {
-		if (DIR_FILLER(filler, buf, list[i]->name, NULL, 0) != 0) {
-			ret = -EIO;
-			goto out;
-		}
+		if (nextcg && offset < 3)
+			cg_dir_fill(filler, buf, nextcg, 3);
+		return 0;
 	}
 
-	// now get the list of child cgroups
-
-	if (!cgfs_list_children(d->controller, d->cgroup, &clist)) {
-		ret = 0;
-		goto out;
-	}
-	if (clist) {
-		for (i = 0; clist[i]; i++) {
-			if (DIR_FILLER(filler, buf, clist[i], NULL, 0) != 0) {
-				ret = -EIO;
-				goto out;
-			}
-		}
-	}
-	ret = 0;
+	for (size_t i = offset > 2 ? offset - 2 : 0; i < dir->nr_names; i++)
+		if (cg_dir_fill(filler, buf, dir->names[i], i + 3))
+			break;
 
-out:
-	free_keys(list);
-	if (clist) {
-		for (i = 0; clist[i]; i++)
-			free(clist[i]);
-		free(clist);
-	}
-	return ret;
+	return 0;
 }
 
 __lxcfs_fuse_ops int cg_access(const char *path, int mode)
 {
+	watch_request("access", path);
 	int ret;
 	const char *cgroup;
 	char *path1, *path2, *controller;
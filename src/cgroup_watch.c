@@ -0,0 +1,521 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#if HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include <fuse.h>
+#endif
+
+#include "cgroup_watch.h"
+
+#include "bindings.h"
+#include "cgroups/cgroup.h"
+#include "cgroups/cgroup_utils.h"
+#include "memory_utils.h"
+#include "proc_loadavg.h"
+#include "utils.h"
+
+#define CGROUP_WATCH_HASH_SIZE 256
+#define CGROUP_WATCH_MASK                                                   \
+	(IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM |   \
+	 IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+/* Child cgroups or files coming, going or changing owner and mode. */
+#define CGROUP_WATCH_TREE_MASK \
+	(IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* Files whose changes invalidate values lxcfs derives from a cgroup. */
+static const char *const watched_files[] = {
+	"cgroup.events",
+	"cgroup.procs",
+	"cpu.cfs_period_us",
+	"cpu.cfs_quota_us",
+	"cpu.max",
+	"cpu.shares",
+	"cpu.weight",
+	"cpuset.cpus",
+	"cpuset.cpus.effective",
+	"memory.high",
+	"memory.limit_in_bytes",
+	"memory.max",
+	"memory.memsw.limit_in_bytes",
+	"memory.swap.max",
+	"memory.swappiness",
+};
+
+/*
+ * One per watched directory. A directory mounted in several hierarchies, such
+ * as the cgroup2 root shared by the controllers of a hybrid layout, is found
+ * through one alias per hierarchy and path that all share its generation.
+ */
+struct cgroup_watch {
+	int wd;
+	uint64_t generation;
+	/* Kernel id, 0 until resolved. Recreating the cgroup drops the watch. */
+	uint64_t id;
+	/* Path of the first alias, for debugging. */
+	const char *cgroup;
+	struct cgroup_watch_alias *aliases;
+	/* Chained by watch descriptor. */
+	struct cgroup_watch *next_wd;
+	/* Most recently used first. */
+	struct cgroup_watch *lru_prev;
+	struct cgroup_watch *lru_next;
+};
+
+struct cgroup_watch_alias {
+	struct hierarchy *h;
+	char *cgroup;
+	struct cgroup_watch *watch;
+	/* Chained by hierarchy and cgroup and per watch. */
+	struct cgroup_watch_alias *next;
+	struct cgroup_watch_alias *next_alias;
+};
+
+static struct cgroup_watch_alias *watch_hash[CGROUP_WATCH_HASH_SIZE];
+static struct cgroup_watch *wd_hash[CGROUP_WATCH_HASH_SIZE];
+static struct cgroup_watch *lru_head, *lru_tail;
+static int nr_watches;
+/* Never reused so a re-added cgroup can't go back to an old generation. */
+static uint64_t last_generation;
+static pthread_mutex_t watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t watch_once = PTHREAD_ONCE_INIT;
+
+static bool watching;
+static pthread_t watcher;
+static int inotify_fd = -EBADF;
+static int stop_fd = -EBADF;
+
+static inline void watch_lock(void)
+{
+	pthread_mutex_lock(&watch_mutex);
+}
+
+static inline void watch_unlock(void)
+{
+	pthread_mutex_unlock(&watch_mutex);
+}
+
+static inline int watch_bucket(const struct hierarchy *h, const char *cgroup)
+{
+	return (calc_hash(cgroup) ^ h->fd) % CGROUP_WATCH_HASH_SIZE;
+}
+
+static inline int wd_bucket(int wd)
+{
+	return wd % CGROUP_WATCH_HASH_SIZE;
+}
+
+static bool is_watched_file(const char *name)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(watched_files); i++)
+		if (strcmp(name, watched_files[i]) == 0)
+			return true;
+
+	return false;
+}
+
+static void lru_unlink(struct cgroup_watch *w)
+{
+	if (w->lru_prev)
+		w->lru_prev->lru_next = w->lru_next;
+	else
+		lru_head = w->lru_next;
+
+	if (w->lru_next)
+		w->lru_next->lru_prev = w->lru_prev;
+	else
+		lru_tail = w->lru_prev;
+
+	w->lru_prev = w->lru_next = NULL;
+}
+
+static void lru_push(struct cgroup_watch *w)
+{
+	w->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = w;
+	lru_head = w;
+	if (!lru_tail)
+		lru_tail = w;
+}
+
+/* Must be called under watch_lock */
+static struct cgroup_watch *find_wd(int wd)
+{
+	for (struct cgroup_watch *w = wd_hash[wd_bucket(wd)]; w; w = w->next_wd)
+		if (w->wd == wd)
+			return w;
+
+	return NULL;
+}
+
+/* Must be called under watch_lock */
+static void alias_del(struct cgroup_watch_alias *a)
+{
+	struct cgroup_watch_alias **it;
+
+	for (it = &watch_hash[watch_bucket(a->h, a->cgroup)]; *it; it = &(*it)->next) {
+		if (*it == a) {
+			*it = a->next;
+			break;
+		}
+	}
+
+	free(a->cgroup);
+	free(a);
+}
+
+/* Must be called under watch_lock */
+static void watch_del(struct cgroup_watch *w, bool rm_watch)
+{
+	struct cgroup_watch **it;
+
+	while (w->aliases) {
+		struct cgroup_watch_alias *a = w->aliases;
+
+		w->aliases = a->next_alias;
+		alias_del(a);
+	}
+
+	for (it = &wd_hash[wd_bucket(w->wd)]; *it; it = &(*it)->next_wd) {
+		if (*it == w) {
+			*it = w->next_wd;
+			break;
+		}
+	}
+
+	lru_unlink(w);
+	nr_watches--;
+
+	if (rm_watch)
+		inotify_rm_watch(inotify_fd, w->wd);
+
+	free(w);
+}
+
+static void handle_events(const char *buf, ssize_t len)
+{
+	const struct inotify_event *ev;
+
+	watch_lock();
+	for (const char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		struct cgroup_watch *w;
+
+		ev = (const struct inotify_event *)p;
+
+		/* Events were lost, anything might have changed. */
+		if (ev->mask & IN_Q_OVERFLOW) {
+			for (w = lru_head; w; w = w->lru_next) {
+				w->generation = ++last_generation;
+				w->id = 0;
+			}
+			continue;
+		}
+
+		w = find_wd(ev->wd);
+		if (!w)
+			continue;
+
+		if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+			lxcfs_debug("Stopped watching removed cgroup %s", w->cgroup);
+			watch_del(w, false);
+			continue;
+		}
+
+		if ((ev->mask & CGROUP_WATCH_TREE_MASK) ||
+		    (ev->len && is_watched_file(ev->name)))
+			w->generation = ++last_generation;
+	}
+	watch_unlock();
+}
+
+static void *cgroup_watch_thread(void *arg)
+{
+	char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	lxcfs_background_thread_setup(arg);
+
+	for (;;) {
+		struct pollfd fds[] = {
+			{ .fd = inotify_fd,	.events = POLLIN },
+			{ .fd = stop_fd,	.events = POLLIN },
+		};
+		ssize_t len;
+
+		if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		len = read(inotify_fd, buf, sizeof(buf));
+		if (len <= 0)
+			continue;
+
+		handle_events(buf, len);
+	}
+
+	return NULL;
+}
+
+static void cgroup_watch_init(void)
+{
+	__do_close int fd = -EBADF, efd = -EBADF;
+	struct fuse_context *fc = fuse_get_context();
+	int ret;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		lxcfs_error("%s - Failed to initialize inotify, cgroup values won't be cached", strerror(errno));
+		return;
+	}
+
+	efd = eventfd(0, EFD_CLOEXEC);
+	if (efd < 0) {
+		lxcfs_error("%s - Failed to create eventfd", strerror(errno));
+		return;
+	}
+
+	inotify_fd = move_fd(fd);
+	stop_fd = move_fd(efd);
+	ret = pthread_create(&watcher, NULL, cgroup_watch_thread, fc ? fc->private_data : NULL);
+	if (ret) {
+		close_prot_errno_disarm(inotify_fd);
+		close_prot_errno_disarm(stop_fd);
+		lxcfs_error("%s - Failed to create cgroup watcher thread", strerror(ret));
+		return;
+	}
+
+	watching = true;
+}
+
+/* Must be called under watch_lock */
+static struct cgroup_watch_alias *alias_add(struct cgroup_watch *w,
+					    struct hierarchy *h, const char *cgroup)
+{
+	__do_free struct cgroup_watch_alias *a = NULL;
+	int bucket;
+
+	a = zalloc(sizeof(*a));
+	if (!a)
+		return NULL;
+
+	a->cgroup = strdup(cgroup);
+	if (!a->cgroup)
+		return NULL;
+
+	a->h = h;
+	a->watch = w;
+
+	bucket = watch_bucket(h, a->cgroup);
+	a->next = watch_hash[bucket];
+	watch_hash[bucket] = a;
+
+	a->next_alias = w->aliases;
+	w->aliases = a;
+	if (!w->cgroup)
+		w->cgroup = a->cgroup;
+
+	return move_ptr(a);
+}
+
+/* Must be called under watch_lock */
+static struct cgroup_watch *watch_add(struct hierarchy *h, const char *cgroup)
+{
+	__do_free struct cgroup_watch *w = NULL;
+	struct cgroup_watch *existing;
+	char path[PATH_MAX];
+	int bucket, ret, wd;
+
+	ret = snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", h->fd, cgroup);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return NULL;
+
+	wd = inotify_add_watch(inotify_fd, path, CGROUP_WATCH_MASK);
+	if (wd < 0)
+		return NULL;
+
+	/* Same directory through another hierarchy, share its generation. */
+	existing = find_wd(wd);
+	if (existing) {
+		if (!alias_add(existing, h, cgroup))
+			return NULL;
+
+		lru_unlink(existing);
+		lru_push(existing);
+		return existing;
+	}
+
+	w = zalloc(sizeof(*w));
+	if (!w)
+		goto out_rm;
+
+	w->wd = wd;
+	w->generation = ++last_generation;
+	if (!alias_add(w, h, cgroup))
+		goto out_rm;
+
+	/* Only a watch that is really new takes a slot. */
+	if (nr_watches >= CGROUP_WATCH_MAX)
+		watch_del(lru_tail, true);
+
+	bucket = wd_bucket(wd);
+	w->next_wd = wd_hash[bucket];
+	wd_hash[bucket] = w;
+
+	lru_push(w);
+	nr_watches++;
+
+	return move_ptr(w);
+
+out_rm:
+	inotify_rm_watch(inotify_fd, wd);
+	return NULL;
+}
+
+/* Must be called under watch_lock */
+static struct cgroup_watch *watch_find(struct hierarchy *h, const char *cgroup)
+{
+	struct cgroup_watch_alias *a;
+
+	for (a = watch_hash[watch_bucket(h, cgroup)]; a; a = a->next)
+		if (a->h == h && strcmp(a->cgroup, cgroup) == 0)
+			return a->watch;
+
+	return NULL;
+}
+
+/* Must be called under watch_lock */
+static struct cgroup_watch *watch_get(struct hierarchy *h, const char *cgroup)
+{
+	struct cgroup_watch *w;
+
+	w = watch_find(h, cgroup);
+	if (!w)
+		return watch_add(h, cgroup);
+
+	lru_unlink(w);
+	lru_push(w);
+	return w;
+}
+
+static struct hierarchy *watch_hierarchy(const char *controller)
+{
+	struct hierarchy *h;
+
+	pthread_once(&watch_once, cgroup_watch_init);
+	if (!watching)
+		return NULL;
+
+	h = cgroup_ops->get_hierarchy(cgroup_ops, controller);
+	if (!h || h->fd < 0)
+		return NULL;
+
+	return h;
+}
+
+uint64_t cgroup_generation(const char *controller, const char *cgroup)
+{
+	struct hierarchy *h;
+	struct cgroup_watch *w;
+	uint64_t generation = 0;
+
+	h = watch_hierarchy(controller);
+	if (!h)
+		return 0;
+
+	while (*cgroup == '/')
+		cgroup++;
+
+	watch_lock();
+	w = watch_get(h, cgroup);
+	if (w)
+		generation = w->generation;
+	watch_unlock();
+
+	return generation;
+}
+
+uint64_t cgroup_watch_id(const char *controller, const char *cgroup)
+{
+	struct hierarchy *h;
+	struct cgroup_watch *w;
+	uint64_t generation, id;
+
+	h = watch_hierarchy(controller);
+	if (!h)
+		return get_cgroup_id(controller, cgroup);
+
+	while (*cgroup == '/')
+		cgroup++;
+
+	watch_lock();
+	w = watch_get(h, cgroup);
+	if (!w) {
+		watch_unlock();
+		return get_cgroup_id(controller, cgroup);
+	}
+
+	id = w->id;
+	generation = w->generation;
+	watch_unlock();
+	if (id)
+		return id;
+
+	/* Resolved without the lock, only kept if nothing changed meanwhile. */
+	id = cgroup_id_at(h->fd, cgroup);
+
+	watch_lock();
+	w = watch_find(h, cgroup);
+	if (w && w->generation == generation)
+		w->id = id;
+	watch_unlock();
+
+	return id;
+}
+
+void cgroup_watch_exit(void)
+{
+	uint64_t val = 1;
+
+	if (!watching)
+		return;
+
+	if (write(stop_fd, &val, sizeof(val)) != sizeof(val))
+		lxcfs_error("%s - Failed to stop cgroup watcher", strerror(errno));
+	else
+		pthread_join(watcher, NULL);
+
+	watch_lock();
+	while (lru_head)
+		watch_del(lru_head, false);
+	watch_unlock();
+
+	close_prot_errno_disarm(inotify_fd);
+	close_prot_errno_disarm(stop_fd);
+	watching = false;
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_CGROUP_WATCH_H
+#define __LXCFS_CGROUP_WATCH_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "macro.h"
+
+/*
+ * Change notification for cgroups lxcfs is serving. A background thread keeps
+ * inotify watches on the cgroup directories and bumps a per-cgroup generation
+ * whenever a limit, cpuset, quota or membership file is written, the populated
+ * state changes, a child cgroup is created or removed, anything in it changes
+ * owner or mode or the cgroup goes away. Values derived from a cgroup can be
+ * cached as long as its generation stays the same.
+ *
+ * Only the least recently used cgroups are dropped once CGROUP_WATCH_MAX
+ * watches are in use. A cgroup that is watched again gets a generation it
+ * never had before so stale values are never mistaken for fresh ones.
+ *
+ * Changes that the kernel doesn't notify, such as cpuset.cpus.effective
+ * following an ancestor's cpuset, don't bump the generation.
+ */
+#define CGROUP_WATCH_MAX 1024
+
+/*
+ * Current generation of @cgroup in @controller's hierarchy, watching it on
+ * first use. 0 means it can't be watched and nothing derived from it may be
+ * cached.
+ */
+extern uint64_t cgroup_generation(const char *controller, const char *cgroup);
+
+/*
+ * Kernel id of @cgroup in @controller's hierarchy like get_cgroup_id(), but
+ * only resolved again once the cgroup went away. Returns 0 if unknown.
+ */
+extern uint64_t cgroup_watch_id(const char *controller, const char *cgroup);
+
+extern void cgroup_watch_exit(void);
+
+#endif /* __LXCFS_CGROUP_WATCH_H */
@@ -22,6 +22,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <linux/kdev_t.h>
 #include <linux/types.h>
 #include <poll.h>
@@ -629,7 +630,7 @@ static int cgfsng_get_memory_slabinfo_fd(struct cgroup_ops *ops, const char *cgr
 	if (!h)
 		return -1;
 
-	if (faccessat(h->fd, "memory.kmem.slabinfo", F_OK, 0))
+	if (!h->has_kmem_slabinfo)
 		return -1;
 
 	path = must_make_path_relative(cgroup, "memory.kmem.slabinfo", NULL);
@@ -666,12 +667,265 @@ static bool cgfsng_can_use_swap(struct cgroup_ops *ops)
 	return has_swap;
 }
 
+/* Huge page size in kB from /proc/meminfo, 0 if there is none. */
+static uint64_t default_hugepage_kb(void)
+{
+	__do_fclose FILE *f = NULL;
+	__do_free char *line = NULL;
+	size_t len = 0;
+	uint64_t kb = 0;
+
+	f = fopen("/proc/meminfo", "re");
+	if (!f)
+		return 0;
+
+	while (getline(&line, &len, f) != -1)
+		if (sscanf(line, "Hugepagesize: %" PRIu64 " kB", &kb) == 1)
+			break;
+
+	return kb;
+}
+
+/* Named like the kernel names hugetlb.<size>.* files. */
+static void hugetlb_size_name(uint64_t bytes, char *buf, size_t len)
+{
+	if (bytes >= (1ULL << 30))
+		snprintf(buf, len, "%" PRIu64 "GB", bytes >> 30);
+	else if (bytes >= (1ULL << 20))
+		snprintf(buf, len, "%" PRIu64 "MB", bytes >> 20);
+	else
+		snprintf(buf, len, "%" PRIu64 "KB", bytes >> 10);
+}
+
+static void probe_hugetlb_sizes(struct hierarchy *h)
+{
+	__do_closedir DIR *dir = NULL;
+	struct dirent *dirent;
+	uint64_t default_kb;
+
+	dir = opendir("/sys/kernel/mm/hugepages");
+	if (!dir)
+		return;
+
+	default_kb = default_hugepage_kb();
+	while ((dirent = readdir(dir))) {
+		struct hugetlb_size *sizes;
+		uint64_t kb;
+
+		if (sscanf(dirent->d_name, "hugepages-%" PRIu64 "kB", &kb) != 1)
+			continue;
+
+		sizes = realloc(h->hugetlb_sizes, (h->nr_hugetlb_sizes + 1) * sizeof(*sizes));
+		if (!sizes)
+			return;
+		h->hugetlb_sizes = sizes;
+
+		/* The default size goes first, it is what meminfo reports on. */
+		if (kb == default_kb && h->nr_hugetlb_sizes) {
+			sizes[h->nr_hugetlb_sizes] = sizes[0];
+			sizes = &sizes[0];
+		} else {
+			sizes = &sizes[h->nr_hugetlb_sizes];
+		}
+
+		sizes->bytes = kb * 1024;
+		hugetlb_size_name(sizes->bytes, sizes->name, sizeof(sizes->name));
+		h->nr_hugetlb_sizes++;
+	}
+}
+
+static void cgfsng_probe_files(struct cgroup_ops *ops)
+{
+	struct hierarchy *h;
+
+	h = ops->get_hierarchy(ops, "memory");
+	if (h && !is_unified_hierarchy(h))
+		h->has_kmem_slabinfo = faccessat(h->fd, "memory.kmem.slabinfo", F_OK, 0) == 0;
+
+	h = ops->get_hierarchy(ops, "cpuacct");
+	if (h && !is_unified_hierarchy(h))
+		h->has_cpuacct_usage_all = faccessat(h->fd, "cpuacct.usage_all", F_OK, 0) == 0;
+
+	h = ops->get_hierarchy(ops, "hugetlb");
+	if (h && !h->hugetlb_sizes)
+		probe_hugetlb_sizes(h);
+}
+
 static int cgfsng_get_memory_stats(struct cgroup_ops *ops, const char *cgroup,
 				   char **value)
 {
 	return cgfsng_get_memory(ops, cgroup, "memory.stat", value);
 }
 
+/* cgroup1 memory.stat, the hierarchical total_* counters. */
+static const char *const memory_stat_keys_legacy[MEMORY_STAT_MAX] = {
+	[MEMORY_STAT_HIERARCHICAL_MEMORY_LIMIT]	= "hierarchical_memory_limit",
+	[MEMORY_STAT_HIERARCHICAL_MEMSW_LIMIT]	= "hierarchical_memsw_limit",
+	[MEMORY_STAT_CACHE]			= "total_cache",
+	[MEMORY_STAT_RSS]			= "total_rss",
+	[MEMORY_STAT_RSS_HUGE]			= "total_rss_huge",
+	[MEMORY_STAT_SHMEM]			= "total_shmem",
+	[MEMORY_STAT_MAPPED_FILE]		= "total_mapped_file",
+	[MEMORY_STAT_DIRTY]			= "total_dirty",
+	[MEMORY_STAT_WRITEBACK]			= "total_writeback",
+	[MEMORY_STAT_SWAP]			= "total_swap",
+	[MEMORY_STAT_PGPGIN]			= "total_pgpgin",
+	[MEMORY_STAT_PGPGOUT]			= "total_pgpgout",
+	[MEMORY_STAT_PGFAULT]			= "total_pgfault",
+	[MEMORY_STAT_PGMAJFAULT]		= "total_pgmajfault",
+	[MEMORY_STAT_INACTIVE_ANON]		= "total_inactive_anon",
+	[MEMORY_STAT_ACTIVE_ANON]		= "total_active_anon",
+	[MEMORY_STAT_INACTIVE_FILE]		= "total_inactive_file",
+	[MEMORY_STAT_ACTIVE_FILE]		= "total_active_file",
+	[MEMORY_STAT_UNEVICTABLE]		= "total_unevictable",
+};
+
+/* cgroup2 memory.stat is hierarchical by default. */
+static const char *const memory_stat_keys_unified[MEMORY_STAT_MAX] = {
+	[MEMORY_STAT_CACHE]			= "file",
+	[MEMORY_STAT_SHMEM]			= "shmem",
+	[MEMORY_STAT_MAPPED_FILE]		= "file_mapped",
+	[MEMORY_STAT_PGFAULT]			= "pgfault",
+	[MEMORY_STAT_PGMAJFAULT]		= "pgmajfault",
+	[MEMORY_STAT_INACTIVE_ANON]		= "inactive_anon",
+	[MEMORY_STAT_ACTIVE_ANON]		= "active_anon",
+	[MEMORY_STAT_INACTIVE_FILE]		= "inactive_file",
+	[MEMORY_STAT_ACTIVE_FILE]		= "active_file",
+	[MEMORY_STAT_UNEVICTABLE]		= "unevictable",
+	[MEMORY_STAT_SLAB_RECLAIMABLE]		= "slab_reclaimable",
+	[MEMORY_STAT_SLAB_UNRECLAIMABLE]	= "slab_unreclaimable",
+	[MEMORY_STAT_KERNEL_STACK]		= "kernel_stack",
+	[MEMORY_STAT_SLAB]			= "slab",
+};
+
+static bool cgfsng_get_cpu_quota_legacy(struct cgroup_ops *ops, const char *cgroup,
+					int64_t *quota, int64_t *period)
+{
+	__do_free char *quota_str = NULL, *period_str = NULL;
+
+	if (!ops->get(ops, "cpu", cgroup, "cpu.cfs_quota_us", &quota_str))
+		return false;
+
+	if (!ops->get(ops, "cpu", cgroup, "cpu.cfs_period_us", &period_str))
+		return false;
+
+	return sscanf(quota_str, "%" PRId64, quota) == 1 &&
+	       sscanf(period_str, "%" PRId64, period) == 1;
+}
+
+/* "max" reads as no limit. */
+static bool readat_hugetlb(int cgroup_fd, const char *size, const char *suffix,
+			   uint64_t *value)
+{
+	__do_free char *str = NULL;
+	char file[64];
+	int ret;
+
+	ret = snprintf(file, sizeof(file), "hugetlb.%s.%s", size, suffix);
+	if (ret < 0 || (size_t)ret >= sizeof(file))
+		return false;
+
+	str = readat_file(cgroup_fd, file);
+	if (!str)
+		return false;
+
+	if (strcmp(str, "max") == 0) {
+		*value = UINT64_MAX;
+		return true;
+	}
+
+	return safe_uint64(str, value, 10) == 0;
+}
+
+/*
+ * The cgroup is opened and its ancestors walked once for all page sizes. Only
+ * the default size's limit and reservations are shown, so the other sizes
+ * just get their usage read.
+ */
+static bool cgfsng_get_hugetlb(struct cgroup_ops *ops, const char *cgroup,
+			       const char *limit_file, const char *usage_file,
+			       const char *rsvd_file, struct hugetlb_usage *usage)
+{
+	__do_close int cgroup_fd = -EBADF;
+	__do_free char *path = NULL;
+	const struct hugetlb_size *sizes;
+	struct hierarchy *h;
+
+	h = ops->get_hierarchy(ops, "hugetlb");
+	if (!h || !h->nr_hugetlb_sizes)
+		return false;
+	sizes = h->hugetlb_sizes;
+
+	path = must_make_path_relative(cgroup, NULL);
+	cgroup_fd = openat_safe(h->fd, path);
+	if (cgroup_fd < 0)
+		return false;
+
+	for (int i = 0; i < h->nr_hugetlb_sizes; i++) {
+		usage[i].limit = UINT64_MAX;
+		usage[i].rsvd = 0;
+		if (!readat_hugetlb(cgroup_fd, sizes[i].name, usage_file, &usage[i].usage)) {
+			if (i == 0)
+				return false;
+			usage[i].usage = 0;
+		}
+	}
+
+	/* Reservation accounting is newer, it's fine without. */
+	if (!readat_hugetlb(cgroup_fd, sizes[0].name, rsvd_file, &usage[0].rsvd))
+		usage[0].rsvd = 0;
+
+	/* Limits of all ancestors apply, the smallest one wins. */
+	for (;;) {
+		uint64_t val;
+		int fd;
+
+		if (readat_hugetlb(cgroup_fd, sizes[0].name, limit_file, &val) &&
+		    val < usage[0].limit)
+			usage[0].limit = val;
+
+		fd = openat_safe(cgroup_fd, "../");
+		if (fd < 0)
+			break;
+
+		if (!is_cgroup_fd(fd)) {
+			close(fd);
+			break;
+		}
+
+		close_prot_errno_replace(cgroup_fd, fd);
+	}
+
+	return true;
+}
+
+static bool cgfsng_get_hugetlb_legacy(struct cgroup_ops *ops, const char *cgroup,
+				      struct hugetlb_usage *usage)
+{
+	return cgfsng_get_hugetlb(ops, cgroup, "limit_in_bytes",
+				  "usage_in_bytes", "rsvd.usage_in_bytes",
+				  usage);
+}
+
+static bool cgfsng_get_hugetlb_unified(struct cgroup_ops *ops, const char *cgroup,
+				       struct hugetlb_usage *usage)
+{
+	return cgfsng_get_hugetlb(ops, cgroup, "max", "current", "rsvd.current",
+				  usage);
+}
+
+/* Both are in cpu.max, a quota of "max" means there is none. */
+static bool cgfsng_get_cpu_quota_unified(struct cgroup_ops *ops, const char *cgroup,
+					 int64_t *quota, int64_t *period)
+{
+	__do_free char *str = NULL;
+
+	if (!ops->get(ops, "cpu", cgroup, "cpu.max", &str))
+		return false;
+
+	return sscanf(str, "%" PRId64 " %" PRId64, quota, period) == 2;
+}
+
 static char *readat_cpuset(int cgroup_fd)
 {
 	__do_free char *val = NULL;
@@ -997,6 +1251,7 @@ static int cg_init(struct cgroup_ops *ops)
 struct cgroup_ops *cgfsng_ops_init(void)
 {
 	__do_free struct cgroup_ops *cgfsng_ops = NULL;
+	struct hierarchy *h;
 
 	cgfsng_ops = zalloc(sizeof(struct cgroup_ops));
 	if (!cgfsng_ops)
@@ -1009,6 +1264,28 @@ struct cgroup_ops *cgfsng_ops_init(void)
 	if (cg_init(cgfsng_ops))
 		return NULL;
 
+	/*
+	 * Hybrid layouts mix both so bind what each controller's hierarchy
+	 * needs, hot paths don't look at the layout again.
+	 */
+	h = cgfsng_get_hierarchy(cgfsng_ops, "memory");
+	if (h && is_unified_hierarchy(h))
+		cgfsng_ops->memory_stat_keys = memory_stat_keys_unified;
+	else
+		cgfsng_ops->memory_stat_keys = memory_stat_keys_legacy;
+
+	h = cgfsng_get_hierarchy(cgfsng_ops, "cpu");
+	if (h && is_unified_hierarchy(h))
+		cgfsng_ops->get_cpu_quota = cgfsng_get_cpu_quota_unified;
+	else
+		cgfsng_ops->get_cpu_quota = cgfsng_get_cpu_quota_legacy;
+
+	h = cgfsng_get_hierarchy(cgfsng_ops, "hugetlb");
+	if (h && is_unified_hierarchy(h))
+		cgfsng_ops->get_hugetlb = cgfsng_get_hugetlb_unified;
+	else
+		cgfsng_ops->get_hugetlb = cgfsng_get_hugetlb_legacy;
+
 	cgfsng_ops->num_hierarchies = cgfsng_num_hierarchies;
 	cgfsng_ops->get = cgfsng_get;
 	cgfsng_ops->get_hierarchies = cgfsng_get_hierarchies;
@@ -1027,6 +1304,7 @@ struct cgroup_ops *cgfsng_ops_init(void)
 	cgfsng_ops->get_memory_swap_current = cgfsng_get_memory_swap_current;
 	cgfsng_ops->get_memory_slabinfo_fd = cgfsng_get_memory_slabinfo_fd;
 	cgfsng_ops->can_use_swap = cgfsng_can_use_swap;
+	cgfsng_ops->probe_files = cgfsng_probe_files;
 
 	/* cpuset */
 	cgfsng_ops->get_cpuset_cpus = cgfsng_get_cpuset_cpus;
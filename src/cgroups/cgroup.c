@@ -28,6 +28,7 @@
 
 #include "../macro.h"
 #include "../memory_utils.h"
+#include "../watchdog.h"
 #include "cgroup.h"
 #include "cgroup_utils.h"
 #include "cgroup2_devices.h"
@@ -61,6 +62,7 @@ void cgroup_exit(struct cgroup_ops *ops)
 
 		free((*it)->mountpoint);
 		free((*it)->base_path);
+		free((*it)->hugetlb_sizes);
 		free(*it);
 	}
 
@@ -97,10 +99,17 @@ void prune_init_scope(char *cg)
 	}
 }
 
+uint64_t get_cgroup_id(const char *controller, const char *cgroup)
+{
+	return cgroup_id_at(get_cgroup_fd(controller), cgroup);
+}
+
 char *get_pid_cgroup(pid_t pid, const char *contrl)
 {
 	int cfd;
 
+	request_stage(REQUEST_STAGE_CGROUP);
+
 	cfd = get_cgroup_fd(contrl);
 	if (cfd < 0)
 		return NULL;
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "../config.h"
@@ -31,6 +32,20 @@ typedef enum {
         CGROUP_LAYOUT_UNIFIED =  2,
 } cgroup_layout_t;
 
+/* A huge page size the host supports. */
+struct hugetlb_size {
+	/* As in hugetlb.<name>.* files, e.g. "2MB". */
+	char name[16];
+	uint64_t bytes;
+};
+
+/* Counters of one huge page size, in bytes. */
+struct hugetlb_usage {
+	uint64_t limit;		/* UINT64_MAX if there is none. */
+	uint64_t usage;
+	uint64_t rsvd;
+};
+
 /* A descriptor for a mounted hierarchy
  *
  * @controllers
@@ -81,9 +96,49 @@ struct hierarchy {
 
 	/* cgroup2 only */
 	unsigned int bpf_device_controller:1;
+
+	/* legacy only, optional files probed once by probe_files() */
+	unsigned int has_kmem_slabinfo:1;
+	unsigned int has_cpuacct_usage_all:1;
+
+	/* hugetlb only, page sizes probed once by probe_files(), default first */
+	struct hugetlb_size *hugetlb_sizes;
+	int nr_hugetlb_sizes;
+
 	int fd;
 };
 
+/*
+ * memory.stat entries lxcfs reads. cgroup1 and cgroup2 name them differently
+ * so the driver binds the names for the memory hierarchy once at init.
+ */
+enum cgroup_memory_stat {
+	MEMORY_STAT_HIERARCHICAL_MEMORY_LIMIT,
+	MEMORY_STAT_HIERARCHICAL_MEMSW_LIMIT,
+	MEMORY_STAT_CACHE,
+	MEMORY_STAT_RSS,
+	MEMORY_STAT_RSS_HUGE,
+	MEMORY_STAT_SHMEM,
+	MEMORY_STAT_MAPPED_FILE,
+	MEMORY_STAT_DIRTY,
+	MEMORY_STAT_WRITEBACK,
+	MEMORY_STAT_SWAP,
+	MEMORY_STAT_PGPGIN,
+	MEMORY_STAT_PGPGOUT,
+	MEMORY_STAT_PGFAULT,
+	MEMORY_STAT_PGMAJFAULT,
+	MEMORY_STAT_INACTIVE_ANON,
+	MEMORY_STAT_ACTIVE_ANON,
+	MEMORY_STAT_INACTIVE_FILE,
+	MEMORY_STAT_ACTIVE_FILE,
+	MEMORY_STAT_UNEVICTABLE,
+	MEMORY_STAT_SLAB_RECLAIMABLE,
+	MEMORY_STAT_SLAB_UNRECLAIMABLE,
+	MEMORY_STAT_KERNEL_STACK,
+	MEMORY_STAT_SLAB,
+	MEMORY_STAT_MAX,
+};
+
 struct cgroup_ops {
 	/*
 	 * File descriptor of the mount namespace the cgroup hierarchies are
@@ -158,6 +213,22 @@ struct cgroup_ops {
 	int (*get_memory_slabinfo_fd)(struct cgroup_ops *ops,
 				      const char *cgroup);
 	bool (*can_use_swap)(struct cgroup_ops *ops);
+	/* Names in memory.stat, NULL for entries the hierarchy lacks. */
+	const char *const *memory_stat_keys;
+	/* Record which optional interface files the kernel provides. */
+	void (*probe_files)(struct cgroup_ops *ops);
+
+	/*
+	 * hugetlb, one entry in @usage for each of the hierarchy's
+	 * hugetlb_sizes. Only the default size gets its limit and
+	 * reservations read.
+	 */
+	bool (*get_hugetlb)(struct cgroup_ops *ops, const char *cgroup,
+			    struct hugetlb_usage *usage);
+
+	/* cpu */
+	bool (*get_cpu_quota)(struct cgroup_ops *ops, const char *cgroup,
+			      int64_t *quota, int64_t *period);
 
 	/* cpuset */
 	int (*get_cpuset_cpus)(struct cgroup_ops *ops, const char *cgroup,
@@ -217,6 +288,9 @@ static inline int get_cgroup_fd(const char *controller)
 	return h ? h->fd : -EBADF;
 }
 
+/* Kernel id of @cgroup in @controller's hierarchy, 0 if unknown. */
+extern uint64_t get_cgroup_id(const char *controller, const char *cgroup);
+
 extern char *get_pid_cgroup(pid_t pid, const char *contrl);
 
 extern char *get_cpuset(const char *cg);
@@ -20,6 +20,7 @@
 
 #include "../macro.h"
 #include "../memory_utils.h"
+#include "../watchdog.h"
 #include "cgroup.h"
 #include "cgroup_utils.h"
 
@@ -67,6 +68,39 @@ int unified_cgroup_hierarchy(void)
 	return 0;
 }
 
+uint64_t cgroup_id_at(int hierarchy_fd, const char *cgroup)
+{
+	__do_free char *path = NULL;
+	struct {
+		struct file_handle fh;
+		uint64_t id;
+	} handle = {
+		.fh.handle_bytes = sizeof(uint64_t),
+	};
+	int mnt_id;
+
+	if (hierarchy_fd < 0)
+		return 0;
+
+	path = must_make_path_relative(cgroup, NULL);
+
+	/* cgroupfs is kernfs, its file handle is the cgroup id. */
+	if (name_to_handle_at(hierarchy_fd, path, &handle.fh, &mnt_id, 0) == 0 &&
+	    handle.fh.handle_bytes == sizeof(uint64_t)) {
+		uint64_t id;
+
+		memcpy(&id, handle.fh.f_handle, sizeof(id));
+		return id;
+	}
+
+	/*
+	 * No file handles for cgroupfs. The inode number isn't a substitute,
+	 * kernfs hands out freed inode numbers again so a recreated cgroup
+	 * could look like the old one.
+	 */
+	return 0;
+}
+
 bool is_cgroup_fd(int fd)
 {
 
@@ -675,6 +709,8 @@ char *readat_file(int dirfd, const char *path)
 	size_t len = 0, fulllen = 0;
 	ssize_t linelen;
 
+	request_stage(REQUEST_STAGE_CGROUP_IO);
+
 	fd = openat(dirfd, path, O_NOFOLLOW | O_RDONLY | O_CLOEXEC);
 	if (fd < 0)
 		return NULL;
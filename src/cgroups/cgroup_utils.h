@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -90,6 +91,14 @@ extern char *cg_legacy_get_current_cgroup(pid_t pid, const char *controller);
 extern bool mkdir_p(const char *dir, mode_t mode);
 extern bool is_cgroup_fd(int fd);
 
+/*
+ * The kernel's 64 bit id of @cgroup below @hierarchy_fd. A cgroup that is
+ * removed and created again gets a new id. Returns 0 if it can't be resolved,
+ * always on kernels that can't export cgroupfs file handles, so callers can't
+ * tell recreated cgroups apart there.
+ */
+extern uint64_t cgroup_id_at(int hierarchy_fd, const char *cgroup);
+
 static inline int openat_safe(int fd, const char *path)
 {
 	return openat(fd, path, O_DIRECTORY | O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
@@ -0,0 +1,307 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/netlink.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/sysinfo.h>
+
+#if HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include <fuse.h>
+#endif
+
+#include "cpu_topology.h"
+
+#include "bindings.h"
+#include "cgroups/cgroup_utils.h"
+#include "memory_utils.h"
+#include "utils.h"
+
+/* Without a uevent listener re-read the topology at most this often. */
+#define TOPOLOGY_POLL_SECS 1
+#define UEVENT_BUFSIZE 8192
+
+struct cpu_topology {
+	cpu_set_t online;
+	cpu_set_t possible;
+	int nr_online;
+	int nr_possible;
+	/* One more than the highest possible CPU. */
+	int possible_end;
+	long clock_ticks;
+	/* Last refresh, only used when there is no uevent listener. */
+	int64_t refreshed;
+};
+
+static struct cpu_topology topology;
+static pthread_rwlock_t topology_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+static bool listening;
+static pthread_t listener;
+static int uevent_fd = -EBADF;
+static int stop_fd = -EBADF;
+
+/*
+ * Parse a cpu list such as "0-3,8" into @set. Returns one more than the
+ * highest cpu in it, cpus beyond CPU_SETSIZE only count towards that.
+ */
+static int cpu_list_parse(const char *list, cpu_set_t *set)
+{
+	int end = 0;
+
+	CPU_ZERO(set);
+	for (const char *c = list; c && *c;) {
+		int a, b, ret;
+
+		ret = sscanf(c, "%d-%d", &a, &b);
+		if (ret == 1)
+			b = a;
+		if (ret >= 1 && a >= 0) {
+			for (int cpu = a; cpu <= b && cpu < CPU_SETSIZE; cpu++)
+				CPU_SET(cpu, set);
+			if (b + 1 > end)
+				end = b + 1;
+		}
+
+		c = strchr(c, ',');
+		if (c)
+			c++;
+	}
+
+	return end;
+}
+
+/* Without sysfs all cpus up to @nr are assumed to be there. */
+static void cpu_set_fill(cpu_set_t *set, int nr)
+{
+	CPU_ZERO(set);
+	for (int cpu = 0; cpu < nr && cpu < CPU_SETSIZE; cpu++)
+		CPU_SET(cpu, set);
+}
+
+static void topology_refresh(void)
+{
+	__do_free char *online = NULL, *possible = NULL;
+	struct cpu_topology t = {
+		.refreshed = time(NULL),
+	};
+
+	online = read_file_strip_newline("/sys/devices/system/cpu/online");
+	if (!online || cpu_list_parse(online, &t.online) <= 0)
+		cpu_set_fill(&t.online, get_nprocs());
+	t.nr_online = CPU_COUNT(&t.online);
+
+	possible = read_file_strip_newline("/sys/devices/system/cpu/possible");
+	if (possible)
+		t.possible_end = cpu_list_parse(possible, &t.possible);
+	if (t.possible_end <= 0) {
+		t.possible_end = get_nprocs_conf();
+		cpu_set_fill(&t.possible, t.possible_end);
+	}
+	t.nr_possible = CPU_COUNT(&t.possible);
+
+	t.clock_ticks = sysconf(_SC_CLK_TCK);
+
+	pthread_rwlock_wrlock(&topology_lock);
+	topology = t;
+	pthread_rwlock_unlock(&topology_lock);
+
+	lxcfs_debug("Host topology: %d online, %d possible CPUs", t.nr_online, t.nr_possible);
+}
+
+/* Whether a uevent is about a CPU going on- or offline. */
+static bool uevent_is_cpu_hotplug(const char *buf, size_t len)
+{
+	bool cpu = false, hotplug = false;
+
+	/* "action@devpath" followed by NUL separated KEY=VALUE pairs. */
+	for (size_t off = 0; off < len; off += strlen(buf + off) + 1) {
+		const char *key = buf + off;
+
+		if (strcmp(key, "SUBSYSTEM=cpu") == 0)
+			cpu = true;
+		else if (strcmp(key, "ACTION=online") == 0 ||
+			 strcmp(key, "ACTION=offline") == 0 ||
+			 strcmp(key, "ACTION=add") == 0 ||
+			 strcmp(key, "ACTION=remove") == 0)
+			hotplug = true;
+	}
+
+	return cpu && hotplug;
+}
+
+static void *uevent_listen(void *arg)
+{
+	char buf[UEVENT_BUFSIZE];
+
+	lxcfs_background_thread_setup(arg);
+
+	for (;;) {
+		struct pollfd fds[] = {
+			{ .fd = uevent_fd,	.events = POLLIN },
+			{ .fd = stop_fd,	.events = POLLIN },
+		};
+		ssize_t len;
+
+		if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		len = recv(uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len <= 0) {
+			/* We missed events, assume the topology changed. */
+			if (len < 0 && errno == ENOBUFS)
+				topology_refresh();
+			continue;
+		}
+		buf[len] = '\0';
+
+		if (uevent_is_cpu_hotplug(buf, len))
+			topology_refresh();
+	}
+
+	return NULL;
+}
+
+static int uevent_listener_start(const struct lxcfs_opts *opts)
+{
+	__do_close int fd = -EBADF, efd = -EBADF;
+	struct sockaddr_nl addr = {
+		.nl_family	= AF_NETLINK,
+		.nl_groups	= 1, /* kernel uevents */
+	};
+	int ret;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return log_error_errno(-1, errno, "%s - Failed to create uevent socket", strerror(errno));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		return log_error_errno(-1, errno, "%s - Failed to bind uevent socket", strerror(errno));
+
+	efd = eventfd(0, EFD_CLOEXEC);
+	if (efd < 0)
+		return log_error_errno(-1, errno, "%s - Failed to create eventfd", strerror(errno));
+
+	uevent_fd = move_fd(fd);
+	stop_fd = move_fd(efd);
+	ret = pthread_create(&listener, NULL, uevent_listen, (void *)opts);
+	if (ret) {
+		close_prot_errno_disarm(uevent_fd);
+		close_prot_errno_disarm(stop_fd);
+		return log_error_errno(-1, ret, "Failed to create uevent listener thread");
+	}
+
+	return 0;
+}
+
+static void topology_init(void)
+{
+	struct fuse_context *fc = fuse_get_context();
+
+	topology_refresh();
+	listening = uevent_listener_start(fc ? fc->private_data : NULL) == 0;
+	if (!listening)
+		lxcfs_info("Re-reading CPU topology every %ds", TOPOLOGY_POLL_SECS);
+}
+
+static struct cpu_topology topology_get(void)
+{
+	struct cpu_topology t;
+
+	pthread_once(&topology_once, topology_init);
+
+	pthread_rwlock_rdlock(&topology_lock);
+	t = topology;
+	pthread_rwlock_unlock(&topology_lock);
+
+	if (!listening && (time(NULL) - t.refreshed) >= TOPOLOGY_POLL_SECS) {
+		topology_refresh();
+
+		pthread_rwlock_rdlock(&topology_lock);
+		t = topology;
+		pthread_rwlock_unlock(&topology_lock);
+	}
+
+	return t;
+}
+
+int host_cpus_online(void)
+{
+	return topology_get().nr_online;
+}
+
+int host_cpus_possible(void)
+{
+	return topology_get().possible_end;
+}
+
+int host_cpus_nr_possible(void)
+{
+	return topology_get().nr_possible;
+}
+
+bool host_cpu_online(int cpu)
+{
+	struct cpu_topology t = topology_get();
+
+	return cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &t.online);
+}
+
+int host_cpus_possible_ids(int *ids, int nr)
+{
+	struct cpu_topology t = topology_get();
+	int n = 0;
+
+	for (int cpu = 0; cpu < t.possible_end && cpu < CPU_SETSIZE && n < nr; cpu++)
+		if (CPU_ISSET(cpu, &t.possible))
+			ids[n++] = cpu;
+
+	return n;
+}
+
+long host_clock_ticks(void)
+{
+	return topology_get().clock_ticks;
+}
+
+void cpu_topology_exit(void)
+{
+	uint64_t val = 1;
+
+	if (!listening)
+		return;
+
+	if (write(stop_fd, &val, sizeof(val)) != sizeof(val))
+		lxcfs_error("%s - Failed to stop uevent listener", strerror(errno));
+	else
+		pthread_join(listener, NULL);
+
+	close_prot_errno_disarm(uevent_fd);
+	close_prot_errno_disarm(stop_fd);
+	listening = false;
+}
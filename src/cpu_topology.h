@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_CPU_TOPOLOGY_H
+#define __LXCFS_CPU_TOPOLOGY_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "macro.h"
+
+/*
+ * Host CPU topology. It is read once and refreshed when the kernel reports a
+ * CPU hotplug uevent, so renderers don't need to parse sysfs on every read.
+ */
+
+/* Number of online CPUs, replaces get_nprocs(). */
+extern int host_cpus_online(void);
+
+/*
+ * One more than the highest possible CPU number, replaces get_nprocs_conf()
+ * when sizing per-CPU arrays indexed by CPU number.
+ */
+extern int host_cpus_possible(void);
+
+/* Number of possible CPUs, which may have holes in their numbering. */
+extern int host_cpus_nr_possible(void);
+
+extern bool host_cpu_online(int cpu);
+
+/*
+ * Store the numbers of the first @nr possible CPUs in ascending order in
+ * @ids, the order the kernel lays out per-CPU values in. Returns how many
+ * were stored.
+ */
+extern int host_cpus_possible_ids(int *ids, int nr);
+
+/* Clock ticks per second, replaces sysconf(_SC_CLK_TCK). */
+extern long host_clock_ticks(void);
+
+extern void cpu_topology_exit(void);
+
+#endif /* __LXCFS_CPU_TOPOLOGY_H */
@@ -0,0 +1,388 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "file_info_pool.h"
+
+#include "bindings.h"
+#include "memory_utils.h"
+#include "syscall_numbers.h"
+#include "utils.h"
+
+/* Objects kept per size class and thread. */
+#define FILE_INFO_POOL_DEPTH 8
+/* Upper bound on buffer memory parked in a single thread's pool. */
+#define FILE_INFO_POOL_MAX_BYTES (1024 * 1024)
+/* The high-water mark covers renders of the last two of these windows. */
+#define FILE_INFO_HWM_WINDOW 60
+
+static const size_t buf_class_size[] = {
+	4096,
+	16384,
+	65536,
+	262144,
+	1048576,
+};
+#define NR_BUF_CLASSES (sizeof(buf_class_size) / sizeof(*buf_class_size))
+
+struct file_info_pool {
+	struct file_info *infos[FILE_INFO_POOL_DEPTH];
+	int nr_infos;
+	char *bufs[NR_BUF_CLASSES][FILE_INFO_POOL_DEPTH];
+	int nr_bufs[NR_BUF_CLASSES];
+	size_t bytes;
+	/* NUMA node of the owning thread when the pool was created. */
+	int numa_node;
+	struct file_info_pool *next;
+};
+
+/*
+ * Largest render of a file type in the window starting at @window and in the
+ * one before it, so the mark shrinks once big renders stop.
+ */
+struct file_info_hwm {
+	size_t size;
+	size_t prev;
+	int64_t window;
+};
+
+static struct file_info_hwm hwm[LXC_TYPE_MAX];
+static pthread_mutex_t hwm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t pool_key;
+static pthread_once_t pool_key_once = PTHREAD_ONCE_INIT;
+static bool pool_key_valid;
+
+/* All per-thread pools so they can be released when liblxcfs is unloaded. */
+static struct file_info_pool *pools;
+static pthread_mutex_t pools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void pool_destroy(struct file_info_pool *pool)
+{
+	for (int i = 0; i < pool->nr_infos; i++)
+		free(pool->infos[i]);
+
+	for (size_t c = 0; c < NR_BUF_CLASSES; c++)
+		for (int i = 0; i < pool->nr_bufs[c]; i++)
+			free(pool->bufs[c][i]);
+
+	free(pool);
+}
+
+/* Called on thread exit. */
+static void pool_release(void *data)
+{
+	struct file_info_pool *pool = data;
+	bool found = false;
+
+	pthread_mutex_lock(&pools_mutex);
+	for (struct file_info_pool **it = &pools; *it; it = &(*it)->next) {
+		if (*it == pool) {
+			*it = pool->next;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pools_mutex);
+
+	/* Already freed by file_info_pool_exit(). */
+	if (found)
+		pool_destroy(pool);
+}
+
+static void pool_key_init(void)
+{
+	pool_key_valid = pthread_key_create(&pool_key, pool_release) == 0;
+}
+
+static int current_numa_node(void)
+{
+#ifdef __NR_getcpu
+	unsigned int node;
+
+	if (syscall(__NR_getcpu, NULL, &node, NULL) == 0)
+		return node;
+#endif
+	return -1;
+}
+
+static struct file_info_pool *get_pool(void)
+{
+	struct file_info_pool *pool;
+
+	pthread_once(&pool_key_once, pool_key_init);
+	if (!pool_key_valid)
+		return NULL;
+
+	pool = pthread_getspecific(pool_key);
+	if (pool)
+		return pool;
+
+	pool = zalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->numa_node = current_numa_node();
+
+	if (pthread_setspecific(pool_key, pool)) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&pools_mutex);
+	pool->next = pools;
+	pools = pool;
+	pthread_mutex_unlock(&pools_mutex);
+
+	return pool;
+}
+
+static size_t get_file_size(const char *path)
+{
+	__do_fclose FILE *f = NULL;
+	__do_free char *line = NULL;
+	size_t len = 0;
+	ssize_t sz, answer = 0;
+
+	f = fopen(path, "re");
+	if (!f)
+		return 0;
+
+	while ((sz = getline(&line, &len, f)) != -1)
+		answer += sz;
+
+	return answer;
+}
+
+/* Must be called under hwm_mutex */
+static void file_info_hwm_rotate(struct file_info_hwm *h, int64_t now)
+{
+	int64_t elapsed = now - h->window;
+
+	if (elapsed < FILE_INFO_HWM_WINDOW)
+		return;
+
+	h->prev = elapsed < 2 * FILE_INFO_HWM_WINDOW ? h->size : 0;
+	h->size = 0;
+	h->window = now;
+}
+
+static size_t file_info_bufsize(int type, const char *path)
+{
+	int64_t now = time(NULL);
+	size_t size;
+
+	if (type < 0 || type >= LXC_TYPE_MAX)
+		return get_file_size(path) + BUF_RESERVE_SIZE;
+
+	pthread_mutex_lock(&hwm_mutex);
+	file_info_hwm_rotate(&hwm[type], now);
+	size = MAX(hwm[type].size, hwm[type].prev);
+	pthread_mutex_unlock(&hwm_mutex);
+	if (size)
+		return size + BUF_RESERVE_SIZE;
+
+	/* Nothing rendered lately, the host's file is as good a guess as any. */
+	size = get_file_size(path);
+
+	pthread_mutex_lock(&hwm_mutex);
+	if (size > hwm[type].size)
+		hwm[type].size = size;
+	pthread_mutex_unlock(&hwm_mutex);
+
+	return size + BUF_RESERVE_SIZE;
+}
+
+static void file_info_hwm_update(int type, size_t size)
+{
+	if (type < 0 || type >= LXC_TYPE_MAX)
+		return;
+
+	pthread_mutex_lock(&hwm_mutex);
+	file_info_hwm_rotate(&hwm[type], time(NULL));
+	if (size > hwm[type].size)
+		hwm[type].size = size;
+	pthread_mutex_unlock(&hwm_mutex);
+}
+
+/* Smallest class that fits @size or -1 if it's too large to pool. */
+static int buf_class(size_t size)
+{
+	for (size_t c = 0; c < NR_BUF_CLASSES; c++)
+		if (size <= buf_class_size[c])
+			return c;
+
+	return -1;
+}
+
+/* Class of a buffer of exactly @buflen bytes or -1 if it wasn't pooled. */
+static int buf_class_exact(int buflen)
+{
+	for (size_t c = 0; c < NR_BUF_CLASSES; c++)
+		if ((size_t)buflen == buf_class_size[c])
+			return c;
+
+	return -1;
+}
+
+static char *pool_get_buf(struct file_info_pool *pool, int type,
+			  const char *path, size_t *buflen)
+{
+	size_t size;
+	char *buf;
+	int c;
+
+	size = file_info_bufsize(type, path);
+	c = buf_class(size);
+	if (c >= 0) {
+		size = buf_class_size[c];
+		if (pool && pool->nr_bufs[c] > 0) {
+			buf = pool->bufs[c][--pool->nr_bufs[c]];
+			pool->bytes -= size;
+		} else {
+			buf = malloc(size);
+		}
+	} else {
+		buf = malloc(size);
+	}
+	if (!buf)
+		return NULL;
+
+	buf[0] = '\0';
+	*buflen = size;
+	return buf;
+}
+
+static void pool_put_buf(struct file_info_pool *pool, struct file_info *f)
+{
+	int c;
+
+	/* cgroup file_info structs don't initialize the render fields. */
+	if (f->buf && f->cached && f->size > 0)
+		file_info_hwm_update(f->type, f->size);
+
+	/*
+	 * Buffers are first touched by the opening thread. Only keep them
+	 * if this thread lives on the same node, otherwise it would be
+	 * handed remote memory on its next open.
+	 */
+	c = buf_class_exact(f->buflen);
+	if (f->buf && pool && c >= 0 && f->numa_node == pool->numa_node &&
+	    pool->nr_bufs[c] < FILE_INFO_POOL_DEPTH &&
+	    (pool->bytes + buf_class_size[c]) <= FILE_INFO_POOL_MAX_BYTES) {
+		pool->bufs[c][pool->nr_bufs[c]++] = move_ptr(f->buf);
+		pool->bytes += buf_class_size[c];
+	} else {
+		free_disarm(f->buf);
+	}
+}
+
+struct file_info *file_info_new(int type, const char *path)
+{
+	__do_free struct file_info *info = NULL;
+	struct file_info_pool *pool;
+	size_t size;
+
+	pool = get_pool();
+
+	if (pool && pool->nr_infos > 0)
+		info = pool->infos[--pool->nr_infos];
+	else
+		info = malloc(sizeof(*info));
+	if (!info)
+		return NULL;
+	memset(info, 0, sizeof(*info));
+
+	info->buf = pool_get_buf(pool, type, path, &size);
+	if (!info->buf)
+		return NULL;
+
+	info->numa_node = pool ? pool->numa_node : -1;
+	info->type = type;
+	info->buflen = size;
+	/* set actual size to buffer size */
+	info->size = info->buflen;
+
+	return move_ptr(info);
+}
+
+int file_info_get_buf(struct file_info *f, const char *path)
+{
+	struct file_info_pool *pool;
+	size_t size;
+
+	if (f->buf)
+		return 0;
+
+	pool = get_pool();
+	f->buf = pool_get_buf(pool, f->type, path, &size);
+	if (!f->buf)
+		return -ENOMEM;
+
+	f->numa_node = pool ? pool->numa_node : -1;
+	f->buflen = size;
+	f->size = f->buflen;
+	f->cached = 0;
+
+	return 0;
+}
+
+void file_info_put_buf(struct file_info *f)
+{
+	pool_put_buf(get_pool(), f);
+	f->buflen = 0;
+	f->size = 0;
+	f->cached = 0;
+}
+
+void file_info_free(struct file_info *f)
+{
+	struct file_info_pool *pool;
+
+	if (!f)
+		return;
+
+	pool = get_pool();
+	pool_put_buf(pool, f);
+
+	if (pool && pool->nr_infos < FILE_INFO_POOL_DEPTH)
+		pool->infos[pool->nr_infos++] = f;
+	else
+		free(f);
+}
+
+void file_info_pool_exit(void)
+{
+	struct file_info_pool *pool;
+
+	pthread_mutex_lock(&pools_mutex);
+	pool = pools;
+	pools = NULL;
+	pthread_mutex_unlock(&pools_mutex);
+
+	while (pool) {
+		struct file_info_pool *next = pool->next;
+
+		pool_destroy(pool);
+		pool = next;
+	}
+
+	if (pool_key_valid) {
+		pthread_key_delete(pool_key);
+		pool_key_valid = false;
+	}
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_FILE_INFO_POOL_H
+#define __LXCFS_FILE_INFO_POOL_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "macro.h"
+
+struct file_info;
+
+/*
+ * Allocate a zeroed file_info of @type with a render buffer. Both come from
+ * a per-thread pool and the buffer is sized from the largest recent render
+ * of @type. The host's @path is only read when there was none.
+ */
+extern struct file_info *file_info_new(int type, const char *path);
+
+/* Return @f and its render buffer to the calling thread's pool. */
+extern void file_info_free(struct file_info *f);
+
+/*
+ * Return only the render buffer of @f to the pool, for files whose contents
+ * are kept elsewhere between reads. file_info_get_buf() hands @f a new one.
+ */
+extern void file_info_put_buf(struct file_info *f);
+extern int file_info_get_buf(struct file_info *f, const char *path);
+
+extern void file_info_pool_exit(void);
+
+#endif /* __LXCFS_FILE_INFO_POOL_H */
@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdbool.h>
@@ -26,6 +27,9 @@
 #include <sys/epoll.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
 #include <linux/limits.h>
 
 #if HAVE_FUSE3
@@ -38,6 +42,7 @@
 #include "lxcfs_fuse_compat.h"
 #include "macro.h"
 #include "memory_utils.h"
+#include "trace.h"
 
 void *dlopen_handle;
 
@@ -45,6 +50,8 @@ void *dlopen_handle;
 
 static int users_count;
 static pthread_mutex_t user_count_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when users_count drops to 0, under user_count_mutex. */
+static pthread_cond_t users_idle = PTHREAD_COND_INITIALIZER;
 static void lock_mutex(pthread_mutex_t *l)
 {
 	int ret;
@@ -74,12 +81,52 @@ static inline void users_unlock(void)
 }
 
 static pthread_t loadavg_pid = 0;
+static bool prewarm_on = false;
+static bool bpf_cpuacct_on = false;
+static bool watchdog_on = false;
+static struct lxcfs_opts *opts;
+
+/* Exported to liblxcfs, see bindings.h. */
+__visible struct lxcfs_handoff lxcfs_handoff = {
+	.version	= 1,
+	.bpf_map_fd	= -EBADF,
+	.bpf_link_fd	= -EBADF,
+	.mntns_fd	= -EBADF,
+};
+
+/* Close what the outgoing liblxcfs left behind and the new one didn't take. */
+static void handoff_close(void)
+{
+	struct lxcfs_handoff *h = &lxcfs_handoff;
+
+	close_prot_errno_disarm(h->bpf_map_fd);
+	close_prot_errno_disarm(h->bpf_link_fd);
+	close_prot_errno_disarm(h->mntns_fd);
+	for (int i = 0; i < h->nr_hierarchies; i++) {
+		close_prot_errno_disarm(h->hierarchies[i].fd);
+		free_disarm(h->hierarchies[i].mountpoint);
+	}
+	h->nr_hierarchies = 0;
+}
 
 /* Returns zero on success */
 static int start_loadavg(void)
 {
 	char *error;
 	pthread_t (*__load_daemon)(int);
+	pthread_t (*__load_daemon_v2)(int, const struct lxcfs_opts *);
+
+	/* Older liblxcfs versions can't place the loadavg thread. */
+	dlerror();
+	__load_daemon_v2 = (pthread_t(*)(int, const struct lxcfs_opts *))dlsym(dlopen_handle, "load_daemon_v2");
+	error = dlerror();
+	if (!error) {
+		loadavg_pid = __load_daemon_v2(1, opts);
+		if (!loadavg_pid)
+			return -1;
+
+		return 0;
+	}
 
 	dlerror();
 	__load_daemon = (pthread_t(*)(int))dlsym(dlopen_handle, "load_daemon");
@@ -111,6 +158,63 @@ static int stop_loadavg(void)
 	return 0;
 }
 
+/* Returns zero on success */
+static int start_prewarm(void)
+{
+	char *error;
+	int (*__prewarm_start)(const struct lxcfs_opts *);
+
+	dlerror();
+	__prewarm_start = (int (*)(const struct lxcfs_opts *))dlsym(dlopen_handle, "prewarm_start");
+	error = dlerror();
+	if (error)
+		return log_error(-1, "%s - Failed to start pre-warming", error);
+
+	if (__prewarm_start(opts))
+		return -1;
+
+	prewarm_on = true;
+	return 0;
+}
+
+/* Returns zero on success */
+static int start_bpf_cpuacct(void)
+{
+	char *error;
+	int (*__bpf_cpuacct_start)(const struct lxcfs_opts *);
+
+	dlerror();
+	__bpf_cpuacct_start = (int (*)(const struct lxcfs_opts *))dlsym(dlopen_handle, "bpf_cpuacct_start");
+	error = dlerror();
+	if (error)
+		return log_error(-1, "%s - Failed to start BPF cpu accounting", error);
+
+	if (__bpf_cpuacct_start(opts))
+		return -1;
+
+	bpf_cpuacct_on = true;
+	return 0;
+}
+
+/* Returns zero on success */
+static int start_watchdog(void)
+{
+	char *error;
+	int (*__watchdog_start)(const struct lxcfs_opts *);
+
+	dlerror();
+	__watchdog_start = (int (*)(const struct lxcfs_opts *))dlsym(dlopen_handle, "watchdog_start");
+	error = dlerror();
+	if (error)
+		return log_error(-1, "%s - Failed to start slow request watchdog", error);
+
+	if (__watchdog_start(opts))
+		return -1;
+
+	watchdog_on = true;
+	return 0;
+}
+
 static volatile sig_atomic_t need_reload;
 
 /* do_reload - reload the dynamic library.  Done under
@@ -158,11 +262,60 @@ good:
 	if (loadavg_pid > 0)
 		start_loadavg();
 
+	if (prewarm_on)
+		start_prewarm();
+
+	if (bpf_cpuacct_on)
+		start_bpf_cpuacct();
+
+	if (watchdog_on)
+		start_watchdog();
+
+	handoff_close();
+
 	if (need_reload)
 		lxcfs_info("Reloaded LXCFS");
 	need_reload = 0;
 }
 
+static volatile sig_atomic_t need_policy_reload;
+static pthread_mutex_t policy_reload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Re-read the policy file without reloading liblxcfs. */
+static void do_policy_reload(void)
+{
+	char *error;
+	int (*__lxcfs_policy_reload)(const char *path);
+
+	/* Every worker notices the signal, one of them reloading is enough. */
+	if (pthread_mutex_trylock(&policy_reload_mutex))
+		return;
+
+	if (!need_policy_reload)
+		goto out;
+	need_policy_reload = 0;
+
+	dlerror();
+	__lxcfs_policy_reload = (int (*)(const char *))dlsym(dlopen_handle, "lxcfs_policy_reload");
+	error = dlerror();
+	if (error) {
+		lxcfs_error("%s - Failed to find lxcfs_policy_reload()", error);
+		goto out;
+	}
+
+	if (__lxcfs_policy_reload(opts->policy_file))
+		lxcfs_error("Failed to reload policy file %s, keeping the previous policy",
+			    opts->policy_file);
+
+out:
+	unlock_mutex(&policy_reload_mutex);
+}
+
+static void sighup_reload_policy(int signo, siginfo_t *info, void *extra)
+{
+	need_policy_reload = 1;
+}
+
 static void up_users(void)
 {
 	users_lock();
@@ -170,12 +323,17 @@ static void up_users(void)
 		do_reload();
 	users_count++;
 	users_unlock();
+
+	/* The library can't be unloaded while we hold a user reference. */
+	if (need_policy_reload)
+		do_policy_reload();
 }
 
 static void down_users(void)
 {
 	users_lock();
-	users_count--;
+	if (--users_count == 0)
+		pthread_cond_broadcast(&users_idle);
 	users_unlock();
 }
 
@@ -781,32 +939,46 @@ static int lxcfs_releasedir(const char *path, struct fuse_file_info *fi)
 	return -EINVAL;
 }
 
+/*
+ * Contents we render can't go through the page cache: getattr reports the
+ * host's size for /proc files and 4096 for cgroup files and reads would stop
+ * there. Only files passed through to the host file may use it.
+ */
+static void session_open(struct fuse_file_info *fi)
+{
+	struct fuse_context *fc = fuse_get_context();
+
+	if (!fc || !lxcfs_session_pid(fc->private_data))
+		return;
+
+#if HAVE_FUSE_PASSTHROUGH
+	if (fi->backing_id > 0)
+		return;
+#endif
+	fi->direct_io = 1;
+}
+
 static int lxcfs_open(const char *path, struct fuse_file_info *fi)
 {
-	int ret;
+	int ret = -EACCES;
 
 	if (strncmp(path, "/cgroup", 7) == 0) {
 		up_users();
 		ret = do_cg_open(path, fi);
 		down_users();
-		return ret;
-	}
-
-	if (strncmp(path, "/proc", 5) == 0) {
+	} else if (strncmp(path, "/proc", 5) == 0) {
 		up_users();
 		ret = do_proc_open(path, fi);
 		down_users();
-		return ret;
-	}
-
-	if (strncmp(path, "/sys", 4) == 0) {
+	} else if (strncmp(path, "/sys", 4) == 0) {
 		up_users();
 		ret = do_sys_open(path, fi);
 		down_users();
-		return ret;
 	}
 
-	return -EACCES;
+	if (ret == 0)
+		session_open(fi);
+	return ret;
 }
 
 static int lxcfs_read(const char *path, char *buf, size_t size, off_t offset,
@@ -1026,6 +1198,21 @@ static void *lxcfs_init(struct fuse_conn_info *conn)
 	return __lxcfs_fuse_init(conn, NULL);
 }
 
+static void lxcfs_destroy(void *private_data)
+{
+	char *error;
+	void (*__lxcfs_fuse_destroy)(void *data);
+
+	up_users();
+	dlerror();
+	__lxcfs_fuse_destroy = (void (*)(void *data))dlsym(dlopen_handle, "lxcfs_fuse_destroy");
+	error = dlerror();
+	/* Older libraries have nothing to clean up per connection. */
+	if (!error)
+		__lxcfs_fuse_destroy(private_data);
+	down_users();
+}
+
 const struct fuse_operations lxcfs_ops = {
 	.access		= lxcfs_access,
 	.chmod		= lxcfs_chmod,
@@ -1047,7 +1234,7 @@ const struct fuse_operations lxcfs_ops = {
 	.readlink	= lxcfs_readlink,
 
 	.create		= NULL,
-	.destroy	= NULL,
+	.destroy	= lxcfs_destroy,
 #ifndef HAVE_FUSE3
 	.fgetattr	= NULL,
 #endif
@@ -1071,6 +1258,538 @@ const struct fuse_operations lxcfs_ops = {
 #endif
 };
 
+/* The handlers FUSE dispatches to, wrapped when requests are traced. */
+static const struct fuse_operations *fuse_ops = &lxcfs_ops;
+
+/*
+ * Per-container sessions.
+ *
+ * On the shared mount the same inode shows different contents depending on
+ * who reads it, which is why the kernel can't be allowed to cache anything.
+ * With --session-socket a container can instead get a FUSE connection of its
+ * own: "lxcfs --mount-session=SOCKET DIR" mounts /dev/fuse at DIR from inside
+ * the container and hands the fd to the daemon which serves it like the main
+ * mount, except that every request is answered for that container.
+ */
+#define LXCFS_SESSION_PROTO 2
+
+/*
+ * Sent along with the /dev/fuse fd. The device number of the mount lets the
+ * daemon find the connection in fusectl to abort it on shutdown.
+ */
+struct lxcfs_session_req {
+	__u32 proto;
+	__u32 dev_major;
+	__u32 dev_minor;
+};
+
+/*
+ * Find a fuse.lxcfs mount in the mountinfo file @mountinfo. With @mountpoint
+ * the topmost one mounted there is returned in @dev, without it whether the
+ * one with device number @dev exists.
+ */
+static bool session_find_mount(const char *mountinfo, const char *mountpoint, dev_t *dev)
+{
+	__do_fclose FILE *f = NULL;
+	__do_free char *line = NULL;
+	size_t len = 0;
+	bool found = false;
+
+	f = fopen(mountinfo, "re");
+	if (!f)
+		return false;
+
+	while (getline(&line, &len, f) != -1) {
+		char mnt[PATH_MAX];
+		unsigned int maj, min;
+		char *fstype;
+
+		if (sscanf(line, "%*d %*d %u:%u %*s %4095s", &maj, &min, mnt) != 3)
+			continue;
+
+		fstype = strstr(line, " - ");
+		if (!fstype || strncmp(fstype + 3, "fuse.lxcfs ", STRLITERALLEN("fuse.lxcfs ")) != 0)
+			continue;
+
+		if (!mountpoint) {
+			if (makedev(maj, min) == *dev)
+				return true;
+		} else if (strcmp(mnt, mountpoint) == 0) {
+			/* Later entries are mounted on top of earlier ones. */
+			*dev = makedev(maj, min);
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * What a container sees doesn't depend on the caller so lookups and
+ * attributes are cached longer. There's no mount-wide direct_io, it would
+ * override passthrough for files shown as-is, see session_open().
+ */
+#define LXCFS_SESSION_FUSE_OPTS "entry_timeout=10,attr_timeout=2,negative_timeout=10"
+
+#ifdef HAVE_FUSE3
+struct lxcfs_session {
+	struct fuse *fuse;
+	unsigned int conn; /* connection number in /sys/fs/fuse/connections */
+	struct lxcfs_opts opts;
+	struct lxcfs_session *next;
+};
+
+static int session_fd = -EBADF;
+static pthread_t session_listener;
+static struct lxcfs_session *sessions;
+static pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Walk up from @pid to the init of its innermost pid namespace. */
+static pid_t session_init_pid(pid_t pid)
+{
+	for (int depth = 0; pid > 1 && depth < 64; depth++) {
+		__do_fclose FILE *f = NULL;
+		__do_free char *line = NULL;
+		char path[STRLITERALLEN("/proc//status") + INTTYPE_TO_STRLEN(pid_t) + 1];
+		pid_t ppid = 0, nspid = 0;
+		size_t len = 0;
+
+		snprintf(path, sizeof(path), "/proc/%d/status", pid);
+		f = fopen(path, "re");
+		if (!f)
+			return ret_errno(ESRCH);
+
+		while (getline(&line, &len, f) != -1) {
+			char *last;
+
+			if (strncmp(line, "PPid:", STRLITERALLEN("PPid:")) == 0) {
+				sscanf(line + STRLITERALLEN("PPid:"), "%d", &ppid);
+			} else if (strncmp(line, "NSpid:", STRLITERALLEN("NSpid:")) == 0) {
+				last = strrchr(line, '\t');
+				if (last)
+					sscanf(last, "%d", &nspid);
+			}
+		}
+
+		if (nspid == 1)
+			return pid;
+
+		pid = ppid;
+	}
+
+	return ret_errno(ESRCH);
+}
+
+/* Read the real uid @pid runs as. */
+static int session_pid_uid(pid_t pid, uid_t *uid)
+{
+	__do_fclose FILE *f = NULL;
+	__do_free char *line = NULL;
+	char path[STRLITERALLEN("/proc//status") + INTTYPE_TO_STRLEN(pid_t) + 1];
+	size_t len = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	f = fopen(path, "re");
+	if (!f)
+		return -errno;
+
+	while (getline(&line, &len, f) != -1) {
+		if (strncmp(line, "Uid:", STRLITERALLEN("Uid:")) == 0)
+			return sscanf(line + STRLITERALLEN("Uid:"), "%u", uid) == 1 ? 0 : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+static bool session_same_ns(pid_t a, pid_t b, const char *ns)
+{
+	char path[STRLITERALLEN("/proc//ns/user") + INTTYPE_TO_STRLEN(pid_t) + 1];
+	struct stat sta, stb;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/%s", a, ns);
+	if (stat(path, &sta))
+		return false;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/%s", b, ns);
+	if (stat(path, &stb))
+		return false;
+
+	return sta.st_dev == stb.st_dev && sta.st_ino == stb.st_ino;
+}
+
+/*
+ * A session is only handed to the root of the container it is for: the peer
+ * has to share the user and mount namespace of the container's init and run
+ * as the same host uid, and the connection it passes has to be an lxcfs mount
+ * in that mount namespace.
+ */
+static int session_check_peer(const struct ucred *cred, pid_t initpid, dev_t dev)
+{
+	char mountinfo[STRLITERALLEN("/proc//mountinfo") + INTTYPE_TO_STRLEN(pid_t) + 1];
+	uid_t uid;
+
+	if (session_pid_uid(initpid, &uid) || cred->uid != uid)
+		return -EPERM;
+
+	if (!session_same_ns(cred->pid, initpid, "user") ||
+	    !session_same_ns(cred->pid, initpid, "mnt"))
+		return -EPERM;
+
+	snprintf(mountinfo, sizeof(mountinfo), "/proc/%d/mountinfo", initpid);
+	if (!session_find_mount(mountinfo, NULL, &dev))
+		return -EPERM;
+
+	return 0;
+}
+
+static void *session_serve(void *data)
+{
+	struct lxcfs_session *s = data;
+
+	fuse_loop_mt(s->fuse, 0);
+	lxcfs_debug("Per-container session for %d ended", s->opts.session_pid);
+
+	lock_mutex(&sessions_mutex);
+	for (struct lxcfs_session **it = &sessions; *it; it = &(*it)->next) {
+		if (*it == s) {
+			*it = s->next;
+			break;
+		}
+	}
+	unlock_mutex(&sessions_mutex);
+
+	fuse_destroy(s->fuse);
+	free(s);
+	return NULL;
+}
+
+/* Serve the FUSE connection @fusefd for the container whose init is @initpid. */
+static int session_start(int fusefd, pid_t initpid, dev_t dev)
+{
+	__do_free struct lxcfs_session *s = NULL;
+	char *argv[] = { "lxcfs", "-o", LXCFS_SESSION_FUSE_OPTS, NULL };
+	struct fuse_args args = FUSE_ARGS_INIT(3, argv);
+	char mnt[STRLITERALLEN("/dev/fd/") + INTTYPE_TO_STRLEN(int) + 1];
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	s = zalloc(sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	/* fusectl names connections by the kernel's encoding of s_dev. */
+	s->conn = (major(dev) << 20) | minor(dev);
+	s->opts = *opts;
+	s->opts.session_pid = initpid;
+	s->opts.session_starttime = 0;
+
+	s->fuse = fuse_new(&args, fuse_ops, sizeof(*fuse_ops), &s->opts);
+	fuse_opt_free_args(&args);
+	if (!s->fuse)
+		return log_error(-EINVAL, "Failed to create session for %d", initpid);
+
+	/* The connection is already mounted, libfuse takes over @fusefd. */
+	snprintf(mnt, sizeof(mnt), "/dev/fd/%d", fusefd);
+	if (fuse_mount(s->fuse, mnt)) {
+		fuse_destroy(s->fuse);
+		return log_error(-EINVAL, "Failed to attach session for %d", initpid);
+	}
+
+	lock_mutex(&sessions_mutex);
+	s->next = sessions;
+	sessions = s;
+	unlock_mutex(&sessions_mutex);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, session_serve, s);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		lock_mutex(&sessions_mutex);
+		sessions = s->next;
+		unlock_mutex(&sessions_mutex);
+		fuse_destroy(s->fuse);
+		return log_error(-ret, "%s - Failed to start session for %d", strerror(ret), initpid);
+	}
+
+	lxcfs_debug("Started per-container session for %d", initpid);
+	move_ptr(s);
+	return 0;
+}
+
+/* Receive a session request and the /dev/fuse fd that comes with it. */
+static int session_recv(int conn, struct lxcfs_session_req *req, int *fusefd)
+{
+	char cmsgbuf[CMSG_SPACE(sizeof(int))] = {};
+	struct iovec iov = {
+		.iov_base	= req,
+		.iov_len	= sizeof(*req),
+	};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cmsgbuf,
+		.msg_controllen	= sizeof(cmsgbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	ret = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	if (ret < 0)
+		return -errno;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return -EBADMSG;
+	memcpy(fusefd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (ret != sizeof(*req) || req->proto != LXCFS_SESSION_PROTO) {
+		close_prot_errno_disarm(*fusefd);
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+static void session_accept(int conn)
+{
+	struct lxcfs_session_req req = {};
+	int fusefd = -EBADF;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	pid_t initpid;
+	dev_t dev;
+	int ret;
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		ret = -errno;
+		goto reply;
+	}
+
+	ret = session_recv(conn, &req, &fusefd);
+	if (ret)
+		goto reply;
+
+	initpid = session_init_pid(cred.pid);
+	if (initpid < 0) {
+		lxcfs_error("Session requested by %d which isn't in a container", cred.pid);
+		ret = -ESRCH;
+		close_prot_errno_disarm(fusefd);
+		goto reply;
+	}
+
+	dev = makedev(req.dev_major, req.dev_minor);
+	ret = session_check_peer(&cred, initpid, dev);
+	if (ret) {
+		lxcfs_error("Refusing session requested by %d for the container of %d", cred.pid, initpid);
+		close_prot_errno_disarm(fusefd);
+		goto reply;
+	}
+
+	ret = session_start(fusefd, initpid, dev);
+	if (ret)
+		close_prot_errno_disarm(fusefd);
+
+reply:
+	if (send(conn, &ret, sizeof(ret), MSG_NOSIGNAL) != sizeof(ret))
+		lxcfs_error("%s - Failed to answer session request", strerror(errno));
+}
+
+static void *session_listen(void *data)
+{
+	for (;;) {
+		__do_close int conn = -EBADF;
+
+		conn = accept4(session_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		session_accept(conn);
+	}
+
+	return NULL;
+}
+
+static int sessions_start(const char *path)
+{
+	__do_close int fd = -EBADF;
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return log_error(-1, "Session socket path %s is too long", path);
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return log_error(-1, "%s - Failed to create session socket", strerror(errno));
+
+	if (unlink(path) && errno != ENOENT)
+		return log_error(-1, "%s - Failed to remove stale session socket %s", strerror(errno), path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		return log_error(-1, "%s - Failed to bind session socket %s", strerror(errno), path);
+
+	if (chmod(path, S_IRUSR | S_IWUSR))
+		return log_error(-1, "%s - Failed to restrict session socket %s", strerror(errno), path);
+
+	if (listen(fd, 16))
+		return log_error(-1, "%s - Failed to listen on session socket %s", strerror(errno), path);
+
+	session_fd = move_fd(fd);
+	ret = pthread_create(&session_listener, NULL, session_listen, NULL);
+	if (ret) {
+		close_prot_errno_disarm(session_fd);
+		return log_error(-1, "%s - Failed to start session listener", strerror(ret));
+	}
+
+	return 0;
+}
+
+/* Make the kernel fail the session's connection so its readers get ENODEV. */
+static void session_abort(struct lxcfs_session *s)
+{
+	__do_close int fd = -EBADF;
+	char path[STRLITERALLEN("/sys/fs/fuse/connections//abort") + INTTYPE_TO_STRLEN(unsigned int) + 1];
+
+	fuse_exit(s->fuse);
+
+	snprintf(path, sizeof(path), "/sys/fs/fuse/connections/%u/abort", s->conn);
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, "1", 1) != 1)
+		lxcfs_debug("%s - Failed to abort session for %d", strerror(errno), s->opts.session_pid);
+}
+
+/*
+ * Stop taking new sessions, abort the ones being served and wait until none
+ * is inside liblxcfs. The users lock is kept so that nothing calls into it
+ * once it is unloaded.
+ */
+static void sessions_stop(const char *path)
+{
+	if (session_fd < 0)
+		return;
+
+	shutdown(session_fd, SHUT_RDWR);
+	pthread_join(session_listener, NULL);
+	close_prot_errno_disarm(session_fd);
+	unlink(path);
+
+	lock_mutex(&sessions_mutex);
+	for (struct lxcfs_session *s = sessions; s; s = s->next)
+		session_abort(s);
+	unlock_mutex(&sessions_mutex);
+
+	users_lock();
+	while (users_count > 0)
+		pthread_cond_wait(&users_idle, &user_count_mutex);
+}
+#else
+static int sessions_start(const char *path)
+{
+	return log_error(-1, "Per-container sessions require fuse3");
+}
+
+static void sessions_stop(const char *path)
+{
+}
+#endif
+
+/* Client side of --session-socket, run from inside the container. */
+static int mount_session(const char *path, const char *mountpoint)
+{
+	__do_close int devfd = -EBADF, sock = -EBADF;
+	__do_free char *target = NULL;
+	char cmsgbuf[CMSG_SPACE(sizeof(int))] = {};
+	char mntopts[STRLITERALLEN("fd=,rootmode=40000,user_id=0,group_id=0,allow_other") +
+		     INTTYPE_TO_STRLEN(int) + 1];
+	struct lxcfs_session_req req = {
+		.proto		= LXCFS_SESSION_PROTO,
+	};
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct iovec iov = {
+		.iov_base	= &req,
+		.iov_len	= sizeof(req),
+	};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cmsgbuf,
+		.msg_controllen	= sizeof(cmsgbuf),
+	};
+	struct cmsghdr *cmsg;
+	int status = -EIO;
+	dev_t dev;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return log_error(-1, "Session socket path %s is too long", path);
+	strcpy(addr.sun_path, path);
+
+	/* As it will show up in mountinfo. */
+	target = realpath(mountpoint, NULL);
+	if (!target)
+		return log_error(-1, "%s - Failed to resolve %s", strerror(errno), mountpoint);
+
+	devfd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (devfd < 0)
+		return log_error(-1, "%s - Failed to open /dev/fuse", strerror(errno));
+
+	snprintf(mntopts, sizeof(mntopts),
+		 "fd=%d,rootmode=40000,user_id=0,group_id=0,allow_other", devfd);
+	if (mount("lxcfs", mountpoint, "fuse.lxcfs", MS_NOSUID | MS_NODEV, mntopts))
+		return log_error(-1, "%s - Failed to mount session at %s", strerror(errno), mountpoint);
+
+	/* Stat'ing the mount would wait for the daemon we haven't reached yet. */
+	if (!session_find_mount("/proc/self/mountinfo", target, &dev)) {
+		lxcfs_error("Failed to find the session mounted at %s", target);
+		goto umount;
+	}
+	req.dev_major = major(dev);
+	req.dev_minor = minor(dev);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		lxcfs_error("%s - Failed to create session socket", strerror(errno));
+		goto umount;
+	}
+
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		lxcfs_error("%s - Failed to connect to %s", strerror(errno), path);
+		goto umount;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &devfd, sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req)) {
+		lxcfs_error("%s - Failed to send session request", strerror(errno));
+		goto umount;
+	}
+
+	if (recv(sock, &status, sizeof(status), 0) != sizeof(status))
+		status = -EIO;
+	if (status == 0)
+		return 0;
+
+	lxcfs_error("%s - lxcfs refused the session", strerror(-status));
+
+umount:
+	umount2(mountpoint, MNT_DETACH);
+	return -1;
+}
+
 static void usage(void)
 {
 	lxcfs_info("Usage: lxcfs <directory>\n");
@@ -1085,8 +1804,32 @@ static void usage(void)
 	lxcfs_info("                       Default pidfile is %s/lxcfs.pid", RUNTIME_PATH);
 	lxcfs_info("  -u, --disable-swap   Disable swap virtualization");
 	lxcfs_info("  -v, --version        Print lxcfs version");
+	lxcfs_info("  --background-cpus=LIST");
+	lxcfs_info("                       Run background threads such as the loadavg refresher on LIST");
+	lxcfs_info("  --background-idle    Run background threads with SCHED_IDLE");
+	lxcfs_info("  --background-nice=N  Run background threads at nice level N");
+	lxcfs_info("  --cache-budget=SIZE  Cap memory used by per-container caches");
+	lxcfs_info("                       SIZE is in bytes, K, M and G suffixes are accepted");
+	lxcfs_info("  --enable-bpf-cpuacct Account per-cpu usage on cgroup2 with BPF, estimated");
+	lxcfs_info("                       from cpu.stat when BPF isn't permitted");
 	lxcfs_info("  --enable-cfs         Enable CPU virtualization via CPU shares");
 	lxcfs_info("  --enable-pidfd       Use pidfd for process tracking");
+	lxcfs_info("  --policy=FILE        Load per-container virtualization policy from FILE");
+	lxcfs_info("                       FILE is re-read on SIGHUP");
+	lxcfs_info("  --prewarm=CGROUPS    Warm caches for containers created below CGROUPS,");
+	lxcfs_info("                       a comma separated list such as /lxc.payload");
+	lxcfs_info("  --session-socket=PATH");
+	lxcfs_info("                       Accept requests for per-container mounts on PATH");
+	lxcfs_info("  --mount-session=PATH Mount a per-container lxcfs at <directory> through");
+	lxcfs_info("                       the daemon listening on PATH");
+	lxcfs_info("  --slow-request-ms=MS Log where requests taking longer than MS milliseconds");
+	lxcfs_info("                       spent their time");
+	lxcfs_info("  --trace=FILE         Record every request served into FILE");
+	lxcfs_info("  --trace-records=N    Keep the newest N requests in the trace, default %d",
+		   TRACE_RECORDS_DEFAULT);
+	lxcfs_info("  --replay=FILE        Re-issue the requests recorded in FILE against the");
+	lxcfs_info("                       lxcfs mounted at <directory> and report latencies");
+	lxcfs_info("  --worker-cpus=LIST   Run FUSE worker threads on LIST, e.g. 0-1,4");
 	exit(EXIT_FAILURE);
 }
 
@@ -1133,13 +1876,99 @@ static const struct option long_options[] = {
 	{"help",		no_argument,		0,	'h'	},
 	{"version",		no_argument,		0,	'v'	},
 
+	{"enable-bpf-cpuacct",	no_argument,		0,	  0	},
 	{"enable-cfs",		no_argument,		0,	  0	},
 	{"enable-pidfd",	no_argument,		0,	  0	},
+	{"cache-budget",	required_argument,	0,	  0	},
+	{"worker-cpus",		required_argument,	0,	  0	},
+	{"background-cpus",	required_argument,	0,	  0	},
+	{"background-idle",	no_argument,		0,	  0	},
+	{"background-nice",	required_argument,	0,	  0	},
+	{"policy",		required_argument,	0,	  0	},
+	{"prewarm",		required_argument,	0,	  0	},
+	{"session-socket",	required_argument,	0,	  0	},
+	{"slow-request-ms",	required_argument,	0,	  0	},
+	{"mount-session",	required_argument,	0,	  0	},
+	{"trace",		required_argument,	0,	  0	},
+	{"trace-records",	required_argument,	0,	  0	},
+	{"replay",		required_argument,	0,	  0	},
 
 	{"pidfile",		required_argument,	0,	'p'	},
 	{								},
 };
 
+/* Parse a byte count with an optional K, M or G suffix. */
+static int parse_size(const char *str, __u64 *size)
+{
+	char *end = NULL;
+	unsigned long long val;
+	unsigned int shift = 0;
+
+	errno = 0;
+	val = strtoull(str, &end, 10);
+	if (errno || end == str || *str == '-')
+		return -EINVAL;
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		shift += 10;
+		// fallthrough
+	case 'M':
+	case 'm':
+		shift += 10;
+		// fallthrough
+	case 'K':
+	case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+
+	if (*end != '\0')
+		return -EINVAL;
+
+	if (val > (UINT64_MAX >> shift))
+		return -ERANGE;
+
+	*size = val << shift;
+	return 0;
+}
+
+/* Parse a cpu list such as "0-3,8" into @set. */
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	__do_free char *dup = NULL;
+	char *token;
+
+	dup = strdup(list);
+	if (!dup)
+		return -ENOMEM;
+
+	CPU_ZERO(set);
+	lxc_iterate_parts(token, dup, ",") {
+		unsigned int a, b;
+		int ret;
+
+		ret = sscanf(token, "%u-%u", &a, &b);
+		if (ret == 1)
+			b = a;
+		else if (ret != 2 || a > b)
+			return -EINVAL;
+
+		if (b >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (; a <= b; a++)
+			CPU_SET(a, set);
+	}
+
+	if (CPU_COUNT(set) == 0)
+		return -EINVAL;
+
+	return 0;
+}
+
 static int append_comma_separate(char **s, const char *append)
 {
 	int ret;
@@ -1194,10 +2023,15 @@ int main(int argc, char *argv[])
 	char *fuse_argv[7];
 	const char *fuse_opts = NULL;
 	char *new_fuse_opts = NULL;
+	char *mountpoint = NULL;
 	char *const *new_argv;
-	struct lxcfs_opts *opts;
+	bool pin_workers = false;
+	cpu_set_t worker_cpus;
+	const char *session_socket = NULL, *session_mount = NULL;
+	const char *trace_file = NULL, *replay_file = NULL;
+	__u64 trace_records = TRACE_RECORDS_DEFAULT;
 
-	opts = malloc(sizeof(struct lxcfs_opts));
+	opts = zalloc(sizeof(struct lxcfs_opts));
 	if (opts == NULL) {
 		lxcfs_error("Error allocating memory for options");
 		goto out;
@@ -1206,7 +2040,18 @@ int main(int argc, char *argv[])
 	opts->swap_off = false;
 	opts->use_pidfd = false;
 	opts->use_cfs = false;
-	opts->version = 1;
+	opts->version = 8;
+	opts->cache_budget = 0;
+	opts->pin_background = false;
+	opts->background_policy = SCHED_OTHER;
+	opts->background_nice = 0;
+	opts->policy_file = NULL;
+	opts->session_pid = 0;
+	opts->session_starttime = 0;
+	opts->prewarm = NULL;
+	opts->mountpoint = NULL;
+	opts->bpf_cpuacct = false;
+	opts->slow_request_ms = 0;
 
 	while ((c = getopt_long(argc, argv, "dulfhvso:p:", long_options, &idx)) != -1) {
 		switch (c) {
@@ -1215,7 +2060,69 @@ int main(int argc, char *argv[])
 				opts->use_pidfd = true;
 			else if (strcmp(long_options[idx].name, "enable-cfs") == 0)
 				opts->use_cfs = true;
-			else
+			else if (strcmp(long_options[idx].name, "enable-bpf-cpuacct") == 0)
+				opts->bpf_cpuacct = true;
+			else if (strcmp(long_options[idx].name, "cache-budget") == 0) {
+				if (parse_size(optarg, &opts->cache_budget)) {
+					lxcfs_error("Invalid cache budget \"%s\"", optarg);
+					usage();
+				}
+			} else if (strcmp(long_options[idx].name, "worker-cpus") == 0) {
+				if (parse_cpu_list(optarg, &worker_cpus)) {
+					lxcfs_error("Invalid cpu list \"%s\"", optarg);
+					usage();
+				}
+				pin_workers = true;
+			} else if (strcmp(long_options[idx].name, "background-cpus") == 0) {
+				if (parse_cpu_list(optarg, &opts->background_cpus)) {
+					lxcfs_error("Invalid cpu list \"%s\"", optarg);
+					usage();
+				}
+				opts->pin_background = true;
+			} else if (strcmp(long_options[idx].name, "background-idle") == 0) {
+				opts->background_policy = SCHED_IDLE;
+			} else if (strcmp(long_options[idx].name, "background-nice") == 0) {
+				char *end = NULL;
+				long nice_level;
+
+				errno = 0;
+				nice_level = strtol(optarg, &end, 10);
+				if (errno || end == optarg || *end != '\0' ||
+				    nice_level < -20 || nice_level > 19) {
+					lxcfs_error("Invalid nice level \"%s\"", optarg);
+					usage();
+				}
+				opts->background_nice = nice_level;
+			} else if (strcmp(long_options[idx].name, "policy") == 0) {
+				opts->policy_file = optarg;
+			} else if (strcmp(long_options[idx].name, "prewarm") == 0) {
+				opts->prewarm = optarg;
+			} else if (strcmp(long_options[idx].name, "slow-request-ms") == 0) {
+				char *end = NULL;
+				unsigned long ms;
+
+				errno = 0;
+				ms = strtoul(optarg, &end, 10);
+				if (errno || end == optarg || *end != '\0' ||
+				    *optarg == '-' || ms == 0 || ms > UINT_MAX) {
+					lxcfs_error("Invalid slow request threshold \"%s\"", optarg);
+					usage();
+				}
+				opts->slow_request_ms = ms;
+			} else if (strcmp(long_options[idx].name, "session-socket") == 0) {
+				session_socket = optarg;
+			} else if (strcmp(long_options[idx].name, "mount-session") == 0) {
+				session_mount = optarg;
+			} else if (strcmp(long_options[idx].name, "trace") == 0) {
+				trace_file = optarg;
+			} else if (strcmp(long_options[idx].name, "trace-records") == 0) {
+				if (parse_size(optarg, &trace_records)) {
+					lxcfs_error("Invalid number of trace records \"%s\"", optarg);
+					usage();
+				}
+			} else if (strcmp(long_options[idx].name, "replay") == 0) {
+				replay_file = optarg;
+			} else
 				usage();
 			break;
 		case 'd':
@@ -1267,6 +2174,28 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	/* Client mode, nothing of the daemon below applies. */
+	if (session_mount) {
+		ret = mount_session(session_mount, new_argv[0]) ? EXIT_FAILURE : EXIT_SUCCESS;
+		free(opts);
+		exit(ret);
+	}
+
+	if (replay_file) {
+		ret = trace_replay(replay_file, new_argv[0]) ? EXIT_FAILURE : EXIT_SUCCESS;
+		free(opts);
+		exit(ret);
+	}
+
+	if (opts->prewarm) {
+		mountpoint = realpath(new_argv[0], NULL);
+		if (!mountpoint) {
+			lxcfs_error("%s - Failed to resolve mountpoint %s", strerror(errno), new_argv[0]);
+			goto out;
+		}
+		opts->mountpoint = mountpoint;
+	}
+
 	fuse_argv[fuse_argc++] = argv[0];
 	if (debug)
 		fuse_argv[fuse_argc++] = "-d";
@@ -1361,6 +2290,11 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (opts->policy_file && install_signal_handler(SIGHUP, sighup_reload_policy)) {
+		lxcfs_error("%s - Failed to install SIGHUP signal handler", strerror(errno));
+		goto out;
+	}
+
 	if (!pidfile) {
 		snprintf(pidfile_buf, sizeof(pidfile_buf), "%s/lxcfs.pid", RUNTIME_PATH);
 		pidfile = pidfile_buf;
@@ -1370,21 +2304,60 @@ int main(int argc, char *argv[])
 	if (pidfile_fd < 0)
 		goto out;
 
+	if (pin_workers) {
+		/*
+		 * Background threads are (re)started from FUSE workers on
+		 * reload. Unless told otherwise, keep them where they are now.
+		 */
+		if (!opts->pin_background &&
+		    sched_getaffinity(0, sizeof(cpu_set_t), &opts->background_cpus) == 0)
+			opts->pin_background = true;
+	}
+
 	if (load_use && start_loadavg() != 0)
 		goto out;
 
-	if (!fuse_main(fuse_argc, fuse_argv, &lxcfs_ops, opts))
+	if (opts->prewarm && start_prewarm() != 0)
+		goto out;
+
+	if (opts->bpf_cpuacct && start_bpf_cpuacct() != 0)
+		goto out;
+
+	if (opts->slow_request_ms && start_watchdog() != 0)
+		goto out;
+
+	/* FUSE worker threads inherit the affinity of the main thread. */
+	if (pin_workers && sched_setaffinity(0, sizeof(cpu_set_t), &worker_cpus)) {
+		lxcfs_error("%s - Failed to pin FUSE workers", strerror(errno));
+		goto out;
+	}
+
+	if (trace_file) {
+		if (trace_start(trace_file, trace_records))
+			goto out;
+		fuse_ops = trace_ops(&lxcfs_ops);
+	}
+
+	if (session_socket && sessions_start(session_socket))
+		goto out;
+
+	if (!fuse_main(fuse_argc, fuse_argv, fuse_ops, opts))
 		ret = EXIT_SUCCESS;
 
+	if (session_socket)
+		sessions_stop(session_socket);
+
 	if (load_use)
 		stop_loadavg();
 
 out:
+	trace_stop();
 	if (dlopen_handle)
 		dlclose(dlopen_handle);
 	if (pidfile)
 		unlink(pidfile);
 	free(new_fuse_opts);
+	free(mountpoint);
 	free(opts);
 	close_prot_errno_disarm(pidfile_fd);
 	exit(ret);
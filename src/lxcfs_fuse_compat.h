@@ -12,4 +12,26 @@
 #else
 #define DIR_FILLER(F,B,N,S,O) F(B,N,S,O)
 #endif
+
+#if HAVE_FUSE_PASSTHROUGH
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * libfuse doesn't export the passthrough ioctls to high-level filesystems and
+ * <linux/fuse.h> clashes with its headers, so carry the kernel ABI here.
+ */
+#ifndef FUSE_DEV_IOC_BACKING_OPEN
+struct fuse_backing_map {
+	int32_t fd;
+	uint32_t flags;
+	uint64_t padding;
+};
+
+#define FUSE_DEV_IOC_MAGIC 229
+#define FUSE_DEV_IOC_BACKING_OPEN _IOW(FUSE_DEV_IOC_MAGIC, 1, struct fuse_backing_map)
+#define FUSE_DEV_IOC_BACKING_CLOSE _IOW(FUSE_DEV_IOC_MAGIC, 2, uint32_t)
+#endif
+#endif
+
 #endif /* __LXCFS_FUSE_COMPAT_H */
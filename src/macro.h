@@ -70,6 +70,10 @@
 
 #define STRLITERALLEN(x) (sizeof(""x"") - 1)
 
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+#endif
+
 /* Calculate the number of chars needed to represent a given integer as a C
  * string. Include room for '-' to indicate negative numbers and the \0 byte.
  * This is based on systemd.
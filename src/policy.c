@@ -0,0 +1,631 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "policy.h"
+
+#include "bindings.h"
+#include "cache_budget.h"
+#include "cgroups/cgroup.h"
+#include "memory_utils.h"
+#include "proc_loadavg.h"
+#include "utils.h"
+#include "watchdog.h"
+
+#define POLICY_HASH_SIZE 64
+/* Drop per-cgroup entries that haven't been used for this long. */
+#define POLICY_PRUNE_SECS 60
+
+/* Files a policy can refer to and the controller used to match them. */
+static const struct policy_file {
+	const char *name;
+	int type;
+	const char *controller;
+} policy_files[] = {
+	{ "meminfo",	LXC_TYPE_PROC_MEMINFO,			"memory"	},
+	{ "cpuinfo",	LXC_TYPE_PROC_CPUINFO,			"cpuset"	},
+	{ "uptime",	LXC_TYPE_PROC_UPTIME,			"memory"	},
+	{ "stat",	LXC_TYPE_PROC_STAT,			"cpuset"	},
+	{ "diskstats",	LXC_TYPE_PROC_DISKSTATS,		"blkio"		},
+	{ "swaps",	LXC_TYPE_PROC_SWAPS,			"memory"	},
+	{ "loadavg",	LXC_TYPE_PROC_LOADAVG,			"cpu"		},
+	{ "slabinfo",	LXC_TYPE_PROC_SLABINFO,			"memory"	},
+	{ "cpuonline",	LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE,	"cpuset"	},
+};
+
+struct policy_rule {
+	char *prefix;
+	size_t len;
+	struct lxcfs_policy policy;
+	struct policy_rule *next;
+};
+
+struct policy_render {
+	char *buf;
+	size_t len;
+	int64_t rendered;
+	/* Containers sharing a cgroup don't share renders. */
+	pid_t initpid;
+	uint64_t starttime;
+};
+
+/* The rule matched by a cgroup and its cached renders. */
+struct policy_entry {
+	char *cgroup;
+	struct policy_rule *rule;
+	struct policy_render render[LXC_TYPE_MAX];
+	int64_t lastuse;
+	struct policy_entry *next;
+};
+
+static struct policy_rule *rules;
+static struct policy_entry *policy_hash[POLICY_HASH_SIZE];
+static pthread_mutex_t policy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t policy_once = PTHREAD_ONCE_INIT;
+
+static int64_t policy_cache_oldest(void);
+static void policy_cache_evict(int64_t cutoff, uint64_t bytes);
+
+static struct lxcfs_cache policy_cache = {
+	.name	= "policy",
+	.oldest	= policy_cache_oldest,
+	.evict	= policy_cache_evict,
+};
+
+static inline void policy_lock(void)
+{
+	pthread_mutex_lock(&policy_mutex);
+}
+
+static inline void policy_unlock(void)
+{
+	pthread_mutex_unlock(&policy_mutex);
+}
+
+static const struct policy_file *policy_file_by_name(const char *name)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(policy_files); i++)
+		if (strcmp(policy_files[i].name, name) == 0)
+			return &policy_files[i];
+
+	return NULL;
+}
+
+static const char *policy_controller(int type)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(policy_files); i++)
+		if (policy_files[i].type == type)
+			return policy_files[i].controller;
+
+	return "memory";
+}
+
+static void free_rules(struct policy_rule *rule)
+{
+	while (rule) {
+		struct policy_rule *next = rule->next;
+
+		free(rule->prefix);
+		free(rule);
+		rule = next;
+	}
+}
+
+static inline size_t policy_entry_size(const struct policy_entry *entry)
+{
+	size_t size = sizeof(*entry) + strlen(entry->cgroup) + 1;
+
+	for (int i = 0; i < LXC_TYPE_MAX; i++)
+		size += entry->render[i].len;
+
+	return size;
+}
+
+static void free_policy_entry(struct policy_entry *entry, bool evicted)
+{
+	cache_account_del(&policy_cache, policy_entry_size(entry), evicted);
+	for (int i = 0; i < LXC_TYPE_MAX; i++)
+		free(entry->render[i].buf);
+	free(entry->cgroup);
+	free(entry);
+}
+
+/* Must be called under policy_lock */
+static void clear_policy_entries(void)
+{
+	for (int i = 0; i < POLICY_HASH_SIZE; i++) {
+		while (policy_hash[i]) {
+			struct policy_entry *entry = policy_hash[i];
+
+			policy_hash[i] = entry->next;
+			free_policy_entry(entry, false);
+		}
+	}
+}
+
+static int policy_parse_bool(const char *value, bool *on)
+{
+	if (strcmp(value, "on") == 0)
+		*on = true;
+	else if (strcmp(value, "off") == 0)
+		*on = false;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int policy_parse_setting(struct lxcfs_policy *policy, char *setting)
+{
+	const struct policy_file *file;
+	char *value;
+	uint64_t ttl;
+	bool on;
+
+	value = strchr(setting, '=');
+	if (!value)
+		return -EINVAL;
+	*value++ = '\0';
+
+	if (strcmp(setting, "ttl") == 0) {
+		if (safe_uint64(value, &ttl, 10) < 0 || ttl > UINT_MAX)
+			return -EINVAL;
+
+		for (size_t i = 0; i < ARRAY_SIZE(policy_files); i++)
+			policy->ttl[policy_files[i].type] = ttl;
+
+		return 0;
+	}
+
+	if (strncmp(setting, "ttl.", STRLITERALLEN("ttl.")) == 0) {
+		file = policy_file_by_name(setting + STRLITERALLEN("ttl."));
+		if (!file || safe_uint64(value, &ttl, 10) < 0 || ttl > UINT_MAX)
+			return -EINVAL;
+
+		policy->ttl[file->type] = ttl;
+		return 0;
+	}
+
+	if (policy_parse_bool(value, &on))
+		return -EINVAL;
+
+	if (strcmp(setting, "cpuview") == 0) {
+		policy->cpuview = on;
+		return 0;
+	}
+
+	file = policy_file_by_name(setting);
+	if (!file)
+		return -EINVAL;
+
+	if (on)
+		policy->host &= ~(1ULL << file->type);
+	else
+		policy->host |= 1ULL << file->type;
+
+	return 0;
+}
+
+/* Sets @ret to NULL for blank lines. */
+static int policy_parse_line(char *line, struct policy_rule **ret)
+{
+	__do_free struct policy_rule *rule = NULL;
+	char *token, *prefix = NULL;
+
+	*ret = NULL;
+
+	rule = zalloc(sizeof(*rule));
+	if (!rule)
+		return -ENOMEM;
+	rule->policy.cpuview = -1;
+
+	lxc_iterate_parts(token, line, " \t\n") {
+		if (!prefix) {
+			if (*token != '/')
+				return log_error(-EINVAL, "Policy prefix \"%s\" is not an absolute cgroup path", token);
+
+			prefix = token;
+			continue;
+		}
+
+		if (policy_parse_setting(&rule->policy, token))
+			return log_error(-EINVAL, "Invalid policy setting \"%s\" for %s", token, prefix);
+	}
+
+	if (!prefix)
+		return 0;
+
+	/* Match "/a/" the same as "/a". */
+	rule->len = strlen(prefix);
+	while (rule->len > 1 && prefix[rule->len - 1] == '/')
+		prefix[--rule->len] = '\0';
+
+	rule->prefix = strdup(prefix);
+	if (!rule->prefix)
+		return -ENOMEM;
+
+	*ret = move_ptr(rule);
+	return 0;
+}
+
+static int policy_parse_file(const char *path, struct policy_rule **ret)
+{
+	__do_fclose FILE *f = NULL;
+	__do_free char *line = NULL;
+	struct policy_rule *head = NULL, **tail = &head;
+	size_t linelen = 0;
+	int nr = 0, err;
+
+	f = fopen(path, "re");
+	if (!f) {
+		err = -errno;
+		return log_error(err, "%s - Failed to open policy file %s", strerror(-err), path);
+	}
+
+	while (getline(&line, &linelen, f) != -1) {
+		struct policy_rule *rule;
+		char *comment;
+
+		nr++;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		err = policy_parse_line(line, &rule);
+		if (err < 0) {
+			free_rules(head);
+			return log_error(err, "Invalid policy in %s on line %d", path, nr);
+		}
+
+		if (!rule)
+			continue;
+
+		*tail = rule;
+		tail = &rule->next;
+	}
+
+	*ret = head;
+	return 0;
+}
+
+/* Longest prefix of @cgroup ending on a path component. */
+static struct policy_rule *policy_match(const char *cgroup)
+{
+	struct policy_rule *best = NULL;
+
+	for (struct policy_rule *rule = rules; rule; rule = rule->next) {
+		if (strncmp(cgroup, rule->prefix, rule->len) != 0)
+			continue;
+
+		if (rule->len > 1 && cgroup[rule->len] != '\0' && cgroup[rule->len] != '/')
+			continue;
+
+		if (!best || rule->len > best->len)
+			best = rule;
+	}
+
+	return best;
+}
+
+/* Must be called under policy_lock */
+static void prune_policy_entries(int64_t now)
+{
+	static int64_t last_prune = 0;
+
+	if (now < (last_prune + POLICY_PRUNE_SECS / 4))
+		return;
+	last_prune = now;
+
+	for (int i = 0; i < POLICY_HASH_SIZE; i++) {
+		for (struct policy_entry **it = &policy_hash[i]; *it;) {
+			struct policy_entry *entry = *it;
+
+			if (entry->lastuse < (now - POLICY_PRUNE_SECS)) {
+				*it = entry->next;
+				free_policy_entry(entry, false);
+			} else {
+				it = &entry->next;
+			}
+		}
+	}
+}
+
+/* Must be called under policy_lock */
+static struct policy_entry *policy_entry_get(const char *cgroup, int64_t now)
+{
+	struct policy_entry *entry;
+	int hash;
+
+	prune_policy_entries(now);
+
+	hash = calc_hash(cgroup) % POLICY_HASH_SIZE;
+	for (entry = policy_hash[hash]; entry; entry = entry->next) {
+		if (strcmp(entry->cgroup, cgroup) == 0) {
+			entry->lastuse = now;
+			return entry;
+		}
+	}
+
+	entry = zalloc(sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	entry->cgroup = strdup(cgroup);
+	if (!entry->cgroup) {
+		free(entry);
+		return NULL;
+	}
+
+	entry->rule = policy_match(cgroup);
+	entry->lastuse = now;
+	entry->next = policy_hash[hash];
+	policy_hash[hash] = entry;
+	cache_account_add(&policy_cache, policy_entry_size(entry));
+
+	return entry;
+}
+
+static int64_t policy_cache_oldest(void)
+{
+	int64_t oldest = -1;
+
+	policy_lock();
+	for (int i = 0; i < POLICY_HASH_SIZE; i++)
+		for (struct policy_entry *entry = policy_hash[i]; entry; entry = entry->next)
+			if (oldest < 0 || entry->lastuse < oldest)
+				oldest = entry->lastuse;
+	policy_unlock();
+
+	return oldest;
+}
+
+static void policy_cache_evict(int64_t cutoff, uint64_t bytes)
+{
+	uint64_t freed = 0;
+
+	policy_lock();
+	for (int i = 0; i < POLICY_HASH_SIZE && freed < bytes; i++) {
+		for (struct policy_entry **it = &policy_hash[i]; *it && freed < bytes;) {
+			struct policy_entry *entry = *it;
+
+			if (entry->lastuse > cutoff) {
+				it = &entry->next;
+				continue;
+			}
+
+			*it = entry->next;
+			freed += policy_entry_size(entry);
+			free_policy_entry(entry, true);
+		}
+	}
+	policy_unlock();
+}
+
+int lxcfs_policy_reload(const char *path)
+{
+	struct policy_rule *new_rules = NULL, *old_rules;
+	int ret;
+
+	ret = policy_parse_file(path, &new_rules);
+	if (ret)
+		return ret;
+
+	cache_register(&policy_cache);
+
+	policy_lock();
+	old_rules = rules;
+	rules = new_rules;
+	/* Entries point into the old rules and renders may be stale. */
+	clear_policy_entries();
+	policy_unlock();
+
+	free_rules(old_rules);
+	lxcfs_info("Loaded policy file %s", path);
+	return 0;
+}
+
+static void policy_load(void)
+{
+	struct fuse_context *fc = fuse_get_context();
+	const char *path;
+
+	path = lxcfs_policy_file(fc ? fc->private_data : NULL);
+	if (path)
+		lxcfs_policy_reload(path);
+}
+
+/* Whether a policy file was given, loading it on first use. */
+static bool policy_configured(void)
+{
+	struct fuse_context *fc = fuse_get_context();
+
+	if (!lxcfs_policy_file(fc ? fc->private_data : NULL))
+		return false;
+
+	pthread_once(&policy_once, policy_load);
+	return true;
+}
+
+/* The caller's container, keyed like the other caches, and its cgroup. */
+static char *policy_cgroup(pid_t pid, int type, pid_t *initpid,
+			   uint64_t *starttime)
+{
+	char *cgroup;
+
+	*initpid = lookup_initpid_starttime(pid, starttime);
+	if (*initpid <= 1 || is_shared_pidns(*initpid)) {
+		*initpid = pid;
+		*starttime = 0;
+	}
+
+	cgroup = get_pid_cgroup(*initpid, policy_controller(type));
+	if (cgroup)
+		prune_init_slice(cgroup);
+
+	return cgroup;
+}
+
+static void policy_render_store(const char *cgroup, pid_t initpid,
+				uint64_t starttime, int type, const char *buf,
+				size_t len, int64_t now)
+{
+	struct policy_entry *entry;
+	struct policy_render *r;
+	char *copy;
+
+	policy_lock();
+	entry = policy_entry_get(cgroup, now);
+	/* The policy might have been reloaded while rendering. */
+	if (!entry || !entry->rule || !entry->rule->policy.ttl[type]) {
+		policy_unlock();
+		return;
+	}
+
+	r = &entry->render[type];
+	copy = realloc(r->buf, len);
+	if (!copy) {
+		policy_unlock();
+		return;
+	}
+	memcpy(copy, buf, len);
+
+	cache_account_resize(&policy_cache, r->len, len);
+	r->buf = copy;
+	r->len = len;
+	r->rendered = now;
+	r->initpid = initpid;
+	r->starttime = starttime;
+	policy_unlock();
+
+	cache_budget_enforce();
+}
+
+int policy_read(int type, const char *host_path, policy_render_t render,
+		char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	__do_free char *cgroup = NULL;
+	struct fuse_context *fc = fuse_get_context();
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+	struct policy_entry *entry;
+	struct policy_render *r;
+	uint64_t starttime = 0;
+	unsigned int ttl;
+	pid_t initpid;
+	int64_t now;
+	int total_len;
+
+	/* Later chunks are served from the buffer filled by the first read. */
+	if (offset || !policy_configured())
+		return render(buf, size, offset, fi);
+
+	cgroup = policy_cgroup(fc->pid, type, &initpid, &starttime);
+	if (!cgroup)
+		return render(buf, size, offset, fi);
+
+	now = time(NULL);
+	policy_lock();
+	entry = policy_entry_get(cgroup, now);
+	if (!entry || !entry->rule) {
+		policy_unlock();
+		return render(buf, size, offset, fi);
+	}
+
+	if (entry->rule->policy.host & (1ULL << type)) {
+		policy_unlock();
+		return read_file_fuse(host_path, buf, size, d);
+	}
+
+	ttl = entry->rule->policy.ttl[type];
+	r = &entry->render[type];
+	if (ttl && r->buf && (now - r->rendered) < ttl &&
+	    r->initpid == initpid && r->starttime == starttime &&
+	    r->len <= (size_t)d->buflen) {
+		memcpy(d->buf, r->buf, r->len);
+		d->size = r->len;
+		d->cached = 1;
+		policy_unlock();
+
+		total_len = d->size;
+		if ((size_t)total_len > size)
+			total_len = size;
+		copy_out(buf, d->buf, total_len);
+
+		return total_len;
+	}
+	policy_unlock();
+
+	total_len = render(buf, size, offset, fi);
+	if (ttl && total_len > 0 && d->size > 0)
+		policy_render_store(cgroup, initpid, starttime, type, d->buf,
+				    d->size, now);
+
+	return total_len;
+}
+
+bool policy_host_file(int type)
+{
+	__do_free char *cgroup = NULL;
+	struct fuse_context *fc = fuse_get_context();
+	struct policy_entry *entry;
+	uint64_t starttime = 0;
+	bool host = false;
+	pid_t initpid;
+
+	if (!policy_configured())
+		return false;
+
+	cgroup = policy_cgroup(fc->pid, type, &initpid, &starttime);
+	if (!cgroup)
+		return false;
+
+	policy_lock();
+	entry = policy_entry_get(cgroup, time(NULL));
+	if (entry && entry->rule)
+		host = entry->rule->policy.host & (1ULL << type);
+	policy_unlock();
+
+	return host;
+}
+
+bool policy_use_cpuview(const char *cgroup, bool dflt)
+{
+	struct policy_entry *entry;
+	bool use_view = dflt;
+
+	if (!policy_configured())
+		return dflt;
+
+	policy_lock();
+	entry = policy_entry_get(cgroup, time(NULL));
+	if (entry && entry->rule && entry->rule->policy.cpuview >= 0)
+		use_view = entry->rule->policy.cpuview;
+	policy_unlock();
+
+	return use_view;
+}
+
+void policy_exit(void)
+{
+	policy_lock();
+	clear_policy_entries();
+	free_rules(rules);
+	rules = NULL;
+	policy_unlock();
+
+	cache_unregister(&policy_cache);
+}
@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_POLICY_H
+#define __LXCFS_POLICY_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#if HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include <fuse.h>
+#endif
+
+#include "bindings.h"
+#include "macro.h"
+
+/*
+ * Per-container virtualization policy loaded from --policy=FILE. Each line
+ * names a cgroup path prefix followed by settings for the containers below
+ * it, the longest matching prefix wins:
+ *
+ *   # prefix		settings
+ *   /lxc.payload.ci	diskstats=off swaps=off cpuview=off ttl=2
+ *   /lxc.payload.db	ttl.meminfo=1
+ *
+ *   <file>=on|off	virtualize <file> or show the host's version
+ *   cpuview=on|off	override --enable-cfs for cpuinfo, stat and cpu/online
+ *   ttl=N		serve renders of every file for up to N seconds
+ *   ttl.<file>=N	same for a single file
+ *
+ * <file> is one of meminfo, cpuinfo, uptime, stat, diskstats, swaps,
+ * loadavg, slabinfo and cpuonline.
+ */
+struct lxcfs_policy {
+	/* Bitmask of LXC_TYPE_* files passed through from the host. */
+	__u64 host;
+	/* 1 or 0 to force the cpu view on or off, -1 to follow --enable-cfs. */
+	int cpuview;
+	/* Seconds a render may be reused, 0 renders on every read. */
+	unsigned int ttl[LXC_TYPE_MAX];
+};
+
+typedef int (*policy_render_t)(char *buf, size_t size, off_t offset,
+			       struct fuse_file_info *fi);
+
+/*
+ * Read file @type for the calling container according to its policy: pass
+ * @host_path through, serve a cached render or call @render.
+ */
+extern int policy_read(int type, const char *host_path, policy_render_t render,
+		       char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi);
+
+/* Whether the caller's policy shows the host's version of file @type. */
+extern bool policy_host_file(int type);
+
+/* Whether the cpu view should be used for @cgroup. */
+extern bool policy_use_cpuview(const char *cgroup, bool dflt);
+
+/*
+ * Replace the loaded policy with the one in @path. The old policy is kept if
+ * @path can't be parsed. Called by the lxcfs binary on SIGHUP.
+ */
+__visible extern int lxcfs_policy_reload(const char *path);
+
+extern void policy_exit(void);
+
+#endif /* __LXCFS_POLICY_H */
@@ -0,0 +1,402 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "prewarm.h"
+
+#include "bindings.h"
+#include "cgroups/cgroup.h"
+#include "cgroups/cgroup_utils.h"
+#include "memory_utils.h"
+#include "utils.h"
+
+/* Give up on a new cgroup that has no container process after this long. */
+#define PREWARM_TIMEOUT_SECS 10
+/* How often cgroups without a container process are looked at again. */
+#define PREWARM_POLL_MS 100
+
+/* Read through the mount on behalf of a new container. */
+static const char *const prewarm_files[] = {
+	LXC_TYPE_PROC_CPUINFO_PATH,
+	LXC_TYPE_PROC_DISKSTATS_PATH,
+	LXC_TYPE_PROC_LOADAVG_PATH,
+	LXC_TYPE_PROC_MEMINFO_PATH,
+	LXC_TYPE_PROC_STAT_PATH,
+	LXC_TYPE_PROC_SWAPS_PATH,
+	LXC_TYPE_PROC_UPTIME_PATH,
+	LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE_PATH,
+};
+
+struct prewarm_parent {
+	int wd;
+	char *cgroup;
+	struct prewarm_parent *next;
+};
+
+struct prewarm_pending {
+	char *cgroup;
+	int64_t deadline;
+	struct prewarm_pending *next;
+};
+
+static struct prewarm_parent *parents;
+static struct prewarm_pending *pending;
+static char prewarm_paths[ARRAY_SIZE(prewarm_files)][PATH_MAX];
+
+static bool running;
+static pthread_t prewarmer;
+static int inotify_fd = -EBADF;
+static int stop_fd = -EBADF;
+
+static void free_pending(struct prewarm_pending *p)
+{
+	free(p->cgroup);
+	free(p);
+}
+
+static void queue_cgroup(const char *parent, const char *name)
+{
+	struct prewarm_pending *p;
+
+	p = zalloc(sizeof(*p));
+	if (!p)
+		return;
+
+	p->cgroup = must_make_path(parent, name, NULL);
+	p->deadline = time(NULL) + PREWARM_TIMEOUT_SECS;
+	p->next = pending;
+	pending = p;
+}
+
+static void handle_events(const char *buf, ssize_t len)
+{
+	const struct inotify_event *ev;
+
+	for (const char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)p;
+
+		if (!(ev->mask & IN_CREATE) || !(ev->mask & IN_ISDIR) || !ev->len)
+			continue;
+
+		for (struct prewarm_parent *parent = parents; parent; parent = parent->next) {
+			if (parent->wd == ev->wd) {
+				queue_cgroup(parent->cgroup, ev->name);
+				break;
+			}
+		}
+	}
+}
+
+/* A process in @cgroup that lives in another pid namespace, 0 if none yet. */
+static pid_t container_pid(const char *cgroup)
+{
+	__do_free char *path = NULL, *procs = NULL;
+	char *line;
+	int cfd;
+
+	cfd = get_cgroup_fd("cpu");
+	if (cfd < 0)
+		return -EBADF;
+
+	path = must_make_path_relative(cgroup, "cgroup.procs", NULL);
+	procs = readat_file(cfd, path);
+	if (!procs)
+		return -errno;
+
+	lxc_iterate_parts(line, procs, "\n") {
+		pid_t pid;
+
+		if (sscanf(line, "%d", &pid) != 1)
+			continue;
+
+		if (!is_shared_pidns(pid))
+			return pid;
+	}
+
+	return 0;
+}
+
+static void prewarm_read_files(void)
+{
+	char buf[4096];
+
+	for (size_t i = 0; i < ARRAY_SIZE(prewarm_paths); i++) {
+		int fd;
+
+		fd = open(prewarm_paths[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		while (read(fd, buf, sizeof(buf)) > 0)
+			;
+		close(fd);
+	}
+}
+
+/*
+ * The reader blocks while liblxcfs is being reloaded so give up on it when
+ * we are asked to stop instead of holding up the reload.
+ */
+static void prewarm_wait(pid_t child)
+{
+	for (;;) {
+		struct pollfd fd = { .fd = stop_fd, .events = POLLIN };
+		pid_t ret;
+
+		ret = waitpid(child, NULL, WNOHANG);
+		if (ret == child || (ret < 0 && errno != EINTR))
+			return;
+
+		if (poll(&fd, 1, PREWARM_POLL_MS) > 0) {
+			kill(child, SIGKILL);
+			waitpid(child, NULL, 0);
+			return;
+		}
+	}
+}
+
+static void prewarm_container(pid_t pid)
+{
+	__do_close int nsfd = -EBADF;
+	char path[LXCFS_PROC_PID_NS_LEN];
+	pid_t child;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/pid", pid);
+	nsfd = open(path, O_RDONLY | O_CLOEXEC);
+	if (nsfd < 0)
+		return;
+
+	child = fork();
+	if (child < 0)
+		return;
+
+	if (child == 0) {
+		pid_t reader;
+
+		if (setns(nsfd, CLONE_NEWPID))
+			_exit(EXIT_FAILURE);
+
+		/* Only children enter the pid namespace. */
+		reader = lxcfs_raw_clone(0, NULL);
+		if (reader < 0)
+			_exit(EXIT_FAILURE);
+
+		if (reader == 0) {
+			if (prctl(PR_SET_PDEATHSIG, SIGKILL, 0, 0, 0))
+				_exit(EXIT_FAILURE);
+
+			prewarm_read_files();
+			_exit(EXIT_SUCCESS);
+		}
+
+		_exit(wait_for_pid(reader) ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	prewarm_wait(child);
+}
+
+static void process_pending(void)
+{
+	int64_t now = time(NULL);
+
+	for (struct prewarm_pending **it = &pending; *it;) {
+		struct prewarm_pending *p = *it;
+		pid_t pid;
+
+		pid = container_pid(p->cgroup);
+		if (pid > 0) {
+			lxcfs_debug("Pre-warming caches for %s through %d", p->cgroup, pid);
+			prewarm_container(pid);
+		} else if (pid == 0 && now < p->deadline) {
+			it = &p->next;
+			continue;
+		}
+
+		*it = p->next;
+		free_pending(p);
+	}
+}
+
+static void *prewarm_thread(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	lxcfs_background_thread_setup(arg);
+
+	for (;;) {
+		struct pollfd fds[] = {
+			{ .fd = inotify_fd,	.events = POLLIN },
+			{ .fd = stop_fd,	.events = POLLIN },
+		};
+		ssize_t len;
+
+		if (poll(fds, ARRAY_SIZE(fds), pending ? PREWARM_POLL_MS : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (fds[0].revents) {
+			len = read(inotify_fd, buf, sizeof(buf));
+			if (len > 0)
+				handle_events(buf, len);
+		}
+
+		process_pending();
+	}
+
+	return NULL;
+}
+
+static int watch_parent(const char *cgroup)
+{
+	struct prewarm_parent *parent;
+	char path[PATH_MAX];
+	const char *rel = cgroup;
+	int cfd, ret, wd;
+
+	cfd = get_cgroup_fd("cpu");
+	if (cfd < 0)
+		return -EBADF;
+
+	while (*rel == '/')
+		rel++;
+
+	ret = snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", cfd, rel);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return -ENAMETOOLONG;
+
+	wd = inotify_add_watch(inotify_fd, path, IN_CREATE | IN_ONLYDIR);
+	if (wd < 0)
+		return log_error(-errno, "%s - Failed to watch %s for new containers", strerror(errno), cgroup);
+
+	parent = zalloc(sizeof(*parent));
+	if (!parent)
+		return -ENOMEM;
+
+	parent->wd = wd;
+	parent->cgroup = must_copy_string(cgroup);
+	parent->next = parents;
+	parents = parent;
+
+	return 0;
+}
+
+static void free_parents(void)
+{
+	while (parents) {
+		struct prewarm_parent *parent = parents;
+
+		parents = parent->next;
+		free(parent->cgroup);
+		free(parent);
+	}
+
+	while (pending) {
+		struct prewarm_pending *p = pending;
+
+		pending = p->next;
+		free_pending(p);
+	}
+}
+
+int prewarm_start(const struct lxcfs_opts *opts)
+{
+	__do_free char *list = NULL;
+	const char *mountpoint;
+	char *cgroup;
+	int ret;
+
+	if (running || !lxcfs_prewarm(opts))
+		return 0;
+
+	mountpoint = lxcfs_mountpoint(opts);
+	if (!mountpoint)
+		return log_error(-EINVAL, "Pre-warming needs the mountpoint");
+
+	/* Built now, the reader runs in a forked child and must not allocate. */
+	for (size_t i = 0; i < ARRAY_SIZE(prewarm_files); i++) {
+		ret = snprintf(prewarm_paths[i], sizeof(prewarm_paths[i]), "%s%s",
+			       mountpoint, prewarm_files[i]);
+		if (ret < 0 || (size_t)ret >= sizeof(prewarm_paths[i]))
+			return log_error(-ENAMETOOLONG, "Mountpoint %s is too long", mountpoint);
+	}
+
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0)
+		return log_error(-errno, "%s - Failed to initialize inotify", strerror(errno));
+
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd < 0) {
+		ret = log_error(-errno, "%s - Failed to create eventfd", strerror(errno));
+		goto out_close;
+	}
+
+	list = must_copy_string(lxcfs_prewarm(opts));
+	lxc_iterate_parts(cgroup, list, ",")
+		watch_parent(cgroup);
+
+	if (!parents) {
+		ret = -ENOENT;
+		goto out_close;
+	}
+
+	ret = pthread_create(&prewarmer, NULL, prewarm_thread, (void *)opts);
+	if (ret) {
+		ret = log_error(-ret, "%s - Failed to create pre-warm thread", strerror(ret));
+		free_parents();
+		goto out_close;
+	}
+
+	running = true;
+	return 0;
+
+out_close:
+	close_prot_errno_disarm(inotify_fd);
+	close_prot_errno_disarm(stop_fd);
+	return ret;
+}
+
+void prewarm_exit(void)
+{
+	uint64_t val = 1;
+
+	if (!running)
+		return;
+
+	if (write(stop_fd, &val, sizeof(val)) != sizeof(val))
+		lxcfs_error("%s - Failed to stop pre-warm thread", strerror(errno));
+	else
+		pthread_join(prewarmer, NULL);
+
+	free_parents();
+	close_prot_errno_disarm(inotify_fd);
+	close_prot_errno_disarm(stop_fd);
+	running = false;
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_PREWARM_H
+#define __LXCFS_PREWARM_H
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "macro.h"
+
+struct lxcfs_opts;
+
+/*
+ * Warm caches for new containers before they read anything. Every cgroup
+ * created directly below one of the cgroups listed in --prewarm is watched
+ * until it holds a process from another pid namespace. A helper in that
+ * namespace then reads the virtualized files through the mount once, which
+ * resolves the init, the cgroup and creates the cpuview and loadavg nodes
+ * the container's own first reads would otherwise have to wait for.
+ *
+ * Returns 0 when there is nothing to watch or the watcher was started.
+ * @opts must stay valid until liblxcfs is unloaded.
+ */
+__visible extern int prewarm_start(const struct lxcfs_opts *opts);
+
+extern void prewarm_exit(void);
+
+#endif /* __LXCFS_PREWARM_H */
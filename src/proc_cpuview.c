@@ -36,22 +36,33 @@
 
 #include "proc_cpuview.h"
 
+#include "async_log.h"
 #include "bindings.h"
+#include "bpf_cpuacct.h"
+#include "cache_budget.h"
 #include "cgroup_fuse.h"
+#include "cgroup_watch.h"
 #include "cpuset_parse.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "cpu_topology.h"
 #include "memory_utils.h"
+#include "policy.h"
 #include "proc_loadavg.h"
 #include "utils.h"
+#include "watchdog.h"
 
 /* Data for CPU view */
 struct cg_proc_stat {
 	char *cg;
+	uint64_t id;			/* Kernel cgroup id, 0 if unknown. */
+	uint64_t generation;		/* Watch generation id was checked at. */
 	struct cpuacct_usage *usage; 	/* Real usage as read from the host's /proc/stat. */
 	struct cpuacct_usage *view; 	/* Usage stats reported to the container. */
 	int cpu_count;
+	int64_t lastuse;		/* For cache budget eviction. */
 	pthread_mutex_t lock; 		/* For node manipulation. */
+	int refs;			/* Lookups waiting for the node lock. */
 	struct cg_proc_stat *next;
 };
 
@@ -68,6 +79,30 @@ struct cg_proc_stat_head {
 #define CPUVIEW_HASH_SIZE 100
 static struct cg_proc_stat_head *proc_stat_history[CPUVIEW_HASH_SIZE];
 
+static int64_t cpuview_cache_oldest(void);
+static void cpuview_cache_evict(int64_t cutoff, uint64_t bytes);
+
+static struct lxcfs_cache cpuview_cache = {
+	.name	= "cpuview",
+	.oldest	= cpuview_cache_oldest,
+	.evict	= cpuview_cache_evict,
+};
+
+/*
+ * Nodes are keyed by path. The id only tells a cgroup that was created again
+ * under the same path apart, see revalidate_proc_stat_node().
+ */
+static inline int proc_stat_bucket(const char *cg)
+{
+	return calc_hash(cg) % CPUVIEW_HASH_SIZE;
+}
+
+static inline size_t proc_stat_node_size(const char *cg, int cpu_count)
+{
+	return sizeof(struct cg_proc_stat) + strlen(cg) + 1 +
+	       2 * sizeof(struct cpuacct_usage) * cpu_count;
+}
+
 static void reset_proc_stat_node(struct cg_proc_stat *node,
 				 struct cpuacct_usage *usage, int cpu_count)
 {
@@ -114,6 +149,9 @@ static bool expand_proc_stat_node(struct cg_proc_stat *node, int cpu_count)
 
 	free(node->view);
 	node->view = move_ptr(new_view);
+	cache_account_resize(&cpuview_cache,
+			     proc_stat_node_size(node->cg, node->cpu_count),
+			     proc_stat_node_size(node->cg, cpu_count));
 	node->cpu_count = cpu_count;
 
 	return true;
@@ -137,11 +175,37 @@ static void free_proc_stat_node(struct cg_proc_stat *node)
 
 define_cleanup_function(struct cg_proc_stat *, free_proc_stat_node);
 
+/*
+ * Lock @node without blocking on it under the bucket lock. The reference keeps
+ * pruning and eviction away until the node lock is held. Must be called with
+ * @head's lock held, returns with it dropped.
+ */
+static void lock_proc_stat_node(struct cg_proc_stat_head *head,
+				struct cg_proc_stat *node)
+{
+	__atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&head->lock);
+	pthread_mutex_lock(&node->lock);
+	__atomic_sub_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Lock @node for removal unless it is in use. Must be called with the bucket
+ * lock held for writing.
+ */
+static bool trylock_proc_stat_node(struct cg_proc_stat *node)
+{
+	if (__atomic_load_n(&node->refs, __ATOMIC_RELAXED))
+		return false;
+
+	return pthread_mutex_trylock(&node->lock) == 0;
+}
+
 static struct cg_proc_stat *add_proc_stat_node(struct cg_proc_stat *new_node)
 {
 	call_cleaner(free_proc_stat_node) struct cg_proc_stat *new = new_node;
 	struct cg_proc_stat *rv = new_node;
-	int hash = calc_hash(new->cg) % CPUVIEW_HASH_SIZE;
+	int hash = proc_stat_bucket(new->cg);
 	struct cg_proc_stat_head *head = proc_stat_history[hash];
 	struct cg_proc_stat *cur;
 
@@ -149,6 +213,7 @@ static struct cg_proc_stat *add_proc_stat_node(struct cg_proc_stat *new_node)
 
 	if (!head->next) {
 		head->next = move_ptr(new);
+		cache_account_add(&cpuview_cache, proc_stat_node_size(rv->cg, rv->cpu_count));
 		goto out_rwlock_unlock;
 	}
 
@@ -172,11 +237,12 @@ static struct cg_proc_stat *add_proc_stat_node(struct cg_proc_stat *new_node)
 
 		/* Add new node to end of list. */
 		cur->next = move_ptr(new);
+		cache_account_add(&cpuview_cache, proc_stat_node_size(rv->cg, rv->cpu_count));
 		goto out_rwlock_unlock;
 	}
 
 out_rwlock_unlock:
-	pthread_rwlock_unlock(&head->lock);
+	lock_proc_stat_node(head, rv);
 	return move_ptr(rv);
 }
 
@@ -193,6 +259,8 @@ static struct cg_proc_stat *new_proc_stat_node(struct cpuacct_usage *usage,
 	node->cg = strdup(cg);
 	if (!node->cg)
 		return NULL;
+	node->generation = cgroup_generation("cpuset", cg);
+	node->id = get_cgroup_id("cpuset", cg);
 
 	new_usage = memdup(usage, sizeof(struct cpuacct_usage) * cpu_count);
 	if (!new_usage)
@@ -203,6 +271,7 @@ static struct cg_proc_stat *new_proc_stat_node(struct cpuacct_usage *usage,
 		return NULL;
 
 	node->cpu_count = cpu_count;
+	node->lastuse = time(NULL);
 
 	if (pthread_mutex_init(&node->lock, NULL))
 		return NULL;
@@ -234,7 +303,9 @@ static struct cg_proc_stat *prune_proc_stat_list(struct cg_proc_stat *node)
 	struct cg_proc_stat *first = NULL;
 
 	for (struct cg_proc_stat *prev = NULL; node; ) {
-		if (!cgroup_supports("cpu", node->cg, "cpu.shares")) {
+		/* cpu.shares doesn't exist on cgroup2, cgroup.procs always does. */
+		if (!cgroup_supports("cpu", node->cg, "cgroup.procs") &&
+		    trylock_proc_stat_node(node)) {
 			struct cg_proc_stat *cur = node;
 
 			if (prev)
@@ -245,6 +316,10 @@ static struct cg_proc_stat *prune_proc_stat_list(struct cg_proc_stat *node)
 			node = node->next;
 			lxcfs_debug("Removing stat node for %s\n", cur);
 
+			pthread_mutex_unlock(&cur->lock);
+			cache_account_del(&cpuview_cache,
+					  proc_stat_node_size(cur->cg, cur->cpu_count),
+					  false);
 			free_proc_stat_node(cur);
 		} else {
 			if (!first)
@@ -294,25 +369,50 @@ static struct cg_proc_stat *find_proc_stat_node(struct cg_proc_stat_head *head,
 	node = head->next;
 
 	do {
-		if (strcmp(cg, node->cg) == 0)
+		if (strcmp(node->cg, cg) == 0)
 			goto out;
 	} while ((node = node->next));
 
-	node = NULL;
+	pthread_rwlock_unlock(&head->lock);
+	return NULL;
 
 out:
-	pthread_rwlock_unlock(&head->lock);
-	prune_proc_stat_history();
+	lock_proc_stat_node(head, node);
 	return node;
 }
 
+/*
+ * The id is only resolved again once the cgroup's watch generation moved, not
+ * on every lookup. A cgroup that was created again under the same path starts
+ * over. Must be called with node->lock held.
+ */
+static void revalidate_proc_stat_node(struct cg_proc_stat *node,
+				      struct cpuacct_usage *usage, int cpu_count)
+{
+	uint64_t generation, id;
+
+	generation = cgroup_generation("cpuset", node->cg);
+	if (generation && generation == node->generation)
+		return;
+
+	id = get_cgroup_id("cpuset", node->cg);
+	if (id && node->id && id != node->id)
+		reset_proc_stat_node(node, usage, cpu_count);
+
+	if (id)
+		node->id = id;
+	node->generation = generation;
+}
+
 static struct cg_proc_stat *find_or_create_proc_stat_node(struct cpuacct_usage *usage,
 							  int cpu_count, const char *cg)
 {
-	int hash = calc_hash(cg) % CPUVIEW_HASH_SIZE;
-	struct cg_proc_stat_head *head = proc_stat_history[hash];
+	struct cg_proc_stat_head *head = proc_stat_history[proc_stat_bucket(cg)];
 	struct cg_proc_stat *node;
 
+	prune_proc_stat_history();
+
+	/* Both return the node locked. */
 	node = find_proc_stat_node(head, cg);
 	if (!node) {
 		node = new_proc_stat_node(usage, cpu_count, cg);
@@ -323,7 +423,7 @@ static struct cg_proc_stat *find_or_create_proc_stat_node(struct cpuacct_usage *
 		lxcfs_debug("New stat node (%d) for %s\n", cpu_count, cg);
 	}
 
-	pthread_mutex_lock(&node->lock);
+	node->lastuse = time(NULL);
 
 	/*
 	 * If additional CPUs on the host have been enabled, CPU usage counter
@@ -339,6 +439,8 @@ static struct cg_proc_stat *find_or_create_proc_stat_node(struct cpuacct_usage *
 		}
 	}
 
+	revalidate_proc_stat_node(node, usage, cpu_count);
+
 	return node;
 }
 
@@ -400,33 +502,6 @@ static uint64_t diff_cpu_usage(struct cpuacct_usage *older,
 	return sum;
 }
 
-/*
- * Read cgroup CPU quota parameters from `cpu.cfs_quota_us` or
- * `cpu.cfs_period_us`, depending on `param`. Parameter value is returned
- * through `value`.
- */
-static bool read_cpu_cfs_param(const char *cg, const char *param, int64_t *value)
-{
-	__do_free char *str = NULL;
-	char file[STRLITERALLEN("cpu.cfs_period_us") + 1];
-	bool first = true;
-	int ret;
-
-	if (pure_unified_layout(cgroup_ops)) {
-		first = !strcmp(param, "quota");
-		ret = snprintf(file, sizeof(file), "cpu.max");
-	} else {
-		ret = snprintf(file, sizeof(file), "cpu.cfs_%s_us", param);
-	}
-	if (ret < 0 || (size_t)ret >= sizeof(file))
-		return false;
-
-	if (!cgroup_ops->get(cgroup_ops, "cpu", cg, file, &str))
-		return false;
-
-	return sscanf(str, first ? "%" PRId64 : "%*d %" PRId64, value) == 1;
-}
-
 /*
  * Return the exact number of visible CPUs based on CPU quotas.
  * If there is no quota set, zero is returned.
@@ -437,10 +512,7 @@ static double exact_cpu_count(const char *cg)
 	int nprocs;
 	int64_t cfs_quota, cfs_period;
 
-	if (!read_cpu_cfs_param(cg, "quota", &cfs_quota))
-		return 0;
-
-	if (!read_cpu_cfs_param(cg, "period", &cfs_period))
+	if (!cgroup_ops->get_cpu_quota(cgroup_ops, cg, &cfs_quota, &cfs_period))
 		return 0;
 
 	if (cfs_quota <= 0 || cfs_period <= 0)
@@ -448,7 +520,7 @@ static double exact_cpu_count(const char *cg)
 
 	rv = (double)cfs_quota / (double)cfs_period;
 
-	nprocs = get_nprocs();
+	nprocs = host_cpus_online();
 
 	if (rv > nprocs)
 		rv = nprocs;
@@ -467,10 +539,7 @@ int max_cpu_count(const char *cg)
 	int64_t cfs_quota, cfs_period;
 	int nr_cpus_in_cpuset = 0;
 
-	if (!read_cpu_cfs_param(cg, "quota", &cfs_quota))
-		return 0;
-
-	if (!read_cpu_cfs_param(cg, "period", &cfs_period))
+	if (!cgroup_ops->get_cpu_quota(cgroup_ops, cg, &cfs_quota, &cfs_period))
 		return 0;
 
 	cpuset = get_cpuset(cg);
@@ -493,7 +562,7 @@ int max_cpu_count(const char *cg)
 	if ((cfs_quota % cfs_period) > 0)
 		rv += 1;
 
-	nprocs = get_nprocs();
+	nprocs = host_cpus_online();
 	if (rv > nprocs)
 		rv = nprocs;
 
@@ -523,7 +592,7 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 	uint64_t total_sum, threshold;
 	struct cg_proc_stat *stat_node;
 
-	nprocs = get_nprocs_conf();
+	nprocs = host_cpus_possible();
 	if (cg_cpu_usage_size < nprocs)
 		nprocs = cg_cpu_usage_size;
 
@@ -586,7 +655,7 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 			cg_cpu_usage[curcpu].idle = idle + (all_used - cg_used);
 
 		} else {
-			lxcfs_error("cpu%d from %s has unexpected cpu time: %" PRIu64 " in /proc/stat, %" PRIu64 " in cpuacct.usage_all; unable to determine idle time",
+			lxcfs_error_ratelimit("cpu%d from %s has unexpected cpu time: %" PRIu64 " in /proc/stat, %" PRIu64 " in cpuacct.usage_all; unable to determine idle time",
 				    curcpu, cg, all_used, cg_used);
 			cg_cpu_usage[curcpu].idle = idle;
 		}
@@ -600,7 +669,7 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 	/* takes lock pthread_mutex_lock(&node->lock) */
 	stat_node = find_or_create_proc_stat_node(cg_cpu_usage, nprocs, cg);
 	if (!stat_node)
-		return log_error(0, "Failed to find/create stat node for %s", cg);
+		return log_error_ratelimit(0, "Failed to find/create stat node for %s", cg);
 
 	diff = zalloc(sizeof(struct cpuacct_usage) * nprocs);
 	if (!diff)
@@ -753,12 +822,12 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 		     user_sum, system_sum, idle_sum);
 	lxcfs_v("cpu-all: %s\n", buf);
 	if (l < 0) {
-		lxcfs_error("Failed to write cache");
+		lxcfs_error_ratelimit("Failed to write cache");
 		total_len = 0;
 		goto out_pthread_mutex_unlock;
 	}
 	if ((size_t)l >= buf_size) {
-		lxcfs_error("Write to cache was truncated");
+		lxcfs_error_ratelimit("Write to cache was truncated");
 		total_len = 0;
 		goto out_pthread_mutex_unlock;
 	}
@@ -784,12 +853,12 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 			     stat_node->view[curcpu].idle);
 		lxcfs_v("cpu: %s\n", buf);
 		if (l < 0) {
-			lxcfs_error("Failed to write cache");
+			lxcfs_error_ratelimit("Failed to write cache");
 			total_len = 0;
 			goto out_pthread_mutex_unlock;
 		}
 		if ((size_t)l >= buf_size) {
-			lxcfs_error("Write to cache was truncated");
+			lxcfs_error_ratelimit("Write to cache was truncated");
 			total_len = 0;
 			goto out_pthread_mutex_unlock;
 		}
@@ -802,12 +871,12 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 	/* Pass the rest of /proc/stat, start with the last line read */
 	l = snprintf(buf, buf_size, "%s", line);
 	if (l < 0) {
-		lxcfs_error("Failed to write cache");
+		lxcfs_error_ratelimit("Failed to write cache");
 		total_len = 0;
 		goto out_pthread_mutex_unlock;
 	}
 	if ((size_t)l >= buf_size) {
-		lxcfs_error("Write to cache was truncated");
+		lxcfs_error_ratelimit("Write to cache was truncated");
 		total_len = 0;
 		goto out_pthread_mutex_unlock;
 	}
@@ -820,12 +889,12 @@ int cpuview_proc_stat(const char *cg, const char *cpuset,
 	while (getline(&line, &linelen, f) != -1) {
 		l = snprintf(buf, buf_size, "%s", line);
 		if (l < 0) {
-			lxcfs_error("Failed to write cache");
+			lxcfs_error_ratelimit("Failed to write cache");
 			total_len = 0;
 			goto out_pthread_mutex_unlock;
 		}
 		if ((size_t)l >= buf_size) {
-			lxcfs_error("Write to cache was truncated");
+			lxcfs_error_ratelimit("Write to cache was truncated");
 			total_len = 0;
 			goto out_pthread_mutex_unlock;
 		}
@@ -839,6 +908,8 @@ out_pthread_mutex_unlock:
 	if (stat_node)
 		pthread_mutex_unlock(&stat_node->lock);
 
+	cache_budget_enforce();
+
 	return total_len;
 }
 
@@ -888,7 +959,7 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size: left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
@@ -906,7 +977,8 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 	if (!cpuset)
 		return 0;
 
-	if (cgroup_ops->can_use_cpuview(cgroup_ops) && opts && opts->use_cfs)
+	if (cgroup_ops->can_use_cpuview(cgroup_ops) &&
+	    policy_use_cpuview(cg, opts && opts->use_cfs))
 		use_view = true;
 	else
 		use_view = false;
@@ -940,9 +1012,9 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 				curcpu++;
 				l = snprintf(cache, cache_size, "processor	: %d\n", curcpu);
 				if (l < 0)
-					return log_error(0, "Failed to write cache");
+					return log_error_ratelimit(0, "Failed to write cache");
 				if ((size_t)l >= cache_size)
-					return log_error(0, "Write to cache was truncated");
+					return log_error_ratelimit(0, "Write to cache was truncated");
 				cache += l;
 				cache_size -= l;
 				total_len += l;
@@ -965,9 +1037,9 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 
 			l = snprintf(cache, cache_size, "processor %d:%s", curcpu, p);
 			if (l < 0)
-				return log_error(0, "Failed to write cache");
+				return log_error_ratelimit(0, "Failed to write cache");
 			if ((size_t)l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return log_error_ratelimit(0, "Write to cache was truncated");
 
 			cache += l;
 			cache_size -= l;
@@ -978,9 +1050,9 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		if (am_printing) {
 			l = snprintf(cache, cache_size, "%s", line);
 			if (l < 0)
-				return log_error(0, "Failed to write cache");
+				return log_error_ratelimit(0, "Failed to write cache");
 			if ((size_t)l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return log_error_ratelimit(0, "Write to cache was truncated");
 
 			cache += l;
 			cache_size -= l;
@@ -1027,11 +1099,205 @@ int proc_cpuinfo_read(char *buf, size_t size, off_t offset,
 		total_len = size;
 
 	/* read from off 0 */
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 
 	return total_len;
 }
 
+/*
+ * cgroup2 only reports the total in cpu.stat. Each read splits what it grew by
+ * since the previous read over the cpus, by the runtime the BPF accounting saw
+ * on each of them in the meantime or evenly over the cpuset when that isn't
+ * available, and adds it to what was handed out before. The per-cpu values
+ * thus never go backwards even when the container's load moves between cpus.
+ */
+struct cpu_stat_split {
+	char *cg;
+	int cpucount;
+	int64_t lastuse;
+	/* cpu.stat and the BPF runtime at the previous read. */
+	uint64_t user_usec;
+	uint64_t system_usec;
+	uint64_t *runtime;
+	/* Microseconds handed out to each cpu so far. */
+	double *user;
+	double *system;
+	struct cpu_stat_split *next;
+};
+
+/* Splits not read for this long are dropped when a new one is added. */
+#define CPU_STAT_SPLIT_TTL_SECS 300
+
+static struct cpu_stat_split *cpu_stat_splits[CPUVIEW_HASH_SIZE];
+static pthread_mutex_t cpu_stat_split_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cpu_stat_split_free(struct cpu_stat_split *split)
+{
+	free(split->cg);
+	free(split->runtime);
+	free(split->user);
+	free(split->system);
+	free(split);
+}
+
+/* Must be called under cpu_stat_split_lock. */
+static struct cpu_stat_split *cpu_stat_split_get(const char *cg, int cpucount,
+						 int64_t now)
+{
+	struct cpu_stat_split **it = &cpu_stat_splits[calc_hash(cg) % CPUVIEW_HASH_SIZE];
+	struct cpu_stat_split *split;
+
+	while ((split = *it)) {
+		if (strcmp(split->cg, cg) == 0 && split->cpucount == cpucount)
+			return split;
+
+		if (strcmp(split->cg, cg) == 0 ||
+		    now - split->lastuse > CPU_STAT_SPLIT_TTL_SECS * 1000) {
+			*it = split->next;
+			cpu_stat_split_free(split);
+			continue;
+		}
+
+		it = &split->next;
+	}
+
+	split = zalloc(sizeof(*split));
+	if (!split)
+		return NULL;
+
+	split->cg = strdup(cg);
+	split->runtime = zalloc(sizeof(*split->runtime) * cpucount);
+	split->user = zalloc(sizeof(*split->user) * cpucount);
+	split->system = zalloc(sizeof(*split->system) * cpucount);
+	if (!split->cg || !split->runtime || !split->user || !split->system) {
+		cpu_stat_split_free(split);
+		return NULL;
+	}
+	split->cpucount = cpucount;
+
+	*it = split;
+	return split;
+}
+
+static void cpu_stat_split_exit(void)
+{
+	for (int i = 0; i < CPUVIEW_HASH_SIZE; i++) {
+		while (cpu_stat_splits[i]) {
+			struct cpu_stat_split *split = cpu_stat_splits[i];
+
+			cpu_stat_splits[i] = split->next;
+			cpu_stat_split_free(split);
+		}
+	}
+}
+
+/* Add @user and @system microseconds to the cpus in proportion to @weight. */
+static void cpu_stat_split_add(struct cpu_stat_split *split, const uint64_t *weight,
+			       uint64_t total, uint64_t user, uint64_t system)
+{
+	for (int i = 0; i < split->cpucount; i++) {
+		double share = (double)weight[i] / total;
+
+		split->user[i] += user * share;
+		split->system[i] += system * share;
+	}
+}
+
+static int read_cpu_stat_usage(const char *cg, const char *cpuset,
+			       struct cpuacct_usage *cpu_usage, int cpucount,
+			       int64_t ticks_per_sec)
+{
+	__do_free char *path = NULL, *stat = NULL;
+	__do_free uint64_t *runtime = NULL, *delta = NULL, *even = NULL;
+	uint64_t cg_user = 0, cg_system = 0, total = 0, nr_even = 0;
+	struct cpu_stat_split *split;
+	int64_t now = monotonic_ms();
+	bool fresh;
+	char *line;
+
+	path = must_make_path_relative(cg, "cpu.stat", NULL);
+	stat = readat_file(cgroup_ops->unified->fd, path);
+	if (!stat)
+		return -1;
+
+	lxc_iterate_parts(line, stat, "\n") {
+		if (sscanf(line, "user_usec %" PRIu64, &cg_user) == 1)
+			continue;
+		sscanf(line, "system_usec %" PRIu64, &cg_system);
+	}
+
+	runtime = zalloc(sizeof(uint64_t) * cpucount);
+	delta = zalloc(sizeof(uint64_t) * cpucount);
+	even = zalloc(sizeof(uint64_t) * cpucount);
+	if (!runtime || !delta || !even)
+		return -ENOMEM;
+
+	if (bpf_cpuacct_read(cg, runtime, cpucount) == 0)
+		for (int i = 0; i < cpucount; i++)
+			total += runtime[i];
+
+	for (int i = 0; i < cpucount; i++) {
+		if (host_cpu_online(i) && (!cpuset || cpu_in_cpuset(i, cpuset))) {
+			even[i] = 1;
+			nr_even++;
+		}
+	}
+
+	if (!total && !nr_even)
+		return -1;
+
+	pthread_mutex_lock(&cpu_stat_split_lock);
+	split = cpu_stat_split_get(cg, cpucount, now);
+	if (!split) {
+		pthread_mutex_unlock(&cpu_stat_split_lock);
+		return -ENOMEM;
+	}
+
+	/* New or recreated cgroups start from a split of the totals. */
+	fresh = !split->lastuse || cg_user < split->user_usec ||
+		cg_system < split->system_usec;
+	if (fresh) {
+		memset(split->user, 0, sizeof(*split->user) * cpucount);
+		memset(split->system, 0, sizeof(*split->system) * cpucount);
+		if (total)
+			cpu_stat_split_add(split, runtime, total, cg_user, cg_system);
+		else
+			cpu_stat_split_add(split, even, nr_even, cg_user, cg_system);
+	} else {
+		uint64_t delta_total = 0;
+
+		/* Counters the BPF map forgot in between don't count. */
+		for (int i = 0; i < cpucount; i++) {
+			if (runtime[i] > split->runtime[i])
+				delta[i] = runtime[i] - split->runtime[i];
+			delta_total += delta[i];
+		}
+
+		if (delta_total)
+			cpu_stat_split_add(split, delta, delta_total,
+					   cg_user - split->user_usec,
+					   cg_system - split->system_usec);
+		else if (nr_even)
+			cpu_stat_split_add(split, even, nr_even,
+					   cg_user - split->user_usec,
+					   cg_system - split->system_usec);
+	}
+
+	memcpy(split->runtime, runtime, sizeof(*runtime) * cpucount);
+	split->user_usec = cg_user;
+	split->system_usec = cg_system;
+	split->lastuse = now;
+
+	for (int i = 0; i < cpucount; i++) {
+		/* Convert the time from microseconds to USER_HZ */
+		cpu_usage[i].user = split->user[i] / 1000 / 1000 * ticks_per_sec;
+		cpu_usage[i].system = split->system[i] / 1000 / 1000 * ticks_per_sec;
+	}
+	pthread_mutex_unlock(&cpu_stat_split_lock);
+
+	return 0;
+}
+
 /*
  * Returns 0 on success.
  * It is the caller's responsibility to free `return_usage`, unless this
@@ -1048,25 +1314,34 @@ int read_cpuacct_usage_all(char *cg, char *cpuset,
 	int cg_cpu;
 	uint64_t cg_user, cg_system;
 	int64_t ticks_per_sec;
+	struct hierarchy *h;
 
-	ticks_per_sec = sysconf(_SC_CLK_TCK);
-	if (ticks_per_sec < 0 && errno == EINVAL) {
+	ticks_per_sec = host_clock_ticks();
+	if (ticks_per_sec <= 0) {
 		lxcfs_debug("%m - Failed to determine number of ticks per second");
 		return -1;
 	}
 
-	cpucount = get_nprocs_conf();
+	cpucount = host_cpus_possible();
 	cpu_usage = malloc(sizeof(struct cpuacct_usage) * cpucount);
 	if (!cpu_usage)
 		return -ENOMEM;
 
 	memset(cpu_usage, 0, sizeof(struct cpuacct_usage) * cpucount);
-	if (!cgroup_ops->get(cgroup_ops, "cpuacct", cg, "cpuacct.usage_all", &usage_str)) {
+	h = cgroup_ops->get_hierarchy(cgroup_ops, "cpuacct");
+	if (!h && pure_unified_layout(cgroup_ops)) {
+		/* Without it callers fall back to the host's numbers. */
+		if (!bpf_cpuacct_enabled())
+			return -1;
+
+		ret = read_cpu_stat_usage(cg, cpuset, cpu_usage, cpucount, ticks_per_sec);
+		if (ret)
+			return ret;
+	} else if (!h || !h->has_cpuacct_usage_all) {
 		char *sep = " \t\n";
 		char *tok;
 
-		/* Read cpuacct.usage_percpu instead. */
-		lxcfs_debug("Falling back to cpuacct.usage_percpu");
+		/* Older kernels only have cpuacct.usage_percpu. */
 		if (!cgroup_ops->get(cgroup_ops, "cpuacct", cg, "cpuacct.usage_percpu", &usage_str))
 			return -1;
 
@@ -1088,8 +1363,11 @@ int read_cpuacct_usage_all(char *cg, char *cpuset,
 			lxcfs_debug("cpu%d with time %s", i, tok);
 		}
 	} else {
+		if (!cgroup_ops->get(cgroup_ops, "cpuacct", cg, "cpuacct.usage_all", &usage_str))
+			return -1;
+
 		if (sscanf(usage_str, "cpu user system\n%n", &read_cnt) != 0)
-			return log_error(-1, "read_cpuacct_usage_all reading first line from %s/cpuacct.usage_all failed", cg);
+			return log_error_ratelimit(-1, "read_cpuacct_usage_all reading first line from %s/cpuacct.usage_all failed", cg);
 
 		read_pos += read_cnt;
 
@@ -1102,7 +1380,7 @@ int read_cpuacct_usage_all(char *cg, char *cpuset,
 				break;
 
 			if (ret != 3)
-				return log_error(-EINVAL, "Failed to parse cpuacct.usage_all line %s from cgroup %s",
+				return log_error_ratelimit(-EINVAL, "Failed to parse cpuacct.usage_all line %s from cgroup %s",
 						usage_str + read_pos, cg);
 
 			read_pos += read_cnt;
@@ -1119,6 +1397,61 @@ int read_cpuacct_usage_all(char *cg, char *cpuset,
 	return 0;
 }
 
+static int64_t cpuview_cache_oldest(void)
+{
+	int64_t oldest = -1;
+
+	for (int i = 0; i < CPUVIEW_HASH_SIZE; i++) {
+		struct cg_proc_stat_head *head = proc_stat_history[i];
+
+		pthread_rwlock_rdlock(&head->lock);
+		for (struct cg_proc_stat *node = head->next; node; node = node->next) {
+			if (oldest < 0 || node->lastuse < oldest)
+				oldest = node->lastuse;
+		}
+		pthread_rwlock_unlock(&head->lock);
+	}
+
+	return oldest;
+}
+
+static void cpuview_cache_evict(int64_t cutoff, uint64_t bytes)
+{
+	uint64_t freed = 0;
+
+	for (int i = 0; i < CPUVIEW_HASH_SIZE && freed < bytes; i++) {
+		struct cg_proc_stat_head *head = proc_stat_history[i];
+
+		pthread_rwlock_wrlock(&head->lock);
+		for (struct cg_proc_stat *node = head->next, *prev = NULL; node;) {
+			struct cg_proc_stat *cur = node;
+			size_t node_size;
+
+			/* Nodes in use are locked or referenced, skip them. */
+			if (node->lastuse > cutoff || freed >= bytes ||
+			    !trylock_proc_stat_node(node)) {
+				prev = node;
+				node = node->next;
+				continue;
+			}
+
+			if (prev)
+				prev->next = node->next;
+			else
+				head->next = node->next;
+			node = node->next;
+
+			lxcfs_debug("Evicting stat node for %s\n", cur->cg);
+			pthread_mutex_unlock(&cur->lock);
+			node_size = proc_stat_node_size(cur->cg, cur->cpu_count);
+			cache_account_del(&cpuview_cache, node_size, true);
+			free_proc_stat_node(cur);
+			freed += node_size;
+		}
+		pthread_rwlock_unlock(&head->lock);
+	}
+}
+
 static bool cpuview_init_head(struct cg_proc_stat_head **head)
 {
 	__do_free struct cg_proc_stat_head *h;
@@ -1148,6 +1481,7 @@ bool init_cpuview(void)
 			goto err;
 	}
 
+	cache_register(&cpuview_cache);
 	return true;
 
 err:
@@ -1181,6 +1515,9 @@ static void cpuview_free_head(struct cg_proc_stat_head *head)
 
 void free_cpuview(void)
 {
+	cache_unregister(&cpuview_cache);
+	cpu_stat_split_exit();
+
 	for (int i = 0; i < CPUVIEW_HASH_SIZE; i++)
 		if (proc_stat_history[i])
 			cpuview_free_head(proc_stat_history[i]);
@@ -16,6 +16,7 @@
 #include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,16 +37,23 @@
 
 #include "proc_fuse.h"
 
+#include "async_log.h"
 #include "bindings.h"
+#include "cache_budget.h"
 #include "cgroup_fuse.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
+#include "cpu_topology.h"
 #include "cpuset_parse.h"
+#include "file_info_pool.h"
 #include "lxcfs_fuse_compat.h"
 #include "memory_utils.h"
+#include "policy.h"
 #include "proc_loadavg.h"
 #include "proc_cpuview.h"
+#include "render_stream.h"
 #include "utils.h"
+#include "watchdog.h"
 
 struct memory_stat {
 	uint64_t hierarchical_memory_limit;
@@ -67,8 +75,24 @@ struct memory_stat {
 	uint64_t total_inactive_file;
 	uint64_t total_active_file;
 	uint64_t total_unevictable;
+	/* cgroup2 only */
+	uint64_t slab_reclaimable;
+	uint64_t slab_unreclaimable;
+	uint64_t kernel_stack;
+	uint64_t slab;
 };
 
+/* Large enough for the header and a handful of caches. */
+#define LXCFS_STATS_SIZE 4096
+
+/* lxcfs' own statistics are only visible to root on the host. */
+static bool lxcfs_stats_visible(void)
+{
+	struct fuse_context *fc = fuse_get_context();
+
+	return fc && fc->uid == 0 && is_host_pidns(fc->pid);
+}
+
 static off_t get_procfile_size(const char *path)
 {
 	__do_fclose FILE *f = NULL;
@@ -88,6 +112,7 @@ static off_t get_procfile_size(const char *path)
 
 __lxcfs_fuse_ops int proc_getattr(const char *path, struct stat *sb)
 {
+	watch_request("getattr", path);
 	struct timespec now;
 
 	memset(sb, 0, sizeof(struct stat));
@@ -116,6 +141,14 @@ __lxcfs_fuse_ops int proc_getattr(const char *path, struct stat *sb)
 		return 0;
 	}
 
+	if (strcmp(path, LXC_TYPE_PROC_LXCFS_STATS_PATH) == 0 &&
+	    lxcfs_stats_visible()) {
+		sb->st_size = LXCFS_STATS_SIZE;
+		sb->st_mode = S_IFREG | 00400;
+		sb->st_nlink = 1;
+		return 0;
+	}
+
 	return -ENOENT;
 }
 
@@ -123,6 +156,7 @@ __lxcfs_fuse_ops int proc_readdir(const char *path, void *buf,
 				  fuse_fill_dir_t filler, off_t offset,
 				  struct fuse_file_info *fi)
 {
+	watch_request("readdir", path);
 	if (DIR_FILLER(filler, buf, ".",		NULL, 0) != 0 ||
 	    DIR_FILLER(filler, buf, "..",		NULL, 0) != 0 ||
 	    DIR_FILLER(filler, buf, "cpuinfo",	NULL, 0) != 0 ||
@@ -140,7 +174,8 @@ __lxcfs_fuse_ops int proc_readdir(const char *path, void *buf,
 
 __lxcfs_fuse_ops int proc_open(const char *path, struct fuse_file_info *fi)
 {
-	__do_free struct file_info *info = NULL;
+	watch_request("open", path);
+	struct file_info *info;
 	int type = -1;
 
 	if (strcmp(path, "/proc/meminfo") == 0)
@@ -159,29 +194,28 @@ __lxcfs_fuse_ops int proc_open(const char *path, struct fuse_file_info *fi)
 		type = LXC_TYPE_PROC_LOADAVG;
 	else if (strcmp(path, "/proc/slabinfo") == 0)
 		type = LXC_TYPE_PROC_SLABINFO;
+	else if (strcmp(path, LXC_TYPE_PROC_LXCFS_STATS_PATH) == 0 &&
+		 lxcfs_stats_visible())
+		type = LXC_TYPE_PROC_LXCFS_STATS;
 	if (type == -1)
 		return -ENOENT;
 
-	info = zalloc(sizeof(*info));
+	info = file_info_new(type, path);
 	if (!info)
 		return -ENOMEM;
 
-	info->type = type;
-
-	info->buflen = get_procfile_size(path) + BUF_RESERVE_SIZE;
-
-	info->buf = zalloc(info->buflen);
-	if (!info->buf)
-		return -ENOMEM;
-	/* set actual size to buffer size */
-	info->size = info->buflen;
+	/* Files shown as-is don't need to go through us on every read. */
+	if (type != LXC_TYPE_PROC_LXCFS_STATS &&
+	    (!liblxcfs_functional() || policy_host_file(type)))
+		passthrough_open(path, fi, info);
 
-	fi->fh = PTR_TO_UINT64(move_ptr(info));
+	fi->fh = PTR_TO_UINT64(info);
 	return 0;
 }
 
 __lxcfs_fuse_ops int proc_access(const char *path, int mask)
 {
+	watch_request("access", path);
 	if (strcmp(path, "/proc") == 0 && access(path, R_OK) == 0)
 		return 0;
 
@@ -209,7 +243,7 @@ static uint64_t get_memlimit(const char *cgroup, bool swap)
 	else
 		ret = cgroup_ops->get_memory_max(cgroup_ops, cgroup, &memlimit_str);
 	if (ret > 0 && memlimit_str[0] && safe_uint64(memlimit_str, &memlimit, 10) < 0)
-		lxcfs_error("Failed to convert memlimit %s", memlimit_str);
+		lxcfs_error_ratelimit("Failed to convert memlimit %s", memlimit_str);
 
 	return memlimit;
 }
@@ -339,7 +373,7 @@ static int proc_swaps_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size: left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
@@ -360,7 +394,7 @@ static int proc_swaps_read(char *buf, size_t size, off_t offset,
 		return 0;
 
 	if (safe_uint64(memusage_str, &memusage, 10) < 0)
-		lxcfs_error("Failed to convert memusage %s", memusage_str);
+		lxcfs_error_ratelimit("Failed to convert memusage %s", memusage_str);
 
 	if (wants_swap) {
 		memswlimit = get_min_memlimit(cgroup, true);
@@ -421,14 +455,14 @@ static int proc_swaps_read(char *buf, size_t size, off_t offset,
 	}
 
 	if (total_len < 0 || l < 0)
-		return log_error(0, "Failed writing to cache");
+		return log_error_ratelimit(0, "Failed writing to cache");
 
 	d->cached = 1;
 	d->size = (int)total_len;
 
 	if ((size_t)total_len > size)
 		total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 
 	return total_len;
 }
@@ -510,7 +544,7 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size: left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
@@ -630,9 +664,9 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 
 		l = snprintf(cache, cache_size, "%s", lbuf);
 		if (l < 0)
-			return log_error(0, "Failed to write cache");
+			return log_error_ratelimit(0, "Failed to write cache");
 		if ((size_t)l >= cache_size)
-			return log_error(0, "Write to cache was truncated");
+			return log_error_ratelimit(0, "Write to cache was truncated");
 
 		cache += l;
 		cache_size -= l;
@@ -643,7 +677,7 @@ static int proc_diskstats_read(char *buf, size_t size, off_t offset,
 	d->size = total_len;
 	if (total_len > size)
 		total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 
 	return total_len;
 }
@@ -663,13 +697,11 @@ static inline void iwashere(void)
  * account as well. If someone has a clever solution for this please send a
  * patch!
  */
-static double get_reaper_busy(pid_t task)
+static double get_reaper_busy(pid_t initpid)
 {
 	__do_free char *cgroup = NULL, *usage_str = NULL;
 	uint64_t usage = 0;
-	pid_t initpid;
 
-	initpid = lookup_initpid_in_store(task);
 	if (initpid <= 0)
 		return 0;
 
@@ -682,111 +714,38 @@ static double get_reaper_busy(pid_t task)
 		return 0;
 
 	if (safe_uint64(usage_str, &usage, 10) < 0)
-		lxcfs_error("Failed to convert usage %s", usage_str);
+		lxcfs_error_ratelimit("Failed to convert usage %s", usage_str);
 
 	return ((double)usage / 1000000000);
 }
 
-static uint64_t get_reaper_start_time(pid_t pid)
-{
-	__do_free void *fopen_cache = NULL;
-	__do_fclose FILE *f = NULL;
-	int ret;
-	uint64_t starttime;
-	char path[STRLITERALLEN("/proc/") + LXCFS_NUMSTRLEN64 +
-		  STRLITERALLEN("/stat") + 1];
-	pid_t qpid;
-
-	qpid = lookup_initpid_in_store(pid);
-	if (qpid <= 0)
-		return ret_errno(EINVAL);
-
-	ret = snprintf(path, sizeof(path), "/proc/%d/stat", qpid);
-	if (ret < 0 || (size_t)ret >= sizeof(path))
-		return ret_errno(EINVAL);
-
-	f = fopen_cached(path, "re", &fopen_cache);
-	if (!f)
-		return ret_errno(EINVAL);
-
-	/* Note that the *scanf() argument supression requires that length
-	 * modifiers such as "l" are omitted. Otherwise some compilers will yell
-	 * at us. It's like telling someone you're not married and then asking
-	 * if you can bring your wife to the party.
-	 */
-	ret = fscanf(f, "%*d "      /* (1)  pid         %d   */
-			"%*s "      /* (2)  comm        %s   */
-			"%*c "      /* (3)  state       %c   */
-			"%*d "      /* (4)  ppid        %d   */
-			"%*d "      /* (5)  pgrp        %d   */
-			"%*d "      /* (6)  session     %d   */
-			"%*d "      /* (7)  tty_nr      %d   */
-			"%*d "      /* (8)  tpgid       %d   */
-			"%*u "      /* (9)  flags       %u   */
-			"%*u "      /* (10) minflt      %lu  */
-			"%*u "      /* (11) cminflt     %lu  */
-			"%*u "      /* (12) majflt      %lu  */
-			"%*u "      /* (13) cmajflt     %lu  */
-			"%*u "      /* (14) utime       %lu  */
-			"%*u "      /* (15) stime       %lu  */
-			"%*d "      /* (16) cutime      %ld  */
-			"%*d "      /* (17) cstime      %ld  */
-			"%*d "      /* (18) priority    %ld  */
-			"%*d "      /* (19) nice        %ld  */
-			"%*d "      /* (20) num_threads %ld  */
-			"%*d "      /* (21) itrealvalue %ld  */
-			"%" PRIu64, /* (22) starttime   %llu */
-		     &starttime);
-	if (ret != 1)
-		return ret_errno(EINVAL);
-
-	return ret_set_errno(starttime, 0);
-}
-
-static double get_reaper_start_time_in_sec(pid_t pid)
+/* @starttime is the start time of the reaper in clock ticks after boot. */
+static double get_reaper_age(uint64_t starttime)
 {
-	uint64_t clockticks, ticks_per_sec;
-	int64_t ret;
-	double res = 0;
+	long ticks_per_sec;
+	uint64_t uptime_ms;
+	double procstart;
+	struct timespec spec;
 
-	clockticks = get_reaper_start_time(pid);
-	if (clockticks <= 0)
-		return log_debug(0, "Failed to retrieve start time of pid %d", pid);
+	if (!starttime)
+		return log_debug(0, "Failed to retrieve start time of reaper");
 
-	ret = sysconf(_SC_CLK_TCK);
-	if (ret < 0)
+	ticks_per_sec = host_clock_ticks();
+	if (ticks_per_sec <= 0)
 		return log_debug(0, "Failed to determine number of clock ticks in a second");
 
-	ticks_per_sec = (uint64_t)ret;
-	res = (double)clockticks / ticks_per_sec;
-	return res;
-}
-
-static double get_reaper_age(pid_t pid)
-{
-	uint64_t uptime_ms;
-	double procstart, procage;
-
 	/*
 	 * We need to substract the time the process has started since system
 	 * boot minus the time when the system has started to get the actual
 	 * reaper age.
 	 */
-	procstart = get_reaper_start_time_in_sec(pid);
-	procage = procstart;
-	if (procstart > 0) {
-		int ret;
-		struct timespec spec;
-
-		ret = clock_gettime(CLOCK_BOOTTIME, &spec);
-		if (ret < 0)
-			return 0;
+	procstart = (double)starttime / ticks_per_sec;
 
-		uptime_ms = (spec.tv_sec * 1000) + (spec.tv_nsec * 1e-6);
-		procage = (uptime_ms - (procstart * 1000)) / 1000;
-	}
+	if (clock_gettime(CLOCK_BOOTTIME, &spec) < 0)
+		return 0;
 
-	return procage;
+	uptime_ms = (spec.tv_sec * 1000) + (spec.tv_nsec * 1e-6);
+	return (uptime_ms - (procstart * 1000)) / 1000;
 }
 
 /*
@@ -802,6 +761,8 @@ static int proc_uptime_read(char *buf, size_t size, off_t offset,
 	char *cache = d->buf;
 	ssize_t total_len = 0, ret = 0;
 	double busytime, idletime, reaperage;
+	uint64_t starttime = 0;
+	pid_t initpid;
 
 #ifdef RELOADTEST
 	iwashere();
@@ -818,18 +779,20 @@ static int proc_uptime_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size : left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
 
-	reaperage = get_reaper_age(fc->pid);
+	/* The reaper's start time is cached alongside its pid. */
+	initpid = lookup_initpid_starttime(fc->pid, &starttime);
+	reaperage = get_reaper_age(initpid > 0 ? starttime : 0);
 	/*
 	 * To understand why this is done, please read the comment to the
 	 * get_reaper_busy() function.
 	 */
 	idletime = reaperage;
-	busytime = get_reaper_busy(fc->pid);
+	busytime = get_reaper_busy(initpid);
 	if (reaperage >= busytime)
 		idletime = reaperage - busytime;
 
@@ -842,7 +805,7 @@ static int proc_uptime_read(char *buf, size_t size, off_t offset,
 	d->size = total_len;
 	if ((size_t)total_len > size)
 		total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 
 	return total_len;
 }
@@ -883,7 +846,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size : left;
-		memcpy(buf, d->buf + offset, total_len);
+		copy_out(buf, d->buf + offset, total_len);
 
 		return total_len;
 	}
@@ -915,7 +878,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 
 	/* Skip first system cpu line. */
 	if (getline(&line, &linelen, f) < 0)
-		return log_error(0, "proc_stat_read read first line failed");
+		return log_error_ratelimit(0, "proc_stat_read read first line failed");
 
 	/*
 	 * Read cpuacct.usage_all for all CPUs.
@@ -923,7 +886,8 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 	 * CPU usage. If not, values from the host's /proc/stat are used.
 	 */
 	if (read_cpuacct_usage_all(cg, cpuset, &cg_cpu_usage, &cg_cpu_usage_size) == 0) {
-		if (cgroup_ops->can_use_cpuview(cgroup_ops) && opts && opts->use_cfs) {
+		if (cgroup_ops->can_use_cpuview(cgroup_ops) &&
+		    policy_use_cpuview(cg, opts && opts->use_cfs)) {
 			total_len = cpuview_proc_stat(cg, cpuset, cg_cpu_usage,
 						      cg_cpu_usage_size, f,
 						      d->buf, d->buflen);
@@ -946,9 +910,9 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 			/* not a ^cpuN line containing a number N, just print it */
 			l = snprintf(cache, cache_size, "%s", line);
 			if (l < 0)
-				return log_error(0, "Failed to write cache");
+				return log_error_ratelimit(0, "Failed to write cache");
 			if ((size_t)l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return log_error_ratelimit(0, "Write to cache was truncated");
 
 			cache += l;
 			cache_size -= l;
@@ -983,9 +947,9 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 
 			l = snprintf(cache, cache_size, "cpu%d%s", curcpu, c);
 			if (l < 0)
-				return log_error(0, "Failed to write cache");
+				return log_error_ratelimit(0, "Failed to write cache");
 			if ((size_t)l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return log_error_ratelimit(0, "Write to cache was truncated");
 
 			cache += l;
 			cache_size -= l;
@@ -1015,9 +979,9 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 				     curcpu, cg_cpu_usage[physcpu].user,
 				     cg_cpu_usage[physcpu].system, new_idle);
 			if (l < 0)
-				return log_error(0, "Failed to write cache");
+				return log_error_ratelimit(0, "Failed to write cache");
 			if ((size_t)l >= cache_size)
-				return log_error(0, "Write to cache was truncated");
+				return log_error_ratelimit(0, "Write to cache was truncated");
 
 			cache += l;
 			cache_size -= l;
@@ -1058,7 +1022,7 @@ static int proc_stat_read(char *buf, size_t size, off_t offset,
 		cache += cpuall_len;
 	} else {
 		/* shouldn't happen */
-		lxcfs_error("proc_stat_read copy cpuall failed, cpuall_len=%d", cpuall_len);
+		lxcfs_error_ratelimit("proc_stat_read copy cpuall failed, cpuall_len=%d", cpuall_len);
 		cpuall_len = 0;
 	}
 
@@ -1071,18 +1035,44 @@ out:
 	if (total_len > size)
 		total_len = size;
 
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 	return total_len;
 }
 
-/* Note that "memory.stat" in cgroup2 is hierarchical by default. */
+static const size_t memory_stat_offsets[MEMORY_STAT_MAX] = {
+	[MEMORY_STAT_HIERARCHICAL_MEMORY_LIMIT]	= offsetof(struct memory_stat, hierarchical_memory_limit),
+	[MEMORY_STAT_HIERARCHICAL_MEMSW_LIMIT]	= offsetof(struct memory_stat, hierarchical_memsw_limit),
+	[MEMORY_STAT_CACHE]			= offsetof(struct memory_stat, total_cache),
+	[MEMORY_STAT_RSS]			= offsetof(struct memory_stat, total_rss),
+	[MEMORY_STAT_RSS_HUGE]			= offsetof(struct memory_stat, total_rss_huge),
+	[MEMORY_STAT_SHMEM]			= offsetof(struct memory_stat, total_shmem),
+	[MEMORY_STAT_MAPPED_FILE]		= offsetof(struct memory_stat, total_mapped_file),
+	[MEMORY_STAT_DIRTY]			= offsetof(struct memory_stat, total_dirty),
+	[MEMORY_STAT_WRITEBACK]			= offsetof(struct memory_stat, total_writeback),
+	[MEMORY_STAT_SWAP]			= offsetof(struct memory_stat, total_swap),
+	[MEMORY_STAT_PGPGIN]			= offsetof(struct memory_stat, total_pgpgin),
+	[MEMORY_STAT_PGPGOUT]			= offsetof(struct memory_stat, total_pgpgout),
+	[MEMORY_STAT_PGFAULT]			= offsetof(struct memory_stat, total_pgfault),
+	[MEMORY_STAT_PGMAJFAULT]		= offsetof(struct memory_stat, total_pgmajfault),
+	[MEMORY_STAT_INACTIVE_ANON]		= offsetof(struct memory_stat, total_inactive_anon),
+	[MEMORY_STAT_ACTIVE_ANON]		= offsetof(struct memory_stat, total_active_anon),
+	[MEMORY_STAT_INACTIVE_FILE]		= offsetof(struct memory_stat, total_inactive_file),
+	[MEMORY_STAT_ACTIVE_FILE]		= offsetof(struct memory_stat, total_active_file),
+	[MEMORY_STAT_UNEVICTABLE]		= offsetof(struct memory_stat, total_unevictable),
+	[MEMORY_STAT_SLAB_RECLAIMABLE]		= offsetof(struct memory_stat, slab_reclaimable),
+	[MEMORY_STAT_SLAB_UNRECLAIMABLE]	= offsetof(struct memory_stat, slab_unreclaimable),
+	[MEMORY_STAT_KERNEL_STACK]		= offsetof(struct memory_stat, kernel_stack),
+	[MEMORY_STAT_SLAB]			= offsetof(struct memory_stat, slab),
+};
+
+/* The names for the memory hierarchy's layout were bound at init. */
 static bool cgroup_parse_memory_stat(const char *cgroup, struct memory_stat *mstat)
 {
 	__do_close int fd = -EBADF;
 	__do_fclose FILE *f = NULL;
 	__do_free char *line = NULL;
 	__do_free void *fdopen_cache = NULL;
-	bool unified;
+	const char *const *keys = cgroup_ops->memory_stat_keys;
 	size_t len = 0;
 	ssize_t linelen;
 
@@ -1094,52 +1084,74 @@ static bool cgroup_parse_memory_stat(const char *cgroup, struct memory_stat *mst
 	if (!f)
 		return false;
 
-	unified = pure_unified_layout(cgroup_ops);
 	while ((linelen = getline(&line, &len, f)) != -1) {
-		if (!unified && startswith(line, "hierarchical_memory_limit")) {
-			sscanf(line, "hierarchical_memory_limit %" PRIu64, &(mstat->hierarchical_memory_limit));
-		} else if (!unified && startswith(line, "hierarchical_memsw_limit")) {
-			sscanf(line, "hierarchical_memsw_limit %" PRIu64, &(mstat->hierarchical_memsw_limit));
-		} else if (startswith(line, unified ? "file" :"total_cache")) {
-			sscanf(line, unified ? "file %" PRIu64 : "total_cache %" PRIu64, &(mstat->total_cache));
-		} else if (!unified && startswith(line, "total_rss")) {
-			sscanf(line, "total_rss %" PRIu64, &(mstat->total_rss));
-		} else if (!unified && startswith(line, "total_rss_huge")) {
-			sscanf(line, "total_rss_huge %" PRIu64, &(mstat->total_rss_huge));
-		} else if (startswith(line, unified ? "shmem" : "total_shmem")) {
-			sscanf(line, unified ? "shmem %" PRIu64 : "total_shmem %" PRIu64, &(mstat->total_shmem));
-		} else if (startswith(line, unified ? "file_mapped" : "total_mapped_file")) {
-			sscanf(line, unified ? "file_mapped %" PRIu64 : "total_mapped_file %" PRIu64, &(mstat->total_mapped_file));
-		} else if (!unified && startswith(line, "total_dirty")) {
-			sscanf(line, "total_dirty %" PRIu64, &(mstat->total_dirty));
-		} else if (!unified && startswith(line, "total_writeback")) {
-			sscanf(line, "total_writeback %" PRIu64, &(mstat->total_writeback));
-		} else if (!unified && startswith(line, "total_swap")) {
-			sscanf(line, "total_swap %" PRIu64, &(mstat->total_swap));
-		} else if (!unified && startswith(line, "total_pgpgin")) {
-			sscanf(line, "total_pgpgin %" PRIu64, &(mstat->total_pgpgin));
-		} else if (!unified && startswith(line, "total_pgpgout")) {
-			sscanf(line, "total_pgpgout %" PRIu64, &(mstat->total_pgpgout));
-		} else if (startswith(line, unified ? "pgfault" : "total_pgfault")) {
-			sscanf(line, unified ? "pgfault %" PRIu64 : "total_pgfault %" PRIu64, &(mstat->total_pgfault));
-		} else if (startswith(line, unified ? "pgmajfault" : "total_pgmajfault")) {
-			sscanf(line, unified ? "pgmajfault %" PRIu64 : "total_pgmajfault %" PRIu64, &(mstat->total_pgmajfault));
-		} else if (startswith(line, unified ? "inactive_anon" : "total_inactive_anon")) {
-			sscanf(line, unified ? "inactive_anon %" PRIu64 : "total_inactive_anon %" PRIu64, &(mstat->total_inactive_anon));
-		} else if (startswith(line, unified ? "active_anon" : "total_active_anon")) {
-			sscanf(line, unified ? "active_anon %" PRIu64 : "total_active_anon %" PRIu64, &(mstat->total_active_anon));
-		} else if (startswith(line, unified ? "inactive_file" : "total_inactive_file")) {
-			sscanf(line, unified ? "inactive_file %" PRIu64 : "total_inactive_file %" PRIu64, &(mstat->total_inactive_file));
-		} else if (startswith(line, unified ? "active_file" : "total_active_file")) {
-			sscanf(line, unified ? "active_file %" PRIu64 : "total_active_file %" PRIu64, &(mstat->total_active_file));
-		} else if (startswith(line, unified ? "unevictable" : "total_unevictable")) {
-			sscanf(line, unified ? "unevictable %" PRIu64 : "total_unevictable %" PRIu64, &(mstat->total_unevictable));
+		char *val;
+
+		val = strchr(line, ' ');
+		if (!val)
+			continue;
+		*val++ = '\0';
+
+		for (int i = 0; i < MEMORY_STAT_MAX; i++) {
+			if (keys[i] && strcmp(line, keys[i]) == 0) {
+				sscanf(val, "%" PRIu64, (uint64_t *)((char *)mstat + memory_stat_offsets[i]));
+				break;
+			}
 		}
 	}
 
 	return true;
 }
 
+/* The container's view of the default huge page pool, in pages. */
+struct hugetlb_info {
+	bool valid;
+	uint64_t page_size;
+	uint64_t limit;
+	uint64_t used;
+	uint64_t rsvd;
+	uint64_t total;
+	/* Used by the other page sizes, in kB. */
+	uint64_t other_kb;
+};
+
+static bool get_hugetlb_info(pid_t initpid, struct hugetlb_info *hi)
+{
+	__do_free char *cgroup = NULL;
+	__do_free struct hugetlb_usage *usage = NULL;
+	const struct hugetlb_size *sizes;
+	struct hierarchy *h;
+
+	h = cgroup_ops->get_hierarchy(cgroup_ops, "hugetlb");
+	if (!h || !h->nr_hugetlb_sizes)
+		return false;
+
+	cgroup = get_pid_cgroup(initpid, "hugetlb");
+	if (!cgroup)
+		return false;
+	prune_init_slice(cgroup);
+
+	usage = malloc(h->nr_hugetlb_sizes * sizeof(*usage));
+	if (!usage)
+		return false;
+
+	if (!cgroup_ops->get_hugetlb(cgroup_ops, cgroup, usage))
+		return false;
+
+	sizes = h->hugetlb_sizes;
+	hi->page_size = sizes[0].bytes;
+	hi->limit = usage[0].limit / sizes[0].bytes;
+	hi->used = usage[0].usage / sizes[0].bytes;
+	/* Reservations include the pages already faulted in. */
+	hi->rsvd = usage[0].rsvd > usage[0].usage ?
+		   (usage[0].rsvd - usage[0].usage) / sizes[0].bytes : 0;
+
+	for (int i = 1; i < h->nr_hugetlb_sizes; i++)
+		hi->other_kb += usage[i].usage / 1024;
+
+	return true;
+}
+
 static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 			     struct fuse_file_info *fi)
 {
@@ -1154,6 +1166,7 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 		 hosttotal = 0, swfree = 0, swusage = 0, swtotal = 0,
 		 memswpriority = 1;
 	struct memory_stat mstat = {};
+	struct hugetlb_info hugetlb = {};
 	size_t linelen = 0, total_len = 0;
 	char *cache = d->buf;
 	size_t cache_size = d->buflen;
@@ -1170,7 +1183,7 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size : left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
@@ -1191,7 +1204,7 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 		return read_file_fuse("/proc/meminfo", buf, size, d);
 
 	if (safe_uint64(memusage_str, &memusage, 10) < 0)
-		lxcfs_error("Failed to convert memusage %s", memusage_str);
+		lxcfs_error_ratelimit("Failed to convert memusage %s", memusage_str);
 
 	if (!cgroup_parse_memory_stat(cgroup, &mstat))
 		return read_file_fuse("/proc/meminfo", buf, size, d);
@@ -1363,15 +1376,51 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 			snprintf(lbuf, 100, "AnonHugePages:  %8" PRIu64 " kB\n",
 				 mstat.total_rss_huge / 1024);
 			printme = lbuf;
+		} else if (startswith(line, "HugePages_Total:")) {
+			uint64_t hostpages = 0;
+
+			/* Only look at hugetlb when the host has a pool to share. */
+			sscanf(line + STRLITERALLEN("HugePages_Total:"), "%" PRIu64, &hostpages);
+			if (hostpages > 0)
+				hugetlb.valid = get_hugetlb_info(initpid, &hugetlb);
+
+			if (hugetlb.valid) {
+				hugetlb.total = MIN(hostpages, hugetlb.limit);
+				snprintf(lbuf, 100, "HugePages_Total:   %5" PRIu64 "\n", hugetlb.total);
+				printme = lbuf;
+			} else {
+				printme = line;
+			}
+		} else if (hugetlb.valid && startswith(line, "HugePages_Free:")) {
+			uint64_t hostfree = 0, freepages = 0;
+
+			sscanf(line + STRLITERALLEN("HugePages_Free:"), "%" PRIu64, &hostfree);
+			if (hugetlb.total > hugetlb.used)
+				freepages = MIN(hostfree, hugetlb.total - hugetlb.used);
+
+			/* Reserved pages are counted as free. */
+			hugetlb.rsvd = MIN(hugetlb.rsvd, freepages);
+			snprintf(lbuf, 100, "HugePages_Free:    %5" PRIu64 "\n", freepages);
+			printme = lbuf;
+		} else if (hugetlb.valid && startswith(line, "HugePages_Rsvd:")) {
+			snprintf(lbuf, 100, "HugePages_Rsvd:    %5" PRIu64 "\n", hugetlb.rsvd);
+			printme = lbuf;
+		} else if (hugetlb.valid && startswith(line, "HugePages_Surp:")) {
+			snprintf(lbuf, 100, "HugePages_Surp:    %5" PRIu64 "\n", (uint64_t)0);
+			printme = lbuf;
+		} else if (hugetlb.valid && startswith(line, "Hugetlb:")) {
+			snprintf(lbuf, 100, "Hugetlb:        %8" PRIu64 " kB\n",
+				 hugetlb.total * (hugetlb.page_size / 1024) + hugetlb.other_kb);
+			printme = lbuf;
  		} else {
  			printme = line;
 		}
 
 		l = snprintf(cache, cache_size, "%s", printme);
 		if (l < 0)
-			return log_error(0, "Failed to write cache");
+			return log_error_ratelimit(0, "Failed to write cache");
 		if ((size_t)l >= cache_size)
-			return log_error(0, "Write to cache was truncated");
+			return log_error_ratelimit(0, "Write to cache was truncated");
 
 		cache += l;
 		cache_size -= l;
@@ -1382,7 +1431,70 @@ static int proc_meminfo_read(char *buf, size_t size, off_t offset,
 	d->size = total_len;
 	if (total_len > size)
 		total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
+
+	return total_len;
+}
+
+#define SLABINFO_HEADER                                                                      \
+	"slabinfo - version: 2.1\n"                                                         \
+	"# name            <active_objs> <num_objs> <objsize> <objperslab> <pagesperslab> " \
+	": tunables <limit> <batchcount> <sharedfactor> "                                   \
+	": slabdata <active_slabs> <num_slabs> <sharedavail>\n"
+
+/*
+ * cgroup2 has no per-cache slab statistics. Report the kernel memory charged
+ * to the cgroup as page sized objects of a few pseudo caches so tools that
+ * multiply objects by object size still arrive at the right totals.
+ */
+static int proc_slabinfo_from_memory_stat(const char *cgroup, char *buf,
+					  size_t buflen)
+{
+	struct memory_stat mstat = {};
+	long page_size;
+	struct {
+		const char *name;
+		uint64_t bytes;
+	} caches[3];
+	size_t nr_caches = 0, total_len = 0;
+	int ret;
+
+	if (!cgroup_parse_memory_stat(cgroup, &mstat))
+		return -1;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	if (page_size <= 0)
+		return -1;
+
+	/* Kernels before 5.9 only report the combined slab usage. */
+	if (mstat.slab_reclaimable || mstat.slab_unreclaimable) {
+		caches[nr_caches].name = "slab_reclaimable";
+		caches[nr_caches++].bytes = mstat.slab_reclaimable;
+		caches[nr_caches].name = "slab_unreclaimable";
+		caches[nr_caches++].bytes = mstat.slab_unreclaimable;
+	} else {
+		caches[nr_caches].name = "slab";
+		caches[nr_caches++].bytes = mstat.slab;
+	}
+	caches[nr_caches].name = "kernel_stack";
+	caches[nr_caches++].bytes = mstat.kernel_stack;
+
+	ret = snprintf(buf, buflen, SLABINFO_HEADER);
+	if (ret < 0 || (size_t)ret >= buflen)
+		return -1;
+	total_len += ret;
+
+	for (size_t i = 0; i < nr_caches; i++) {
+		uint64_t pages = caches[i].bytes / page_size;
+
+		ret = snprintf(buf + total_len, buflen - total_len,
+			       "%-17s %6" PRIu64 " %6" PRIu64 " %4ld %4d %4d : tunables %4d %4d %4d : slabdata %6" PRIu64 " %6" PRIu64 " %6d\n",
+			       caches[i].name, pages, pages, page_size, 1, 1,
+			       0, 0, 0, pages, pages, 0);
+		if (ret < 0 || (size_t)ret >= buflen - total_len)
+			return -1;
+		total_len += ret;
+	}
 
 	return total_len;
 }
@@ -1400,6 +1512,7 @@ static int proc_slabinfo_read(char *buf, size_t size, off_t offset,
 	char *cache = d->buf;
 	size_t cache_size = d->buflen;
 	pid_t initpid;
+	int ret;
 
 	if (offset) {
 		size_t left;
@@ -1412,7 +1525,7 @@ static int proc_slabinfo_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size : left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
@@ -1427,6 +1540,18 @@ static int proc_slabinfo_read(char *buf, size_t size, off_t offset,
 
 	prune_init_slice(cgroup);
 
+	if (pure_unified_layout(cgroup_ops)) {
+		ret = proc_slabinfo_from_memory_stat(cgroup, d->buf, d->buflen);
+		/* Never fall back to the host's caches, report none instead. */
+		if (ret < 0)
+			ret = snprintf(d->buf, d->buflen, SLABINFO_HEADER);
+		if (ret < 0 || (size_t)ret >= d->buflen)
+			return log_error_ratelimit(0, "Failed to write cache");
+
+		total_len = ret;
+		goto out;
+	}
+
 	fd = cgroup_ops->get_memory_slabinfo_fd(cgroup_ops, cgroup);
 	if (fd < 0)
 		return read_file_fuse("/proc/slabinfo", buf, size, d);
@@ -1438,20 +1563,56 @@ static int proc_slabinfo_read(char *buf, size_t size, off_t offset,
 	while (getline(&line, &linelen, f) != -1) {
 		ssize_t l = snprintf(cache, cache_size, "%s", line);
 		if (l < 0)
-			return log_error(0, "Failed to write cache");
+			return log_error_ratelimit(0, "Failed to write cache");
 		if ((size_t)l >= cache_size)
-			return log_error(0, "Write to cache was truncated");
+			return log_error_ratelimit(0, "Write to cache was truncated");
 
 		cache += l;
 		cache_size -= l;
 		total_len += l;
 	}
 
+out:
 	d->cached = 1;
 	d->size = total_len;
 	if (total_len > size)
 		total_len = size;
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
+
+	return total_len;
+}
+
+static int proc_lxcfs_stats_read(char *buf, size_t size, off_t offset,
+				 struct fuse_file_info *fi)
+{
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+	int total_len;
+
+	if (offset) {
+		size_t left;
+
+		if (offset > d->size)
+			return -EINVAL;
+
+		if (!d->cached)
+			return 0;
+
+		left = d->size - offset;
+		total_len = left > size ? size : left;
+		copy_out(buf, d->buf + offset, total_len);
+
+		return total_len;
+	}
+
+	total_len = cache_budget_stats(d->buf, d->buflen);
+	if (total_len < 0)
+		return log_error_ratelimit(0, "Failed to write to cache");
+
+	d->cached = 1;
+	d->size = total_len;
+	if ((size_t)total_len > size)
+		total_len = size;
+	copy_out(buf, d->buf, total_len);
 
 	return total_len;
 }
@@ -1459,57 +1620,80 @@ static int proc_slabinfo_read(char *buf, size_t size, off_t offset,
 __lxcfs_fuse_ops int proc_read(const char *path, char *buf, size_t size,
 			       off_t offset, struct fuse_file_info *fi)
 {
+	watch_request("read", path);
 	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
 
 	switch (f->type) {
 	case LXC_TYPE_PROC_MEMINFO:
 		if (liblxcfs_functional())
-			return proc_meminfo_read(buf, size, offset, fi);
+			return policy_read(f->type, LXC_TYPE_PROC_MEMINFO_PATH,
+					   proc_meminfo_read, buf, size, offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_MEMINFO_PATH,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_CPUINFO:
 		if (liblxcfs_functional())
-			return proc_cpuinfo_read(buf, size, offset, fi);
+			return render_stream_read(f->type, LXC_TYPE_PROC_CPUINFO_PATH,
+						  proc_cpuinfo_read, buf, size,
+						  offset, fi);
+
+		if (file_info_get_buf(f, LXC_TYPE_PROC_CPUINFO_PATH))
+			return -ENOMEM;
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_CPUINFO_PATH,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_UPTIME:
 		if (liblxcfs_functional())
-			return proc_uptime_read(buf, size, offset, fi);
+			return policy_read(f->type, LXC_TYPE_PROC_UPTIME_PATH,
+					   proc_uptime_read, buf, size, offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_UPTIME_PATH,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_STAT:
 		if (liblxcfs_functional())
-			return proc_stat_read(buf, size, offset, fi);
+			return render_stream_read(f->type, LXC_TYPE_PROC_STAT_PATH,
+						  proc_stat_read, buf, size,
+						  offset, fi);
+
+		if (file_info_get_buf(f, LXC_TYPE_PROC_STAT_PATH))
+			return -ENOMEM;
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_STAT_PATH, buf,
 						  size, offset, f);
 	case LXC_TYPE_PROC_DISKSTATS:
 		if (liblxcfs_functional())
-			return proc_diskstats_read(buf, size, offset, fi);
+			return render_stream_read(f->type, LXC_TYPE_PROC_DISKSTATS_PATH,
+						  proc_diskstats_read, buf, size,
+						  offset, fi);
+
+		if (file_info_get_buf(f, LXC_TYPE_PROC_DISKSTATS_PATH))
+			return -ENOMEM;
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_DISKSTATS_PATH,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_SWAPS:
 		if (liblxcfs_functional())
-			return proc_swaps_read(buf, size, offset, fi);
+			return policy_read(f->type, LXC_TYPE_PROC_SWAPS_PATH,
+					   proc_swaps_read, buf, size, offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_SWAPS_PATH, buf,
 						  size, offset, f);
 	case LXC_TYPE_PROC_LOADAVG:
 		if (liblxcfs_functional())
-			return proc_loadavg_read(buf, size, offset, fi);
+			return policy_read(f->type, LXC_TYPE_PROC_LOADAVG_PATH,
+					   proc_loadavg_read, buf, size, offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_LOADAVG_PATH,
 						  buf, size, offset, f);
 	case LXC_TYPE_PROC_SLABINFO:
 		if (liblxcfs_functional())
-			return proc_slabinfo_read(buf, size, offset, fi);
+			return policy_read(f->type, LXC_TYPE_PROC_SLABINFO_PATH,
+					   proc_slabinfo_read, buf, size, offset, fi);
 
 		return read_file_fuse_with_offset(LXC_TYPE_PROC_SLABINFO_PATH,
 						  buf, size, offset, f);
+	case LXC_TYPE_PROC_LXCFS_STATS:
+		return proc_lxcfs_stats_read(buf, size, offset, fi);
 	}
 
 	return -EINVAL;
@@ -36,12 +36,16 @@
 
 #include "proc_loadavg.h"
 
+#include "async_log.h"
 #include "bindings.h"
+#include "cache_budget.h"
 #include "cgroup_fuse.h"
+#include "cgroup_watch.h"
 #include "cgroups/cgroup.h"
 #include "cgroups/cgroup_utils.h"
 #include "memory_utils.h"
 #include "utils.h"
+#include "watchdog.h"
 
 /*
  * This parameter is used for proc_loadavg_read().
@@ -66,6 +70,8 @@ static volatile sig_atomic_t loadavg_stop = 0;
 struct load_node {
 	/* cgroup */
 	char *cg;
+	/* Kernel id of the cgroup, 0 if it couldn't be resolved */
+	uint64_t id;
 	/* Load averages */
 	uint64_t avenrun[3];
 	unsigned int run_pid;
@@ -73,6 +79,10 @@ struct load_node {
 	unsigned int last_pid;
 	/* The file descriptor of the mounted cgroup */
 	int cfd;
+	/* Last read, for cache budget eviction */
+	int64_t lastuse;
+	/* Evicted nodes are skipped by readers and freed by load_begin() */
+	bool evicted;
 	struct load_node *next;
 	struct load_node **pre;
 };
@@ -101,6 +111,21 @@ struct load_head {
 
 static struct load_head load_hash[LOAD_SIZE]; /* hash table */
 
+static int64_t loadavg_cache_oldest(void);
+static void loadavg_cache_evict(int64_t cutoff, uint64_t bytes);
+static void seed_load(struct load_node *p);
+
+static struct lxcfs_cache loadavg_cache = {
+	.name	= "loadavg",
+	.oldest	= loadavg_cache_oldest,
+	.evict	= loadavg_cache_evict,
+};
+
+static inline size_t load_node_size(const struct load_node *n)
+{
+	return sizeof(struct load_node) + strlen(n->cg) + 1;
+}
+
 /*
  * locate_node() finds special node. Not return NULL means success.
  * It should be noted that rdlock isn't unlocked at the end of code
@@ -108,28 +133,52 @@ static struct load_head load_hash[LOAD_SIZE]; /* hash table */
  * allowed before read has ended.
  * unlock rdlock only in proc_loadavg_read().
  */
-static struct load_node *locate_node(char *cg, int locate)
+static inline bool load_node_matches(const struct load_node *n, uint64_t id,
+				     const char *cg)
 {
-	struct load_node *f = NULL;
-	int i = 0;
+	if (n->evicted || n->id != id)
+		return false;
+
+	return id || strcmp(n->cg, cg) == 0;
+}
+
+static inline int load_bucket(uint64_t id, const char *cg)
+{
+	if (id)
+		return id % LOAD_SIZE;
+
+	return calc_hash(cg) % LOAD_SIZE;
+}
 
+static inline void bucket_read_lock(int locate)
+{
+	request_stage(REQUEST_STAGE_LOCK);
 	pthread_rwlock_rdlock(&load_hash[locate].rilock);
 	pthread_rwlock_rdlock(&load_hash[locate].rdlock);
+}
+
+static struct load_node *locate_node(const char *cg, uint64_t id, int locate)
+{
+	struct load_node *f = NULL;
+
+	bucket_read_lock(locate);
 	if (load_hash[locate].next == NULL) {
 		pthread_rwlock_unlock(&load_hash[locate].rilock);
 		return f;
 	}
 	f = load_hash[locate].next;
 	pthread_rwlock_unlock(&load_hash[locate].rilock);
-	while (f && ((i = strcmp(f->cg, cg)) != 0))
+	while (f && !load_node_matches(f, id, cg))
 		f = f->next;
 	return f;
 }
 
+/* Holds rdlock like a reader so del_node() can't relink the bucket meanwhile. */
 static void insert_node(struct load_node **n, int locate)
 {
 	struct load_node *f;
 
+	pthread_rwlock_rdlock(&load_hash[locate].rdlock);
 	pthread_mutex_lock(&load_hash[locate].lock);
 	pthread_rwlock_wrlock(&load_hash[locate].rilock);
 	f = load_hash[locate].next;
@@ -141,6 +190,7 @@ static void insert_node(struct load_node **n, int locate)
 	(*n)->next = f;
 	pthread_mutex_unlock(&load_hash[locate].lock);
 	pthread_rwlock_unlock(&load_hash[locate].rilock);
+	pthread_rwlock_unlock(&load_hash[locate].rdlock);
 }
 
 int calc_hash(const char *name)
@@ -160,6 +210,31 @@ int calc_hash(const char *name)
 	return (hash & 0x7fffffff);
 }
 
+static ssize_t loadavg_format(char *buf, size_t buflen, const struct load_node *n)
+{
+	uint64_t a, b, c;
+
+	a = n->avenrun[0] + (FIXED_1 / 200);
+	b = n->avenrun[1] + (FIXED_1 / 200);
+	c = n->avenrun[2] + (FIXED_1 / 200);
+	return snprintf(buf, buflen,
+			"%lu.%02lu "
+			"%lu.%02lu "
+			"%lu.%02lu "
+			"%d/"
+			"%d "
+			"%d\n",
+			LOAD_INT(a),
+			LOAD_FRAC(a),
+			LOAD_INT(b),
+			LOAD_FRAC(b),
+			LOAD_INT(c),
+			LOAD_FRAC(c),
+			n->run_pid,
+			n->total_pid,
+			n->last_pid);
+}
+
 int proc_loadavg_read(char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
@@ -169,9 +244,9 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 	pid_t initpid;
 	ssize_t total_len = 0;
 	struct load_node *n;
+	uint64_t id;
 	int hash;
 	int cfd;
-	uint64_t a, b, c;
 
 	if (offset) {
 		size_t left;
@@ -184,7 +259,7 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 
 		left = d->size - offset;
 		total_len = left > size ? size : left;
-		memcpy(buf, d->buf + offset, total_len);
+		copy_out(buf, d->buf + offset, total_len);
 
 		return total_len;
 	}
@@ -200,23 +275,28 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 		return read_file_fuse("/proc/loadavg", buf, size, d);
 
 	prune_init_slice(cg);
-	hash = calc_hash(cg) % LOAD_SIZE;
-	n = locate_node(cg, hash);
+	id = cgroup_watch_id("cpu", cg);
+	hash = load_bucket(id, cg);
+	n = locate_node(cg, id, hash);
 
 	/* First time */
 	if (n == NULL) {
+		/*
+		 * In locate_node() above, pthread_rwlock_unlock() isn't used
+		 * because delete is not allowed before read has ended. The new
+		 * node isn't visible to anyone else until it is inserted so
+		 * don't keep deletes waiting while it is seeded, insert_node()
+		 * takes the lock again.
+		 */
+		pthread_rwlock_unlock(&load_hash[hash].rdlock);
+
 		cfd = get_cgroup_fd("cpu");
-		if (cfd < 0) {
-			/*
-			 * In locate_node() above, pthread_rwlock_unlock() isn't used
-			 * because delete is not allowed before read has ended.
-			 */
-			pthread_rwlock_unlock(&load_hash[hash].rdlock);
+		if (cfd < 0)
 			return read_file_fuse("/proc/loadavg", buf, size, d);
-		}
 
 		n = must_realloc(NULL, sizeof(struct load_node));
 		n->cg = move_ptr(cg);
+		n->id = id;
 		n->avenrun[0] = 0;
 		n->avenrun[1] = 0;
 		n->avenrun[2] = 0;
@@ -224,30 +304,26 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 		n->total_pid = 1;
 		n->last_pid = initpid;
 		n->cfd = cfd;
+		n->evicted = false;
+		n->lastuse = time(NULL);
+		seed_load(n);
+
+		/*
+		 * The refresher decays the seed from its next pass on and may
+		 * free the node once it is inserted, format it beforehand.
+		 */
+		total_len = loadavg_format(d->buf, d->buflen, n);
+		cache_account_add(&loadavg_cache, load_node_size(n));
 		insert_node(&n, hash);
+	} else {
+		n->lastuse = time(NULL);
+		total_len = loadavg_format(d->buf, d->buflen, n);
+		pthread_rwlock_unlock(&load_hash[hash].rdlock);
 	}
-	a = n->avenrun[0] + (FIXED_1 / 200);
-	b = n->avenrun[1] + (FIXED_1 / 200);
-	c = n->avenrun[2] + (FIXED_1 / 200);
-	total_len = snprintf(d->buf, d->buflen,
-			     "%lu.%02lu "
-			     "%lu.%02lu "
-			     "%lu.%02lu "
-			     "%d/"
-			     "%d "
-			     "%d\n",
-			     LOAD_INT(a),
-			     LOAD_FRAC(a),
-			     LOAD_INT(b),
-			     LOAD_FRAC(b),
-			     LOAD_INT(c),
-			     LOAD_FRAC(c),
-			     n->run_pid,
-			     n->total_pid,
-			     n->last_pid);
-	pthread_rwlock_unlock(&load_hash[hash].rdlock);
+
+	cache_budget_enforce();
 	if (total_len < 0 || total_len >= d->buflen)
-		return log_error(0, "Failed to write to cache");
+		return log_error_ratelimit(0, "Failed to write to cache");
 
 	d->size = (int)total_len;
 	d->cached = 1;
@@ -255,7 +331,7 @@ int proc_loadavg_read(char *buf, size_t size, off_t offset,
 	if ((size_t)total_len > size)
 		total_len = size;
 
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 	return total_len;
 }
 
@@ -353,12 +429,19 @@ static uint64_t calc_load(uint64_t load, uint64_t exp, uint64_t active)
 	return newload / FIXED_1;
 }
 
+struct task_count {
+	int run_pid;
+	int total_pid;
+	int last_pid;
+};
+
 /*
- * Return 0 means that container p->cg is closed.
+ * Count the runnable tasks of the cgroup at @path in a single pass.
+ * Return 0 means that the cgroup is closed.
  * Return -1 means that error occurred in refresh.
  * Positive num equals the total number of pid.
  */
-static int refresh_load(struct load_node *p, const char *path)
+static int count_tasks(int cfd, const char *path, struct task_count *count)
 {
 	char **idbuf = NULL;
 	char proc_path[STRLITERALLEN("/proc//task//status") +
@@ -370,7 +453,7 @@ static int refresh_load(struct load_node *p, const char *path)
 
 	idbuf = must_realloc(NULL, sizeof(char **));
 
-	sum = calc_pid(&idbuf, path, DEPTH_DIR, 0, p->cfd);
+	sum = calc_pid(&idbuf, path, DEPTH_DIR, 0, cfd);
 	if (!sum)
 		goto out;
 
@@ -390,7 +473,7 @@ static int refresh_load(struct load_node *p, const char *path)
 
 		dp = opendir(proc_path);
 		if (!dp) {
-			lxcfs_error("Failed to open \"%s\"", proc_path);
+			lxcfs_error_ratelimit("Failed to open \"%s\"", proc_path);
 			continue;
 		}
 
@@ -432,13 +515,9 @@ static int refresh_load(struct load_node *p, const char *path)
 		}
 	}
 
-	/* Calculate the loadavg. */
-	p->avenrun[0]	= calc_load(p->avenrun[0], EXP_1, run_pid);
-	p->avenrun[1]	= calc_load(p->avenrun[1], EXP_5, run_pid);
-	p->avenrun[2]	= calc_load(p->avenrun[2], EXP_15, run_pid);
-	p->run_pid	= run_pid;
-	p->total_pid	= total_pid;
-	p->last_pid	= last_pid;
+	count->run_pid		= run_pid;
+	count->total_pid	= total_pid;
+	count->last_pid		= last_pid;
 
 err_out:
 	for (; i > 0; i--)
@@ -448,6 +527,53 @@ out:
 	return sum;
 }
 
+/*
+ * Return 0 means that container p->cg is closed.
+ * Return -1 means that error occurred in refresh.
+ * Positive num equals the total number of pid.
+ */
+static int refresh_load(struct load_node *p, const char *path)
+{
+	struct task_count count;
+	int sum;
+
+	sum = count_tasks(p->cfd, path, &count);
+	if (sum <= 0)
+		return sum;
+
+	/* Calculate the loadavg. */
+	p->avenrun[0]	= calc_load(p->avenrun[0], EXP_1, count.run_pid);
+	p->avenrun[1]	= calc_load(p->avenrun[1], EXP_5, count.run_pid);
+	p->avenrun[2]	= calc_load(p->avenrun[2], EXP_15, count.run_pid);
+	p->run_pid	= count.run_pid;
+	p->total_pid	= count.total_pid;
+	p->last_pid	= count.last_pid;
+
+	return sum;
+}
+
+/*
+ * A new node would read "0.00 0.00 0.00" until the refresher gets to it.
+ * Start the averages at the current number of runnable tasks instead, the
+ * refresher decays them from there.
+ */
+static void seed_load(struct load_node *p)
+{
+	__do_free char *path = NULL;
+	struct task_count count;
+
+	path = must_make_path_relative(p->cg, NULL);
+	if (count_tasks(p->cfd, path, &count) <= 0)
+		return;
+
+	p->avenrun[0]	= (uint64_t)count.run_pid * FIXED_1;
+	p->avenrun[1]	= p->avenrun[0];
+	p->avenrun[2]	= p->avenrun[0];
+	p->run_pid	= count.run_pid;
+	p->total_pid	= count.total_pid;
+	p->last_pid	= count.last_pid;
+}
+
 /* Delete the load_node n and return the next node of it. */
 static struct load_node *del_node(struct load_node *n, int locate)
 {
@@ -461,12 +587,77 @@ static struct load_node *del_node(struct load_node *n, int locate)
 		n->next->pre = n->pre;
 	}
 	g = n->next;
+	if (n->evicted)
+		cache_account_release(&loadavg_cache, load_node_size(n));
+	else
+		cache_account_del(&loadavg_cache, load_node_size(n), false);
 	free_disarm(n->cg);
 	free_disarm(n);
 	pthread_rwlock_unlock(&load_hash[locate].rdlock);
 	return g;
 }
 
+static int64_t loadavg_cache_oldest(void)
+{
+	int64_t oldest = -1;
+
+	if (!loadavg)
+		return -1;
+
+	for (int i = 0; i < LOAD_SIZE; i++) {
+		struct load_node *f;
+
+		pthread_rwlock_rdlock(&load_hash[i].rilock);
+		pthread_rwlock_rdlock(&load_hash[i].rdlock);
+		f = load_hash[i].next;
+		pthread_rwlock_unlock(&load_hash[i].rilock);
+		for (; f; f = f->next) {
+			if (f->evicted)
+				continue;
+
+			if (oldest < 0 || f->lastuse < oldest)
+				oldest = f->lastuse;
+		}
+		pthread_rwlock_unlock(&load_hash[i].rdlock);
+	}
+
+	return oldest;
+}
+
+/*
+ * Nodes can't be unlinked here since load_begin() walks the buckets without
+ * holding a lock. Mark them instead and let load_begin() free them, their
+ * bytes are released from the budget then.
+ */
+static void loadavg_cache_evict(int64_t cutoff, uint64_t bytes)
+{
+	uint64_t freed = 0;
+
+	if (!loadavg)
+		return;
+
+	for (int i = 0; i < LOAD_SIZE && freed < bytes; i++) {
+		struct load_node *f;
+
+		pthread_rwlock_rdlock(&load_hash[i].rilock);
+		pthread_rwlock_rdlock(&load_hash[i].rdlock);
+		f = load_hash[i].next;
+		pthread_rwlock_unlock(&load_hash[i].rilock);
+		for (; f && freed < bytes; f = f->next) {
+			size_t node_size;
+
+			if (f->evicted || f->lastuse > cutoff)
+				continue;
+
+			f->evicted = true;
+			node_size = load_node_size(f);
+			cache_account_evicting(&loadavg_cache, node_size);
+			freed += node_size;
+		}
+		pthread_rwlock_unlock(&load_hash[i].rdlock);
+	}
+}
+
 /*
  * Traverse the hash table and update it.
  */
@@ -477,6 +668,8 @@ static void *load_begin(void *arg)
 	struct load_node *f;
 	clock_t time1, time2;
 
+	lxcfs_background_thread_setup(arg);
+
 	for (;;) {
 		if (loadavg_stop == 1)
 			return NULL;
@@ -496,7 +689,13 @@ static void *load_begin(void *arg)
 
 				path = must_make_path_relative(f->cg, NULL);
 
-				sum = refresh_load(f, path);
+				if (f->evicted)
+					sum = 0;
+				/* Removed and created again, start over. */
+				else if (f->id && cgroup_id_at(f->cfd, f->cg) != f->id)
+					sum = 0;
+				else
+					sum = refresh_load(f, path);
 				if (sum == 0)
 					f = del_node(f, i);
 				else
@@ -600,8 +799,11 @@ static void load_free(void)
 	}
 }
 
-/* Return a positive number on success, return 0 on failure.*/
-pthread_t load_daemon(int load_use)
+/*
+ * Return a positive number on success, return 0 on failure.
+ * @opts must stay valid until stop_load_daemon() is called.
+ */
+pthread_t load_daemon_v2(int load_use, const struct lxcfs_opts *opts)
 {
 	int ret;
 	pthread_t pid;
@@ -610,7 +812,7 @@ pthread_t load_daemon(int load_use)
 	if (ret == -1)
 		return log_error(0, "Initialize hash_table fails in load_daemon!");
 
-	ret = pthread_create(&pid, NULL, load_begin, NULL);
+	ret = pthread_create(&pid, NULL, load_begin, (void *)opts);
 	if (ret != 0) {
 		load_free();
 		return log_error(0, "Create pthread fails in load_daemon!");
@@ -618,9 +820,15 @@ pthread_t load_daemon(int load_use)
 
 	/* use loadavg, here loadavg = 1*/
 	loadavg = load_use;
+	cache_register(&loadavg_cache);
 	return pid;
 }
 
+pthread_t load_daemon(int load_use)
+{
+	return load_daemon_v2(load_use, NULL);
+}
+
 /* Returns 0 on success. */
 int stop_load_daemon(pthread_t pid)
 {
@@ -633,6 +841,7 @@ int stop_load_daemon(pthread_t pid)
 	if (s)
 		return log_error(-1, "stop_load_daemon error: failed to join");
 
+	cache_unregister(&loadavg_cache);
 	load_free();
 	loadavg_stop = 0;
 
@@ -19,7 +19,10 @@
 
 #include "macro.h"
 
+struct lxcfs_opts;
+
 __visible extern pthread_t load_daemon(int load_use);
+__visible extern pthread_t load_daemon_v2(int load_use, const struct lxcfs_opts *opts);
 __visible extern int stop_load_daemon(pthread_t pid);
 
 extern int proc_loadavg_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+
+#if HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include <fuse.h>
+#endif
+
+#include "render_stream.h"
+
+#include "bindings.h"
+#include "cache_budget.h"
+#include "file_info_pool.h"
+#include "memory_utils.h"
+#include "utils.h"
+#include "watchdog.h"
+
+#define RENDER_CHUNK_SIZE 16384
+#define RENDER_HASH_SIZE 64
+
+/* Rendered contents of a file, never changed once published. */
+struct render_snapshot {
+	int refcount;
+	size_t len;
+	size_t nr_chunks;
+	char *chunks[];
+};
+
+/* The latest snapshot of a file for one container. */
+struct render_entry {
+	int type;
+	pid_t initpid;
+	uint64_t starttime;
+	struct render_snapshot *snapshot;
+	int64_t rendered; /* monotonic_ms() */
+	int64_t lastuse; /* time() */
+	struct render_entry *next;
+};
+
+static struct render_entry *render_hash[RENDER_HASH_SIZE];
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int64_t render_cache_oldest(void);
+static void render_cache_evict(int64_t cutoff, uint64_t bytes);
+
+static struct lxcfs_cache render_cache = {
+	.name	= "render",
+	.oldest	= render_cache_oldest,
+	.evict	= render_cache_evict,
+};
+
+static inline void render_lock(void)
+{
+	pthread_mutex_lock(&render_mutex);
+}
+
+static inline void render_unlock(void)
+{
+	pthread_mutex_unlock(&render_mutex);
+}
+
+static void snapshot_put(struct render_snapshot *snap)
+{
+	if (!snap || __atomic_sub_fetch(&snap->refcount, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (size_t i = 0; i < snap->nr_chunks; i++)
+		free(snap->chunks[i]);
+	free(snap);
+}
+
+static inline struct render_snapshot *snapshot_get(struct render_snapshot *snap)
+{
+	__atomic_add_fetch(&snap->refcount, 1, __ATOMIC_RELAXED);
+	return snap;
+}
+
+static struct render_snapshot *snapshot_new(const char *data, size_t len)
+{
+	struct render_snapshot *snap;
+	size_t nr_chunks = (len + RENDER_CHUNK_SIZE - 1) / RENDER_CHUNK_SIZE;
+
+	snap = zalloc(sizeof(*snap) + nr_chunks * sizeof(char *));
+	if (!snap)
+		return NULL;
+	snap->refcount = 1;
+
+	for (size_t off = 0; off < len; off += RENDER_CHUNK_SIZE) {
+		size_t n = MIN(len - off, RENDER_CHUNK_SIZE);
+		char *chunk;
+
+		chunk = malloc(n);
+		if (!chunk) {
+			snapshot_put(snap);
+			return NULL;
+		}
+
+		memcpy(chunk, data + off, n);
+		snap->chunks[snap->nr_chunks++] = chunk;
+	}
+	snap->len = len;
+
+	return snap;
+}
+
+static int snapshot_read(const struct render_snapshot *snap, char *buf,
+			 size_t size, off_t offset)
+{
+	size_t pos = offset, total_len = 0;
+
+	while (total_len < size && pos < snap->len) {
+		size_t off = pos % RENDER_CHUNK_SIZE;
+		size_t n;
+
+		n = MIN(size - total_len, snap->len - pos);
+		n = MIN(n, RENDER_CHUNK_SIZE - off);
+		copy_out(buf + total_len, snap->chunks[pos / RENDER_CHUNK_SIZE] + off, n);
+
+		total_len += n;
+		pos += n;
+	}
+
+	return total_len;
+}
+
+static inline size_t render_entry_size(const struct render_entry *entry)
+{
+	const struct render_snapshot *snap = entry->snapshot;
+
+	return sizeof(*entry) + sizeof(*snap) + snap->nr_chunks * sizeof(char *) + snap->len;
+}
+
+/* Must be called under render_lock */
+static void free_render_entry(struct render_entry *entry, bool evicted)
+{
+	cache_account_del(&render_cache, render_entry_size(entry), evicted);
+	snapshot_put(entry->snapshot);
+	free(entry);
+}
+
+static inline int render_hash_key(int type, pid_t initpid)
+{
+	return ((unsigned int)initpid * 31 + type) % RENDER_HASH_SIZE;
+}
+
+static inline bool render_entry_matches(const struct render_entry *entry,
+					int type, pid_t initpid,
+					uint64_t starttime)
+{
+	return entry->type == type && entry->initpid == initpid &&
+	       entry->starttime == starttime;
+}
+
+/*
+ * Must be called under render_lock. Snapshots past their TTL are never
+ * served again so they are dropped whenever their bucket is walked.
+ */
+static inline bool render_entry_stale(const struct render_entry *entry,
+				      int64_t now)
+{
+	return now - entry->rendered >= RENDER_SNAPSHOT_TTL_MS;
+}
+
+static struct render_snapshot *render_lookup(int type, pid_t initpid,
+					     uint64_t starttime)
+{
+	struct render_snapshot *snap = NULL;
+	int64_t now = monotonic_ms();
+
+	render_lock();
+	for (struct render_entry **it = &render_hash[render_hash_key(type, initpid)]; *it;) {
+		struct render_entry *entry = *it;
+
+		if (render_entry_stale(entry, now)) {
+			*it = entry->next;
+			free_render_entry(entry, false);
+			continue;
+		}
+
+		if (!snap && render_entry_matches(entry, type, initpid, starttime)) {
+			entry->lastuse = time(NULL);
+			snap = snapshot_get(entry->snapshot);
+		}
+		it = &entry->next;
+	}
+	render_unlock();
+
+	return snap;
+}
+
+static void render_publish(int type, pid_t initpid, uint64_t starttime,
+			   struct render_snapshot *snap)
+{
+	struct render_entry *new;
+	int64_t now = monotonic_ms();
+	int hash = render_hash_key(type, initpid);
+
+	new = zalloc(sizeof(*new));
+	if (!new)
+		return;
+
+	new->type = type;
+	new->initpid = initpid;
+	new->starttime = starttime;
+	new->snapshot = snapshot_get(snap);
+	new->rendered = now;
+	new->lastuse = time(NULL);
+
+	render_lock();
+	for (struct render_entry **it = &render_hash[hash]; *it;) {
+		struct render_entry *entry = *it;
+
+		if (render_entry_stale(entry, now) ||
+		    render_entry_matches(entry, type, initpid, starttime)) {
+			*it = entry->next;
+			free_render_entry(entry, false);
+			continue;
+		}
+		it = &entry->next;
+	}
+	new->next = render_hash[hash];
+	render_hash[hash] = new;
+	cache_account_add(&render_cache, render_entry_size(new));
+	render_unlock();
+
+	cache_budget_enforce();
+}
+
+static int64_t render_cache_oldest(void)
+{
+	int64_t oldest = -1;
+
+	render_lock();
+	for (int i = 0; i < RENDER_HASH_SIZE; i++)
+		for (struct render_entry *entry = render_hash[i]; entry; entry = entry->next)
+			if (oldest < 0 || entry->lastuse < oldest)
+				oldest = entry->lastuse;
+	render_unlock();
+
+	return oldest;
+}
+
+static void render_cache_evict(int64_t cutoff, uint64_t bytes)
+{
+	uint64_t freed = 0;
+
+	render_lock();
+	for (int i = 0; i < RENDER_HASH_SIZE && freed < bytes; i++) {
+		for (struct render_entry **it = &render_hash[i]; *it && freed < bytes;) {
+			struct render_entry *entry = *it;
+
+			if (entry->lastuse > cutoff) {
+				it = &entry->next;
+				continue;
+			}
+
+			*it = entry->next;
+			freed += render_entry_size(entry);
+			free_render_entry(entry, true);
+		}
+	}
+	render_unlock();
+}
+
+/* The container the caller belongs to, keyed like the other caches. */
+static pid_t render_initpid(uint64_t *starttime)
+{
+	struct fuse_context *fc = fuse_get_context();
+	pid_t initpid;
+
+	initpid = lookup_initpid_starttime(fc->pid, starttime);
+	if (initpid <= 1 || is_shared_pidns(initpid)) {
+		*starttime = 0;
+		return fc->pid;
+	}
+
+	return initpid;
+}
+
+int render_stream_read(int type, const char *host_path, policy_render_t render,
+		       char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+	struct file_info *d = INTTYPE_TO_PTR(fi->fh);
+	struct render_snapshot *snap = NULL;
+	uint64_t starttime = 0;
+	pid_t initpid;
+	int ret;
+
+	if (offset < 0)
+		return -EINVAL;
+
+	if (offset && d->snapshot)
+		return snapshot_read(d->snapshot, buf, size, offset);
+
+	initpid = render_initpid(&starttime);
+	if (offset)
+		snap = render_lookup(type, initpid, starttime);
+
+	if (!snap) {
+		ret = file_info_get_buf(d, host_path);
+		if (ret)
+			return ret;
+
+		/* Renderers that bail out early leave the size alone. */
+		d->size = 0;
+		ret = policy_read(type, host_path, render, buf, size, 0, fi);
+		if (ret < 0)
+			return ret;
+
+		snap = snapshot_new(d->buf, d->size);
+		file_info_put_buf(d);
+		if (!snap)
+			return -ENOMEM;
+
+		render_publish(type, initpid, starttime, snap);
+	}
+
+	snapshot_put(d->snapshot);
+	d->snapshot = snap;
+
+	return snapshot_read(snap, buf, size, offset);
+}
+
+void render_stream_release(struct file_info *f)
+{
+	snapshot_put(move_ptr(f->snapshot));
+}
+
+void render_stream_init(void)
+{
+	cache_register(&render_cache);
+}
+
+void render_stream_exit(void)
+{
+	render_lock();
+	for (int i = 0; i < RENDER_HASH_SIZE; i++) {
+		while (render_hash[i]) {
+			struct render_entry *entry = render_hash[i];
+
+			render_hash[i] = entry->next;
+			free_render_entry(entry, false);
+		}
+	}
+	render_unlock();
+
+	cache_unregister(&render_cache);
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_RENDER_STREAM_H
+#define __LXCFS_RENDER_STREAM_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#if HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include <fuse.h>
+#endif
+
+#include "macro.h"
+#include "policy.h"
+
+/* A snapshot read at a later offset is rendered again once it is this old. */
+#define RENDER_SNAPSHOT_TTL_MS 1000
+
+struct file_info;
+
+/*
+ * Read files that grow with the host, like cpuinfo and stat, through a
+ * snapshot of the rendered contents. The snapshot is split into fixed size
+ * chunks and shared by all readers in the same container. Open files only
+ * keep a reference to it and hand their render buffer back to the pool, so
+ * a read at any offset copies straight out of the chunks it covers.
+ *
+ * A read at offset 0 renders through policy_read() as before. A read at a
+ * later offset is served from the file's snapshot or, when the file hasn't
+ * been read yet, from a snapshot the container rendered within
+ * RENDER_SNAPSHOT_TTL_MS.
+ */
+extern int render_stream_read(int type, const char *host_path,
+			      policy_render_t render, char *buf, size_t size,
+			      off_t offset, struct fuse_file_info *fi);
+
+/* Drop the snapshot @f refers to. */
+extern void render_stream_release(struct file_info *f);
+
+extern void render_stream_init(void);
+extern void render_stream_exit(void);
+
+#endif /* __LXCFS_RENDER_STREAM_H */
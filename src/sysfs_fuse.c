@@ -41,11 +41,15 @@
 
 #include "sysfs_fuse.h"
 
+#include "async_log.h"
 #include "bindings.h"
+#include "file_info_pool.h"
 #include "memory_utils.h"
 #include "cgroups/cgroup.h"
 #include "lxcfs_fuse_compat.h"
+#include "policy.h"
 #include "utils.h"
+#include "watchdog.h"
 
 static ssize_t get_max_cpus(char *cpulist)
 {
@@ -157,7 +161,7 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 
 		left = d->size - offset;
 		total_len = left > size ? size : left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
@@ -175,7 +179,8 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 	if (!cpuset)
 		return 0;
 
-	if (cgroup_ops->can_use_cpuview(cgroup_ops) && opts && opts->use_cfs)
+	if (cgroup_ops->can_use_cpuview(cgroup_ops) &&
+	    policy_use_cpuview(cg, opts && opts->use_cfs))
 		use_view = true;
 	else
 		use_view = false;
@@ -192,7 +197,7 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 		total_len = snprintf(d->buf, d->buflen, "%s\n", cpuset);
 	}
 	if (total_len < 0 || total_len >= d->buflen)
-		return log_error(0, "Failed to write to cache");
+		return log_error_ratelimit(0, "Failed to write to cache");
 
 	d->size = (int)total_len;
 	d->cached = 1;
@@ -200,7 +205,7 @@ static int sys_devices_system_cpu_online_read(char *buf, size_t size,
 	if ((size_t)total_len > size)
 		total_len = size;
 
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 
 	return total_len;
 }
@@ -351,6 +356,7 @@ static int sys_getattr_legacy(const char *path, struct stat *sb)
 
 __lxcfs_fuse_ops int sys_getattr(const char *path, struct stat *sb)
 {
+	watch_request("getattr", path);
 	int ret;
 	struct timespec now;
 	mode_t st_mode;
@@ -403,6 +409,7 @@ __lxcfs_fuse_ops int sys_releasedir(const char *path, struct fuse_file_info *fi)
 __lxcfs_fuse_ops int sys_write(const char *path, const char *buf, size_t size,
 			       off_t offset, struct fuse_file_info *fi)
 {
+	watch_request("write", path);
 	__do_close int fd = -EBADF;
 	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
 
@@ -462,6 +469,7 @@ __lxcfs_fuse_ops int sys_readdir(const char *path, void *buf,
 				 fuse_fill_dir_t filler, off_t offset,
 				 struct fuse_file_info *fi)
 {
+	watch_request("readdir", path);
 	__do_closedir DIR *dir = NULL;
 	struct dirent *dirent;
 	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
@@ -531,6 +539,7 @@ __lxcfs_fuse_ops int sys_readdir(const char *path, void *buf,
 
 __lxcfs_fuse_ops int sys_readlink(const char *path, char *buf, size_t size)
 {
+	watch_request("readlink", path);
 	ssize_t ret;
 
 	if (!liblxcfs_functional())
@@ -550,7 +559,7 @@ __lxcfs_fuse_ops int sys_readlink(const char *path, char *buf, size_t size)
 
 static int sys_open_legacy(const char *path, struct fuse_file_info *fi)
 {
-	__do_free struct file_info *info = NULL;
+	struct file_info *info;
 	int type = -1;
 
 	if (strcmp(path, "/sys/devices") == 0)
@@ -564,30 +573,18 @@ static int sys_open_legacy(const char *path, struct fuse_file_info *fi)
 	if (type == -1)
 		return -ENOENT;
 
-	info = malloc(sizeof(*info));
+	info = file_info_new(type, path);
 	if (!info)
 		return -ENOMEM;
 
-	memset(info, 0, sizeof(*info));
-	info->type = type;
-
-	info->buflen = get_sysfile_size(path) + BUF_RESERVE_SIZE;
-
-	info->buf = malloc(info->buflen);
-	if (!info->buf)
-		return -ENOMEM;
-
-	memset(info->buf, 0, info->buflen);
-	/* set actual size to buffer size */
-	info->size = info->buflen;
-
-	fi->fh = PTR_TO_UINT64(move_ptr(info));
+	fi->fh = PTR_TO_UINT64(info);
 	return 0;
 }
 
 __lxcfs_fuse_ops int sys_open(const char *path, struct fuse_file_info *fi)
 {
-	__do_free struct file_info *info = NULL;
+	watch_request("open", path);
+	struct file_info *info;
 	int type = -1;
 
 	if (!liblxcfs_functional())
@@ -613,29 +610,21 @@ __lxcfs_fuse_ops int sys_open(const char *path, struct fuse_file_info *fi)
 	if (type == -1)
 		return -ENOENT;
 
-	info = malloc(sizeof(*info));
+	info = file_info_new(type, path);
 	if (!info)
 		return -ENOMEM;
 
-	memset(info, 0, sizeof(*info));
-	info->type = type;
-
-	info->buflen = get_sysfile_size(path) + BUF_RESERVE_SIZE;
-
-	info->buf = malloc(info->buflen);
-	if (!info->buf)
-		return -ENOMEM;
-
-	memset(info->buf, 0, info->buflen);
-	/* set actual size to buffer size */
-	info->size = info->buflen;
+	/* Files shown as-is don't need to go through us on every read. */
+	if (type == LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_SUBFILE || policy_host_file(type))
+		passthrough_open(path, fi, info);
 
-	fi->fh = PTR_TO_UINT64(move_ptr(info));
+	fi->fh = PTR_TO_UINT64(info);
 	return 0;
 }
 
 __lxcfs_fuse_ops int sys_opendir(const char *path, struct fuse_file_info *fi)
 {
+	watch_request("opendir", path);
 	__do_free struct file_info *dir_info = NULL;
 	int type = -1;
 
@@ -665,11 +654,10 @@ __lxcfs_fuse_ops int sys_opendir(const char *path, struct fuse_file_info *fi)
 	if (type == -1)
 		return -ENOENT;
 
-	dir_info = malloc(sizeof(*dir_info));
+	dir_info = zalloc(sizeof(*dir_info));
 	if (!dir_info)
 		return -ENOMEM;
 
-	memset(dir_info, 0, sizeof(*dir_info));
 	dir_info->type = type;
 	dir_info->buf = NULL;
 	dir_info->file = NULL;
@@ -703,6 +691,7 @@ static int sys_access_legacy(const char *path, int mask)
 
 __lxcfs_fuse_ops int sys_access(const char *path, int mask)
 {
+	watch_request("access", path);
 	if (!liblxcfs_functional())
 		return -EIO;
 
@@ -738,6 +727,7 @@ static int sys_read_legacy(const char *path, char *buf, size_t size,
 __lxcfs_fuse_ops int sys_read(const char *path, char *buf, size_t size,
 			      off_t offset, struct fuse_file_info *fi)
 {
+	watch_request("read", path);
 	struct file_info *f = INTTYPE_TO_PTR(fi->fh);
 
 	if (!liblxcfs_functional())
@@ -748,7 +738,9 @@ __lxcfs_fuse_ops int sys_read(const char *path, char *buf, size_t size,
 
 	switch (f->type) {
 	case LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE:
-		return sys_devices_system_cpu_online_read(buf, size, offset, fi);
+		return policy_read(f->type, LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_ONLINE_PATH,
+				   sys_devices_system_cpu_online_read, buf, size,
+				   offset, fi);
 	case LXC_TYPE_SYS_DEVICES_SYSTEM_CPU_SUBFILE:
 		return read_file_fuse_with_offset(path, buf, size, offset, f);
 	}
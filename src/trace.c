@@ -0,0 +1,809 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "trace.h"
+
+#include "memory_utils.h"
+
+#define TRACE_MAGIC "LXCFSTRC"
+#define TRACE_VERSION 1
+#define TRACE_RECORD_SIZE 256
+#define TRACE_RECORDS_MAX (1ULL << 24)
+#define TRACE_REPLAY_THREADS 256
+#define TRACE_FH_HASH_SIZE 1024
+
+enum trace_op {
+	TRACE_GETATTR = 1,
+	TRACE_ACCESS,
+	TRACE_OPEN,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_RELEASE,
+	TRACE_OPENDIR,
+	TRACE_READDIR,
+	TRACE_RELEASEDIR,
+	TRACE_READLINK,
+	TRACE_MKDIR,
+	TRACE_RMDIR,
+	TRACE_CHOWN,
+	TRACE_CHMOD,
+	TRACE_TRUNCATE,
+	TRACE_OP_MAX,
+};
+
+static const char *const trace_op_names[TRACE_OP_MAX] = {
+	[TRACE_GETATTR]		= "getattr",
+	[TRACE_ACCESS]		= "access",
+	[TRACE_OPEN]		= "open",
+	[TRACE_READ]		= "read",
+	[TRACE_WRITE]		= "write",
+	[TRACE_RELEASE]		= "release",
+	[TRACE_OPENDIR]		= "opendir",
+	[TRACE_READDIR]		= "readdir",
+	[TRACE_RELEASEDIR]	= "releasedir",
+	[TRACE_READLINK]	= "readlink",
+	[TRACE_MKDIR]		= "mkdir",
+	[TRACE_RMDIR]		= "rmdir",
+	[TRACE_CHOWN]		= "chown",
+	[TRACE_CHMOD]		= "chmod",
+	[TRACE_TRUNCATE]	= "truncate",
+};
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t nr_records;
+	uint64_t head; /* requests ever recorded */
+	int64_t realtime_ns; /* wall clock time the trace started */
+	uint8_t reserved[24];
+};
+
+/*
+ * A record in slot pos % nr_records is complete when its sequence is
+ * pos + 1, it is cleared while being written.
+ */
+struct trace_record {
+	uint64_t seq;
+	uint64_t start_ns; /* since the trace started */
+	uint64_t latency_ns;
+	uint64_t caller; /* inode of the caller's pid namespace */
+	uint64_t fh;
+	int64_t offset;
+	uint32_t size; /* bytes for read and write, mode for access and chmod */
+	uint32_t thread; /* FUSE worker that served the request */
+	int32_t ret;
+	uint8_t op;
+	char path[TRACE_RECORD_SIZE - 61];
+};
+
+_Static_assert(sizeof(struct trace_header) == 64, "trace header size changed");
+_Static_assert(sizeof(struct trace_record) == TRACE_RECORD_SIZE, "trace record size changed");
+
+static struct trace_header *trace_map;
+static struct trace_record *trace_ring;
+static size_t trace_map_size;
+static uint64_t trace_base_ns;
+static const struct fuse_operations *traced;
+static struct fuse_operations trace_fuse_ops;
+
+/* The caller's namespace is looked up once per pid and worker. */
+static __thread pid_t caller_pid;
+static __thread uint64_t caller_key;
+static __thread uint32_t worker_tid;
+
+static inline uint64_t trace_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t trace_caller(void)
+{
+	struct fuse_context *fc = fuse_get_context();
+	char path[STRLITERALLEN("/proc//ns/pid") + INTTYPE_TO_STRLEN(pid_t) + 1];
+	struct stat st;
+
+	if (!fc)
+		return 0;
+
+	if (fc->pid == caller_pid)
+		return caller_key;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/pid", fc->pid);
+	caller_pid = fc->pid;
+	caller_key = stat(path, &st) ? 0 : st.st_ino;
+
+	return caller_key;
+}
+
+static void trace_record(enum trace_op op, const char *path, uint64_t start,
+			 int ret, struct fuse_file_info *fi, size_t size,
+			 off_t offset)
+{
+	struct trace_record *rec;
+	uint64_t pos, end;
+	size_t len;
+
+	end = trace_clock_ns(CLOCK_MONOTONIC);
+	pos = __atomic_fetch_add(&trace_map->head, 1, __ATOMIC_RELAXED);
+	rec = &trace_ring[pos % trace_map->nr_records];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (!worker_tid)
+		worker_tid = syscall(SYS_gettid);
+
+	rec->start_ns = start - trace_base_ns;
+	rec->latency_ns = end - start;
+	rec->caller = trace_caller();
+	rec->fh = fi ? fi->fh : 0;
+	rec->offset = offset;
+	rec->size = size;
+	rec->thread = worker_tid;
+	rec->ret = ret;
+	rec->op = op;
+
+	len = strnlen(path, sizeof(rec->path) - 1);
+	memcpy(rec->path, path, len);
+	rec->path[len] = '\0';
+
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_CALL(op, path, fi, size, offset, call)                        \
+	({                                                                  \
+		uint64_t __start__ = trace_clock_ns(CLOCK_MONOTONIC);       \
+		int __ret__ = call;                                         \
+		trace_record(op, path, __start__, __ret__, fi, size, offset); \
+		__ret__;                                                    \
+	})
+
+#ifdef HAVE_FUSE3
+static int trace_getattr(const char *path, struct stat *sb, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_GETATTR, path, NULL, 0, 0, traced->getattr(path, sb, fi));
+}
+#else
+static int trace_getattr(const char *path, struct stat *sb)
+{
+	return TRACE_CALL(TRACE_GETATTR, path, NULL, 0, 0, traced->getattr(path, sb));
+}
+#endif
+
+static int trace_access(const char *path, int mode)
+{
+	return TRACE_CALL(TRACE_ACCESS, path, NULL, mode, 0, traced->access(path, mode));
+}
+
+static int trace_open(const char *path, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_OPEN, path, fi, 0, 0, traced->open(path, fi));
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_READ, path, fi, size, offset,
+			  traced->read(path, buf, size, offset, fi));
+}
+
+static int trace_write(const char *path, const char *buf, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_WRITE, path, fi, size, offset,
+			  traced->write(path, buf, size, offset, fi));
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_RELEASE, path, fi, 0, 0, traced->release(path, fi));
+}
+
+static int trace_opendir(const char *path, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_OPENDIR, path, fi, 0, 0, traced->opendir(path, fi));
+}
+
+#ifdef HAVE_FUSE3
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi,
+			 enum fuse_readdir_flags flags)
+{
+	return TRACE_CALL(TRACE_READDIR, path, fi, 0, offset,
+			  traced->readdir(path, buf, filler, offset, fi, flags));
+}
+#else
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_READDIR, path, fi, 0, offset,
+			  traced->readdir(path, buf, filler, offset, fi));
+}
+#endif
+
+static int trace_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_RELEASEDIR, path, fi, 0, 0, traced->releasedir(path, fi));
+}
+
+static int trace_readlink(const char *path, char *buf, size_t size)
+{
+	return TRACE_CALL(TRACE_READLINK, path, NULL, size, 0, traced->readlink(path, buf, size));
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+	return TRACE_CALL(TRACE_MKDIR, path, NULL, mode, 0, traced->mkdir(path, mode));
+}
+
+static int trace_rmdir(const char *path)
+{
+	return TRACE_CALL(TRACE_RMDIR, path, NULL, 0, 0, traced->rmdir(path));
+}
+
+#ifdef HAVE_FUSE3
+static int trace_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_CHOWN, path, NULL, 0, 0, traced->chown(path, uid, gid, fi));
+}
+
+static int trace_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_CHMOD, path, NULL, mode, 0, traced->chmod(path, mode, fi));
+}
+
+static int trace_truncate(const char *path, off_t newsize, struct fuse_file_info *fi)
+{
+	return TRACE_CALL(TRACE_TRUNCATE, path, NULL, 0, newsize, traced->truncate(path, newsize, fi));
+}
+#else
+static int trace_chown(const char *path, uid_t uid, gid_t gid)
+{
+	return TRACE_CALL(TRACE_CHOWN, path, NULL, 0, 0, traced->chown(path, uid, gid));
+}
+
+static int trace_chmod(const char *path, mode_t mode)
+{
+	return TRACE_CALL(TRACE_CHMOD, path, NULL, mode, 0, traced->chmod(path, mode));
+}
+
+static int trace_truncate(const char *path, off_t newsize)
+{
+	return TRACE_CALL(TRACE_TRUNCATE, path, NULL, 0, newsize, traced->truncate(path, newsize));
+}
+#endif
+
+const struct fuse_operations *trace_ops(const struct fuse_operations *ops)
+{
+	traced = ops;
+	trace_fuse_ops = *ops;
+
+	trace_fuse_ops.access		= trace_access;
+	trace_fuse_ops.chmod		= trace_chmod;
+	trace_fuse_ops.chown		= trace_chown;
+	trace_fuse_ops.getattr		= trace_getattr;
+	trace_fuse_ops.mkdir		= trace_mkdir;
+	trace_fuse_ops.open		= trace_open;
+	trace_fuse_ops.opendir		= trace_opendir;
+	trace_fuse_ops.read		= trace_read;
+	trace_fuse_ops.readdir		= trace_readdir;
+	trace_fuse_ops.release		= trace_release;
+	trace_fuse_ops.releasedir	= trace_releasedir;
+	trace_fuse_ops.rmdir		= trace_rmdir;
+	trace_fuse_ops.truncate		= trace_truncate;
+	trace_fuse_ops.write		= trace_write;
+	trace_fuse_ops.readlink		= trace_readlink;
+
+	return &trace_fuse_ops;
+}
+
+int trace_start(const char *path, uint64_t nr_records)
+{
+	__do_close int fd = -EBADF;
+	size_t size;
+	void *map;
+
+	if (nr_records == 0 || nr_records > TRACE_RECORDS_MAX)
+		return log_error(-EINVAL, "Trace must hold between 1 and %llu requests",
+				 (unsigned long long)TRACE_RECORDS_MAX);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return log_error(-errno, "%s - Failed to open trace file %s", strerror(errno), path);
+
+	size = sizeof(struct trace_header) + nr_records * sizeof(struct trace_record);
+	if (ftruncate(fd, size))
+		return log_error(-errno, "%s - Failed to size trace file %s", strerror(errno), path);
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return log_error(-errno, "%s - Failed to map trace file %s", strerror(errno), path);
+
+	trace_map = map;
+	trace_ring = (struct trace_record *)(trace_map + 1);
+	trace_map_size = size;
+
+	memcpy(trace_map->magic, TRACE_MAGIC, sizeof(trace_map->magic));
+	trace_map->version = TRACE_VERSION;
+	trace_map->record_size = sizeof(struct trace_record);
+	trace_map->nr_records = nr_records;
+	trace_map->realtime_ns = trace_clock_ns(CLOCK_REALTIME);
+	trace_base_ns = trace_clock_ns(CLOCK_MONOTONIC);
+
+	return 0;
+}
+
+void trace_stop(void)
+{
+	if (!trace_map)
+		return;
+
+	if (msync(trace_map, trace_map_size, MS_SYNC))
+		lxcfs_error("%s - Failed to write back trace", strerror(errno));
+	munmap(trace_map, trace_map_size);
+	trace_map = NULL;
+	trace_ring = NULL;
+}
+
+/* Replay */
+
+struct replay_stats {
+	uint64_t count;
+	uint64_t skipped;
+	uint64_t errors;
+	uint64_t recorded_ns;
+	uint64_t recorded_max_ns;
+	uint64_t replayed_ns;
+	uint64_t replayed_max_ns;
+};
+
+struct replay_fh {
+	uint64_t fh;
+	int fd;
+	struct replay_fh *next;
+};
+
+struct replay {
+	int mntfd;
+	struct trace_record *records;
+	size_t nr_records;
+	size_t max_size;
+	uint32_t threads[TRACE_REPLAY_THREADS];
+	int nr_threads;
+	uint64_t start_ns;
+	uint64_t max_lag_ns;
+	struct replay_stats stats[TRACE_OP_MAX];
+	struct replay_fh *fhs[TRACE_FH_HASH_SIZE];
+	pthread_mutex_t fh_mutex;
+};
+
+struct replay_worker {
+	struct replay *replay;
+	int idx;
+	pthread_t thread;
+};
+
+static inline void atomic_max(uint64_t *max, uint64_t val)
+{
+	uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (val > cur &&
+	       !__atomic_compare_exchange_n(max, &cur, val, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Requests that would change the test mount are only counted. */
+static inline bool replay_skipped(uint8_t op)
+{
+	switch (op) {
+	case TRACE_WRITE:
+	case TRACE_MKDIR:
+	case TRACE_RMDIR:
+	case TRACE_CHOWN:
+	case TRACE_CHMOD:
+	case TRACE_TRUNCATE:
+		return true;
+	}
+
+	return false;
+}
+
+static void replay_fh_add(struct replay *r, uint64_t fh, int fd)
+{
+	struct replay_fh *new;
+
+	new = zalloc(sizeof(*new));
+	if (!new) {
+		close(fd);
+		return;
+	}
+	new->fh = fh;
+	new->fd = fd;
+
+	pthread_mutex_lock(&r->fh_mutex);
+	new->next = r->fhs[fh % TRACE_FH_HASH_SIZE];
+	r->fhs[fh % TRACE_FH_HASH_SIZE] = new;
+	pthread_mutex_unlock(&r->fh_mutex);
+}
+
+/* Returns the descriptor standing in for @fh, removing it if @take. */
+static int replay_fh_get(struct replay *r, uint64_t fh, bool take)
+{
+	int fd = -EBADF;
+
+	pthread_mutex_lock(&r->fh_mutex);
+	for (struct replay_fh **it = &r->fhs[fh % TRACE_FH_HASH_SIZE]; *it; it = &(*it)->next) {
+		struct replay_fh *entry = *it;
+
+		if (entry->fh != fh)
+			continue;
+
+		fd = entry->fd;
+		if (take) {
+			*it = entry->next;
+			free(entry);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&r->fh_mutex);
+
+	return fd;
+}
+
+static inline const char *replay_path(const struct trace_record *rec)
+{
+	const char *path = rec->path;
+
+	while (*path == '/')
+		path++;
+
+	return *path ? path : ".";
+}
+
+static int replay_getdents(int fd, char *buf, size_t size)
+{
+	ssize_t ret;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return -errno;
+
+	do {
+		ret = syscall(SYS_getdents64, fd, buf, size);
+	} while (ret > 0);
+
+	return ret < 0 ? -errno : 0;
+}
+
+static int replay_one(struct replay *r, const struct trace_record *rec,
+		      char *buf, size_t size)
+{
+	const char *path = replay_path(rec);
+	bool dir = false;
+	struct stat st;
+	int fd, ret = 0;
+
+	switch (rec->op) {
+	case TRACE_GETATTR:
+		ret = fstatat(r->mntfd, path, &st, AT_SYMLINK_NOFOLLOW);
+		break;
+	case TRACE_ACCESS:
+		ret = faccessat(r->mntfd, path, rec->size, 0);
+		break;
+	case TRACE_READLINK:
+		ret = readlinkat(r->mntfd, path, buf, MIN(size, MAX(rec->size, 1)));
+		break;
+	case TRACE_OPENDIR:
+		dir = true;
+		// fallthrough
+	case TRACE_OPEN:
+		fd = openat(r->mntfd, path, O_RDONLY | O_CLOEXEC | (dir ? O_DIRECTORY : 0));
+		if (fd < 0)
+			return -errno;
+		if (rec->ret == 0)
+			replay_fh_add(r, rec->fh, fd);
+		else
+			close(fd);
+		break;
+	case TRACE_READDIR:
+		dir = true;
+		// fallthrough
+	case TRACE_READ:
+		fd = replay_fh_get(r, rec->fh, false);
+		if (fd < 0) {
+			/* Opened before the trace began or wrapped out of it. */
+			fd = openat(r->mntfd, path, O_RDONLY | O_CLOEXEC | (dir ? O_DIRECTORY : 0));
+			if (fd < 0)
+				return -errno;
+			replay_fh_add(r, rec->fh, fd);
+		}
+		if (dir)
+			return replay_getdents(fd, buf, size);
+		ret = pread(fd, buf, MIN(size, rec->size), rec->offset);
+		break;
+	case TRACE_RELEASE:
+	case TRACE_RELEASEDIR:
+		fd = replay_fh_get(r, rec->fh, true);
+		if (fd >= 0)
+			ret = close(fd);
+		break;
+	}
+
+	return ret < 0 ? -errno : 0;
+}
+
+static void *replay_thread(void *arg)
+{
+	struct replay_worker *w = arg;
+	struct replay *r = w->replay;
+	__do_free char *buf = NULL;
+	size_t size = MAX(r->max_size, 65536);
+
+	buf = malloc(size);
+	if (!buf)
+		return NULL;
+
+	for (size_t i = 0; i < r->nr_records; i++) {
+		const struct trace_record *rec = &r->records[i];
+		struct replay_stats *stats = &r->stats[rec->op];
+		uint64_t due = r->start_ns + rec->start_ns, now, end;
+		struct timespec ts = {
+			.tv_sec		= due / 1000000000,
+			.tv_nsec	= due % 1000000000,
+		};
+		int ret;
+
+		if ((int)(rec->thread % TRACE_REPLAY_THREADS) != w->idx)
+			continue;
+
+		__atomic_add_fetch(&stats->count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats->recorded_ns, rec->latency_ns, __ATOMIC_RELAXED);
+		atomic_max(&stats->recorded_max_ns, rec->latency_ns);
+		if (replay_skipped(rec->op)) {
+			__atomic_add_fetch(&stats->skipped, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		now = trace_clock_ns(CLOCK_MONOTONIC);
+		atomic_max(&r->max_lag_ns, now > due ? now - due : 0);
+		ret = replay_one(r, rec, buf, size);
+		end = trace_clock_ns(CLOCK_MONOTONIC);
+
+		__atomic_add_fetch(&stats->replayed_ns, end - now, __ATOMIC_RELAXED);
+		atomic_max(&stats->replayed_max_ns, end - now);
+		/* Only count what didn't fail when it was recorded either. */
+		if (ret < 0 && rec->ret >= 0)
+			__atomic_add_fetch(&stats->errors, 1, __ATOMIC_RELAXED);
+	}
+
+	return NULL;
+}
+
+static int cmp_record(const void *a, const void *b)
+{
+	const struct trace_record *ra = a, *rb = b;
+
+	if (ra->start_ns != rb->start_ns)
+		return ra->start_ns < rb->start_ns ? -1 : 1;
+
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static int replay_load(struct replay *r, const char *path)
+{
+	__do_close int fd = -EBADF;
+	const struct trace_header *hdr;
+	const struct trace_record *ring;
+	struct stat st;
+	uint64_t nr;
+	void *map;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return log_error(-errno, "%s - Failed to open trace file %s", strerror(errno), path);
+
+	if (fstat(fd, &st))
+		return log_error(-errno, "%s - Failed to stat trace file %s", strerror(errno), path);
+
+	if ((size_t)st.st_size < sizeof(*hdr))
+		return log_error(-EINVAL, "%s is not an lxcfs trace", path);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return log_error(-errno, "%s - Failed to map trace file %s", strerror(errno), path);
+
+	hdr = map;
+	ring = (const struct trace_record *)(hdr + 1);
+	nr = hdr->nr_records;
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->record_size != sizeof(struct trace_record) ||
+	    nr == 0 || nr > TRACE_RECORDS_MAX ||
+	    (uint64_t)st.st_size < sizeof(*hdr) + nr * sizeof(struct trace_record)) {
+		munmap(map, st.st_size);
+		return log_error(-EINVAL, "%s is not an lxcfs trace of this version", path);
+	}
+
+	r->records = malloc(nr * sizeof(struct trace_record));
+	if (!r->records) {
+		munmap(map, st.st_size);
+		return -ENOMEM;
+	}
+
+	for (uint64_t i = 0; i < nr; i++) {
+		const struct trace_record *rec = &ring[i];
+
+		/* Torn by a crash mid-write or never written. */
+		if (rec->seq == 0 || (rec->seq - 1) % nr != i)
+			continue;
+		if (rec->op == 0 || rec->op >= TRACE_OP_MAX)
+			continue;
+
+		r->records[r->nr_records] = *rec;
+		r->records[r->nr_records].path[sizeof(rec->path) - 1] = '\0';
+		r->nr_records++;
+	}
+	munmap(map, st.st_size);
+
+	qsort(r->records, r->nr_records, sizeof(struct trace_record), cmp_record);
+
+	return 0;
+}
+
+static void replay_report(const struct replay *r, uint64_t elapsed_ns)
+{
+	__do_free uint64_t *callers = NULL;
+	size_t nr_callers = 0;
+
+	callers = malloc(MAX(r->nr_records, 1) * sizeof(uint64_t));
+	if (callers) {
+		for (size_t i = 0; i < r->nr_records; i++)
+			callers[i] = r->records[i].caller;
+		qsort(callers, r->nr_records, sizeof(uint64_t), cmp_u64);
+		for (size_t i = 0; i < r->nr_records; i++)
+			if (i == 0 || callers[i] != callers[i - 1])
+				nr_callers++;
+	}
+
+	printf("%zu requests from %zu pid namespaces on %d threads in %.3fs, at most %.3fms behind\n",
+	       r->nr_records, nr_callers, r->nr_threads, elapsed_ns / 1e9,
+	       r->max_lag_ns / 1e6);
+	printf("%-11s %9s %9s %9s %12s %12s %12s %12s\n", "op", "count",
+	       "skipped", "errors", "rec avg us", "rec max us", "avg us", "max us");
+
+	for (int op = 1; op < TRACE_OP_MAX; op++) {
+		const struct replay_stats *s = &r->stats[op];
+		uint64_t replayed = s->count - s->skipped;
+
+		if (!s->count)
+			continue;
+
+		printf("%-11s %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %12.1f %12.1f %12.1f %12.1f\n",
+		       trace_op_names[op], s->count, s->skipped, s->errors,
+		       s->recorded_ns / 1e3 / s->count, s->recorded_max_ns / 1e3,
+		       replayed ? s->replayed_ns / 1e3 / replayed : 0.0,
+		       s->replayed_max_ns / 1e3);
+	}
+}
+
+int trace_replay(const char *path, const char *mountpoint)
+{
+	__do_free struct replay *r = NULL;
+	struct replay_worker workers[TRACE_REPLAY_THREADS] = {};
+	uint64_t elapsed;
+	int ret;
+
+	r = zalloc(sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	pthread_mutex_init(&r->fh_mutex, NULL);
+
+	ret = replay_load(r, path);
+	if (ret)
+		return ret;
+
+	r->mntfd = open(mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (r->mntfd < 0) {
+		ret = log_error(-errno, "%s - Failed to open %s", strerror(errno), mountpoint);
+		goto out;
+	}
+
+	/*
+	 * Requests a worker served are replayed in order by one thread. Workers
+	 * whose ids collide share the thread of the first one seen.
+	 */
+	for (size_t i = 0; i < r->nr_records; i++) {
+		struct trace_record *rec = &r->records[i];
+		uint32_t *slot = &r->threads[rec->thread % TRACE_REPLAY_THREADS];
+
+		r->max_size = MAX(r->max_size, rec->size);
+		if (*slot == 0) {
+			*slot = rec->thread;
+			r->nr_threads++;
+		}
+		rec->thread = *slot;
+	}
+
+	r->start_ns = trace_clock_ns(CLOCK_MONOTONIC);
+	if (r->nr_records)
+		r->start_ns -= r->records[0].start_ns;
+
+	for (int i = 0; i < TRACE_REPLAY_THREADS; i++) {
+		workers[i].replay = r;
+		workers[i].idx = i;
+		if (!r->threads[i])
+			continue;
+
+		ret = pthread_create(&workers[i].thread, NULL, replay_thread, &workers[i]);
+		if (ret) {
+			lxcfs_error("%s - Failed to create replay thread", strerror(ret));
+			r->threads[i] = 0;
+			r->nr_threads--;
+		}
+	}
+
+	for (int i = 0; i < TRACE_REPLAY_THREADS; i++)
+		if (r->threads[i])
+			pthread_join(workers[i].thread, NULL);
+
+	elapsed = trace_clock_ns(CLOCK_MONOTONIC) - r->start_ns;
+	if (r->nr_records)
+		elapsed -= r->records[0].start_ns;
+	replay_report(r, elapsed);
+	ret = 0;
+
+out:
+	for (int i = 0; i < TRACE_FH_HASH_SIZE; i++) {
+		while (r->fhs[i]) {
+			struct replay_fh *entry = r->fhs[i];
+
+			r->fhs[i] = entry->next;
+			close(entry->fd);
+			free(entry);
+		}
+	}
+	close_prot_errno_disarm(r->mntfd);
+	free(r->records);
+	pthread_mutex_destroy(&r->fh_mutex);
+
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_TRACE_H
+#define __LXCFS_TRACE_H
+
+#include "config.h"
+
+#include <stdint.h>
+
+#if HAVE_FUSE3
+#include <fuse3/fuse.h>
+#else
+#include <fuse.h>
+#endif
+
+#include "macro.h"
+
+/* Requests kept by default, 8MiB on disk. */
+#define TRACE_RECORDS_DEFAULT 32768
+
+/*
+ * Request capture. Every FUSE request served is written to a ring of fixed
+ * size records in a file mapped shared, so the kernel writes it back even if
+ * lxcfs dies. Only the newest @nr_records requests are kept.
+ */
+extern int trace_start(const char *path, uint64_t nr_records);
+extern void trace_stop(void);
+
+/* A copy of @ops with every request handler recording into the trace. */
+extern const struct fuse_operations *trace_ops(const struct fuse_operations *ops);
+
+/*
+ * Re-issue the requests captured in @path against the lxcfs mounted at
+ * @mountpoint with their original timing, one thread for each FUSE worker
+ * that served them, and print the recorded and replayed latencies.
+ */
+extern int trace_replay(const char *path, const char *mountpoint);
+
+#endif /* __LXCFS_TRACE_H */
@@ -11,6 +11,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sched.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -18,17 +20,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/epoll.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#if HAVE_FUSE_PASSTHROUGH
+#include <fuse3/fuse_lowlevel.h>
+#endif
+
 #include "utils.h"
 
 #include "bindings.h"
+#include "file_info_pool.h"
+#include "lxcfs_fuse_compat.h"
 #include "macro.h"
 #include "memory_utils.h"
+#include "render_stream.h"
+#include "watchdog.h"
 
 /*
  * append the given formatted string to *src.
@@ -132,6 +144,14 @@ bool is_shared_pidns(pid_t pid)
 	return false;
 }
 
+bool is_host_pidns(pid_t pid)
+{
+	__do_close int fd = -EBADF;
+
+	fd = in_same_namespace(pid, getpid(), "pid");
+	return fd == -EINVAL;
+}
+
 int preserve_ns(const int pid, const char *ns)
 {
 	int ret;
@@ -164,146 +184,369 @@ void do_release_file_info(struct fuse_file_info *fi)
 
 	fi->fh = 0;
 
+	passthrough_close(f);
+	render_stream_release(f);
 	free_disarm(f->controller);
 	free_disarm(f->cgroup);
 	free_disarm(f->file);
-	free_disarm(f->buf);
-	free_disarm(f);
+	file_info_free(f);
 }
 
-#define POLLIN_SET ( EPOLLIN | EPOLLHUP | EPOLLRDHUP )
+#if HAVE_FUSE_PASSTHROUGH
+/* Set once the kernel refuses a backing file so we stop asking. */
+static bool passthrough_broken;
 
-bool wait_for_sock(int sock, int timeout)
+/*
+ * The kernel ties a backing file to the FUSE inode, registering another one
+ * while the first is in use fails with EBUSY. All opens of a host file share
+ * one backing id, closed when the last of them is released. Ids belong to
+ * the FUSE connection they were opened on, with per-container sessions each
+ * connection has ids of its own.
+ */
+struct backing_file {
+	int devfd;
+	char *path;
+	int id;
+	unsigned int refs;
+	struct backing_file *next;
+};
+
+static struct backing_file *backing_files;
+static pthread_mutex_t backing_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int fuse_dev_fd(void)
 {
-	__do_close int epfd = -EBADF;
-	struct epoll_event ev;
-	int ret, now, starttime, deltatime;
+	struct fuse_context *fc = fuse_get_context();
 
-	if ((starttime = time(NULL)) < 0)
-		return false;
+	if (!fc || !fc->fuse)
+		return -EBADF;
 
-	epfd = epoll_create(1);
-	if (epfd < 0)
-		return log_error(false, "%m - Failed to create epoll socket");
+	return fuse_session_fd(fuse_get_session(fc->fuse));
+}
 
-	ev.events = POLLIN_SET;
-	ev.data.fd = sock;
-	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
-		return log_error(false, "Failed adding socket to epoll: %m");
+static int backing_file_open(int devfd, const char *path)
+{
+	__do_close int fd = -EBADF;
+	struct fuse_backing_map map = {};
+	int id;
 
-again:
-	if ((now = time(NULL)) < 0)
-		return false;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
 
-	deltatime = (starttime + timeout) - now;
-	if (deltatime < 0)
-		return false;
+	map.fd = fd;
+	id = ioctl(devfd, FUSE_DEV_IOC_BACKING_OPEN, &map);
+	if (id < 0)
+		return -errno;
+	if (id == 0)
+		return -EINVAL;
 
-	ret = epoll_wait(epfd, &ev, 1, 1000*deltatime + 1);
-	if (ret < 0 && errno == EINTR)
-		goto again;
+	/* The kernel holds its own reference to the file now. */
+	return id;
+}
 
-	if (ret <= 0)
-		return false;
+int passthrough_open(const char *path, struct fuse_file_info *fi,
+		     struct file_info *info)
+{
+	__do_free struct backing_file *new = NULL;
+	struct backing_file *b;
+	int devfd, id;
+
+	if (__atomic_load_n(&passthrough_broken, __ATOMIC_RELAXED) ||
+	    !liblxcfs_passthrough())
+		return -EOPNOTSUPP;
+
+	devfd = fuse_dev_fd();
+	if (devfd < 0)
+		return -EBADF;
+
+	pthread_mutex_lock(&backing_mutex);
+	for (b = backing_files; b; b = b->next) {
+		if (b->devfd == devfd && strcmp(b->path, path) == 0) {
+			b->refs++;
+			id = b->id;
+			goto out;
+		}
+	}
 
-	return true;
+	new = zalloc(sizeof(*new));
+	if (new)
+		new->path = strdup(path);
+	if (!new || !new->path) {
+		pthread_mutex_unlock(&backing_mutex);
+		if (new)
+			free(new->path);
+		return -ENOMEM;
+	}
+
+	id = backing_file_open(devfd, path);
+	if (id < 0) {
+		pthread_mutex_unlock(&backing_mutex);
+		free(new->path);
+
+		/* Transient, the open just keeps going through us. */
+		if (id == -EBUSY || id == -ENOENT || id == -EACCES ||
+		    id == -EMFILE || id == -ENFILE || id == -ENOMEM)
+			return id;
+
+		__atomic_store_n(&passthrough_broken, true, __ATOMIC_RELAXED);
+		return log_error(-EOPNOTSUPP, "%s - Disabling FUSE passthrough, failed to open backing file %s",
+				 strerror(-id), path);
+	}
+
+	new->devfd = devfd;
+	new->id = id;
+	new->refs = 1;
+	new->next = backing_files;
+	backing_files = move_ptr(new);
+
+out:
+	pthread_mutex_unlock(&backing_mutex);
+	info->backing_id = id;
+	fi->backing_id = id;
+	return 0;
 }
 
-bool recv_creds(int sock, struct ucred *cred, char *v)
+void passthrough_close(struct file_info *info)
 {
-	struct msghdr msg = {};
-	struct iovec iov;
-	struct cmsghdr *cmsg;
-	ssize_t ret;
-	char cmsgbuf[CMSG_SPACE(sizeof(*cred))] = {};
-	char buf = '1';
-	int optval = 1;
+	struct backing_file **pb, *b = NULL;
+	uint32_t id = info->backing_id;
+	int devfd;
 
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
+	if (info->backing_id <= 0)
+		return;
+	info->backing_id = 0;
 
-	iov.iov_base = &buf;
-	iov.iov_len = sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	/* Released on the connection the file was opened on. */
+	devfd = fuse_dev_fd();
+	if (devfd < 0)
+		return;
 
-	*v = buf;
+	pthread_mutex_lock(&backing_mutex);
+	for (pb = &backing_files; *pb; pb = &(*pb)->next) {
+		if ((*pb)->devfd != devfd || (*pb)->id != (int)id)
+			continue;
 
-	ret = setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval));
-	if (ret < 0)
-		return log_error(false, "Failed to set passcred: %s\n", strerror(errno));
+		b = *pb;
+		if (--b->refs == 0)
+			*pb = b->next;
+		else
+			b = NULL;
+		break;
+	}
+	pthread_mutex_unlock(&backing_mutex);
 
-	ret = write_nointr(sock, &buf, sizeof(buf));
-	if (ret != sizeof(buf))
-		return log_error(false, "Failed to start write on scm fd: %s\n", strerror(errno));
+	/* Still used by other opens of the same file. */
+	if (!b)
+		return;
+	free(b->path);
+	free(b);
 
-	if (!wait_for_sock(sock, 2))
-		return log_error(false, "Timed out waiting for scm_cred: %s\n", strerror(errno));
+	if (ioctl(devfd, FUSE_DEV_IOC_BACKING_CLOSE, &id))
+		lxcfs_debug("%s - Failed to close backing file %u", strerror(errno), id);
+}
 
-	ret = recvmsg(sock, &msg, MSG_DONTWAIT);
-	if (ret < 0)
-		return log_error(false, "Failed to receive scm_cred: %s\n", strerror(errno));
+void passthrough_destroy(void)
+{
+	struct backing_file **pb = &backing_files;
+	int devfd;
 
-	cmsg = CMSG_FIRSTHDR(&msg);
+	/* The kernel drops the ids along with the connection. */
+	devfd = fuse_dev_fd();
+	if (devfd < 0)
+		return;
+
+	pthread_mutex_lock(&backing_mutex);
+	while (*pb) {
+		struct backing_file *b = *pb;
+
+		if (b->devfd != devfd) {
+			pb = &b->next;
+			continue;
+		}
 
-	if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(*cred)) &&
-	    cmsg->cmsg_level == SOL_SOCKET &&
-	    cmsg->cmsg_type == SCM_CREDENTIALS) {
-		memcpy(cred, CMSG_DATA(cmsg), sizeof(*cred));
+		*pb = b->next;
+		free(b->path);
+		free(b);
 	}
-	*v = buf;
+	pthread_mutex_unlock(&backing_mutex);
+}
+#else
+int passthrough_open(const char *path, struct fuse_file_info *fi,
+		     struct file_info *info)
+{
+	return -EOPNOTSUPP;
+}
 
-	return true;
+void passthrough_close(struct file_info *info)
+{
 }
 
-static int msgrecv(int sockfd, void *buf, size_t len)
+void passthrough_destroy(void)
 {
-	if (!wait_for_sock(sockfd, 2))
-		return -1;
+}
+#endif
 
-	return recv(sockfd, buf, len, MSG_DONTWAIT);
+int64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return -errno;
+
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int send_creds(int sock, struct ucred *cred, char v, bool pingfirst)
+int wait_for_events(struct pollfd *pfd, nfds_t nfds, int64_t deadline)
 {
-	struct msghdr msg = { 0 };
-	struct iovec iov;
-	struct cmsghdr *cmsg;
-	char cmsgbuf[CMSG_SPACE(sizeof(*cred))];
-	char buf[1];
-	buf[0] = 'p';
+	for (;;) {
+		int64_t now;
+		int ret;
 
-	if (pingfirst && msgrecv(sock, buf, 1) != 1)
-		return log_error(SEND_CREDS_FAIL, "%s - Failed getting reply from server over socketpair: %d",
-				 strerror(errno), SEND_CREDS_FAIL);
+		now = monotonic_ms();
+		if (now < 0)
+			return now;
 
-	msg.msg_control = cmsgbuf;
-	msg.msg_controllen = sizeof(cmsgbuf);
+		if (now >= deadline)
+			return 0;
+
+		ret = poll(pfd, nfds, deadline - now);
+		if (ret >= 0)
+			return ret;
+
+		if (errno != EINTR)
+			return -errno;
+	}
+}
+
+bool wait_for_sock(int sock, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd	= sock,
+		.events	= POLLIN | POLLRDHUP,
+	};
+	int64_t now;
+
+	now = monotonic_ms();
+	if (now < 0)
+		return false;
+
+	return wait_for_events(&pfd, 1, now + timeout_ms) > 0;
+}
+
+bool enable_passcred(int sock)
+{
+	int optval = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &optval, sizeof(optval)) < 0)
+		return log_error(false, "%s - Failed to set passcred", strerror(errno));
+
+	return true;
+}
+
+union scm_creds_buf {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(struct ucred))];
+};
+
+int recv_creds_batch(int sock, struct ucred *creds, char *v, size_t n)
+{
+	struct mmsghdr msgs[SCM_BATCH] = {};
+	struct iovec iov[SCM_BATCH];
+	union scm_creds_buf cmsgbuf[SCM_BATCH];
+	int ret;
 
-	cmsg = CMSG_FIRSTHDR(&msg);
-	cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
-	cmsg->cmsg_level = SOL_SOCKET;
-	cmsg->cmsg_type = SCM_CREDENTIALS;
-	memcpy(CMSG_DATA(cmsg), cred, sizeof(*cred));
+	n = MIN(n, SCM_BATCH);
+	for (size_t i = 0; i < n; i++) {
+		v[i] = '1';
+		iov[i].iov_base = &v[i];
+		iov[i].iov_len = sizeof(v[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = cmsgbuf[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(cmsgbuf[i].buf);
+	}
 
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
+	ret = recvmmsg(sock, msgs, n, MSG_DONTWAIT, NULL);
+	if (ret < 0)
+		return -errno;
 
-	buf[0] = v;
-	iov.iov_base = buf;
-	iov.iov_len = sizeof(buf);
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
+	for (int i = 0; i < ret; i++) {
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
 
-	if (sendmsg(sock, &msg, 0) < 0) {
-		if (errno == 3)
-			return log_error(SEND_CREDS_NOTSK, "%s - Failed at sendmsg: %d", strerror(errno), SEND_CREDS_NOTSK);
+		creds[i] = (struct ucred){
+			.pid = -1,
+			.uid = -1,
+			.gid = -1,
+		};
 
-		return log_error(SEND_CREDS_FAIL, "%s - Failed at sendmsg: %d", strerror(errno), SEND_CREDS_FAIL);
+		if (cmsg && cmsg->cmsg_len == CMSG_LEN(sizeof(struct ucred)) &&
+		    cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_CREDENTIALS)
+			memcpy(&creds[i], CMSG_DATA(cmsg), sizeof(struct ucred));
 	}
 
+	return ret;
+}
+
+bool recv_creds(int sock, struct ucred *cred, char *v)
+{
+	int ret;
+
+	if (!wait_for_sock(sock, SCM_TIMEOUT_MS))
+		return log_error(false, "Timed out waiting for scm_cred");
+
+	ret = recv_creds_batch(sock, cred, v, 1);
+	if (ret < 0)
+		return log_error(false, "%s - Failed to receive scm_cred", strerror(-ret));
+
+	return ret == 1;
+}
+
+int send_creds_batch(int sock, const struct ucred *creds, const char *v,
+		     size_t n, int flags)
+{
+	struct mmsghdr msgs[SCM_BATCH] = {};
+	struct iovec iov[SCM_BATCH];
+	union scm_creds_buf cmsgbuf[SCM_BATCH] = {};
+	int ret;
+
+	n = MIN(n, SCM_BATCH);
+	for (size_t i = 0; i < n; i++) {
+		struct cmsghdr *cmsg;
+
+		iov[i].iov_base = (char *)&v[i];
+		iov[i].iov_len = sizeof(v[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = cmsgbuf[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(cmsgbuf[i].buf);
+
+		cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(struct ucred));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_CREDENTIALS;
+		memcpy(CMSG_DATA(cmsg), &creds[i], sizeof(struct ucred));
+	}
+
+	ret = sendmmsg(sock, msgs, n, flags);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+int send_creds(int sock, struct ucred *cred, char v)
+{
+	int ret;
+
+	ret = send_creds_batch(sock, cred, &v, 1, 0);
+	if (ret == -ESRCH)
+		return log_error(SEND_CREDS_NOTSK, "%s - Failed at sendmsg: %d", strerror(-ret), SEND_CREDS_NOTSK);
+
+	if (ret != 1)
+		return log_error(SEND_CREDS_FAIL, "%s - Failed at sendmsg: %d", strerror(-ret), SEND_CREDS_FAIL);
+
 	return SEND_CREDS_OK;
 }
 
@@ -315,6 +558,8 @@ int read_file_fuse(const char *path, char *buf, size_t size, struct file_info *d
 	char *cache = d->buf;
 	size_t cache_size = d->buflen;
 
+	request_stage(REQUEST_STAGE_HOST_PROC);
+
 	f = fopen(path, "re");
 	if (!f)
 		return 0;
@@ -338,7 +583,7 @@ int read_file_fuse(const char *path, char *buf, size_t size, struct file_info *d
 		total_len = size;
 
 	/* read from off 0 */
-	memcpy(buf, d->buf, total_len);
+	copy_out(buf, d->buf, total_len);
 
 	if (d->size > (int)total_len)
 		d->cached = d->size - total_len;
@@ -362,7 +607,7 @@ int read_file_fuse_with_offset(const char *path, char *buf, size_t size,
 
 		left = d->size - offset;
 		total_len = left > size ? size : left;
-		memcpy(buf, cache + offset, total_len);
+		copy_out(buf, cache + offset, total_len);
 
 		return total_len;
 	}
@@ -479,6 +724,8 @@ FILE *fopen_cached(const char *path, const char *mode, void **caller_freed_buffe
 	size_t len = 0;
 	FILE *f;
 
+	request_stage(REQUEST_STAGE_HOST_PROC);
+
 	buf = file_to_buf(path, &len);
 	if (!buf)
 		return NULL;
@@ -496,6 +743,9 @@ FILE *fdopen_cached(int fd, const char *mode, void **caller_freed_buffer)
 	size_t len = 0;
 	FILE *f;
 
+	/* Only ever used on cgroup files. */
+	request_stage(REQUEST_STAGE_CGROUP_IO);
+
 	buf = fd_to_buf(fd, &len);
 	if (!buf)
 		return NULL;
@@ -580,3 +830,32 @@ char *trim_whitespace_in_place(char *buffer)
 	buffer[char_right_gc(buffer, strlen(buffer))] = '\0';
 	return buffer;
 }
+
+/*
+ * Move the calling background thread onto the CPUs and scheduling policy
+ * requested on the command line so it stays off CPUs reserved for tenants.
+ */
+int lxcfs_background_thread_setup(const struct lxcfs_opts *opts)
+{
+	if (!opts || opts->version < 3)
+		return 0;
+
+	if (opts->pin_background &&
+	    sched_setaffinity(0, sizeof(cpu_set_t), &opts->background_cpus))
+		return log_error_errno(-1, errno, "Failed to set background thread affinity");
+
+	if (opts->background_policy == SCHED_IDLE) {
+		struct sched_param param = {
+			.sched_priority = 0,
+		};
+
+		if (sched_setscheduler(0, SCHED_IDLE, &param))
+			return log_error_errno(-1, errno, "Failed to switch background thread to SCHED_IDLE");
+	} else if (opts->background_nice) {
+		/* Linux applies nice values per thread. */
+		if (setpriority(PRIO_PROCESS, lxcfs_gettid(), opts->background_nice))
+			return log_error_errno(-1, errno, "Failed to set background thread nice level");
+	}
+
+	return 0;
+}
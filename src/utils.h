@@ -5,8 +5,10 @@
 
 #include "config.h"
 
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -29,15 +31,50 @@
 #define SEND_CREDS_NOTSK 1
 #define SEND_CREDS_FAIL 2
 
+/* Most credentials in flight between lxcfs and a pid namespace helper. */
+#define SCM_BATCH 64
+/* How long either end of a credential exchange waits for the other. */
+#define SCM_TIMEOUT_MS 2000
+
 struct file_info;
+struct lxcfs_opts;
 
 __attribute__((__format__(__printf__, 4, 5))) extern char *must_strcat(char **src, size_t *sz, size_t *asz, const char *format, ...);
 extern bool is_shared_pidns(pid_t pid);
+extern bool is_host_pidns(pid_t pid);
 extern int preserve_ns(const int pid, const char *ns);
 extern void do_release_file_info(struct fuse_file_info *fi);
+/* CLOCK_MONOTONIC in milliseconds, deadlines passed around are in this unit. */
+extern int64_t monotonic_ms(void);
+/*
+ * poll() @pfd until something is ready or the monotonic_ms() @deadline
+ * passes. Callers keep their pollfds across calls and only change the events.
+ * Returns 0 on timeout.
+ */
+extern int wait_for_events(struct pollfd *pfd, nfds_t nfds, int64_t deadline);
+extern bool wait_for_sock(int sock, int timeout_ms);
+/* Must be set on the receiving end before the sender is started. */
+extern bool enable_passcred(int sock);
 extern bool recv_creds(int sock, struct ucred *cred, char *v);
-extern int send_creds(int sock, struct ucred *cred, char v, bool pingfirst);
-extern bool wait_for_sock(int sock, int timeout);
+extern int send_creds(int sock, struct ucred *cred, char v);
+/*
+ * Move up to SCM_BATCH credentials, each tagged with one byte of @v, with a
+ * single system call. Both return the number of messages moved or -errno.
+ * send_creds_batch() fails with -ESRCH when the first credential names a
+ * task that is gone, receiving never blocks.
+ */
+extern int send_creds_batch(int sock, const struct ucred *creds, const char *v,
+			    size_t n, int flags);
+extern int recv_creds_batch(int sock, struct ucred *creds, char *v, size_t n);
+/*
+ * Let the kernel serve reads of @info straight from the host file @path. Only
+ * for files that aren't virtualized, callers keep copying if this fails.
+ */
+extern int passthrough_open(const char *path, struct fuse_file_info *fi,
+			    struct file_info *info);
+extern void passthrough_close(struct file_info *info);
+/* Forget the backing files of the connection that is going away. */
+extern void passthrough_destroy(void);
 extern int read_file_fuse(const char *path, char *buf, size_t size,
 			  struct file_info *d);
 extern int read_file_fuse_with_offset(const char *path, char *buf, size_t size,
@@ -60,11 +97,17 @@ static inline int pidfd_send_signal(int pidfd, int sig, siginfo_t *info,
 }
 #endif
 
+static inline pid_t lxcfs_gettid(void)
+{
+	return syscall(__NR_gettid);
+}
+
 extern FILE *fopen_cached(const char *path, const char *mode,
 			  void **caller_freed_buffer);
 extern FILE *fdopen_cached(int fd, const char *mode, void **caller_freed_buffer);
 extern ssize_t write_nointr(int fd, const void *buf, size_t count);
 extern int safe_uint64(const char *numstr, uint64_t *converted, int base);
 extern char *trim_whitespace_in_place(char *buffer);
+extern int lxcfs_background_thread_setup(const struct lxcfs_opts *opts);
 
 #endif /* __LXCFS_UTILS_H */
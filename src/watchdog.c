@@ -0,0 +1,349 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/param.h>
+
+#include "watchdog.h"
+
+#include "async_log.h"
+#include "bindings.h"
+#include "memory_utils.h"
+#include "utils.h"
+
+#define WATCHDOG_SLOTS 256
+#define WATCHDOG_PATH_MAX 128
+#define WATCHDOG_MIN_INTERVAL_MS 10
+#define WATCHDOG_MAX_INTERVAL_MS 1000
+
+static const char *const stage_names[REQUEST_STAGE_MAX] = {
+	[REQUEST_STAGE_RENDER]		= "render",
+	[REQUEST_STAGE_INITPID]		= "initpid",
+	[REQUEST_STAGE_CGROUP]		= "cgroup",
+	[REQUEST_STAGE_CGROUP_IO]	= "cgroup io",
+	[REQUEST_STAGE_HOST_PROC]	= "host proc",
+	[REQUEST_STAGE_LOCK]		= "lock",
+	[REQUEST_STAGE_COPY_OUT]	= "copy out",
+};
+
+/*
+ * What a worker is doing, for the watchdog thread. The sequence is odd while
+ * a request runs and the request is only reported when it didn't change
+ * while being copied.
+ */
+struct watchdog_slot {
+	bool owned;
+	uint64_t seq;
+	uint64_t start_ns;
+	int stage;
+	char op[16];
+	char path[WATCHDOG_PATH_MAX];
+};
+
+/* The request a worker is serving, only ever touched by that worker. */
+struct watched_request {
+	int depth;
+	const char *op;
+	const char *path;
+	uint64_t start_ns;
+	uint64_t stage_start_ns;
+	enum request_stage stage;
+	uint64_t stage_ns[REQUEST_STAGE_MAX];
+	struct watchdog_slot *slot;
+	bool slot_tried;
+};
+
+static uint64_t threshold_ns;
+static __thread struct watched_request req;
+
+static struct watchdog_slot slots[WATCHDOG_SLOTS];
+static uint64_t reported[WATCHDOG_SLOTS];
+static pthread_key_t slot_key;
+
+static bool running;
+static pthread_t watcher;
+static int stop_fd = -EBADF;
+
+static inline uint64_t watchdog_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void release_slot(void *arg)
+{
+	struct watchdog_slot *slot = arg;
+
+	__atomic_store_n(&slot->owned, false, __ATOMIC_RELEASE);
+}
+
+/* Workers without a slot are still timed, just not watched while running. */
+static struct watchdog_slot *claim_slot(void)
+{
+	if (req.slot_tried)
+		return req.slot;
+	req.slot_tried = true;
+
+	for (int i = 0; i < WATCHDOG_SLOTS; i++) {
+		bool owned = false;
+
+		if (!__atomic_compare_exchange_n(&slots[i].owned, &owned, true, false,
+						 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+
+		if (pthread_setspecific(slot_key, &slots[i])) {
+			release_slot(&slots[i]);
+			return NULL;
+		}
+
+		req.slot = &slots[i];
+		break;
+	}
+
+	return req.slot;
+}
+
+static void slot_begin(struct watchdog_slot *slot)
+{
+	size_t len;
+
+	len = strnlen(req.op, sizeof(slot->op) - 1);
+	memcpy(slot->op, req.op, len);
+	slot->op[len] = '\0';
+
+	len = strnlen(req.path, sizeof(slot->path) - 1);
+	memcpy(slot->path, req.path, len);
+	slot->path[len] = '\0';
+
+	__atomic_store_n(&slot->start_ns, req.start_ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->stage, REQUEST_STAGE_RENDER, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+bool watchdog_request_begin(const char *op, const char *path)
+{
+	if (!__atomic_load_n(&threshold_ns, __ATOMIC_RELAXED))
+		return false;
+
+	/* Handlers calling other handlers are part of the outer request. */
+	if (req.depth++)
+		return true;
+
+	req.op = op;
+	req.path = path;
+	req.start_ns = watchdog_now();
+	req.stage_start_ns = req.start_ns;
+	req.stage = REQUEST_STAGE_RENDER;
+	memset(req.stage_ns, 0, sizeof(req.stage_ns));
+
+	if (__atomic_load_n(&running, __ATOMIC_ACQUIRE) && claim_slot())
+		slot_begin(req.slot);
+
+	return true;
+}
+
+void watchdog_request_end(bool *watched)
+{
+	uint64_t now, total;
+
+	if (!*watched || !req.depth || --req.depth)
+		return;
+
+	now = watchdog_now();
+	req.stage_ns[req.stage] += now - req.stage_start_ns;
+	total = now - req.start_ns;
+
+	if (req.slot)
+		__atomic_store_n(&req.slot->seq, req.slot->seq + 1, __ATOMIC_RELEASE);
+
+	if (total < __atomic_load_n(&threshold_ns, __ATOMIC_RELAXED))
+		return;
+
+	lxcfs_error_ratelimit("Slow %s of %s took %.1fms: initpid %.1fms, cgroup %.1fms, cgroup io %.1fms, host proc %.1fms, lock %.1fms, render %.1fms, copy out %.1fms",
+			      req.op, req.path, total / 1e6,
+			      req.stage_ns[REQUEST_STAGE_INITPID] / 1e6,
+			      req.stage_ns[REQUEST_STAGE_CGROUP] / 1e6,
+			      req.stage_ns[REQUEST_STAGE_CGROUP_IO] / 1e6,
+			      req.stage_ns[REQUEST_STAGE_HOST_PROC] / 1e6,
+			      req.stage_ns[REQUEST_STAGE_LOCK] / 1e6,
+			      req.stage_ns[REQUEST_STAGE_RENDER] / 1e6,
+			      req.stage_ns[REQUEST_STAGE_COPY_OUT] / 1e6);
+}
+
+struct request_stage_timer request_stage_begin(enum request_stage stage)
+{
+	struct request_stage_timer timer = {};
+	uint64_t now;
+
+	if (!req.depth)
+		return timer;
+
+	now = watchdog_now();
+	req.stage_ns[req.stage] += now - req.stage_start_ns;
+	timer.running = true;
+	timer.prev = req.stage;
+
+	req.stage = stage;
+	req.stage_start_ns = now;
+	if (req.slot)
+		__atomic_store_n(&req.slot->stage, stage, __ATOMIC_RELAXED);
+
+	return timer;
+}
+
+void request_stage_end(struct request_stage_timer *timer)
+{
+	uint64_t now;
+
+	if (!timer->running || !req.depth)
+		return;
+
+	now = watchdog_now();
+	req.stage_ns[req.stage] += now - req.stage_start_ns;
+
+	req.stage = timer->prev;
+	req.stage_start_ns = now;
+	if (req.slot)
+		__atomic_store_n(&req.slot->stage, timer->prev, __ATOMIC_RELAXED);
+}
+
+/* Report each request that has been running for too long once. */
+static void watchdog_scan(uint64_t threshold)
+{
+	uint64_t now = watchdog_now();
+
+	for (int i = 0; i < WATCHDOG_SLOTS; i++) {
+		struct watchdog_slot *slot = &slots[i];
+		char op[sizeof(slot->op)], path[sizeof(slot->path)];
+		uint64_t seq, start;
+		int stage;
+
+		if (!__atomic_load_n(&slot->owned, __ATOMIC_ACQUIRE))
+			continue;
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1) || reported[i] == seq)
+			continue;
+
+		start = __atomic_load_n(&slot->start_ns, __ATOMIC_RELAXED);
+		if (now < start || now - start < threshold)
+			continue;
+
+		stage = __atomic_load_n(&slot->stage, __ATOMIC_RELAXED);
+		memcpy(op, slot->op, sizeof(op));
+		memcpy(path, slot->path, sizeof(path));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		op[sizeof(op) - 1] = '\0';
+		path[sizeof(path) - 1] = '\0';
+		if (stage < 0 || stage >= REQUEST_STAGE_MAX)
+			stage = REQUEST_STAGE_RENDER;
+
+		reported[i] = seq;
+		lxcfs_error_ratelimit("%s of %s still running after %.1fms in %s",
+				      op, path, (now - start) / 1e6, stage_names[stage]);
+	}
+}
+
+static void *watchdog_thread(void *arg)
+{
+	uint64_t threshold = __atomic_load_n(&threshold_ns, __ATOMIC_RELAXED);
+	int interval = threshold / 2000000;
+
+	lxcfs_background_thread_setup(arg);
+
+	interval = MAX(interval, WATCHDOG_MIN_INTERVAL_MS);
+	interval = MIN(interval, WATCHDOG_MAX_INTERVAL_MS);
+
+	for (;;) {
+		struct pollfd fd = { .fd = stop_fd, .events = POLLIN };
+		int ret;
+
+		ret = poll(&fd, 1, interval);
+		if (ret > 0 || (ret < 0 && errno != EINTR))
+			break;
+
+		watchdog_scan(threshold);
+	}
+
+	return NULL;
+}
+
+int watchdog_start(const struct lxcfs_opts *opts)
+{
+	unsigned int threshold_ms = lxcfs_slow_request_ms(opts);
+	int ret;
+
+	if (running || !threshold_ms)
+		return 0;
+
+	__atomic_store_n(&threshold_ns, (uint64_t)threshold_ms * 1000000, __ATOMIC_RELAXED);
+
+	ret = pthread_key_create(&slot_key, release_slot);
+	if (ret) {
+		__atomic_store_n(&threshold_ns, 0, __ATOMIC_RELAXED);
+		return log_error(-ret, "%s - Failed to create watchdog key", strerror(ret));
+	}
+
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd < 0) {
+		ret = log_error(-errno, "%s - Failed to create eventfd", strerror(errno));
+		goto out_key;
+	}
+
+	ret = pthread_create(&watcher, NULL, watchdog_thread, (void *)opts);
+	if (ret) {
+		ret = log_error(-ret, "%s - Failed to create watchdog thread", strerror(ret));
+		goto out_close;
+	}
+
+	__atomic_store_n(&running, true, __ATOMIC_RELEASE);
+	return 0;
+
+out_close:
+	close_prot_errno_disarm(stop_fd);
+out_key:
+	pthread_key_delete(slot_key);
+	__atomic_store_n(&threshold_ns, 0, __ATOMIC_RELAXED);
+	return ret;
+}
+
+void watchdog_exit(void)
+{
+	uint64_t val = 1;
+
+	__atomic_store_n(&threshold_ns, 0, __ATOMIC_RELAXED);
+	if (!running)
+		return;
+
+	if (write(stop_fd, &val, sizeof(val)) != sizeof(val))
+		lxcfs_error("%s - Failed to stop watchdog thread", strerror(errno));
+	else
+		pthread_join(watcher, NULL);
+
+	/* Workers outliving this library must not call back into it. */
+	pthread_key_delete(slot_key);
+	close_prot_errno_disarm(stop_fd);
+	__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+}
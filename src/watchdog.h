@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: LGPL-2.1+ */
+
+#ifndef __LXCFS_WATCHDOG_H
+#define __LXCFS_WATCHDOG_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macro.h"
+
+struct lxcfs_opts;
+
+/*
+ * Where a request spends its time. Stages are exclusive: a stage entered
+ * while another one runs pauses it, so the stages of a request add up to
+ * its latency. Time in no other stage is charged to rendering.
+ */
+enum request_stage {
+	REQUEST_STAGE_RENDER,
+	REQUEST_STAGE_INITPID,
+	REQUEST_STAGE_CGROUP,
+	REQUEST_STAGE_CGROUP_IO,
+	REQUEST_STAGE_HOST_PROC,
+	REQUEST_STAGE_LOCK,
+	REQUEST_STAGE_COPY_OUT,
+	REQUEST_STAGE_MAX,
+};
+
+struct request_stage_timer {
+	bool running;
+	enum request_stage prev;
+};
+
+/*
+ * Log the stage breakdown of requests taking longer than --slow-request-ms,
+ * rate limited, and of requests still running that long from a watchdog
+ * thread. Nothing is timed when no threshold is set.
+ *
+ * @opts must stay valid until liblxcfs is unloaded.
+ */
+__visible extern int watchdog_start(const struct lxcfs_opts *opts);
+
+extern void watchdog_exit(void);
+
+extern bool watchdog_request_begin(const char *op, const char *path);
+extern void watchdog_request_end(bool *watched);
+
+extern struct request_stage_timer request_stage_begin(enum request_stage stage);
+extern void request_stage_end(struct request_stage_timer *timer);
+
+/* Time the rest of the calling request handler. */
+#define watch_request(op, path)                                        \
+	__attribute__((__cleanup__(watchdog_request_end))) bool __watched__ = \
+		watchdog_request_begin(op, path)
+
+/* Charge the rest of the enclosing scope to @stage. */
+#define request_stage(stage)                                          \
+	__attribute__((__cleanup__(request_stage_end)))               \
+	struct request_stage_timer __stage_timer__ = request_stage_begin(stage)
+
+/* Copy a reply into the buffer FUSE hands back to the caller. */
+static inline void *copy_out(void *dest, const void *src, size_t n)
+{
+	request_stage(REQUEST_STAGE_COPY_OUT);
+	return memcpy(dest, src, n);
+}
+
+#endif /* __LXCFS_WATCHDOG_H */